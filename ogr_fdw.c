@@ -57,10 +57,100 @@ struct OgrFdwOption
 #define OPT_OPEN_OPTIONS "open_options"
 #define OPT_UPDATEABLE "updateable"
 #define OPT_RASTER_CONF "conf_file"
+#define OPT_RASTER_BANDS "bands"
+#define OPT_BATCH_READ "batch_read"
+#define OPT_ANALYZE_SAMPLE_SIZE "analyze_sample_size"
 
 #define OGR_FDW_FRMT_INT64	 "%lld"
 #define OGR_FDW_CAST_INT64(x)	 (long long)(x)
 
+/*
+ * Indexes of the items in the fdw_private list of a ForeignScan,
+ * passed from ogrGetForeignPlan to gisBeginForeignScan.
+ */
+enum OgrFdwScanPrivateIndex
+{
+	/* OGR SQL attribute filter (String), or NULL. Values for its */
+	/* $n placeholders come from the fdw_exprs of the scan */
+	OgrFdwScanPrivateSql,
+	/* Spatial filter geometry as hex WKB (String), or NULL */
+	OgrFdwScanPrivateSpatialWkb,
+	/* OGR geometry field number the spatial filter applies to (Integer) */
+	OgrFdwScanPrivateSpatialField,
+	/* Whether to filter on the envelope of the geometry only (Integer) */
+	OgrFdwScanPrivateSpatialIsRect,
+	/* Attribute numbers the query uses, all others are skipped (List of Integer) */
+	OgrFdwScanPrivateRetrievedAttrs,
+	/* Place in fdw_exprs (1-based) of an outer geometry to filter on at each rescan, or 0 (Integer) */
+	OgrFdwScanPrivateSpatialParam,
+	/* OGR geometry field that filter applies to (Integer) */
+	OgrFdwScanPrivateSpatialParamField,
+	/* Distance to grow the outer geometry's box by (Float) */
+	OgrFdwScanPrivateSpatialParamExpand,
+	/* Whether features are looked up by FID (Integer) */
+	OgrFdwScanPrivateFidLookup,
+	/* FIDs to look up (List of String) */
+	OgrFdwScanPrivateFids,
+	/* Bounds of a FID range read by feature index, or NULL (String) */
+	OgrFdwScanPrivateFidMin,
+	OgrFdwScanPrivateFidMax,
+	/* SELECT the driver runs in place of reading the layer, up to its WHERE, or NULL (String) */
+	OgrFdwScanPrivateSelect,
+	/* ORDER BY that follows the WHERE, or NULL (String) */
+	OgrFdwScanPrivateSelectTail
+};
+
+/*
+ * Indexes of the items in the fdw_private list of a ForeignPath
+ * the driver sorts, from ogrAddSortedPath to ogrGetForeignPlan.
+ * Other paths of a table have none.
+ */
+enum OgrFdwPathPrivateIndex
+{
+	/* Sort keys of the ORDER BY (String) */
+	OgrFdwPathPrivateOrderBy
+};
+
+/*
+ * Aggregates OGR works out for a whole layer, and the fdw_private
+ * list of the ForeignScan that reads them, which has no relation
+ * of its own. Grouped aggregates are read from a SELECT instead.
+ */
+enum OgrFdwAggKind
+{
+	OGR_AGG_COUNT,   /* COUNT(*) */
+	OGR_AGG_EXTENT   /* ST_Extent(geom) */
+};
+
+enum OgrFdwAggPrivateIndex
+{
+	/* Foreign table aggregated (Integer) */
+	OgrFdwAggPrivateTable,
+	/* OGR SQL attribute filter (String), or NULL */
+	OgrFdwAggPrivateSql,
+	/* OgrFdwAggKind of each target list entry (List of Integer) */
+	OgrFdwAggPrivateKinds,
+	/* OGR geometry field of each ST_Extent, -1 for others (List of Integer) */
+	OgrFdwAggPrivateFields,
+	/* SELECT of a grouped query, up to its WHERE, or NULL (String) */
+	OgrFdwAggPrivateSelect,
+	/* GROUP BY that follows the WHERE, or NULL (String) */
+	OgrFdwAggPrivateSelectTail
+};
+
+/*
+ * Indexes of the items in the fdw_private list of the ForeignScan
+ * of a join the database runs, which has no relation of its own
+ * either. Its scan tuple is the fdw_scan_tlist.
+ */
+enum OgrFdwJoinPrivateIndex
+{
+	/* Outer foreign table, whose connection runs the join (Integer) */
+	OgrFdwJoinPrivateTable,
+	/* SELECT of the join (String) */
+	OgrFdwJoinPrivateSql
+};
+
 /*
  * Valid options for ogr_fdw.
  * ForeignDataWrapperRelationId (no options)
@@ -84,9 +174,12 @@ static struct OgrFdwOption valid_options[] = {
 	/* OGR layer options */
 	{OPT_LAYER, ForeignTableRelationId, true, false},
 	{OPT_UPDATEABLE, ForeignTableRelationId, false, false},
+	{OPT_BATCH_READ, ForeignTableRelationId, false, false},
+	{OPT_ANALYZE_SAMPLE_SIZE, ForeignTableRelationId, false, false},
 
 	/*RASTER config filename*/
 	{OPT_RASTER_CONF, ForeignTableRelationId, true, false},
+	{OPT_RASTER_BANDS, ForeignTableRelationId, false, false},
 
 	/* EOList marker */
 	{NULL, InvalidOid, false, false}
@@ -121,10 +214,32 @@ static ForeignScan *ogrGetForeignPlan(PlannerInfo *root,
 					,Plan *outer_plan
 #endif
 );
+#if PG_VERSION_NUM >= 100000
+static void ogrGetForeignUpperPaths(PlannerInfo *root,
+					UpperRelationKind stage,
+					RelOptInfo *input_rel,
+					RelOptInfo *output_rel
+#if PG_VERSION_NUM >= 110000
+					,void *extra
+#endif
+);
+#endif
+#if PG_VERSION_NUM >= 90600
+static void ogrGetForeignJoinPaths(PlannerInfo *root,
+					RelOptInfo *joinrel,
+					RelOptInfo *outerrel,
+					RelOptInfo *innerrel,
+					JoinType jointype,
+					JoinPathExtraData *extra);
+#endif
 static void gisBeginForeignScan(ForeignScanState *node, int eflags);
 static TupleTableSlot *gisIterateForeignScan(ForeignScanState *node);
 static void ogrReScanForeignScan(ForeignScanState *node);
 static void ogrEndForeignScan(ForeignScanState *node);
+static void ogrExplainForeignScan(ForeignScanState *node, ExplainState *es);
+static bool ogrAnalyzeForeignTable(Relation relation,
+					AcquireSampleRowsFunc *func,
+					BlockNumber *totalpages);
 
 /*
  * FDW modify callback routines
@@ -151,6 +266,12 @@ static TupleTableSlot *ogrExecForeignDelete (EState *estate,
 					TupleTableSlot *planSlot);
 static void ogrEndForeignModify (EState *estate,
 					ResultRelInfo *rinfo);
+#if PG_VERSION_NUM >= 110000
+static void ogrBeginForeignInsert (ModifyTableState *mtstate,
+					ResultRelInfo *rinfo);
+static void ogrEndForeignInsert (EState *estate,
+					ResultRelInfo *rinfo);
+#endif
 static int ogrIsForeignRelUpdatable (Relation rel);
 
 static void
@@ -168,10 +289,19 @@ static OgrConnection ogrGetConnectionFromTable(Oid foreigntableid, bool updateab
 static RasterConnection rasterGetConnectionFromTable(Oid foreigntableid);
 static void ogr_fdw_exit(int code, Datum arg);
 static void ogrReadColumnData(GisFdwState *state);
+static void ogrReadColumnConverters(OgrFdwTable *tbl);
+static void ogrBuildConverterList(OgrFdwTable *tbl);
+static OgrFdwConvertFunc ogrChooseConverter(const OgrFdwColumn *col);
+#ifdef OGR_FDW_ARROW
+static void ogrArrowBeginScan(GisFdwExecState *execstate);
+#endif
 static bool isRaster(Oid foreigntableid);
-static HeapTuple
-make_tuple_from_string(char *str, Relation rel, AttInMetadata *attinmeta,
-        MemoryContext temp_context); 
+static void ogrSetSpatialFilter(OGRLayerH lyr, Value *wkbhex, int ogrfldnum, bool is_rect);
+static void ogrCountCacheForget(Oid foreigntableid);
+static void
+rasterSetColumnType(GisFdwExecState *execstate, Oid typid, int32 typmod);
+static Datum
+rasterTileDatum(GisFdwExecState *state, rt_raster rast);
 static void
 fetch_more_data(ForeignScanState *node, bool nextfile); 
 
@@ -218,6 +348,30 @@ _PG_init(void)
 	if(putenv("POSTGIS_GDAL_ENABLED_DRIVERS=ENABLE_ALL"))
 	    elog(ERROR, "putenv failed.");
 
+	DefineCustomIntVariable("ogr_fdw.connection_idle_timeout",
+	                        "Seconds an unused OGR data source is kept open for reuse.",
+	                        "-1 keeps data sources open for the life of the backend, 0 disables pooling.",
+	                        &ogr_pool_idle_timeout,
+	                        300, -1, INT_MAX,
+	                        PGC_USERSET,
+	                        GUC_UNIT_S,
+	                        NULL, NULL, NULL);
+
+	DefineCustomIntVariable("ogr_fdw.commit_interval",
+	                        "Rows written to an OGR data source per data source transaction.",
+	                        "0 commits once at the end of each statement.",
+	                        &ogr_commit_interval,
+	                        0, 0, INT_MAX,
+	                        PGC_USERSET,
+	                        0,
+	                        NULL, NULL, NULL);
+
+	CacheRegisterSyscacheCallback(FOREIGNSERVEROID, ogrPoolInvalCallback, (Datum) 0);
+	CacheRegisterSyscacheCallback(FOREIGNTABLEREL, ogrPoolInvalCallback, (Datum) 0);
+	RegisterXactCallback(ogrPoolXactCallback, NULL);
+	RegisterXactCallback(ogrWriteXactCallback, NULL);
+	RegisterSubXactCallback(ogrWriteSubXactCallback, NULL);
+
 	on_proc_exit(&ogr_fdw_exit, PointerGetDatum(NULL));
 
 #if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2,1,0)
@@ -233,6 +387,7 @@ _PG_init(void)
 static void
 ogr_fdw_exit(int code, Datum arg)
 {
+	ogrPoolEvict(true);
 	OGRCleanupAll();
 }
 
@@ -250,10 +405,18 @@ ogr_fdw_handler(PG_FUNCTION_ARGS)
 	fdwroutine->GetForeignRelSize = ogrGetForeignRelSize;
 	fdwroutine->GetForeignPaths = ogrGetForeignPaths;
 	fdwroutine->GetForeignPlan = ogrGetForeignPlan;
+#if PG_VERSION_NUM >= 90600
+	fdwroutine->GetForeignJoinPaths = ogrGetForeignJoinPaths;
+#endif
+#if PG_VERSION_NUM >= 100000
+	fdwroutine->GetForeignUpperPaths = ogrGetForeignUpperPaths;
+#endif
 	fdwroutine->BeginForeignScan = gisBeginForeignScan;
 	fdwroutine->IterateForeignScan = gisIterateForeignScan;
 	fdwroutine->ReScanForeignScan = ogrReScanForeignScan;
 	fdwroutine->EndForeignScan = ogrEndForeignScan;
+	fdwroutine->ExplainForeignScan = ogrExplainForeignScan;
+	fdwroutine->AnalyzeForeignTable = ogrAnalyzeForeignTable;
 
 	/* Write support */
 	fdwroutine->AddForeignUpdateTargets = ogrAddForeignUpdateTargets;
@@ -263,6 +426,10 @@ ogr_fdw_handler(PG_FUNCTION_ARGS)
 	fdwroutine->ExecForeignDelete = ogrExecForeignDelete;
 	fdwroutine->EndForeignModify = ogrEndForeignModify;
 	fdwroutine->IsForeignRelUpdatable = ogrIsForeignRelUpdatable;
+#if PG_VERSION_NUM >= 110000
+	fdwroutine->BeginForeignInsert = ogrBeginForeignInsert;
+	fdwroutine->EndForeignInsert = ogrEndForeignInsert;
+#endif
 
 #if PG_VERSION_NUM >= 90500
 	/*  Support functions for IMPORT FOREIGN SCHEMA */
@@ -318,6 +485,8 @@ rasterGetConnectionFromTable(Oid foreigntableid)
 		DefElem *def = (DefElem *) lfirst(cell);
 		if (streq(def->defname, OPT_RASTER_CONF))
 			raster.conf_file = defGetString(def);
+		if (streq(def->defname, OPT_RASTER_BANDS))
+			raster.bands = defGetString(def);
 	}
 
 	return raster;
@@ -439,1342 +608,4824 @@ ogrGetDataSource(const char *source, const char *driver, bool updateable,
 	return ogr_ds;
 }
 
-static bool
-ogrCanReallyCountFast(const OgrConnection *con)
+/*
+ * Connection pool
+ *
+ * Opening a datasource is the most expensive part of a small query,
+ * so opened datasources are kept for the life of the backend and
+ * handed out again to the planner, executor and modify callbacks.
+ * Entries are keyed on every option that changes how the datasource
+ * gets opened. An entry is only lent to one user at a time, since the
+ * OGR layers carry their read cursor and filters on the handle, so
+ * a second simultaneous user of the same source (a self join, for
+ * example) gets a second entry.
+ */
+typedef struct OgrConnPoolEntry
 {
-	GDALDriverH dr = GDALGetDatasetDriver(con->ds);
-	const char *dr_str = GDALGetDriverShortName(dr);
+	char *key;             /* datasource, format, options and open mode */
+	char *ds_str;          /* datasource, to find siblings of writers */
+	uint32 server_hash;    /* syscache hash of the foreign server */
+	bool updateable;       /* opened in update mode? */
+	bool in_use;           /* lent out and not yet returned */
+	bool invalid;          /* definition changed, close when returned */
+	TimestampTz last_used; /* when last returned, for idle eviction */
+	GDALDatasetH ds;       /* GDAL datasource handle */
+	OGRLayerH sql_lyr;     /* result set of a SELECT the borrower ran, or NULL */
+} OgrConnPoolEntry;
+
+/* List of OgrConnPoolEntry, lives in TopMemoryContext */
+static List *ogr_pool = NIL;
+
+/* Seconds an unused datasource stays open, -1 keeps them forever, 0 disables the pool */
+static int ogr_pool_idle_timeout = 300;
 
-	if ( streq(dr_str, "ESRI Shapefile" ) ||
-   	     streq(dr_str, "FileGDB" ) ||
-	     streq(dr_str, "OpenFileGDB" ) )
-	{
-		return true;
-	}
-	return false;
+static char *
+ogrPoolKey(const OgrConnection *ogr, bool updateable)
+{
+	StringInfoData key;
+
+	/* Unit separator can't sensibly appear in any of the options */
+	initStringInfo(&key);
+	appendStringInfo(&key, "%s\x1f%s\x1f%s\x1f%s\x1f%c",
+		ogr->ds_str,
+		ogr->dr_str ? ogr->dr_str : "",
+		ogr->config_options ? ogr->config_options : "",
+		ogr->open_options ? ogr->open_options : "",
+		updateable ? 'w' : 'r');
+
+	return key.data;
 }
 
 static void
-ogrEreportError(const char *errstr)
+ogrPoolCloseEntry(OgrConnPoolEntry *entry)
 {
-	const char *ogrerr = CPLGetLastErrorMsg();
-	if ( ogrerr && ! streq(ogrerr,"") )
-	{
-		ereport(ERROR,
-			(errcode(ERRCODE_FDW_ERROR),
-			 errmsg("%s", errstr),
-			 errhint("%s", ogrerr)));
-	}
-	else
-	{
-		ereport(ERROR,
-			(errcode(ERRCODE_FDW_ERROR),
-			 errmsg("%s", errstr)));
-	}
+	elog(DEBUG2, "closing pooled OGR data source \"%s\"", entry->ds_str);
+	if ( entry->ds && entry->sql_lyr )
+		GDALDatasetReleaseResultSet(entry->ds, entry->sql_lyr);
+	if ( entry->ds )
+		GDALClose(entry->ds);
+	pfree(entry->key);
+	pfree(entry->ds_str);
+	pfree(entry);
 }
 
 /*
- * Make sure the datasource is cleaned up when we're done
- * with a connection.
+ * Close every entry that is not lent out and is either invalid
+ * or has sat unused longer than the idle timeout. With close_all
+ * everything goes, whether in use or not.
  */
 static void
-ogrFinishConnection(OgrConnection *ogr)
+ogrPoolEvict(bool close_all)
 {
-	if ( ogr->lyr && OGR_L_SyncToDisk(ogr->lyr) != OGRERR_NONE )
-		elog(NOTICE, "failed to flush writes to OGR data source");
+	TimestampTz now;
+	ListCell *cell;
+	List *keep = NIL;
+	MemoryContext oldcontext;
 
-	if ( ogr->ds )
-		GDALClose(ogr->ds);
+	if ( ! ogr_pool )
+		return;
 
-	ogr->ds = NULL;
+	now = GetCurrentTimestamp();
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	foreach(cell, ogr_pool)
+	{
+		OgrConnPoolEntry *entry = (OgrConnPoolEntry *) lfirst(cell);
+		bool expired = ogr_pool_idle_timeout == 0 ||
+			( ogr_pool_idle_timeout > 0 &&
+			  TimestampDifferenceExceeds(entry->last_used, now, ogr_pool_idle_timeout * 1000) );
+
+		if ( close_all || ( ! entry->in_use && ( entry->invalid || expired ) ) )
+			ogrPoolCloseEntry(entry);
+		else
+			keep = lappend(keep, entry);
+	}
+
+	list_free(ogr_pool);
+	ogr_pool = keep;
+	MemoryContextSwitchTo(oldcontext);
 }
 
-static OgrConnection
-ogrGetConnectionFromServer(Oid foreignserverid, bool updateable)
+/*
+ * Borrow an open datasource matching the connection options from
+ * the pool, opening a new one if none is free.
+ */
+static void
+ogrPoolAcquire(Oid foreignserverid, OgrConnection *ogr, bool updateable)
 {
-	ForeignServer *server;
-	OgrConnection ogr;
+	char *key = ogrPoolKey(ogr, updateable);
+	OgrConnPoolEntry *entry = NULL;
 	ListCell *cell;
 
-	/* Null all values */
-	memset(&ogr, 0, sizeof(OgrConnection));
-	ogr.ds_updateable = OGR_UPDATEABLE_UNSET;
-	ogr.lyr_updateable = OGR_UPDATEABLE_UNSET;
-
-	server = GetForeignServer(foreignserverid);
+	/* Take the chance to close anything stale before adding more */
+	ogrPoolEvict(false);
 
-	foreach(cell, server->options)
+	foreach(cell, ogr_pool)
 	{
-		DefElem *def = (DefElem *) lfirst(cell);
-		if (streq(def->defname, OPT_SOURCE))
-			ogr.ds_str = defGetString(def);
-		if (streq(def->defname, OPT_DRIVER))
-			ogr.dr_str = defGetString(def);
-		if (streq(def->defname, OPT_CONFIG_OPTIONS))
-			ogr.config_options = defGetString(def);
-		if (streq(def->defname, OPT_OPEN_OPTIONS))
-			ogr.open_options = defGetString(def);
-		if (streq(def->defname, OPT_UPDATEABLE))
+		OgrConnPoolEntry *e = (OgrConnPoolEntry *) lfirst(cell);
+		if ( ! e->in_use && ! e->invalid && streq(e->key, key) )
 		{
-			if ( defGetBoolean(def) )
-				ogr.ds_updateable = OGR_UPDATEABLE_TRUE;
-			else
-				ogr.ds_updateable = OGR_UPDATEABLE_FALSE;
+			entry = e;
+			break;
 		}
 	}
 
-	if ( ! ogr.ds_str )
-		elog(ERROR, "FDW table '%s' option is missing", OPT_SOURCE);
+	if ( entry )
+	{
+		elog(DEBUG2, "reusing pooled OGR data source \"%s\"", entry->ds_str);
+	}
+	else
+	{
+		MemoryContext oldcontext;
+
+		/* Errors out on failure, so nothing to clean up */
+		GDALDatasetH ds = ogrGetDataSource(ogr->ds_str, ogr->dr_str, updateable,
+		                                   ogr->config_options, ogr->open_options);
+
+		oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		entry = palloc0(sizeof(OgrConnPoolEntry));
+		entry->key = pstrdup(key);
+		entry->ds_str = pstrdup(ogr->ds_str);
+		entry->server_hash = GetSysCacheHashValue1(FOREIGNSERVEROID, ObjectIdGetDatum(foreignserverid));
+		entry->updateable = updateable;
+		entry->ds = ds;
+		ogr_pool = lappend(ogr_pool, entry);
+		MemoryContextSwitchTo(oldcontext);
+	}
 
-	if ( updateable && ogr.ds_updateable == OGR_UPDATEABLE_FALSE )
-		ereport(ERROR,
-			(errcode(ERRCODE_FDW_ERROR),
-			 errmsg("updates are not allowed on foreign server '%s'", server->servername),
-			 errhint("ALTER FOREIGN SERVER %s OPTIONS (SET updatable 'true')", server->servername)));
+	entry->in_use = true;
+	ogr->ds = entry->ds;
+	ogr->pool = entry;
+	pfree(key);
+}
+
+/*
+ * Hand a borrowed datasource back to the pool.
+ */
+static void
+ogrPoolRelease(OgrConnection *ogr)
+{
+	OgrConnPoolEntry *entry = ogr->pool;
+
+	entry->in_use = false;
+	entry->last_used = GetCurrentTimestamp();
 
 	/*
-	 * TODO: Connections happen twice for each query, having a
-	 * connection pool will certainly make things faster.
+	 * Read-only handles on a source we may just have written to can
+	 * hold stale headers and caches (shapefile feature counts, etc),
+	 * so retire them.
 	 */
+	if ( entry->updateable )
+	{
+		ListCell *cell;
+		foreach(cell, ogr_pool)
+		{
+			OgrConnPoolEntry *e = (OgrConnPoolEntry *) lfirst(cell);
+			if ( e != entry && streq(e->ds_str, entry->ds_str) )
+				e->invalid = true;
+		}
+	}
 
-	/*  Connect! */
-	ogr.ds = ogrGetDataSource(ogr.ds_str, ogr.dr_str, updateable, ogr.config_options, ogr.open_options);
-
-	return ogr;
+	if ( entry->invalid || ogr_pool_idle_timeout == 0 )
+		ogrPoolEvict(false);
 }
 
+/*
+ * Note the result set of a SELECT run on a borrowed datasource, or
+ * its release (NULL), so one an error leaves behind can be released
+ * at the end of the transaction.
+ */
+static void
+ogrPoolResultSet(OgrConnection *ogr, OGRLayerH sql_lyr)
+{
+	if ( ogr->pool )
+		ogr->pool->sql_lyr = sql_lyr;
+}
 
 /*
- * Read the options (data source connection from server and
- * layer name from table) from a foreign table and use them
- * to connect to an OGR layer. Return a connection object that
- * has handles for both the datasource and layer.
+ * Server or table definitions changed, so the options our entries
+ * were opened with may be out of date. Table changes can't be tied
+ * to a particular entry cheaply, and are rare, so they retire all.
  */
-static OgrConnection
-ogrGetConnectionFromTable(Oid foreigntableid, bool updateable)
+static void
+ogrPoolInvalCallback(Datum arg, int cacheid, uint32 hashvalue)
 {
-	ForeignTable *table;
-	/* UserMapping *mapping; */
-	/* ForeignDataWrapper *wrapper; */
 	ListCell *cell;
-	OgrConnection ogr;
-
-	/* Gather all data for the foreign table. */
-	table = GetForeignTable(foreigntableid);
-	/* mapping = GetUserMapping(GetUserId(), table->serverid); */
-
-	ogr = ogrGetConnectionFromServer(table->serverid, updateable);
 
-	foreach(cell, table->options)
+	foreach(cell, ogr_pool)
 	{
-		DefElem *def = (DefElem *) lfirst(cell);
-		if (streq(def->defname, OPT_LAYER))
-			ogr.lyr_str = defGetString(def);
-		if (streq(def->defname, OPT_UPDATEABLE))
-		{
-			if ( defGetBoolean(def) )
-				ogr.lyr_updateable = OGR_UPDATEABLE_TRUE;
-			else
-				ogr.lyr_updateable = OGR_UPDATEABLE_FALSE;
-		}
+		OgrConnPoolEntry *entry = (OgrConnPoolEntry *) lfirst(cell);
+		if ( hashvalue == 0 || cacheid != FOREIGNSERVEROID || entry->server_hash == hashvalue )
+			entry->invalid = true;
 	}
 
-	if ( ! ogr.lyr_str )
-		elog(ERROR, "FDW table '%s' option is missing", OPT_LAYER);
+	/* Counts taken under the old definition may not hold either */
+	ogrCountCacheForget(InvalidOid);
+}
 
-	if ( updateable && ogr.lyr_updateable == OGR_UPDATEABLE_FALSE )
-		ereport(ERROR,
-			(errcode(ERRCODE_FDW_ERROR),
-			 errmsg("updates are not allowed on foreign table '%s'", get_rel_name(table->relid)),
-			 errhint("ALTER FOREIGN TABLE %s OPTIONS (SET updatable 'true')", get_rel_name(table->relid))));
+/*
+ * Scans that end normally return their connection, but errors (and
+ * planned relations that never get a plan) leave entries marked in
+ * use, with the result set of any SELECT they ran. Nothing survives
+ * the end of a transaction, so reclaim them here. A writer that was
+ * interrupted may have left its datasource in an unknown state, so
+ * those are not reused.
+ */
+static void
+ogrPoolXactCallback(XactEvent event, void *arg)
+{
+	ListCell *cell;
 
-	/* Does the layer exist in the data source? */
-	ogr.lyr = GDALDatasetGetLayerByName(ogr.ds, ogr.lyr_str);
-	if ( ! ogr.lyr )
+	if ( event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT )
+		return;
+
+	foreach(cell, ogr_pool)
 	{
-		const char *ogrerr = CPLGetLastErrorMsg();
-		ereport(ERROR, (
-				errcode(ERRCODE_FDW_OPTION_NAME_NOT_FOUND),
-				errmsg("unable to connect to %s to \"%s\"", OPT_LAYER, ogr.lyr_str),
-				(ogrerr && ! streq(ogrerr, ""))
-				? errhint("%s", ogrerr)
-				: errhint("Does the layer exist?")
-				));
+		OgrConnPoolEntry *entry = (OgrConnPoolEntry *) lfirst(cell);
+		if ( entry->in_use )
+		{
+			/* The scan that ran it never got to its end */
+			if ( entry->sql_lyr )
+			{
+				GDALDatasetReleaseResultSet(entry->ds, entry->sql_lyr);
+				entry->sql_lyr = NULL;
+			}
+			entry->in_use = false;
+			entry->last_used = GetCurrentTimestamp();
+			if ( event == XACT_EVENT_ABORT && entry->updateable )
+				entry->invalid = true;
+		}
 	}
-	ogr.lyr_utf8 = OGR_L_TestCapability(ogr.lyr, OLCStringsAsUTF8);
 
-	return ogr;
+	/* Don't risk GDAL errors while aborting, the next acquire will evict */
+	if ( event == XACT_EVENT_COMMIT )
+		ogrPoolEvict(false);
+
+	/* The next transaction counts afresh */
+	ogrCountCacheForget(InvalidOid);
 }
 
 /*
- * Validate the options given to a FOREIGN DATA WRAPPER, SERVER,
- * USER MAPPING or FOREIGN TABLE that uses ogr_fdw.
+ * Filtered count cache
  *
- * Raise an ERROR if the option or its value is considered invalid.
+ * Some drivers can count the features passing a filter from their
+ * indexes, but that is still a query against the source, and the
+ * planner asks again for every statement. The answers are kept
+ * until the end of the transaction, keyed on the table and the
+ * filter: others may write to the source in between, which we
+ * would never hear about. Definition changes, and writes through
+ * any of our tables, drop them sooner.
  */
-Datum
-ogr_fdw_validator(PG_FUNCTION_ARGS)
+typedef struct OgrCountCacheEntry
+{
+	Oid foreigntableid;
+	char *filter;          /* OGR SQL and spatial filter */
+	double count;
+} OgrCountCacheEntry;
+
+/* Most counts kept, the oldest go first */
+#define OGR_COUNT_CACHE_SIZE 256
+
+/* List of OgrCountCacheEntry, lives in TopMemoryContext */
+static List *ogr_count_cache = NIL;
+
+static OgrCountCacheEntry *
+ogrCountCacheLookup(Oid foreigntableid, const char *filter)
 {
-	List *options_list = untransformRelOptions(PG_GETARG_DATUM(0));
-	Oid catalog = PG_GETARG_OID(1);
 	ListCell *cell;
-	struct OgrFdwOption *opt;
-	const char *source = NULL, *driver = NULL;//, *conf_file = NULL;
-	const char *config_options = NULL, *open_options = NULL;
-	bool updateable = false;
-	bool raster_flag = false;
 
-	/* Check that the database encoding is UTF8, to match OGR internals */
-	if ( GetDatabaseEncoding() != PG_UTF8 )
+	foreach(cell, ogr_count_cache)
 	{
-		elog(ERROR, "OGR FDW only works with UTF-8 databases");
-		PG_RETURN_VOID();
+		OgrCountCacheEntry *entry = (OgrCountCacheEntry *) lfirst(cell);
+		if ( entry->foreigntableid == foreigntableid && streq(entry->filter, filter) )
+			return entry;
 	}
+	return NULL;
+}
 
-	/* Initialize found state to not found */
-	for ( opt = valid_options; opt->optname; opt++ )
+static void
+ogrCountCacheStore(Oid foreigntableid, const char *filter, double count)
+{
+	MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	OgrCountCacheEntry *entry;
+
+	if ( list_length(ogr_count_cache) >= OGR_COUNT_CACHE_SIZE )
 	{
-		opt->optfound = false;
+		entry = (OgrCountCacheEntry *) linitial(ogr_count_cache);
+		ogr_count_cache = list_delete_first(ogr_count_cache);
+		pfree(entry->filter);
+		pfree(entry);
 	}
 
-	/*
-	 * Check that only options supported by ogr_fdw, and allowed for the
-	 * current object type, are given.
-	 */
-	foreach(cell, options_list)
-	{
-		DefElem *def = (DefElem *) lfirst(cell);
-		bool optfound = false;
+	entry = palloc(sizeof(OgrCountCacheEntry));
+	entry->foreigntableid = foreigntableid;
+	entry->filter = pstrdup(filter);
+	entry->count = count;
+	ogr_count_cache = lappend(ogr_count_cache, entry);
 
-		for ( opt = valid_options; opt->optname; opt++ )
-		{
-			if ( catalog == opt->optcontext && streq(opt->optname, def->defname) )
-			{
-				/* Mark that this user option was found */
-				opt->optfound = optfound = true;
+	MemoryContextSwitchTo(oldcontext);
+}
 
-				/* Store some options for testing later */
-				if ( streq(opt->optname, OPT_SOURCE) )
-					source = defGetString(def);
-				if ( streq(opt->optname, OPT_DRIVER) )
-					driver = defGetString(def);
-				if ( streq(opt->optname, OPT_CONFIG_OPTIONS) )
-					config_options = defGetString(def);
-				if ( streq(opt->optname, OPT_OPEN_OPTIONS) )
-					open_options = defGetString(def);
-				if ( streq(opt->optname, OPT_UPDATEABLE) )
-					updateable = defGetBoolean(def);
-			//	if ( streq(opt->optname, OPT_RASTER_CONF) )
-			//		conf_file = defGetString(def);
-
-				break;
-			}
-		}
-
-		if ( ! optfound )
-		{
-			/*
-			 * Unknown option specified, complain about it. Provide a hint
-			 * with list of valid options for the object.
-			 */
-			const struct OgrFdwOption *opt;
-			StringInfoData buf;
-
-			initStringInfo(&buf);
-			for (opt = valid_options; opt->optname; opt++)
-			{
-				if (catalog == opt->optcontext)
-					appendStringInfo(&buf, "%s%s", (buf.len > 0) ? ", " : "",
-									 opt->optname);
-			}
-
-			ereport(ERROR, (
-				errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
-				errmsg("invalid option \"%s\"", def->defname),
-				buf.len > 0
-				? errhint("Valid options in this context are: %s", buf.data)
-				: errhint("There are no valid options in this context.")));
-		}
-	}
-	if (driver && streq(driver, "GTiff"))
-	    raster_flag = true;
+/*
+ * Drop the cached counts of a table, or of every table
+ * for InvalidOid.
+ */
+static void
+ogrCountCacheForget(Oid foreigntableid)
+{
+	ListCell *cell;
+	List *keep = NIL;
+	MemoryContext oldcontext;
 
-	/* Check that all the mandatory options were found */
-	for ( opt = valid_options; opt->optname; opt++ )
-	{
-		/* Required option for this catalog type is missing? */
-		if ( catalog == opt->optcontext && opt->optrequired && ! opt->optfound )
-		{
-		    if ((raster_flag && streq(opt->optname, OPT_RASTER_CONF)) ||
-			(driver && !streq(driver, "GTiff") && streq(opt->optname, OPT_LAYER)))
-			ereport(ERROR, (
-					errcode(ERRCODE_FDW_DYNAMIC_PARAMETER_VALUE_NEEDED),
-					errmsg("required option \"%s\" is missing", opt->optname)));
-		}
-	}
+	if ( ! ogr_count_cache )
+		return;
 
-	/* Make sure server connection can actually be established */
-	if ( catalog == ForeignServerRelationId && source && !raster_flag)
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	foreach(cell, ogr_count_cache)
 	{
-		OGRDataSourceH ogr_ds;
-		ogr_ds = ogrGetDataSource(source, driver, updateable, config_options, open_options);
-		if ( ogr_ds )
+		OgrCountCacheEntry *entry = (OgrCountCacheEntry *) lfirst(cell);
+		if ( OidIsValid(foreigntableid) && entry->foreigntableid != foreigntableid )
 		{
-			GDALClose(ogr_ds);
+			keep = lappend(keep, entry);
+			continue;
 		}
+		pfree(entry->filter);
+		pfree(entry);
 	}
-
-	PG_RETURN_VOID();
+	list_free(ogr_count_cache);
+	ogr_count_cache = keep;
+	MemoryContextSwitchTo(oldcontext);
 }
 
 /*
- * Initialize an GisFdwPlanState on the heap.
+ * Datasource transactions
+ *
+ * Writes to drivers with native transactions (GeoPackage, SQLite,
+ * PostgreSQL, ...) go into one datasource transaction per statement,
+ * or per ogr_fdw.commit_interval rows, rather than each feature
+ * committing (and syncing to disk) on its own. The open transactions
+ * are tracked here so that an aborted transaction, or subtransaction,
+ * can roll back what it wrote.
  */
-static GisFdwState*
-getGisFdwState(Oid foreigntableid, GisFdwStateType state_type)
+typedef struct OgrWriteXact
 {
-	GisFdwState *state;
-	size_t size;
-	bool updateable = false;
+	GDALDatasetH ds;          /* datasource with the open transaction */
+	SubTransactionId subid;   /* subtransaction that opened it */
+} OgrWriteXact;
 
-	switch (state_type)
-	{
-		case GIS_PLAN_STATE:
-			size = sizeof(GisFdwPlanState);
-			updateable = false;
-			break;
-		case GIS_EXEC_STATE:
-			size = sizeof(GisFdwExecState);
-			updateable = false;
-			break;
-		case GIS_MODIFY_STATE:
-			updateable = true;
-			size = sizeof(GisFdwModifyState);
-			break;
-		default:
-			elog(ERROR, "invalid state type");
-	}
+/* List of OgrWriteXact, lives in TopMemoryContext */
+static List *ogr_write_xacts = NIL;
 
-	state = palloc0(size);
-	state->type = state_type;
+/* Rows written before committing and starting a new datasource transaction, 0 for one per statement */
+static int ogr_commit_interval = 0;
 
-	/*  Connect! */
-	if (isRaster(foreigntableid)) {
-	    state->isRaster = true;
-	    if (state_type == GIS_EXEC_STATE)
-	    	state->raster = rasterGetConnectionFromTable(foreigntableid);
-	} else {
-	    state->ogr = ogrGetConnectionFromTable(foreigntableid, updateable);
+static void
+ogrWriteXactBegin(GisFdwModifyState *modstate)
+{
+#if GDAL_VERSION_MAJOR >= 2
+	GDALDatasetH ds = modstate->ogr.ds;
+	MemoryContext oldcontext;
+	OgrWriteXact *xact;
+
+	modstate->xact = NULL;
+	modstate->xact_rows = 0;
+
+	/* Emulated transactions copy the whole datasource, don't bother */
+	if ( ! GDALDatasetTestCapability(ds, ODsCTransactions) )
+		return;
+
+	if ( GDALDatasetStartTransaction(ds, false) != OGRERR_NONE )
+	{
+		elog(DEBUG1, "unable to start OGR data source transaction, writing features one by one");
+		return;
 	}
-	state->foreigntableid = foreigntableid;
 
-	return state;
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	xact = palloc(sizeof(OgrWriteXact));
+	xact->ds = ds;
+	xact->subid = GetCurrentSubTransactionId();
+	ogr_write_xacts = lappend(ogr_write_xacts, xact);
+	MemoryContextSwitchTo(oldcontext);
+
+	modstate->xact = xact;
+#endif
 }
 
+static void
+ogrWriteXactCommit(GisFdwModifyState *modstate)
+{
+#if GDAL_VERSION_MAJOR >= 2
+	OgrWriteXact *xact = modstate->xact;
+
+	if ( ! xact )
+		return;
+
+	/* On failure the transaction stays listed, for the abort to roll back */
+	if ( GDALDatasetCommitTransaction(xact->ds) != OGRERR_NONE )
+		ogrEreportError("failure committing OGR data source transaction");
 
+	ogr_write_xacts = list_delete_ptr(ogr_write_xacts, xact);
+	pfree(xact);
+	modstate->xact = NULL;
+#endif
+}
 
 /*
- * ogrGetForeignRelSize
- *		Obtain relation size estimates for a foreign table
+ * Count a written row, and commit once the interval is reached.
  */
 static void
-ogrGetForeignRelSize(PlannerInfo *root,
-                     RelOptInfo *baserel,
-                     Oid foreigntableid)
+ogrWriteXactRow(GisFdwModifyState *modstate)
 {
-	/* Initialize the OGR connection */
-	GisFdwState *state = (GisFdwState *)getGisFdwState(foreigntableid, GIS_PLAN_STATE);
-	GisFdwPlanState *planstate = (GisFdwPlanState *)state;
-	List *scan_clauses = baserel->baserestrictinfo;
+	if ( ! modstate->xact )
+		return;
 
-	if (planstate->isRaster)
+	if ( ogr_commit_interval > 0 && ++modstate->xact_rows >= ogr_commit_interval )
 	{
-	    baserel->fdw_private = (void *) planstate;
-	    return;
+		ogrWriteXactCommit(modstate);
+		ogrWriteXactBegin(modstate);
 	}
-	/* Set to NULL to clear the restriction clauses in OGR */
-	OGR_L_SetIgnoredFields(planstate->ogr.lyr, NULL);
-	OGR_L_SetSpatialFilter(planstate->ogr.lyr, NULL);
-	OGR_L_SetAttributeFilter(planstate->ogr.lyr, NULL);
-
-	/*
-	* The estimate number of rows returned must actually use restrictions.
-	* Since OGR can't really give us a fast count with restrictions on
-	* (usually involves a scan) and restrictions in the baserel mean we
-	* must punt row count estimates.
-	*/
+}
 
-	/* TODO: calculate the row width based on the attribute types of the OGR table */
+/*
+ * Roll back the datasource transactions opened in the given
+ * subtransaction, or all of them. We are aborting already, so keep
+ * GDAL errors from being raised again.
+ */
+static void
+ogrWriteXactRollback(SubTransactionId subid)
+{
+#if GDAL_VERSION_MAJOR >= 2
+	ListCell *cell;
+	List *keep = NIL;
+	MemoryContext oldcontext;
 
-	/*
-	* OGR asks drivers to honestly state if they can provide a fast
-	* row count, but too many drivers lie. We are only listing drivers
-	* we trust in ogrCanReallyCountFast()
-	*/
+	if ( ! ogr_write_xacts )
+		return;
 
-	/* If we can quickly figure how many rows this layer has, then do so */
-	if ( scan_clauses == NIL &&
-	     OGR_L_TestCapability(planstate->ogr.lyr, OLCFastFeatureCount) == TRUE &&
-	     ogrCanReallyCountFast(&(planstate->ogr)) )
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	foreach(cell, ogr_write_xacts)
 	{
-		/* Count rows, but don't force a slow count */
-		int rows = OGR_L_GetFeatureCount(planstate->ogr.lyr, false);
-		/* Only use row count if return is valid (>0) */
-		if ( rows >= 0 )
+		OgrWriteXact *xact = (OgrWriteXact *) lfirst(cell);
+
+		if ( subid != InvalidSubTransactionId && xact->subid != subid )
 		{
-			planstate->nrows = rows;
-			baserel->rows = rows;
+			keep = lappend(keep, xact);
+			continue;
 		}
+
+		CPLPushErrorHandler(CPLQuietErrorHandler);
+		GDALDatasetRollbackTransaction(xact->ds);
+		CPLPopErrorHandler();
+		pfree(xact);
 	}
+	list_free(ogr_write_xacts);
+	ogr_write_xacts = keep;
+	MemoryContextSwitchTo(oldcontext);
+#endif
+}
 
-	/* Save connection state for next calls */
-	baserel->fdw_private = (void *) planstate;
+static void
+ogrWriteXactCallback(XactEvent event, void *arg)
+{
+	/* Statements that finish commit their own, so anything left failed */
+	if ( event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT )
+		ogrWriteXactRollback(InvalidSubTransactionId);
+}
 
-	return;
+static void
+ogrWriteSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+                        SubTransactionId parentSubid, void *arg)
+{
+	if ( event == SUBXACT_EVENT_ABORT_SUB )
+		ogrWriteXactRollback(mySubid);
 }
 
+static bool
+ogrCanReallyCountFast(const OgrConnection *con)
+{
+	GDALDriverH dr = GDALGetDatasetDriver(con->ds);
+	const char *dr_str = GDALGetDriverShortName(dr);
 
+	if ( streq(dr_str, "ESRI Shapefile" ) ||
+   	     streq(dr_str, "FileGDB" ) ||
+	     streq(dr_str, "OpenFileGDB" ) )
+	{
+		return true;
+	}
+	return false;
+}
 
 /*
- * ogrGetForeignPaths
- *		Create possible access paths for a scan on the foreign table
- *
- *		Currently there is only one
- *		possible access path, which simply returns all records in the order in
- *		the data file.
+ * Drivers fall into three broad classes for costing: local files,
+ * SQL databases that need a connection and a query, and web
+ * services that need requests for every page of features.
  */
-static void
-ogrGetForeignPaths(PlannerInfo *root,
-                   RelOptInfo *baserel,
-                   Oid foreigntableid)
+typedef enum
 {
-	GisFdwPlanState *planstate = (GisFdwPlanState *)(baserel->fdw_private);
+	OGR_DRIVER_FILE,
+	OGR_DRIVER_DATABASE,
+	OGR_DRIVER_SERVICE
+} OgrDriverClass;
 
-	/* TODO: replace this with something that looks at the OGRDriver and */
-	/* makes a determination based on that? Better: add connection caching */
-	/* so that slow startup doesn't matter so much */
-	planstate->startup_cost = 25;
+/*
+ * Start-up cost and cost of fetching one feature from the
+ * source, for each driver class.
+ */
+static const struct
+{
+	Cost startup;
+	Cost fetch;
+} ogr_driver_costs[] = {
+	{ 10.0, 0.01 },    /* OGR_DRIVER_FILE */
+	{ 100.0, 0.01 },   /* OGR_DRIVER_DATABASE */
+	{ 1000.0, 0.1 }    /* OGR_DRIVER_SERVICE */
+};
 
-	/* TODO: more research on what the total cost is supposed to mean, */
-	/* relative to the startup cost? */
-	planstate->total_cost = planstate->startup_cost + baserel->rows;
+static OgrDriverClass
+ogrDriverClass(const OgrConnection *con)
+{
+	static const char *db_drivers[] = {
+		"PostgreSQL", "MySQL", "MSSQLSpatial", "OCI", "ODBC", "PGeo",
+		"DB2ODBC", "HANA", "MongoDB", "MongoDBv3", "CouchDB", NULL
+	};
+	static const char *service_drivers[] = {
+		"WFS", "OAPIF", "WFS3", "ElasticSearch", "CARTO", "CartoDB",
+		"AmigoCloud", "GFT", "PLScenes", "NGW", "EEDA", NULL
+	};
+	GDALDriverH dr = GDALGetDatasetDriver(con->ds);
+	const char *dr_str = GDALGetDriverShortName(dr);
+	const char *ds_str = con->ds_str;
+	int i;
 
-	/* Built the (one) path we are providing. Providing fancy paths is */
-	/* really only possible with back-ends that can properly provide */
-	/* explain info on how they complete the query, not for something as */
-	/* obtuse as OGR. (So far, have only seen it w/ the postgres_fdw */
-	add_path(baserel,
-		(Path *) create_foreignscan_path(root, baserel,
-#if PG_VERSION_NUM >= 90600
-					NULL, /* PathTarget */
-#endif
-					baserel->rows,
-					planstate->startup_cost,
-					planstate->total_cost,
-					NIL,     /* no pathkeys */
-					NULL,    /* no outer rel either */
-					NULL  /* no extra plan */
-#if PG_VERSION_NUM >= 90500
-					,NIL /* no fdw_private list */
-#endif
-					)
-		);   /* no fdw_private data */
-}
+	for ( i = 0; service_drivers[i]; i++ )
+		if ( streq(dr_str, service_drivers[i]) )
+			return OGR_DRIVER_SERVICE;
 
+	/* Any file format can be read over the network too */
+	if ( ds_str && (strncmp(ds_str, "/vsicurl", 8) == 0 ||
+	                strncmp(ds_str, "http://", 7) == 0 ||
+	                strncmp(ds_str, "https://", 8) == 0 ||
+	                strncmp(ds_str, "ftp://", 6) == 0) )
+		return OGR_DRIVER_SERVICE;
 
+	for ( i = 0; db_drivers[i]; i++ )
+		if ( streq(dr_str, db_drivers[i]) )
+			return OGR_DRIVER_DATABASE;
 
+	return OGR_DRIVER_FILE;
+}
 
 /*
- * fileGetForeignPlan
- *		Create a ForeignScan plan node for scanning the foreign table
+ * Drivers that count the features passing a filter with a query
+ * on their own indexes, rather than by reading the features.
  */
-static ForeignScan *
-ogrGetForeignPlan(PlannerInfo *root,
-                  RelOptInfo *baserel,
-                  Oid foreigntableid,
-                  ForeignPath *best_path,
-                  List *tlist,
-                  List *scan_clauses
-#if PG_VERSION_NUM >= 90500
-                  ,Plan *outer_plan
-#endif
-                  )
+static bool
+ogrCanCountFilteredFast(const OgrConnection *con)
 {
-	Index scan_relid = baserel->relid;
-	bool sql_generated;
-	StringInfoData sql;
-	List *params_list = NULL;
-	List *fdw_private;
-	GisFdwPlanState *planstate = (GisFdwPlanState *)(baserel->fdw_private);
-	GisFdwState *state = (GisFdwState *)(baserel->fdw_private);
+	GDALDriverH dr = GDALGetDatasetDriver(con->ds);
+	const char *dr_str = GDALGetDriverShortName(dr);
 
-	if (planstate->isRaster) {
-	    scan_clauses = extract_actual_clauses(scan_clauses, false);
-	} else {
-	    /* Add in column mapping data to build SQL with the right OGR column names */
-	    ogrReadColumnData(state);
+	return streq(dr_str, "GPKG") ||
+	       streq(dr_str, "PostgreSQL") ||
+	       streq(dr_str, "SQLite");
+}
 
-	    /*
-	     * TODO: Review the columns requested (via params_list) and only pull those back, using
-	     * OGR_L_SetIgnoredFields. This is less important than pushing restrictions
-	     * down to OGR via OGR_L_SetAttributeFilter (done) and (TODO) OGR_L_SetSpatialFilter.
-	     */
-	    initStringInfo(&sql);
-	    sql_generated = ogrDeparse(&sql, root, baserel, scan_clauses, state, &params_list);
-	    elog(DEBUG1,"OGR SQL: %s", sql.data);
+/*
+ * Drivers that hand attribute filters on to their database take
+ * them in its SQL rather than in OGR SQL.
+ */
+OgrSqlDialect
+ogrSqlDialect(const OgrConnection *con)
+{
+	GDALDriverH dr = GDALGetDatasetDriver(con->ds);
+	const char *dr_str = GDALGetDriverShortName(dr);
 
-	    /*
-	     * Here we strip RestrictInfo
-	     * nodes from the clauses and ignore pseudoconstants (which will be
-	     * handled elsewhere).
-	     * Some FDW implementations (mysql_fdw) just pass this full list on to the
-	     * make_foreignscan function. postgres_fdw carefully separates local and remote
-	     * clauses and only passes the local ones to make_foreignscan, so this
-	     * is probably best practice, though re-applying the clauses is probably
-	     * the least of our performance worries with this fdw. For now, we just
-	     * pass them all to make_foreignscan, see no evil, etc.
-	     */
-	    scan_clauses = extract_actual_clauses(scan_clauses, false);
+	if ( streq(dr_str, "GPKG") || streq(dr_str, "SQLite") )
+		return OGR_DIALECT_SQLITE;
+	if ( streq(dr_str, "PostgreSQL") )
+		return OGR_DIALECT_POSTGRESQL;
 
-	    /*
-	     * Serialize the data we want to pass to the execution stage.
+	return OGR_DIALECT_OGRSQL;
+}
+
+/*
+ * Drivers that run a whole SELECT in their database, so sorting,
+ * joins and grouping can be left to it. Others would run it as
+ * OGR SQL, reading every feature all the same.
+ */
+static bool
+ogrCanExecuteSql(const OgrConnection *con)
+{
+	GDALDriverH dr = GDALGetDatasetDriver(con->ds);
+	const char *dr_str = GDALGetDriverShortName(dr);
+
+	return streq(dr_str, "GPKG") ||
+	       streq(dr_str, "PostgreSQL") ||
+	       streq(dr_str, "SQLite");
+}
+
+/*
+ * Drivers whose FIDs are the feature index, so a FID range can
+ * be read by starting at its first feature. Shapefile FIDs are
+ * the record numbers.
+ */
+static bool
+ogrFidIsIndex(const OgrConnection *con)
+{
+	GDALDriverH dr = GDALGetDatasetDriver(con->ds);
+	const char *dr_str = GDALGetDriverShortName(dr);
+
+	return streq(dr_str, "ESRI Shapefile") &&
+	       OGR_L_TestCapability(con->lyr, OLCFastSetNextByIndex) == TRUE;
+}
+
+static void
+ogrEreportError(const char *errstr)
+{
+	const char *ogrerr = CPLGetLastErrorMsg();
+	if ( ogrerr && ! streq(ogrerr,"") )
+	{
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+			 errmsg("%s", errstr),
+			 errhint("%s", ogrerr)));
+	}
+	else
+	{
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+			 errmsg("%s", errstr)));
+	}
+}
+
+/*
+ * Make sure the datasource is cleaned up when we're done
+ * with a connection.
+ */
+static void
+ogrFinishConnection(OgrConnection *ogr)
+{
+	if ( ogr->lyr && OGR_L_SyncToDisk(ogr->lyr) != OGRERR_NONE )
+		elog(NOTICE, "failed to flush writes to OGR data source");
+
+	if ( ogr->pool )
+		ogrPoolRelease(ogr);
+	else if ( ogr->ds )
+		GDALClose(ogr->ds);
+
+	ogr->ds = NULL;
+	ogr->lyr = NULL;
+	ogr->pool = NULL;
+}
+
+static OgrConnection
+ogrGetConnectionFromServer(Oid foreignserverid, bool updateable)
+{
+	ForeignServer *server;
+	OgrConnection ogr;
+	ListCell *cell;
+
+	/* Null all values */
+	memset(&ogr, 0, sizeof(OgrConnection));
+	ogr.ds_updateable = OGR_UPDATEABLE_UNSET;
+	ogr.lyr_updateable = OGR_UPDATEABLE_UNSET;
+
+	server = GetForeignServer(foreignserverid);
+
+	foreach(cell, server->options)
+	{
+		DefElem *def = (DefElem *) lfirst(cell);
+		if (streq(def->defname, OPT_SOURCE))
+			ogr.ds_str = defGetString(def);
+		if (streq(def->defname, OPT_DRIVER))
+			ogr.dr_str = defGetString(def);
+		if (streq(def->defname, OPT_CONFIG_OPTIONS))
+			ogr.config_options = defGetString(def);
+		if (streq(def->defname, OPT_OPEN_OPTIONS))
+			ogr.open_options = defGetString(def);
+		if (streq(def->defname, OPT_UPDATEABLE))
+		{
+			if ( defGetBoolean(def) )
+				ogr.ds_updateable = OGR_UPDATEABLE_TRUE;
+			else
+				ogr.ds_updateable = OGR_UPDATEABLE_FALSE;
+		}
+	}
+
+	if ( ! ogr.ds_str )
+		elog(ERROR, "FDW table '%s' option is missing", OPT_SOURCE);
+
+	if ( updateable && ogr.ds_updateable == OGR_UPDATEABLE_FALSE )
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+			 errmsg("updates are not allowed on foreign server '%s'", server->servername),
+			 errhint("ALTER FOREIGN SERVER %s OPTIONS (SET updatable 'true')", server->servername)));
+
+	/*  Connect! (or reuse a pooled datasource) */
+	ogrPoolAcquire(foreignserverid, &ogr, updateable);
+
+	return ogr;
+}
+
+
+/*
+ * Read the options (data source connection from server and
+ * layer name from table) from a foreign table and use them
+ * to connect to an OGR layer. Return a connection object that
+ * has handles for both the datasource and layer.
+ */
+static OgrConnection
+ogrGetConnectionFromTable(Oid foreigntableid, bool updateable)
+{
+	ForeignTable *table;
+	/* UserMapping *mapping; */
+	/* ForeignDataWrapper *wrapper; */
+	ListCell *cell;
+	OgrConnection ogr;
+
+	/* Gather all data for the foreign table. */
+	table = GetForeignTable(foreigntableid);
+	/* mapping = GetUserMapping(GetUserId(), table->serverid); */
+
+	ogr = ogrGetConnectionFromServer(table->serverid, updateable);
+
+	foreach(cell, table->options)
+	{
+		DefElem *def = (DefElem *) lfirst(cell);
+		if (streq(def->defname, OPT_LAYER))
+			ogr.lyr_str = defGetString(def);
+		if (streq(def->defname, OPT_UPDATEABLE))
+		{
+			if ( defGetBoolean(def) )
+				ogr.lyr_updateable = OGR_UPDATEABLE_TRUE;
+			else
+				ogr.lyr_updateable = OGR_UPDATEABLE_FALSE;
+		}
+		if (streq(def->defname, OPT_BATCH_READ))
+			ogr.lyr_arrow = streq(defGetString(def), "arrow");
+		if (streq(def->defname, OPT_ANALYZE_SAMPLE_SIZE))
+			ogr.analyze_sample_size = strtol(defGetString(def), NULL, 10);
+	}
+
+	if ( ! ogr.lyr_str )
+		elog(ERROR, "FDW table '%s' option is missing", OPT_LAYER);
+
+	if ( updateable && ogr.lyr_updateable == OGR_UPDATEABLE_FALSE )
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+			 errmsg("updates are not allowed on foreign table '%s'", get_rel_name(table->relid)),
+			 errhint("ALTER FOREIGN TABLE %s OPTIONS (SET updatable 'true')", get_rel_name(table->relid))));
+
+	/* Does the layer exist in the data source? */
+	ogr.lyr = GDALDatasetGetLayerByName(ogr.ds, ogr.lyr_str);
+	if ( ! ogr.lyr )
+	{
+		const char *ogrerr = CPLGetLastErrorMsg();
+		ereport(ERROR, (
+				errcode(ERRCODE_FDW_OPTION_NAME_NOT_FOUND),
+				errmsg("unable to connect to %s to \"%s\"", OPT_LAYER, ogr.lyr_str),
+				(ogrerr && ! streq(ogrerr, ""))
+				? errhint("%s", ogrerr)
+				: errhint("Does the layer exist?")
+				));
+	}
+	ogr.lyr_utf8 = OGR_L_TestCapability(ogr.lyr, OLCStringsAsUTF8);
+
+	/* A pooled layer may carry filters and a cursor from its last user */
+	OGR_L_SetIgnoredFields(ogr.lyr, NULL);
+	OGR_L_SetSpatialFilter(ogr.lyr, NULL);
+	OGR_L_SetAttributeFilter(ogr.lyr, NULL);
+	OGR_L_ResetReading(ogr.lyr);
+
+	return ogr;
+}
+
+/*
+ * Validate the options given to a FOREIGN DATA WRAPPER, SERVER,
+ * USER MAPPING or FOREIGN TABLE that uses ogr_fdw.
+ *
+ * Raise an ERROR if the option or its value is considered invalid.
+ */
+Datum
+ogr_fdw_validator(PG_FUNCTION_ARGS)
+{
+	List *options_list = untransformRelOptions(PG_GETARG_DATUM(0));
+	Oid catalog = PG_GETARG_OID(1);
+	ListCell *cell;
+	struct OgrFdwOption *opt;
+	const char *source = NULL, *driver = NULL;
+	const char *conf_file = NULL, *bands = NULL;
+	const char *config_options = NULL, *open_options = NULL;
+	bool updateable = false;
+	bool raster_flag = false;
+
+	/* Check that the database encoding is UTF8, to match OGR internals */
+	if ( GetDatabaseEncoding() != PG_UTF8 )
+	{
+		elog(ERROR, "OGR FDW only works with UTF-8 databases");
+		PG_RETURN_VOID();
+	}
+
+	/* Initialize found state to not found */
+	for ( opt = valid_options; opt->optname; opt++ )
+	{
+		opt->optfound = false;
+	}
+
+	/*
+	 * Check that only options supported by ogr_fdw, and allowed for the
+	 * current object type, are given.
+	 */
+	foreach(cell, options_list)
+	{
+		DefElem *def = (DefElem *) lfirst(cell);
+		bool optfound = false;
+
+		for ( opt = valid_options; opt->optname; opt++ )
+		{
+			if ( catalog == opt->optcontext && streq(opt->optname, def->defname) )
+			{
+				/* Mark that this user option was found */
+				opt->optfound = optfound = true;
+
+				/* Store some options for testing later */
+				if ( streq(opt->optname, OPT_SOURCE) )
+					source = defGetString(def);
+				if ( streq(opt->optname, OPT_DRIVER) )
+					driver = defGetString(def);
+				if ( streq(opt->optname, OPT_CONFIG_OPTIONS) )
+					config_options = defGetString(def);
+				if ( streq(opt->optname, OPT_OPEN_OPTIONS) )
+					open_options = defGetString(def);
+				if ( streq(opt->optname, OPT_UPDATEABLE) )
+					updateable = defGetBoolean(def);
+				if ( streq(opt->optname, OPT_ANALYZE_SAMPLE_SIZE) )
+				{
+					const char *rows = defGetString(def);
+					char *end;
+					long val = strtol(rows, &end, 10);
+					if ( *end || val <= 0 || val > INT_MAX )
+						ereport(ERROR, (
+							errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+							errmsg("invalid value for option \"%s\": \"%s\"", opt->optname, rows),
+							errhint("Use a positive number of rows.")));
+				}
+				if ( streq(opt->optname, OPT_BATCH_READ) )
+				{
+					const char *batch_read = defGetString(def);
+					if ( ! (streq(batch_read, "feature") || streq(batch_read, "arrow")) )
+						ereport(ERROR, (
+							errcode(ERRCODE_FDW_INVALID_STRING_FORMAT),
+							errmsg("invalid value for option \"%s\": \"%s\"", OPT_BATCH_READ, batch_read),
+							errhint("Valid values are 'feature' and 'arrow'.")));
+				}
+				if ( streq(opt->optname, OPT_RASTER_BANDS) )
+				{
+					bands = defGetString(def);
+					if ( parse_raster_bands(bands, NULL) < 0 )
+						ereport(ERROR, (
+							errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+							errmsg("invalid value for option \"%s\": \"%s\"", OPT_RASTER_BANDS, bands),
+							errhint("Use a comma separated list of band numbers, starting at 1.")));
+				}
+				if ( streq(opt->optname, OPT_RASTER_CONF) )
+					conf_file = defGetString(def);
+
+				break;
+			}
+		}
+
+		if ( ! optfound )
+		{
+			/*
+			 * Unknown option specified, complain about it. Provide a hint
+			 * with list of valid options for the object.
+			 */
+			const struct OgrFdwOption *opt;
+			StringInfoData buf;
+
+			initStringInfo(&buf);
+			for (opt = valid_options; opt->optname; opt++)
+			{
+				if (catalog == opt->optcontext)
+					appendStringInfo(&buf, "%s%s", (buf.len > 0) ? ", " : "",
+									 opt->optname);
+			}
+
+			ereport(ERROR, (
+				errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+				errmsg("invalid option \"%s\"", def->defname),
+				buf.len > 0
+				? errhint("Valid options in this context are: %s", buf.data)
+				: errhint("There are no valid options in this context.")));
+		}
+	}
+	if (driver && streq(driver, "GTiff"))
+	    raster_flag = true;
+
+	/* Check that all the mandatory options were found */
+	for ( opt = valid_options; opt->optname; opt++ )
+	{
+		/* Required option for this catalog type is missing? */
+		if ( catalog == opt->optcontext && opt->optrequired && ! opt->optfound )
+		{
+		    if ((raster_flag && streq(opt->optname, OPT_RASTER_CONF)) ||
+			(driver && !streq(driver, "GTiff") && streq(opt->optname, OPT_LAYER)))
+			ereport(ERROR, (
+					errcode(ERRCODE_FDW_DYNAMIC_PARAMETER_VALUE_NEEDED),
+					errmsg("required option \"%s\" is missing", opt->optname)));
+		}
+	}
+
+	/* Only raster tables, the ones with a conf_file, read bands */
+	if ( catalog == ForeignTableRelationId && bands && ! conf_file )
+		ereport(ERROR, (
+				errcode(ERRCODE_FDW_DYNAMIC_PARAMETER_VALUE_NEEDED),
+				errmsg("option \"%s\" needs option \"%s\"", OPT_RASTER_BANDS, OPT_RASTER_CONF),
+				errhint("Only raster tables have bands.")));
+
+	/* Make sure server connection can actually be established */
+	if ( catalog == ForeignServerRelationId && source && !raster_flag)
+	{
+		OGRDataSourceH ogr_ds;
+		ogr_ds = ogrGetDataSource(source, driver, updateable, config_options, open_options);
+		if ( ogr_ds )
+		{
+			GDALClose(ogr_ds);
+		}
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Initialize an GisFdwPlanState on the heap.
+ */
+static GisFdwState*
+getGisFdwState(Oid foreigntableid, GisFdwStateType state_type)
+{
+	GisFdwState *state;
+	size_t size;
+	bool updateable = false;
+
+	switch (state_type)
+	{
+		case GIS_PLAN_STATE:
+			size = sizeof(GisFdwPlanState);
+			updateable = false;
+			break;
+		case GIS_EXEC_STATE:
+			size = sizeof(GisFdwExecState);
+			updateable = false;
+			break;
+		case GIS_MODIFY_STATE:
+			updateable = true;
+			size = sizeof(GisFdwModifyState);
+			break;
+		default:
+			elog(ERROR, "invalid state type");
+	}
+
+	state = palloc0(size);
+	state->type = state_type;
+
+	/*  Connect! */
+	if (isRaster(foreigntableid)) {
+	    state->isRaster = true;
+	    if (state_type == GIS_EXEC_STATE)
+	    	state->raster = rasterGetConnectionFromTable(foreigntableid);
+	} else {
+	    state->ogr = ogrGetConnectionFromTable(foreigntableid, updateable);
+	}
+	state->foreigntableid = foreigntableid;
+
+	return state;
+}
+
+
+
+/*
+ * Build a polygon covering an envelope, to carry filter boxes
+ * in the same WKB form as filter geometries.
+ */
+static OGRGeometryH
+ogrEnvelopeToGeometry(const OGREnvelope *env)
+{
+	OGRGeometryH ring = OGR_G_CreateGeometry(wkbLinearRing);
+	OGRGeometryH poly = OGR_G_CreateGeometry(wkbPolygon);
+
+	OGR_G_AddPoint_2D(ring, env->MinX, env->MinY);
+	OGR_G_AddPoint_2D(ring, env->MinX, env->MaxY);
+	OGR_G_AddPoint_2D(ring, env->MaxX, env->MaxY);
+	OGR_G_AddPoint_2D(ring, env->MaxX, env->MinY);
+	OGR_G_AddPoint_2D(ring, env->MinX, env->MinY);
+	OGR_G_AddGeometryDirectly(poly, ring);
+
+	return poly;
+}
+
+/*
+ * List the attribute numbers of the columns referenced by the
+ * target list or the restrictions. A whole-row reference needs
+ * every column.
+ */
+static List *
+ogrGetRetrievedAttrs(RelOptInfo *baserel, List *clauses, const OgrFdwTable *tbl)
+{
+	Bitmapset *attrs_used = NULL;
+	bool whole_row;
+	List *retrieved_attrs = NIL;
+	int i;
+
+#if PG_VERSION_NUM >= 90600
+	pull_varattnos((Node *) baserel->reltarget->exprs, baserel->relid, &attrs_used);
+#else
+	pull_varattnos((Node *) baserel->reltargetlist, baserel->relid, &attrs_used);
+#endif
+	pull_varattnos((Node *) clauses, baserel->relid, &attrs_used);
+
+	whole_row = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, attrs_used);
+
+	for ( i = 0; i < tbl->ncols; i++ )
+	{
+		int attnum = tbl->cols[i].pgattnum;
+		if ( whole_row || bms_is_member(attnum - FirstLowInvalidHeapAttributeNumber, attrs_used) )
+			retrieved_attrs = lappend(retrieved_attrs, makeInteger(attnum));
+	}
+
+	return retrieved_attrs;
+}
+
+/*
+ * Rough size of a serialized geometry of the given type, for
+ * the row width. Only points are exact, other types assume
+ * a modest number of vertices.
+ */
+static int
+ogrGeometryWidth(OGRwkbGeometryType gtype)
+{
+	int nverts;
+
+	switch ( wkbFlatten(gtype) )
+	{
+		case wkbPoint:
+			nverts = 1;
+			break;
+		case wkbMultiPoint:
+			nverts = 8;
+			break;
+		case wkbLineString:
+			nverts = 32;
+			break;
+		case wkbPolygon:
+		case wkbMultiLineString:
+			nverts = 64;
+			break;
+		case wkbMultiPolygon:
+			nverts = 128;
+			break;
+		default:
+			nverts = 64;
+	}
+
+	/* Header and bounding box, then two doubles per vertex */
+	return 16 + 16 * nverts;
+}
+
+/*
+ * The planner sizes geometry columns like any other varlena,
+ * which badly undersells them. Unless ANALYZE has measured
+ * them, size the ones we return from the OGR geometry type.
+ */
+static void
+ogrSetRelWidth(GisFdwPlanState *planstate, RelOptInfo *baserel)
+{
+	OgrFdwTable *tbl = planstate->table;
+	OGRFeatureDefnH dfn = OGR_L_GetLayerDefn(planstate->ogr.lyr);
+	List *target_attrs = ogrGetRetrievedAttrs(baserel, NIL, tbl);
+	ListCell *lc;
+	int width = 0;
+
+	foreach(lc, target_attrs)
+	{
+		int attnum = intVal(lfirst(lc));
+		OgrFdwColumn *col = &(tbl->cols[attnum - 1]);
+		OGRwkbGeometryType gtype;
+
+		if ( col->ogrvariant != OGR_GEOMETRY )
+			continue;
+		if ( get_attavgwidth(planstate->foreigntableid, attnum) > 0 )
+			continue;
+
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+		gtype = OGR_GFld_GetType(OGR_FD_GetGeomFieldDefn(dfn, col->ogrfldnum));
+#else
+		gtype = OGR_FD_GetGeomType(dfn);
+#endif
+		width += ogrGeometryWidth(gtype) - get_typavgwidth(col->pgtype, col->pgtypmod);
+	}
+
+#if PG_VERSION_NUM >= 90600
+	baserel->reltarget->width += width;
+#else
+	baserel->width += width;
+#endif
+}
+
+/*
+ * Cost of turning one feature into a tuple: a bit for every
+ * column we fill, and a lot more for geometries, which are
+ * exported to WKB and parsed again on the way in.
+ */
+static Cost
+ogrFeatureCost(GisFdwPlanState *planstate, RelOptInfo *baserel, List *scan_clauses)
+{
+	OgrFdwTable *tbl = planstate->table;
+	List *attrs = ogrGetRetrievedAttrs(baserel, scan_clauses, tbl);
+	ListCell *lc;
+	Cost cost = cpu_tuple_cost;
+
+	foreach(lc, attrs)
+	{
+		OgrFdwColumn *col = &(tbl->cols[intVal(lfirst(lc)) - 1]);
+		if ( col->ogrvariant == OGR_GEOMETRY )
+			cost += 10 * cpu_operator_cost;
+		else
+			cost += cpu_operator_cost;
+	}
+
+	return cost;
+}
+
+/*
+ * Carry the spatial filter as WKB, in hex to survive copyObject.
+ * Takes ownership of the filter geometry.
+ */
+static void
+ogrSaveSpatialFilter(GisFdwPlanState *planstate, OgrFdwSpatialFilter *spatial)
+{
+	bool is_rect;
+	OGRGeometryH geom;
+	int wkbsize;
+	GByte *wkb;
+	char *hex;
+
+	if ( spatial->nfilters == 0 )
+		return;
+
+	is_rect = (spatial->geom == NULL);
+	geom = is_rect ? ogrEnvelopeToGeometry(&spatial->env) : spatial->geom;
+	wkbsize = OGR_G_WkbSize(geom);
+	wkb = palloc(wkbsize);
+
+	OGR_G_ExportToWkb(geom, wkbNDR, wkb);
+	hex = CPLBinaryToHex(wkbsize, wkb);
+
+	elog(DEBUG1, "OGR spatial filter: %s(%g %g, %g %g)",
+	     is_rect ? "envelope " : "geometry ",
+	     spatial->env.MinX, spatial->env.MinY, spatial->env.MaxX, spatial->env.MaxY);
+
+	planstate->spatial_hex = pstrdup(hex);
+	planstate->spatial_fldnum = spatial->ogrfldnum;
+	planstate->spatial_rect = is_rect;
+
+	CPLFree(hex);
+	pfree(wkb);
+	OGR_G_DestroyGeometry(geom);
+	spatial->geom = NULL;
+}
+
+/*
+ * Work out how the FID restrictions can be read: equalities and
+ * IN lists by looking up each FID, ranges by reading from the
+ * first feature of the range, where FIDs are the feature index
+ * and OGR has no other filter to apply (it would count the
+ * features it skips by the filtered ones).
+ */
+static void
+ogrSaveFidFilter(GisFdwPlanState *planstate)
+{
+	OgrFdwFidFilter *fid = &(planstate->fid);
+
+	if ( fid->lookup )
+	{
+		elog(DEBUG1, "OGR FIDs to look up: %d", fid->nfids);
+		planstate->pushed_clauses = fid->clauses;
+	}
+	else if ( (fid->has_min || fid->has_max) &&
+	          ! planstate->spatial_hex &&
+	          planstate->params_list == NIL &&
+	          list_difference_ptr(planstate->pushed_clauses, fid->clauses) == NIL &&
+	          ogrFidIsIndex(&(planstate->ogr)) )
+	{
+		elog(DEBUG1, "OGR FID range read from feature " OGR_FDW_FRMT_INT64,
+		     OGR_FDW_CAST_INT64(fid->has_min ? Max(fid->min_fid, 0) : 0));
+		planstate->fid_seek = true;
+		planstate->sql = NULL;
+	}
+}
+
+/*
+ * Restrictions OGR applies exactly as PgSQL would needn't be
+ * checked again locally. That only holds if OGR really applies
+ * them: not for FID lookups, which ignore the filters, and not
+ * if OGR can't parse the OGR SQL, which is only a NOTICE at
+ * execution. The range of a FID range read is applied exactly.
+ */
+static void
+ogrCheckExactClauses(GisFdwPlanState *planstate)
+{
+	OGRLayerH lyr = planstate->ogr.lyr;
+	OGRErr err;
+
+	if ( ! planstate->exact_clauses )
+		return;
+
+	if ( planstate->fid.lookup )
+	{
+		planstate->exact_clauses = NIL;
+		return;
+	}
+
+	if ( planstate->fid_seek || ! planstate->sql || strlen(planstate->sql) == 0 )
+		return;
+
+	CPLPushErrorHandler(CPLQuietErrorHandler);
+	err = OGR_L_SetAttributeFilter(lyr, planstate->sql);
+	OGR_L_SetAttributeFilter(lyr, NULL);
+	CPLPopErrorHandler();
+
+	if ( err != OGRERR_NONE )
+		planstate->exact_clauses = NIL;
+}
+
+/*
+ * Features read for the FID restrictions, or -1 if they aren't
+ * read directly.
+ */
+static double
+ogrFidRows(GisFdwPlanState *planstate)
+{
+	OgrFdwFidFilter *fid = &(planstate->fid);
+	double lo, hi;
+
+	if ( fid->lookup )
+		return fid->nfids;
+
+	if ( ! planstate->fid_seek )
+		return -1;
+
+	lo = fid->has_min ? Max(fid->min_fid, 0) : 0;
+	hi = fid->has_max ? Min(fid->max_fid, planstate->nrows - 1) : planstate->nrows - 1;
+	return Max(hi - lo + 1, 0);
+}
+
+/*
+ * Count the features that pass the filters we push, on drivers
+ * that can do it cheaply, by setting the filters on the planning
+ * connection. Returns -1 if there's no cheap count.
+ */
+static double
+ogrFilteredCount(GisFdwPlanState *planstate)
+{
+	OGRLayerH lyr = planstate->ogr.lyr;
+	OgrCountCacheEntry *entry;
+	StringInfoData filter;
+	GIntBig count = -1;
+
+	/* No count for filters on values we don't know yet */
+	if ( planstate->params_list || ! ogrCanCountFilteredFast(&(planstate->ogr)) )
+		return -1;
+
+	initStringInfo(&filter);
+	appendStringInfo(&filter, "%s\x1f%s\x1f%d\x1f%d",
+		planstate->sql ? planstate->sql : "",
+		planstate->spatial_hex ? planstate->spatial_hex : "",
+		planstate->spatial_fldnum, planstate->spatial_rect);
+
+	entry = ogrCountCacheLookup(planstate->foreigntableid, filter.data);
+	if ( entry )
+	{
+		pfree(filter.data);
+		return entry->count;
+	}
+
+	/* A filter OGR won't take just means no count, not an error */
+	CPLPushErrorHandler(CPLQuietErrorHandler);
+	if ( ! planstate->sql || strlen(planstate->sql) == 0 ||
+	     OGR_L_SetAttributeFilter(lyr, planstate->sql) == OGRERR_NONE )
+	{
+		if ( planstate->spatial_hex )
+			ogrSetSpatialFilter(lyr, makeString(planstate->spatial_hex),
+			                    planstate->spatial_fldnum, planstate->spatial_rect);
+		count = OGR_L_GetFeatureCount(lyr, FALSE);
+	}
+	OGR_L_SetAttributeFilter(lyr, NULL);
+	OGR_L_SetSpatialFilter(lyr, NULL);
+	CPLPopErrorHandler();
+
+	elog(DEBUG1, "OGR filtered feature count: " OGR_FDW_FRMT_INT64, OGR_FDW_CAST_INT64(count));
+
+	if ( count >= 0 )
+		ogrCountCacheStore(planstate->foreigntableid, filter.data, count);
+	pfree(filter.data);
+
+	return count;
+}
+
+/*
+ * Fraction of [min, max] that [qmin, qmax] covers.
+ */
+static double
+ogrOverlapFraction(double min, double max, double qmin, double qmax)
+{
+	double lo = Max(min, qmin);
+	double hi = Min(max, qmax);
+
+	if ( hi < lo )
+		return 0.0;
+	/* Features all on one line, and the query covers it */
+	if ( max <= min )
+		return 1.0;
+	return (hi - lo) / (max - min);
+}
+
+/*
+ * Estimate the share of features a spatial filter lets through
+ * as the share of the layer extent the filter box covers, taking
+ * features as spread evenly. Returns -1 if the driver can't give
+ * the extent without a scan.
+ */
+static Selectivity
+ogrExtentSelectivity(GisFdwPlanState *planstate, const OGREnvelope *box)
+{
+	OGREnvelope ext;
+	OGRErr err;
+
+	CPLPushErrorHandler(CPLQuietErrorHandler);
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+	err = OGR_L_GetExtentEx(planstate->ogr.lyr, planstate->spatial_fldnum, &ext, FALSE);
+#else
+	err = OGR_L_GetExtent(planstate->ogr.lyr, &ext, FALSE);
+#endif
+	CPLPopErrorHandler();
+
+	if ( err != OGRERR_NONE )
+		return -1;
+
+	return ogrOverlapFraction(ext.MinX, ext.MaxX, box->MinX, box->MaxX) *
+	       ogrOverlapFraction(ext.MinY, ext.MaxY, box->MinY, box->MaxY);
+}
+
+/*
+ * ogrGetForeignRelSize
+ *		Obtain relation size estimates for a foreign table
+ */
+static void
+ogrGetForeignRelSize(PlannerInfo *root,
+                     RelOptInfo *baserel,
+                     Oid foreigntableid)
+{
+	/* Initialize the OGR connection */
+	GisFdwState *state = (GisFdwState *)getGisFdwState(foreigntableid, GIS_PLAN_STATE);
+	GisFdwPlanState *planstate = (GisFdwPlanState *)state;
+	List *scan_clauses = baserel->baserestrictinfo;
+	OgrFdwSpatialFilter spatial;
+	StringInfoData sql;
+	double layer_rows = -1;
+	double fetched_rows = -1;
+
+	if (planstate->isRaster)
+	{
+	    baserel->fdw_private = (void *) planstate;
+	    return;
+	}
+
+	/* Add in column mapping data to build SQL with the right OGR column names */
+	ogrReadColumnData(state);
+
+	/*
+	* Work out what OGR can filter for us now, the estimates depend
+	* on it, and hold on to the result for ogrGetForeignPlan.
+	*/
+	initStringInfo(&sql);
+	if ( ogrDeparse(&sql, root, baserel, scan_clauses, state,
+	                &(planstate->params_list), &spatial, &(planstate->fid),
+	                &(planstate->pushed_clauses), &(planstate->exact_clauses)) )
+		planstate->sql = sql.data;
+	elog(DEBUG1,"OGR SQL: %s", sql.data);
+	ogrSaveSpatialFilter(planstate, &spatial);
+	ogrSaveFidFilter(planstate);
+	ogrCheckExactClauses(planstate);
+
+	/*
+	* OGR asks drivers to honestly state if they can provide a fast
+	* row count, but too many drivers lie. We are only listing drivers
+	* we trust in ogrCanReallyCountFast(). Failing that, use the
+	* count from the last ANALYZE, or the planner's usual guess.
+	*/
+	if ( OGR_L_TestCapability(planstate->ogr.lyr, OLCFastFeatureCount) == TRUE &&
+	     ogrCanReallyCountFast(&(planstate->ogr)) )
+	{
+		/* Count rows, but don't force a slow count */
+		GIntBig rows = OGR_L_GetFeatureCount(planstate->ogr.lyr, false);
+		/* Only use row count if return is valid (>0) */
+		if ( rows >= 0 )
+			layer_rows = rows;
+	}
+	if ( layer_rows < 0 )
+		layer_rows = baserel->tuples > 0 ? baserel->tuples : baserel->rows;
+
+	planstate->nrows = layer_rows;
+	baserel->tuples = layer_rows;
+
+	/*
+	* OGR only hands back the features that pass the filters we
+	* pushed, or the ones read by FID. Count them if the driver
+	* can do so cheaply, else size a spatial filter against the
+	* layer extent, and fall back on the PgSQL selectivities.
+	*/
+	fetched_rows = ogrFidRows(planstate);
+	if ( fetched_rows < 0 && planstate->pushed_clauses )
+		fetched_rows = ogrFilteredCount(planstate);
+	if ( fetched_rows < 0 )
+	{
+		Selectivity sel = -1;
+
+		if ( spatial.nfilters > 0 )
+			sel = ogrExtentSelectivity(planstate, &(spatial.env));
+		if ( sel >= 0 )
+			sel *= clauselist_selectivity(root,
+				list_difference_ptr(planstate->pushed_clauses, spatial.clauses),
+				0, JOIN_INNER, NULL);
+		else
+			sel = clauselist_selectivity(root, planstate->pushed_clauses, 0, JOIN_INNER, NULL);
+		fetched_rows = layer_rows * sel;
+	}
+	planstate->fetched_rows = clamp_row_est(fetched_rows);
+
+	/* The rest of the restrictions weed out more locally */
+	baserel->rows = clamp_row_est(planstate->fetched_rows *
+		clauselist_selectivity(root,
+			list_difference_ptr(scan_clauses, planstate->pushed_clauses),
+			0, JOIN_INNER, NULL));
+
+	ogrSetRelWidth(planstate, baserel);
+	planstate->feature_cost = ogrFeatureCost(planstate, baserel,
+		extract_actual_clauses(scan_clauses, false));
+	cost_qual_eval(&(planstate->local_qual_cost),
+		list_difference_ptr(scan_clauses, planstate->exact_clauses), root);
+
+	/* Save connection state for next calls */
+	baserel->fdw_private = (void *) planstate;
+
+	return;
+}
+
+
+
+/*
+ * Whether the source can use an index to find the features that
+ * pass a filter, rather than reading every feature to check it.
+ * Databases and services filter on the server. Files only
+ * help spatial filters, if they have a spatial index.
+ */
+static bool
+ogrFiltersByIndex(const OgrConnection *con, bool attribute_filter)
+{
+	if ( ogrDriverClass(con) != OGR_DRIVER_FILE || ogrCanCountFilteredFast(con) )
+		return true;
+
+	return ! attribute_filter && OGR_L_TestCapability(con->lyr, OLCFastSpatialFilter) == TRUE;
+}
+
+/*
+ * Cost a scan that gets fetched_rows features back from OGR
+ * and checks quals on each: opening the source, reading the
+ * features (all of them, where OGR has to check the filter
+ * itself), and converting and checking the ones returned.
+ */
+static void
+ogrCostScan(GisFdwPlanState *planstate, double fetched_rows, bool attribute_filter,
+            const QualCost *qual_cost, Cost *startup_cost, Cost *total_cost)
+{
+	OgrDriverClass dc = ogrDriverClass(&(planstate->ogr));
+	double read_rows = fetched_rows;
+
+	/* FID reads only touch the features they return */
+	if ( ! planstate->fid.lookup && ! planstate->fid_seek &&
+	     ! ogrFiltersByIndex(&(planstate->ogr), attribute_filter) )
+		read_rows = Max(fetched_rows, planstate->nrows);
+
+	*startup_cost = ogr_driver_costs[dc].startup + qual_cost->startup;
+	*total_cost = *startup_cost +
+	              read_rows * ogr_driver_costs[dc].fetch +
+	              fetched_rows * (planstate->feature_cost + qual_cost->per_tuple);
+}
+
+#if PG_VERSION_NUM >= 90500
+typedef enum
+{
+	OGR_PARAM_NONE,
+	OGR_PARAM_ATTRIBUTE,   /* OGR SQL on outer values */
+	OGR_PARAM_SPATIAL      /* spatial filter on an outer geometry */
+} OgrParamClauseKind;
+
+/*
+ * Whether OGR can filter on a join clause once the outer side's
+ * value is bound in, and how: an operator between our columns and
+ * columns of the other relations goes in the OGR SQL, a spatial
+ * test against an outer geometry sets the spatial filter.
+ */
+static OgrParamClauseKind
+ogrParamClauseKind(PlannerInfo *root, RelOptInfo *baserel, GisFdwPlanState *planstate, RestrictInfo *rinfo)
+{
+	StringInfoData buf;
+	List *params = NIL;
+	List *pushed = NIL;
+	int ogrfldnum;
+	double expand;
+
+	if ( ! join_clause_is_movable_to(rinfo, baserel) )
+		return OGR_PARAM_NONE;
+
+	if ( ogrSpatialJoinClause(root, baserel, rinfo->clause, (GisFdwState *) planstate, &ogrfldnum, &expand) )
+		return OGR_PARAM_SPATIAL;
+
+	if ( ! IsA(rinfo->clause, OpExpr) )
+		return OGR_PARAM_NONE;
+
+	initStringInfo(&buf);
+	ogrDeparse(&buf, root, baserel, list_make1(rinfo), (GisFdwState *) planstate, &params, NULL, NULL, &pushed, NULL);
+	pfree(buf.data);
+
+	return (pushed != NIL && params != NIL) ? OGR_PARAM_ATTRIBUTE : OGR_PARAM_NONE;
+}
+
+static bool
+ogrEcMemberMatches(PlannerInfo *root, RelOptInfo *rel, EquivalenceClass *ec,
+                   EquivalenceMember *em, void *arg)
+{
+	Expr *expr = em->em_expr;
+
+	while ( expr && IsA(expr, RelabelType) )
+		expr = ((RelabelType *) expr)->arg;
+
+	return equal(expr, (Var *) arg);
+}
+
+/*
+ * Build parameterized paths for the join clauses OGR can filter
+ * on. Each rescan of such a path sets the filters again with the
+ * values of the current outer row, so a nested loop can look up
+ * the matching features one outer row at a time instead of
+ * reading the whole layer for each.
+ */
+static void
+ogrAddParamPaths(PlannerInfo *root, RelOptInfo *baserel, GisFdwPlanState *planstate)
+{
+	List *clauses = NIL;
+	List *ppi_list = NIL;
+	ListCell *lc;
+
+	/* Nothing beats reading by FID */
+	if ( planstate->fid.lookup || planstate->fid_seek )
+		return;
+
+	foreach(lc, baserel->joininfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		if ( ogrParamClauseKind(root, baserel, planstate, rinfo) != OGR_PARAM_NONE )
+			clauses = lappend(clauses, rinfo);
+	}
+
+	/* Equality joins live in equivalence classes, find them by column */
+	if ( baserel->has_eclass_joins )
+	{
+#if PG_VERSION_NUM >= 90600
+		List *exprs = baserel->reltarget->exprs;
+#else
+		List *exprs = baserel->reltargetlist;
+#endif
+		foreach(lc, exprs)
+		{
+			Var *var = (Var *) lfirst(lc);
+			List *ec_clauses;
+			ListCell *lc2;
+
+			if ( ! IsA(var, Var) || var->varno != baserel->relid )
+				continue;
+
+			ec_clauses = generate_implied_equalities_for_column(root, baserel,
+				ogrEcMemberMatches, (void *) var, baserel->lateral_referencers);
+
+			foreach(lc2, ec_clauses)
+			{
+				RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc2);
+				if ( ogrParamClauseKind(root, baserel, planstate, rinfo) != OGR_PARAM_NONE )
+					clauses = lappend(clauses, rinfo);
+			}
+		}
+	}
+
+	/* One parameterization for each set of outer relations */
+	foreach(lc, clauses)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		Relids required_outer;
+
+		required_outer = bms_union(rinfo->clause_relids, baserel->lateral_relids);
+		required_outer = bms_del_member(required_outer, baserel->relid);
+		if ( bms_is_empty(required_outer) )
+			continue;
+
+		ppi_list = list_append_unique_ptr(ppi_list,
+			get_baserel_parampathinfo(root, baserel, required_outer));
+	}
+
+	foreach(lc, ppi_list)
+	{
+		ParamPathInfo *ppi = (ParamPathInfo *) lfirst(lc);
+		List *pushed = NIL;
+		bool attribute_filter = false;
+		bool spatial_filter = false;
+		QualCost qual_cost;
+		double fetched_rows;
+		Cost startup_cost, total_cost;
+		ListCell *lc2;
+
+		/* Only one spatial join clause becomes a filter, like in ogrDeparseParamClauses */
+		foreach(lc2, ppi->ppi_clauses)
+		{
+			RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc2);
+			OgrParamClauseKind kind = ogrParamClauseKind(root, baserel, planstate, rinfo);
+
+			if ( kind == OGR_PARAM_ATTRIBUTE )
+				attribute_filter = true;
+			else if ( kind == OGR_PARAM_SPATIAL && ! spatial_filter )
+				spatial_filter = true;
+			else
+				continue;
+			pushed = lappend(pushed, rinfo);
+		}
+		if ( ! pushed )
+			continue;
+
+		fetched_rows = clamp_row_est(planstate->fetched_rows *
+			clauselist_selectivity(root, pushed, baserel->relid, JOIN_INNER, NULL));
+
+		cost_qual_eval(&qual_cost, ppi->ppi_clauses, root);
+		qual_cost.startup += baserel->baserestrictcost.startup;
+		qual_cost.per_tuple += baserel->baserestrictcost.per_tuple;
+		/* Spatial lookups only pay off on sources with a spatial index */
+		ogrCostScan(planstate, fetched_rows,
+		            attribute_filter || (planstate->sql && strlen(planstate->sql) > 0),
+		            &qual_cost, &startup_cost, &total_cost);
+
+		add_path(baserel,
+			(Path *) create_foreignscan_path(root, baserel,
+#if PG_VERSION_NUM >= 90600
+						NULL, /* PathTarget */
+#endif
+						ppi->ppi_rows,
+						startup_cost,
+						total_cost,
+						NIL,     /* no pathkeys */
+						ppi->ppi_req_outer,
+						NULL,    /* no extra plan */
+						NIL));   /* no fdw_private list */
+	}
+}
+
+/* Sorting in the database, like postgres_fdw's DEFAULT_FDW_SORT_MULTIPLIER */
+#define OGR_FDW_SORT_MULTIPLIER 1.05
+
+/*
+ * Add a path in the order the query wants, for drivers that can
+ * run the SELECT with its ORDER BY themselves. The plain path
+ * has to have been costed already.
+ */
+static void
+ogrAddSortedPath(PlannerInfo *root, RelOptInfo *baserel, GisFdwPlanState *planstate)
+{
+	StringInfoData orderby;
+	List *retrieved_attrs;
+
+	if ( ! root->query_pathkeys || ! ogrCanExecuteSql(&(planstate->ogr)) ||
+	     planstate->fid.lookup || planstate->fid_seek )
+		return;
+
+	initStringInfo(&orderby);
+	if ( ! ogrDeparseOrderBy(&orderby, root, baserel, root->query_pathkeys, (GisFdwState *) planstate) )
+		return;
+
+	/* Every column read has to be selectable by name */
+	retrieved_attrs = ogrGetRetrievedAttrs(baserel,
+		extract_actual_clauses(baserel->baserestrictinfo, false), planstate->table);
+	if ( ! ogrDeparseSelect((GisFdwState *) planstate, retrieved_attrs) )
+		return;
+
+	add_path(baserel,
+		(Path *) create_foreignscan_path(root, baserel,
+#if PG_VERSION_NUM >= 90600
+					NULL, /* PathTarget */
+#endif
+					baserel->rows,
+					planstate->startup_cost * OGR_FDW_SORT_MULTIPLIER,
+					planstate->total_cost * OGR_FDW_SORT_MULTIPLIER,
+					root->query_pathkeys,
+					NULL,    /* no outer rel either */
+					NULL,    /* no extra plan */
+					list_make1(makeString(orderby.data))));
+}
+#endif
+
+/*
+ * ogrGetForeignPaths
+ *		Create possible access paths for a scan on the foreign table
+ *
+ *		There is the plain path, which returns all records passing
+ *		the table's restrictions in the order in the data file,
+ *		a parameterized one for every set of join clauses OGR can
+ *		filter on, and one sorted by the database for drivers that
+ *		run SQL.
+ */
+static void
+ogrGetForeignPaths(PlannerInfo *root,
+                   RelOptInfo *baserel,
+                   Oid foreigntableid)
+{
+	GisFdwPlanState *planstate = (GisFdwPlanState *)(baserel->fdw_private);
+
+	if ( planstate->isRaster )
+	{
+		planstate->startup_cost = 25;
+		planstate->total_cost = planstate->startup_cost + baserel->rows;
+	}
+	else
+	{
+		ogrCostScan(planstate, planstate->fetched_rows,
+		            planstate->sql && strlen(planstate->sql) > 0,
+		            &(planstate->local_qual_cost),
+		            &(planstate->startup_cost), &(planstate->total_cost));
+	}
+
+	/* Providing fancy paths is really only possible with back-ends */
+	/* that can properly provide explain info on how they complete */
+	/* the query, not for something as obtuse as OGR. (So far, have */
+	/* only seen it w/ the postgres_fdw */
+	add_path(baserel,
+		(Path *) create_foreignscan_path(root, baserel,
+#if PG_VERSION_NUM >= 90600
+					NULL, /* PathTarget */
+#endif
+					baserel->rows,
+					planstate->startup_cost,
+					planstate->total_cost,
+					NIL,     /* no pathkeys */
+					NULL,    /* no outer rel either */
+					NULL  /* no extra plan */
+#if PG_VERSION_NUM >= 90500
+					,NIL /* no fdw_private list */
+#endif
+					)
+		);   /* no fdw_private data */
+
+#if PG_VERSION_NUM >= 90500
+	if ( ! planstate->isRaster )
+	{
+		ogrAddParamPaths(root, baserel, planstate);
+		ogrAddSortedPath(root, baserel, planstate);
+	}
+#endif
+}
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * Find the aggregate OGR can compute for an entry of the target
+ * list: COUNT(*), from OGR_L_GetFeatureCount, or the PostGIS
+ * ST_Extent of one of our geometry columns, from the layer
+ * extent. Returns -1 if it is anything else.
+ */
+static int
+ogrAggKind(Expr *expr, RelOptInfo *baserel, GisFdwPlanState *planstate, int *ogrfldnum)
+{
+	Aggref *agg = (Aggref *) expr;
+	OgrFdwTable *table = planstate->table;
+	char *aggname;
+	Var *var;
+	int i;
+
+	*ogrfldnum = -1;
+
+	if ( ! IsA(expr, Aggref) )
+		return -1;
+
+	/* Plain aggregates of the whole layer only */
+	if ( agg->aggfilter || agg->aggorder || agg->aggdistinct ||
+	     agg->aggdirectargs || agg->aggsplit != AGGSPLIT_SIMPLE )
+		return -1;
+
+	aggname = get_func_name(agg->aggfnoid);
+	if ( ! aggname )
+		return -1;
+
+	if ( streq(aggname, "count") && agg->aggstar &&
+	     get_func_namespace(agg->aggfnoid) == PG_CATALOG_NAMESPACE )
+		return OGR_AGG_COUNT;
+
+	if ( ! streq(aggname, "st_extent") || list_length(agg->args) != 1 )
+		return -1;
+
+	var = (Var *) ((TargetEntry *) linitial(agg->args))->expr;
+	if ( ! IsA(var, Var) || var->varno != baserel->relid || var->varlevelsup != 0 )
+		return -1;
+
+	for ( i = 0; i < table->ncols; i++ )
+	{
+		if ( table->cols[i].pgattnum == var->varattno &&
+		     table->cols[i].ogrvariant == OGR_GEOMETRY &&
+		     table->cols[i].pgtype == GEOMETRYOID )
+		{
+			*ogrfldnum = table->cols[i].ogrfldnum;
+			return OGR_AGG_EXTENT;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Whether OGR applies all the restrictions on the table exactly,
+ * so that what it counts is what PgSQL would have.
+ */
+static bool
+ogrAggFiltersExact(RelOptInfo *baserel, GisFdwPlanState *planstate)
+{
+	ListCell *lc;
+
+	if ( ! baserel->baserestrictinfo )
+		return true;
+
+	if ( ! planstate->sql || planstate->params_list || planstate->spatial_hex ||
+	     planstate->fid.lookup || planstate->fid_seek )
+		return false;
+
+	foreach(lc, baserel->baserestrictinfo)
+	{
+		if ( ! list_member_ptr(planstate->exact_clauses, lfirst(lc)) )
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Let the database run a GROUP BY, for drivers that run SQL, when
+ * it groups and aggregates just as PgSQL would (see
+ * ogrDeparseGroupedSelect) and applies all the restrictions.
+ */
+static void
+ogrAddGroupedPath(PlannerInfo *root, RelOptInfo *baserel, RelOptInfo *grouped_rel, GisFdwPlanState *planstate)
+{
+	PathTarget *target = root->upper_targets[UPPERREL_GROUP_AGG];
+	StringInfoData select, tail;
+	List *group_exprs;
+	OgrDriverClass dc;
+	double ngroups;
+	Cost startup_cost, total_cost;
+
+	if ( root->parse->groupingSets || root->hasHavingQual ||
+	     ! ogrCanExecuteSql(&(planstate->ogr)) ||
+	     ! ogrAggFiltersExact(baserel, planstate) )
+		return;
+
+	initStringInfo(&select);
+	initStringInfo(&tail);
+	if ( ! ogrDeparseGroupedSelect(&select, &tail, root, baserel, target, (GisFdwState *) planstate) )
+		return;
+
+	group_exprs = get_sortgrouplist_exprs(root->parse->groupClause, root->parse->targetList);
+#if PG_VERSION_NUM >= 140000
+	ngroups = estimate_num_groups(root, group_exprs, baserel->rows, NULL, NULL);
+#else
+	ngroups = estimate_num_groups(root, group_exprs, baserel->rows, NULL);
+#endif
+
+	/* The database reads and groups the features, we only convert the groups */
+	dc = ogrDriverClass(&(planstate->ogr));
+	startup_cost = ogr_driver_costs[dc].startup + planstate->fetched_rows * ogr_driver_costs[dc].fetch;
+	total_cost = startup_cost + ngroups * cpu_tuple_cost;
+
+	grouped_rel->fdw_private = planstate;
+	add_path(grouped_rel,
+#if PG_VERSION_NUM >= 120000
+		(Path *) create_foreign_upper_path(root, grouped_rel, target,
+		                                   ngroups, startup_cost, total_cost,
+		                                   NIL, NULL,
+		                                   list_make4(NIL, NIL, makeString(select.data), makeString(tail.data))));
+#else
+		(Path *) create_foreignscan_path(root, grouped_rel, target,
+		                                 ngroups, startup_cost, total_cost,
+		                                 NIL, NULL, NULL,
+		                                 list_make4(NIL, NIL, makeString(select.data), makeString(tail.data))));
+#endif
+}
+
+/*
+ * ogrGetForeignUpperPaths
+ *		Let OGR work out COUNT(*) and ST_Extent() over a whole table,
+ *		which many drivers answer from their headers or indexes
+ *		without reading a single feature. Drivers that run SQL
+ *		also get GROUP BY queries of a single table.
+ */
+static void
+ogrGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
+                        RelOptInfo *input_rel, RelOptInfo *output_rel
+#if PG_VERSION_NUM >= 110000
+                        ,void *extra
+#endif
+                        )
+{
+	GisFdwPlanState *planstate = (GisFdwPlanState *) input_rel->fdw_private;
+	PathTarget *target;
+	List *kinds = NIL;
+	List *fields = NIL;
+	ListCell *lc;
+	OgrDriverClass dc;
+	bool fast = true;
+	Cost startup_cost, total_cost;
+
+	/* Aggregates of a single table only */
+	if ( stage != UPPERREL_GROUP_AGG || output_rel->fdw_private ||
+	     input_rel->reloptkind != RELOPT_BASEREL || ! planstate ||
+	     planstate->isRaster )
+		return;
+
+	if ( root->parse->groupClause )
+	{
+		ogrAddGroupedPath(root, input_rel, output_rel, planstate);
+		return;
+	}
+
+	if ( root->parse->groupingSets || root->hasHavingQual )
+		return;
+
+	target = root->upper_targets[UPPERREL_GROUP_AGG];
+	foreach(lc, target->exprs)
+	{
+		int ogrfldnum;
+		int kind = ogrAggKind((Expr *) lfirst(lc), input_rel, planstate, &ogrfldnum);
+
+		switch ( kind )
+		{
+			case OGR_AGG_COUNT:
+				/* OGR has to count exactly what PgSQL would */
+				if ( ! ogrAggFiltersExact(input_rel, planstate) )
+					return;
+				if ( input_rel->baserestrictinfo ?
+				     ! ogrCanCountFilteredFast(&(planstate->ogr)) :
+				     ! (OGR_L_TestCapability(planstate->ogr.lyr, OLCFastFeatureCount) == TRUE &&
+				        ogrCanReallyCountFast(&(planstate->ogr))) )
+					fast = false;
+				break;
+			case OGR_AGG_EXTENT:
+				/* The extent is of the whole layer, filters or not */
+				if ( input_rel->baserestrictinfo )
+					return;
+				if ( OGR_L_TestCapability(planstate->ogr.lyr, OLCFastGetExtent) != TRUE )
+					fast = false;
+				break;
+			default:
+				return;
+		}
+		kinds = lappend(kinds, makeInteger(kind));
+		fields = lappend(fields, makeInteger(ogrfldnum));
+	}
+	if ( ! kinds )
+		return;
+
+	dc = ogrDriverClass(&(planstate->ogr));
+	startup_cost = ogr_driver_costs[dc].startup;
+	total_cost = startup_cost + cpu_tuple_cost;
+	if ( ! fast )
+		total_cost += planstate->nrows * ogr_driver_costs[dc].fetch;
+
+	output_rel->fdw_private = planstate;
+	add_path(output_rel,
+#if PG_VERSION_NUM >= 120000
+		(Path *) create_foreign_upper_path(root, output_rel, target,
+		                                   1, startup_cost, total_cost,
+		                                   NIL, NULL,
+		                                   list_make4(kinds, fields, NULL, NULL)));
+#else
+		(Path *) create_foreignscan_path(root, output_rel, target,
+		                                 1, startup_cost, total_cost,
+		                                 NIL, NULL, NULL,
+		                                 list_make4(kinds, fields, NULL, NULL)));
+#endif
+}
+#endif
+
+#if PG_VERSION_NUM >= 90600
+/*
+ * A join of two tables the database runs, kept in the join
+ * relation for ogrGetForeignJoinPlan.
+ */
+typedef struct OgrFdwJoinState
+{
+	GisFdwPlanState *outer;    /* tables joined, "r1" and "r2" in the SQL */
+	GisFdwPlanState *inner;
+	char *sql;                 /* SELECT of the join */
+	List *local_conds;         /* RestrictInfos PgSQL checks on the rows */
+	List *tlist;               /* columns the SELECT returns, the scan tuple */
+} OgrFdwJoinState;
+
+/*
+ * Whether a relation is a table whose driver could join it
+ * to another table of its datasource.
+ */
+static bool
+ogrCanJoinTable(RelOptInfo *rel)
+{
+	GisFdwPlanState *planstate = (GisFdwPlanState *) rel->fdw_private;
+
+	return rel->reloptkind == RELOPT_BASEREL && planstate &&
+	       ! planstate->isRaster && ogrCanExecuteSql(&(planstate->ogr));
+}
+
+/*
+ * ogrGetForeignJoinPaths
+ *		Let GeoPackage, SQLite and PostgreSQL sources run an inner
+ *		join of two of their tables, so only the rows that match
+ *		are read and converted. Clauses the database can't apply
+ *		exactly (see ogrDeparseJoinClauses) are checked again on
+ *		the rows it returns, so it must at least take one join
+ *		clause, not to send the cross product.
+ */
+static void
+ogrGetForeignJoinPaths(PlannerInfo *root, RelOptInfo *joinrel,
+                       RelOptInfo *outerrel, RelOptInfo *innerrel,
+                       JoinType jointype, JoinPathExtraData *extra)
+{
+	GisFdwPlanState *outer = (GisFdwPlanState *) outerrel->fdw_private;
+	GisFdwPlanState *inner = (GisFdwPlanState *) innerrel->fdw_private;
+	OgrFdwJoinState *jstate;
+	StringInfoData where;
+	List *clauses, *pushed, *exact;
+	List *local_conds = NIL;
+	List *tlist;
+	bool join_pushed = false;
+	QualCost local_cost;
+	OgrDriverClass dc;
+	Cost startup_cost, total_cost;
+	ListCell *lc;
+	char *sql;
+
+	if ( joinrel->fdw_private || joinrel->reloptkind != RELOPT_JOINREL ||
+	     jointype != JOIN_INNER || root->parse->commandType != CMD_SELECT ||
+	     root->rowMarks )
+		return;
+
+	if ( ! ogrCanJoinTable(outerrel) || ! ogrCanJoinTable(innerrel) ||
+	     ! streq(outer->ogr.ds_str, inner->ogr.ds_str) )
+		return;
+
+	/* Plain columns can be read back from the result, nothing else */
+	foreach(lc, joinrel->reltarget->exprs)
+	{
+		Var *var = (Var *) lfirst(lc);
+
+		if ( ! IsA(var, Var) || var->varattno <= 0 )
+			return;
+	}
+
+	foreach(lc, extra->restrictlist)
+	{
+		if ( ((RestrictInfo *) lfirst(lc))->pseudoconstant )
+			return;
+	}
+
+	/* The join clauses and the restrictions of both tables go in the WHERE */
+	clauses = list_concat(list_copy(extra->restrictlist), list_copy(outerrel->baserestrictinfo));
+	clauses = list_concat(clauses, list_copy(innerrel->baserestrictinfo));
+
+	initStringInfo(&where);
+	ogrDeparseJoinClauses(&where, root, outerrel, (GisFdwState *) outer, innerrel, (GisFdwState *) inner,
+	                      clauses, &pushed, &exact);
+
+	foreach(lc, extra->restrictlist)
+	{
+		if ( list_member_ptr(pushed, lfirst(lc)) )
+			join_pushed = true;
+	}
+	if ( ! join_pushed )
+		return;
+
+	foreach(lc, clauses)
+	{
+		if ( ! list_member_ptr(exact, lfirst(lc)) )
+			local_conds = lappend(local_conds, lfirst(lc));
+	}
+
+	/* Read what the query wants, and what the local checks need */
+	tlist = add_to_flat_tlist(NIL, pull_var_clause((Node *) joinrel->reltarget->exprs, PVC_RECURSE_PLACEHOLDERS));
+	tlist = add_to_flat_tlist(tlist, pull_var_clause((Node *) extract_actual_clauses(local_conds, false),
+	                                                 PVC_RECURSE_PLACEHOLDERS));
+	foreach(lc, tlist)
+	{
+		Var *var = (Var *) ((TargetEntry *) lfirst(lc))->expr;
+
+		if ( var->varattno <= 0 )
+			return;
+	}
+
+	sql = ogrDeparseJoinSelect(outerrel, (GisFdwState *) outer, innerrel, (GisFdwState *) inner,
+	                           tlist, where.data);
+	if ( ! sql )
+		return;
+	elog(DEBUG1, "OGR join query: %s", sql);
+
+	/*
+	 * The database reads the features of both tables that pass
+	 * their filters, we only convert the rows of the join and
+	 * check them against the clauses it didn't apply exactly.
+	 */
+	cost_qual_eval(&local_cost, local_conds, root);
+	dc = ogrDriverClass(&(outer->ogr));
+	startup_cost = ogr_driver_costs[dc].startup + local_cost.startup;
+	total_cost = startup_cost +
+	             (outer->fetched_rows + inner->fetched_rows) * ogr_driver_costs[dc].fetch +
+	             joinrel->rows * (outer->feature_cost + inner->feature_cost + local_cost.per_tuple);
+
+	jstate = palloc0(sizeof(OgrFdwJoinState));
+	jstate->outer = outer;
+	jstate->inner = inner;
+	jstate->sql = sql;
+	jstate->local_conds = local_conds;
+	jstate->tlist = tlist;
+	joinrel->fdw_private = jstate;
+
+	add_path(joinrel,
+#if PG_VERSION_NUM >= 120000
+		(Path *) create_foreign_join_path(root, joinrel, NULL,
+		                                  joinrel->rows, startup_cost, total_cost,
+		                                  NIL, NULL, NULL, NIL));
+#else
+		(Path *) create_foreignscan_path(root, joinrel, NULL,
+		                                 joinrel->rows, startup_cost, total_cost,
+		                                 NIL, NULL, NULL, NIL));
+#endif
+}
+#endif
+
+
+
+
+/*
+ * Spatial filter of a parameterized scan, set from the box of an
+ * outer geometry at each rescan.
+ */
+typedef struct OgrFdwSpatialParam
+{
+	int param;          /* 1-based place of the outer geometry in the params, 0 for none */
+	int ogrfldnum;      /* OGR geometry field to filter */
+	double expand;      /* distance to grow the box by */
+} OgrFdwSpatialParam;
+
+#if PG_VERSION_NUM >= 90500
+/*
+ * Add the join clauses of a parameterized path that OGR can filter
+ * on to the OGR SQL of the table's own restrictions, and pick the
+ * spatial join clause to filter on. Their outer values become
+ * params after those of the restrictions.
+ */
+static char *
+ogrDeparseParamClauses(PlannerInfo *root, RelOptInfo *baserel, GisFdwPlanState *planstate,
+                       List *clauses, List **params, OgrFdwSpatialParam *sparam)
+{
+	StringInfoData buf;
+	ListCell *lc;
+
+	initStringInfo(&buf);
+	if ( planstate->sql )
+		appendStringInfoString(&buf, planstate->sql);
+	*params = list_copy(planstate->params_list);
+
+	foreach(lc, clauses)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		List *clause_params = list_copy(*params);
+		List *pushed = NIL;
+		StringInfoData clause;
+		Expr *outer;
+		int ogrfldnum;
+		double expand;
+
+		/* The first spatial join clause sets the spatial filter */
+		outer = ogrSpatialJoinClause(root, baserel, rinfo->clause, (GisFdwState *) planstate, &ogrfldnum, &expand);
+		if ( outer )
+		{
+			if ( sparam->param == 0 )
+			{
+				*params = lappend(*params, outer);
+				sparam->param = list_length(*params);
+				sparam->ogrfldnum = ogrfldnum;
+				sparam->expand = expand;
+			}
+			continue;
+		}
+
+		if ( ! IsA(rinfo->clause, OpExpr) )
+			continue;
+
+		initStringInfo(&clause);
+		ogrDeparse(&clause, root, baserel, list_make1(rinfo), (GisFdwState *) planstate,
+		           &clause_params, NULL, NULL, &pushed, NULL);
+		if ( pushed && clause.len > 0 )
+		{
+			if ( buf.len > 0 )
+				appendStringInfoString(&buf, " AND ");
+			appendStringInfoString(&buf, clause.data);
+			*params = clause_params;
+		}
+		pfree(clause.data);
+	}
+
+	elog(DEBUG1, "OGR SQL: %s", buf.data);
+	return buf.data;
+}
+#endif
+
+/*
+ * FIDs to look up, as a List of String for the plan.
+ */
+static List *
+ogrFidList(const OgrFdwFidFilter *fid)
+{
+	List *fids = NIL;
+	int i;
+
+	for ( i = 0; i < fid->nfids; i++ )
+		fids = lappend(fids, makeString(psprintf(OGR_FDW_FRMT_INT64, OGR_FDW_CAST_INT64(fid->fids[i]))));
+
+	return fids;
+}
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * Plan the scan of an aggregate pushed down by
+ * ogrGetForeignUpperPaths. It reads no relation, the
+ * aggregates come straight into the scan tuple.
+ */
+static ForeignScan *
+ogrGetForeignAggPlan(RelOptInfo *upperrel, ForeignPath *best_path, List *tlist, Plan *outer_plan)
+{
+	GisFdwPlanState *planstate = (GisFdwPlanState *)(upperrel->fdw_private);
+	List *fdw_private;
+
+	fdw_private = list_make1(makeInteger((int) planstate->foreigntableid));
+	fdw_private = lappend(fdw_private, planstate->sql ? makeString(planstate->sql) : NULL);
+	fdw_private = lappend(fdw_private, linitial(best_path->fdw_private));
+	fdw_private = lappend(fdw_private, lsecond(best_path->fdw_private));
+	fdw_private = lappend(fdw_private, lthird(best_path->fdw_private));
+	fdw_private = lappend(fdw_private, lfourth(best_path->fdw_private));
+
+	ogrFinishConnection(&(planstate->ogr));
+
+	return make_foreignscan(tlist,
+	                        NIL,     /* OGR applies all the restrictions */
+	                        0,       /* no relation scanned */
+	                        NIL,
+	                        fdw_private,
+	                        tlist,   /* the aggregates make the scan tuple */
+	                        NIL,
+	                        outer_plan);
+}
+#endif
+
+#if PG_VERSION_NUM >= 90600
+/*
+ * Plan the scan of a join found by ogrGetForeignJoinPaths. The
+ * SELECT returns the columns of fdw_scan_tlist, which the clauses
+ * left for PgSQL are checked on.
+ */
+static ForeignScan *
+ogrGetForeignJoinPlan(RelOptInfo *joinrel, List *tlist, Plan *outer_plan)
+{
+	OgrFdwJoinState *jstate = (OgrFdwJoinState *)(joinrel->fdw_private);
+	List *fdw_private;
+
+	fdw_private = list_make2(makeInteger((int) jstate->outer->foreigntableid),
+	                         makeString(jstate->sql));
+
+	ogrFinishConnection(&(jstate->outer->ogr));
+	ogrFinishConnection(&(jstate->inner->ogr));
+
+	return make_foreignscan(tlist,
+	                        extract_actual_clauses(jstate->local_conds, false),
+	                        0,       /* no relation scanned */
+	                        NIL,
+	                        fdw_private,
+	                        jstate->tlist,
+	                        NIL,
+	                        outer_plan);
+}
+#endif
+
+/*
+ * fileGetForeignPlan
+ *		Create a ForeignScan plan node for scanning the foreign table
+ */
+static ForeignScan *
+ogrGetForeignPlan(PlannerInfo *root,
+                  RelOptInfo *baserel,
+                  Oid foreigntableid,
+                  ForeignPath *best_path,
+                  List *tlist,
+                  List *scan_clauses
+#if PG_VERSION_NUM >= 90500
+                  ,Plan *outer_plan
+#endif
+                  )
+{
+	Index scan_relid = baserel->relid;
+	List *fdw_private = NIL;
+	List *params_list = NIL;
+	List *retrieved_attrs = NIL;
+	List *local_exprs = NIL;
+	List *remote_exprs = NIL;
+	OgrFdwSpatialParam sparam = {0, 0, 0.0};
+	char *sql;
+	ListCell *lc;
+	GisFdwPlanState *planstate = (GisFdwPlanState *)(baserel->fdw_private);
+	GisFdwState *state = (GisFdwState *)(baserel->fdw_private);
+
+#if PG_VERSION_NUM >= 90600
+	if ( baserel->reloptkind == RELOPT_JOINREL )
+		return ogrGetForeignJoinPlan(baserel, tlist, outer_plan);
+#endif
+#if PG_VERSION_NUM >= 100000
+	if ( baserel->reloptkind == RELOPT_UPPER_REL )
+		return ogrGetForeignAggPlan(baserel, best_path, tlist, outer_plan);
+#endif
+
+	if (planstate->isRaster) {
+	    OGREnvelope env;
+
+	    /*
+	     * The scan only reads the tiles in the box of the spatial
+	     * restrictions on the tiles, which are still checked here.
+	     */
+	    if ( ogrRasterSpatialFilter(baserel, scan_clauses, &env) )
+		fdw_private = list_make4(makeFloat(psprintf("%.17g", env.MinX)),
+		                         makeFloat(psprintf("%.17g", env.MinY)),
+		                         makeFloat(psprintf("%.17g", env.MaxX)),
+		                         makeFloat(psprintf("%.17g", env.MaxY)));
+	    scan_clauses = extract_actual_clauses(scan_clauses, false);
+	} else {
+	    /*
+	     * Here we strip RestrictInfo
+	     * nodes from the clauses and ignore pseudoconstants (which will be
+	     * handled elsewhere).
+	     * Like postgres_fdw, we separate the clauses OGR applies exactly
+	     * as PgSQL would (see ogrCheckExactClauses), which needn't be
+	     * checked again, from the ones checked locally: those OGR can't
+	     * apply, and those it only uses to prefilter (string comparisons
+	     * are case insensitive in OGR, spatial filters are only boxes,
+	     * and so on). A parameterized scan checks everything locally.
+	     */
+	    foreach(lc, scan_clauses)
+	    {
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+		if ( rinfo->pseudoconstant )
+		    continue;
+
+		if ( ! best_path->path.param_info && list_member_ptr(planstate->exact_clauses, rinfo) )
+		    remote_exprs = lappend(remote_exprs, rinfo->clause);
+		else
+		    local_exprs = lappend(local_exprs, rinfo->clause);
+	    }
+	    scan_clauses = extract_actual_clauses(scan_clauses, false);
+
+	    /*
+	     * Only the columns in the target list and the restrictions need
+	     * to be read, everything else can be left out of the OGR read
+	     * with OGR_L_SetIgnoredFields and left NULL in the slot.
+	     */
+	    retrieved_attrs = ogrGetRetrievedAttrs(baserel, scan_clauses, state->table);
+
+	    /* OGR still reads the columns of the remote clauses to filter them */
+	    scan_clauses = local_exprs;
+
+	    /*
+	     * Serialize the data we want to pass to the execution stage.
 	     * This is ugly but seems to be the only way to pass our constructed
-	     * OGR SQL command to execution.
-	     *
-	     * TODO: Pass a spatial filter down also.
+	     * OGR SQL command to execution. The OGR SQL and the spatial
+	     * filter were worked out with the size estimates, a parameterized
+	     * scan adds the join clauses it filters on.
+	     */
+	    params_list = planstate->params_list;
+	    sql = planstate->sql;
+#if PG_VERSION_NUM >= 90500
+	    if ( best_path->path.param_info )
+		sql = ogrDeparseParamClauses(root, baserel, planstate,
+		                             best_path->path.param_info->ppi_clauses, &params_list, &sparam);
+#endif
+	    if ( sql )
+		fdw_private = list_make1(makeString(sql));
+	    else
+		fdw_private = list_make1(NULL);
+
+	    if ( planstate->spatial_hex )
+		fdw_private = lappend(fdw_private, makeString(planstate->spatial_hex));
+	    else
+		fdw_private = lappend(fdw_private, NULL);
+	    fdw_private = lappend(fdw_private, makeInteger(planstate->spatial_fldnum));
+	    fdw_private = lappend(fdw_private, makeInteger(planstate->spatial_rect));
+
+	    fdw_private = lappend(fdw_private, retrieved_attrs);
+
+	    fdw_private = lappend(fdw_private, makeInteger(sparam.param));
+	    fdw_private = lappend(fdw_private, makeInteger(sparam.ogrfldnum));
+	    fdw_private = lappend(fdw_private, makeFloat(psprintf("%.17g", sparam.expand)));
+
+	    fdw_private = lappend(fdw_private, makeInteger(planstate->fid.lookup));
+	    fdw_private = lappend(fdw_private, ogrFidList(&(planstate->fid)));
+	    if ( planstate->fid_seek && planstate->fid.has_min )
+		fdw_private = lappend(fdw_private, makeString(psprintf(OGR_FDW_FRMT_INT64, OGR_FDW_CAST_INT64(planstate->fid.min_fid))));
+	    else
+		fdw_private = lappend(fdw_private, NULL);
+	    if ( planstate->fid_seek && planstate->fid.has_max )
+		fdw_private = lappend(fdw_private, makeString(psprintf(OGR_FDW_FRMT_INT64, OGR_FDW_CAST_INT64(planstate->fid.max_fid))));
+	    else
+		fdw_private = lappend(fdw_private, NULL);
+
+	    /* A sorted path has the driver run a SELECT with its ORDER BY */
+	    if ( best_path->fdw_private )
+	    {
+		Value *orderby = (Value *) list_nth(best_path->fdw_private, OgrFdwPathPrivateOrderBy);
+		char *select = ogrDeparseSelect(state, retrieved_attrs);
+
+		if ( ! select )
+		    elog(ERROR, "unable to write OGR query for table \"%s\"", state->table->tblname);
+
+		fdw_private = lappend(fdw_private, makeString(select));
+		fdw_private = lappend(fdw_private, makeString(psprintf(" ORDER BY %s", strVal(orderby))));
+	    }
+	    else
+	    {
+		fdw_private = lappend(fdw_private, NULL);
+		fdw_private = lappend(fdw_private, NULL);
+	    }
+
+	    /*
+	     * Clean up our connection
+	     */
+	    ogrFinishConnection(&(planstate->ogr));
+	}
+
+	/* Create the ForeignScan node */
+	return make_foreignscan(tlist,
+							scan_clauses,
+							scan_relid,
+							params_list,	/* values for the OGR SQL params */
+							fdw_private
+#if PG_VERSION_NUM >= 90500
+							,NIL  /* no scan_tlist */
+							,remote_exprs  /* clauses OGR applies, for rechecks and EXPLAIN */
+							,outer_plan
+#endif
+);
+
+
+}
+
+static void
+pgCanConvertToOgr(Oid pg_type, OGRFieldType ogr_type, const char *colname, const char *tblname)
+{
+	if ( pg_type == BOOLOID && ogr_type == OFTInteger )
+		return;
+	else if ( pg_type == INT2OID && ogr_type == OFTInteger )
+		return;
+	else if ( pg_type == INT4OID && ogr_type == OFTInteger )
+		return;
+	else if ( pg_type == INT8OID )
+	{
+#if GDAL_VERSION_MAJOR >= 2
+		if ( ogr_type == OFTInteger64 )
+			return;
+#else
+		if ( ogr_type == OFTInteger )
+			return;
+#endif
+	}
+	else if ( pg_type == NUMERICOID && ogr_type == OFTReal )
+		return;
+	else if ( pg_type == FLOAT4OID && ogr_type == OFTReal )
+		return;
+	else if ( pg_type == FLOAT8OID && ogr_type == OFTReal )
+		return;
+	else if ( pg_type == TEXTOID && ogr_type == OFTString )
+		return;
+	else if ( pg_type == VARCHAROID && ogr_type == OFTString )
+		return;
+	else if ( pg_type == CHAROID && ogr_type == OFTString )
+		return;
+	else if ( pg_type == BPCHAROID && ogr_type == OFTString )
+		return;
+	else if ( pg_type == NAMEOID && ogr_type == OFTString )
+		return;
+	else if ( pg_type == BYTEAOID && ogr_type == OFTBinary )
+		return;
+	else if ( pg_type == DATEOID && ogr_type == OFTDate )
+		return;
+	else if ( pg_type == TIMEOID && ogr_type == OFTTime )
+		return;
+	else if ( pg_type == TIMESTAMPOID && ogr_type == OFTDateTime )
+		return;
+
+	ereport(ERROR, (
+			errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+			errmsg("column \"%s\" of foreign table \"%s\" converts \"%s\" to OGR \"%s\"",
+				colname, tblname,
+				format_type_be(pg_type), OGR_GetFieldTypeName(ogr_type))
+			));
+}
+
+static void
+ogrCanConvertToPg(OGRFieldType ogr_type, Oid pg_type, const char *colname, const char *tblname)
+{
+	switch (ogr_type)
+	{
+		case OFTInteger:
+			if ( pg_type == BOOLOID || pg_type == INT2OID || pg_type == INT4OID || pg_type == INT8OID || pg_type == NUMERICOID || pg_type == FLOAT4OID || pg_type == FLOAT8OID || pg_type == TEXTOID || pg_type == VARCHAROID )
+				return;
+			break;
+
+		case OFTReal:
+			if ( pg_type == NUMERICOID || pg_type == FLOAT4OID || pg_type == FLOAT8OID || pg_type == TEXTOID || pg_type == VARCHAROID )
+				return;
+			break;
+
+		case OFTBinary:
+			if ( pg_type == BYTEAOID )
+				return;
+			break;
+
+		case OFTString:
+			if ( pg_type == TEXTOID || pg_type == VARCHAROID || pg_type == CHAROID || pg_type == BPCHAROID )
+				return;
+			break;
+
+		case OFTDate:
+			if ( pg_type == DATEOID || pg_type == TIMESTAMPOID || pg_type == TEXTOID || pg_type == VARCHAROID )
+				return;
+			break;
+
+		case OFTTime:
+			if ( pg_type == TIMEOID || pg_type == TEXTOID || pg_type == VARCHAROID )
+				return;
+			break;
+
+		case OFTDateTime:
+			if ( pg_type == TIMESTAMPOID || pg_type == TEXTOID || pg_type == VARCHAROID )
+				return;
+			break;
+
+#if GDAL_VERSION_MAJOR >= 2
+		case OFTInteger64:
+			if ( pg_type == INT8OID || pg_type == NUMERICOID || pg_type == FLOAT8OID || pg_type == TEXTOID || pg_type == VARCHAROID )
+				return;
+			break;
+#endif
+
+		case OFTWideString:
+		case OFTIntegerList:
+#if GDAL_VERSION_MAJOR >= 2
+		case OFTInteger64List:
+#endif
+		case OFTRealList:
+		case OFTStringList:
+		case OFTWideStringList:
+		{
+			ereport(ERROR, (
+					errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+					errmsg("column \"%s\" of foreign table \"%s\" uses an OGR array, currently unsupported", colname, tblname)
+					));
+			break;
+		}
+	}
+	ereport(ERROR, (
+			errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+			errmsg("column \"%s\" of foreign table \"%s\" converts OGR \"%s\" to \"%s\"",
+				colname, tblname,
+				OGR_GetFieldTypeName(ogr_type), format_type_be(pg_type))
+			));
+}
+
+#ifdef OGR_FDW_HEXWKB
+
+static char *hexchr = "0123456789ABCDEF";
+
+static char *
+ogrBytesToHex(unsigned char *bytes, size_t size)
+{
+	char *hex;
+	int i;
+	if ( ! bytes || ! size )
+	{
+		elog(ERROR, "hexbytes_from_bytes: invalid input");
+		return NULL;
+	}
+	hex = palloc(size * 2 + 1);
+	hex[2*size] = '\0';
+	for( i = 0; i < size; i++ )
+	{
+		/* Top four bits to 0-F */
+		hex[2*i] = hexchr[bytes[i] >> 4];
+		/* Bottom four bits to 0-F */
+		hex[2*i+1] = hexchr[bytes[i] & 0x0F];
+	}
+	return hex;
+}
+
+#endif
+
+static void
+freeOgrFdwTable(OgrFdwTable *table)
+{
+	if ( table )
+	{
+		if ( table->tblname ) pfree(table->tblname);
+		if ( table->cols ) pfree(table->cols);
+		if ( table->converters ) pfree(table->converters);
+		pfree(table);
+	}
+}
+
+typedef struct
+{
+	char *fldname;
+	int fldnum;
+} OgrFieldEntry;
+
+static int ogrFieldEntryCmpFunc(const void * a, const void * b)
+{
+	const char *a_name = ((OgrFieldEntry*)a)->fldname;
+	const char *b_name = ((OgrFieldEntry*)b)->fldname;
+
+	return strcasecmp(a_name, b_name);
+}
+
+
+/*
+ * The execstate holds a foreign table relation id and an OGR connection,
+ * this function finds all the OGR fields that match up to columns in the
+ * foreign table definition, using columns name match and data type consistency
+ * as the criteria for making a match.
+ * The results of the matching are stored in the execstate before the function
+ * returns.
+ */
+static void
+ogrReadColumnData(GisFdwState *state)
+{
+	Relation rel;
+	TupleDesc tupdesc;
+	int i;
+	OgrFdwTable *tbl;
+	OGRFeatureDefnH dfn;
+	int ogr_ncols;
+	int fid_count = 0;
+	int geom_count = 0;
+	int ogr_geom_count = 0;
+	int field_count = 0;
+	OgrFieldEntry *ogr_fields;
+	int ogr_fields_count = 0;
+	char *tblname = get_rel_name(state->foreigntableid);
+
+	/* Blow away any existing table in the state */
+	if ( state->table )
+	{
+		freeOgrFdwTable(state->table);
+		state->table = NULL;
+	}
+
+	/* Fresh table */
+	tbl = palloc0(sizeof(OgrFdwTable));
+
+	/* One column for each PgSQL foreign table column */
+	rel = heap_open(state->foreigntableid, NoLock);
+	tupdesc = rel->rd_att;
+	state->tupdesc = tupdesc;
+	tbl->ncols = tupdesc->natts;
+	tbl->cols = palloc0(tbl->ncols * sizeof(OgrFdwColumn));
+	tbl->tblname = pstrdup(tblname);
+
+	/* Get OGR metadata ready */
+	dfn = OGR_L_GetLayerDefn(state->ogr.lyr);
+	ogr_ncols = OGR_FD_GetFieldCount(dfn);
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+	ogr_geom_count = OGR_FD_GetGeomFieldCount(dfn);
+#else
+	ogr_geom_count = ( OGR_FD_GetGeomType(dfn) != wkbNone ) ? 1 : 0;
+#endif
+
+
+	/* Prepare sorted list of OGR column names */
+	/* TODO: change this to a hash table, to avoid repeated strcmp */
+	/* We will search both the original and laundered OGR field names for matches */
+	ogr_fields_count = 2 * ogr_ncols;
+	ogr_fields = palloc0(ogr_fields_count * sizeof(OgrFieldEntry));
+	for ( i = 0; i < ogr_ncols; i++ )
+	{
+		char *fldname = pstrdup(OGR_Fld_GetNameRef(OGR_FD_GetFieldDefn(dfn, i)));
+		char *fldname_laundered = palloc(STR_MAX_LEN);
+		strncpy(fldname_laundered, fldname, STR_MAX_LEN);
+		ogrStringLaunder(fldname_laundered);
+		ogr_fields[2*i].fldname = fldname;
+		ogr_fields[2*i].fldnum = i;
+		ogr_fields[2*i+1].fldname = fldname_laundered;
+		ogr_fields[2*i+1].fldnum = i;
+	}
+	qsort(ogr_fields, ogr_fields_count, sizeof(OgrFieldEntry), ogrFieldEntryCmpFunc);
+
+
+	/* loop through foreign table columns */
+	for ( i = 0; i < tbl->ncols; i++ )
+	{
+		List *options;
+		ListCell *lc;
+		OgrFieldEntry *found_entry;
+		OgrFieldEntry entry;
+
+#if PG_VERSION_NUM >= 110000
+		Form_pg_attribute att_tuple = &tupdesc->attrs[i];
+#else
+		Form_pg_attribute att_tuple = tupdesc->attrs[i];
+#endif
+		OgrFdwColumn col = tbl->cols[i];
+		col.pgattnum = att_tuple->attnum;
+		col.pgtype = att_tuple->atttypid;
+		col.pgtypmod = att_tuple->atttypmod;
+		col.pgattisdropped = att_tuple->attisdropped;
+
+		/* Skip filling in any further metadata about dropped columns */
+		if ( col.pgattisdropped )
+			continue;
+
+		/* Find the appropriate conversion functions */
+		getTypeInputInfo(col.pgtype, &col.pginputfunc, &col.pginputioparam);
+		getTypeBinaryInputInfo(col.pgtype, &col.pgrecvfunc, &col.pgrecvioparam);
+		getTypeOutputInfo(col.pgtype, &col.pgoutputfunc, &col.pgoutputvarlena);
+		getTypeBinaryOutputInfo(col.pgtype, &col.pgsendfunc, &col.pgsendvarlena);
+
+		/* Get the PgSQL column name */
+		col.pgname = get_relid_attribute_name(rel->rd_id, att_tuple->attnum);
+
+		/* Handle FID first */
+		if ( strcaseeq(col.pgname, "fid") && (col.pgtype == INT4OID || col.pgtype == INT8OID) )
+		{
+			if ( fid_count >= 1 )
+				elog(ERROR, "FDW table '%s' includes more than one FID column", tblname);
+
+			col.ogrvariant = OGR_FID;
+			col.ogrfldnum = fid_count++;
+			tbl->cols[i] = col;
+			continue;
+		}
+
+		/* If the OGR source has geometries, can we match them to Pg columns? */
+		/* We'll match to the first ones we find, irrespective of name */
+		if ( geom_count < ogr_geom_count && col.pgtype == GEOMETRYOID )
+		{
+			col.ogrvariant = OGR_GEOMETRY;
+			col.ogrfldtype = OFTBinary;
+			col.ogrfldnum = geom_count++;
+			tbl->cols[i] = col;
+			continue;
+		}
+
+		/* Now we search for matches in the OGR fields */
+
+		/* By default, search for the PgSQL column name */
+		entry.fldname = col.pgname;
+		entry.fldnum = 0;
+
+		/*
+		 * But, if there is a 'column_name' option for this column, we
+		 * want to search for *that* in the OGR layer.
+		 */
+		options = GetForeignColumnOptions(state->foreigntableid, i + 1);
+		foreach(lc, options)
+		{
+			DefElem    *def = (DefElem *) lfirst(lc);
+
+			if ( streq(def->defname, OPT_COLUMN) )
+			{
+				entry.fldname = defGetString(def);
+				break;
+			}
+		}
+
+		/* Search PgSQL column name in the OGR column name list */
+		found_entry = bsearch(&entry, ogr_fields, ogr_fields_count, sizeof(OgrFieldEntry), ogrFieldEntryCmpFunc);
+
+		/* Column name matched, so save this entry, if the types are consistent */
+		if ( found_entry )
+		{
+			OGRFieldDefnH fld = OGR_FD_GetFieldDefn(dfn, found_entry->fldnum);
+			OGRFieldType fldtype = OGR_Fld_GetType(fld);
+
+			/* Error if types mismatched when column names match */
+			ogrCanConvertToPg(fldtype, col.pgtype, col.pgname, tblname);
+
+			col.ogrvariant = OGR_FIELD;
+			col.ogrfldnum = found_entry->fldnum;
+			col.ogrfldtype = fldtype;
+			col.ogrfldscale = OGR_Fld_GetWidth(fld) ? OGR_Fld_GetPrecision(fld) : -1;
+			field_count++;
+		}
+		else
+		{
+			col.ogrvariant = OGR_UNMATCHED;
+		}
+		tbl->cols[i] = col;
+	}
+
+	elog(DEBUG2, "ogrReadColumnData matched %d FID, %d GEOM, %d FIELDS out of %d PGSQL COLUMNS", fid_count, geom_count, field_count, tbl->ncols);
+
+	/* Clean up */
+
+	state->table = tbl;
+
+	/* Scans settle how to convert each column up front */
+	if ( state->type == GIS_EXEC_STATE )
+		ogrReadColumnConverters(tbl);
+
+	for( i = 0; i < 2*ogr_ncols; i++ )
+		if ( ogr_fields[i].fldname ) pfree(ogr_fields[i].fldname);
+	pfree(ogr_fields);
+	heap_close(rel, NoLock);
+
+	return;
+}
+
+/*
+ * ogrLookupGeometryFunctionOid
+ *
+ * Find the procedure Oids of useful functions so we can call
+ * them later.
+ */
+static Oid
+ogrLookupGeometryFunctionOid(const char *proname)
+{
+	List *names;
+	FuncCandidateList clist;
+
+	/* This only works if PostGIS is installed */
+	if ( GEOMETRYOID == InvalidOid || GEOMETRYOID == BYTEAOID )
+		return InvalidOid;
+
+	names = stringToQualifiedNameList(proname);
+#if PG_VERSION_NUM < 90400
+	clist = FuncnameGetCandidates(names, -1, NIL, false, false);
+#else
+	clist = FuncnameGetCandidates(names, -1, NIL, false, false, false);
+#endif
+	if ( streq(proname, "st_setsrid") )
+	{
+		do
+		{
+			int i;
+			for ( i = 0; i < clist->nargs; i++ )
+			{
+				if ( clist->args[i] == GEOMETRYOID )
+					return clist->oid;
+			}
+		}
+		while( (clist = clist->next) );
+	}
+	else if ( streq(proname, "postgis_typmod_srid") )
+	{
+		return clist->oid;
+	}
+
+	return InvalidOid;
+}
+
+
+/*
+ * Apply the spatial filter serialized by ogrGetForeignPlan
+ * to the layer, or clear the filter if there is none.
+ */
+static void
+ogrSetSpatialFilter(OGRLayerH lyr, Value *wkbhex, int ogrfldnum, bool is_rect)
+{
+	OGRGeometryH geom = NULL;
+	GByte *wkb;
+	int wkbsize;
+
+	if ( ! wkbhex )
+	{
+		OGR_L_SetSpatialFilter(lyr, NULL);
+		return;
+	}
+
+	wkb = CPLHexToBinary(strVal(wkbhex), &wkbsize);
+	if ( OGR_G_CreateFromWkb(wkb, NULL, &geom, wkbsize) != OGRERR_NONE )
+	{
+		CPLFree(wkb);
+		ogrEreportError("unable to read OGR spatial filter");
+	}
+	CPLFree(wkb);
+
+	if ( is_rect )
+	{
+		OGREnvelope env;
+		OGR_G_GetEnvelope(geom, &env);
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+		OGR_L_SetSpatialFilterRectEx(lyr, ogrfldnum, env.MinX, env.MinY, env.MaxX, env.MaxY);
+#else
+		OGR_L_SetSpatialFilterRect(lyr, env.MinX, env.MinY, env.MaxX, env.MaxY);
+#endif
+	}
+	else
+	{
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+		OGR_L_SetSpatialFilterEx(lyr, ogrfldnum, geom);
+#else
+		OGR_L_SetSpatialFilter(lyr, geom);
+#endif
+	}
+
+	/* The layer takes a copy of the filter */
+	OGR_G_DestroyGeometry(geom);
+}
+
+/*
+ * Flag the columns the query doesn't use so they can be skipped
+ * during conversion, and tell OGR not to bother reading them (or
+ * any fields and geometries that aren't mapped to columns at all).
+ */
+static void
+ogrSetRetrievedAttrs(GisFdwExecState *execstate, List *retrieved_attrs)
+{
+	OgrFdwTable *tbl = execstate->table;
+	OGRLayerH lyr = execstate->ogr.lyr;
+	OGRFeatureDefnH dfn = OGR_L_GetLayerDefn(lyr);
+	int ogr_ncols = OGR_FD_GetFieldCount(dfn);
+	int ogr_geom_count;
+	bool *fld_used, *geom_used;
+	char **ignored = NULL;
+	int i;
+
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+	ogr_geom_count = OGR_FD_GetGeomFieldCount(dfn);
+#else
+	ogr_geom_count = ( OGR_FD_GetGeomType(dfn) != wkbNone ) ? 1 : 0;
+#endif
+
+	fld_used = palloc0(sizeof(bool) * (ogr_ncols + 1));
+	geom_used = palloc0(sizeof(bool) * (ogr_geom_count + 1));
+
+	for ( i = 0; i < tbl->ncols; i++ )
+	{
+		OgrFdwColumn *col = &(tbl->cols[i]);
+		ListCell *lc;
+
+		col->pgattskip = true;
+		foreach(lc, retrieved_attrs)
+		{
+			if ( intVal(lfirst(lc)) == col->pgattnum )
+			{
+				col->pgattskip = false;
+				break;
+			}
+		}
+
+		if ( col->pgattisdropped || col->pgattskip )
+			continue;
+
+		if ( col->ogrvariant == OGR_FIELD )
+			fld_used[col->ogrfldnum] = true;
+		else if ( col->ogrvariant == OGR_GEOMETRY )
+			geom_used[col->ogrfldnum] = true;
+	}
+
+	for ( i = 0; i < ogr_ncols; i++ )
+	{
+		if ( ! fld_used[i] )
+			ignored = CSLAddString(ignored, OGR_Fld_GetNameRef(OGR_FD_GetFieldDefn(dfn, i)));
+	}
+
+	for ( i = 0; i < ogr_geom_count; i++ )
+	{
+		if ( geom_used[i] )
+			continue;
+		/* The first geometry can always be ignored by its special name */
+		if ( i == 0 )
+			ignored = CSLAddString(ignored, "OGR_GEOMETRY");
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+		else
+			ignored = CSLAddString(ignored, OGR_GFld_GetNameRef(OGR_FD_GetGeomFieldDefn(dfn, i)));
+#endif
+	}
+	ignored = CSLAddString(ignored, "OGR_STYLE");
+
+	/* Drivers that can't skip fields just read them anyway */
+	if ( OGR_L_SetIgnoredFields(lyr, (const char **)ignored) != OGRERR_NONE )
+		elog(DEBUG1, "unable to set ignored fields on OGR layer");
+
+	CSLDestroy(ignored);
+	pfree(fld_used);
+	pfree(geom_used);
+
+	/* Drop the skipped columns from the conversion plan */
+	ogrBuildConverterList(tbl);
+}
+
+/*
+ * Set an OGR SQL attribute filter on the scan layer, or clear
+ * it for an empty one.
+ */
+static void
+ogrSetAttributeFilter(GisFdwExecState *execstate, const char *sql)
+{
+	OGRErr err;
+
+	if ( ! sql || strlen(sql) == 0 )
+	{
+		OGR_L_SetAttributeFilter(execstate->ogr.lyr, NULL);
+		return;
+	}
+
+	err = OGR_L_SetAttributeFilter(execstate->ogr.lyr, sql);
+	if ( err != OGRERR_NONE )
+	{
+		const char *ogrerr = CPLGetLastErrorMsg();
+
+		if ( ogrerr && ! streq(ogrerr,"") )
+		{
+			ereport(NOTICE,
+				(errcode(ERRCODE_FDW_ERROR),
+				 errmsg("unable to set OGR SQL '%s' on layer", sql),
+				 errhint("%s", ogrerr)));
+		}
+		else
+		{
+			ereport(NOTICE,
+				(errcode(ERRCODE_FDW_ERROR),
+				 errmsg("unable to set OGR SQL '%s' on layer", sql)));
+		}
+	}
+}
+
+/*
+ * The whole statement of a scan that runs a SELECT: the SELECT,
+ * the OGR SQL as its WHERE, and its GROUP BY or ORDER BY.
+ */
+static char *
+ogrSelectStatement(const GisFdwExecState *execstate, const char *where)
+{
+	StringInfoData sql;
+
+	initStringInfo(&sql);
+	appendStringInfoString(&sql, execstate->select);
+	if ( where && strlen(where) > 0 )
+		appendStringInfo(&sql, " WHERE %s", where);
+	if ( execstate->select_tail )
+		appendStringInfoString(&sql, execstate->select_tail);
+	return sql.data;
+}
+
+/*
+ * Point the columns at the fields of the SELECT's result layer,
+ * which the driver numbers and types as it sees fit. A FID the
+ * driver didn't take for the result's FID comes back as a field.
+ * The spatial filter moves to the matching result geometry.
+ */
+static void
+ogrMapSqlColumns(GisFdwExecState *execstate)
+{
+	OgrFdwTable *tbl = execstate->table;
+	OGRLayerH lyr = execstate->ogr.lyr;
+	OGRLayerH sql_lyr = execstate->sql_lyr;
+	OGRFeatureDefnH dfn = OGR_L_GetLayerDefn(lyr);
+	OGRFeatureDefnH sql_dfn = OGR_L_GetLayerDefn(sql_lyr);
+	int spatial_fldnum = -1;
+	int i;
+
+	for ( i = 0; i < tbl->ncols; i++ )
+	{
+		OgrFdwColumn *col = &(tbl->cols[i]);
+		const char *name = NULL;
+		int fldnum;
+
+		if ( col->pgattisdropped || col->pgattskip || col->ogrvariant == OGR_UNMATCHED )
+			continue;
+
+		switch ( col->ogrvariant )
+		{
+			case OGR_FID:
+				name = OGR_L_GetFIDColumn(lyr);
+				fldnum = OGR_FD_GetFieldIndex(sql_dfn, name);
+				if ( fldnum < 0 )
+					continue;
+				col->ogrvariant = OGR_FIELD;
+				break;
+			case OGR_FIELD:
+				name = OGR_Fld_GetNameRef(OGR_FD_GetFieldDefn(dfn, col->ogrfldnum));
+				fldnum = OGR_FD_GetFieldIndex(sql_dfn, name);
+				break;
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+			case OGR_GEOMETRY:
+				name = OGR_GFld_GetNameRef(OGR_FD_GetGeomFieldDefn(dfn, col->ogrfldnum));
+				fldnum = OGR_FD_GetGeomFieldIndex(sql_dfn, name);
+				/* Some drivers don't carry the name of a lone geometry over */
+				if ( fldnum < 0 && OGR_FD_GetGeomFieldCount(sql_dfn) == 1 )
+					fldnum = 0;
+				if ( fldnum < 0 )
+					elog(ERROR, "OGR query result has no geometry \"%s\"", name);
+				if ( col->ogrfldnum == execstate->spatial_fldnum )
+					spatial_fldnum = fldnum;
+				col->ogrfldnum = fldnum;
+				continue;
+#endif
+			default:
+				continue;
+		}
+
+		if ( fldnum < 0 )
+			elog(ERROR, "OGR query result has no field \"%s\"", name);
+
+		col->ogrfldnum = fldnum;
+		col->ogrfldtype = OGR_Fld_GetType(OGR_FD_GetFieldDefn(sql_dfn, fldnum));
+		col->convert = ogrChooseConverter(col);
+		if ( ! col->convert )
+			elog(ERROR, "unsupported OGR type \"%s\" in query result", OGR_GetFieldTypeName(col->ogrfldtype));
+	}
+	ogrBuildConverterList(tbl);
+
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+	execstate->spatial_fldnum = spatial_fldnum;
+#endif
+	execstate->sql_mapped = true;
+}
+
+/*
+ * Run the SELECT of a sorted, joined or grouped scan, with the
+ * OGR SQL as its WHERE, in place of any earlier result.
+ */
+static void
+ogrExecuteSelect(GisFdwExecState *execstate, const char *where)
+{
+	char *sql = ogrSelectStatement(execstate, where);
+
+	if ( execstate->sql_lyr )
+	{
+		GDALDatasetReleaseResultSet(execstate->ogr.ds, execstate->sql_lyr);
+		execstate->sql_lyr = NULL;
+		ogrPoolResultSet(&(execstate->ogr), NULL);
+	}
+
+	elog(DEBUG1, "OGR query: %s", sql);
+	execstate->sql_lyr = GDALDatasetExecuteSQL(execstate->ogr.ds, sql, NULL, NULL);
+	if ( ! execstate->sql_lyr )
+		ogrEreportError("unable to run OGR query");
+	ogrPoolResultSet(&(execstate->ogr), execstate->sql_lyr);
+	pfree(sql);
+
+	/* Grouped scans read their outputs by name, see ogrIterateGroupScan, */
+	/* and joins have a table of their own, see ogrMapJoinColumns */
+	if ( execstate->table && ! execstate->join_scan )
+	{
+		OGRGeometryH filter = OGR_L_GetSpatialFilter(execstate->ogr.lyr);
+
+		if ( ! execstate->sql_mapped )
+			ogrMapSqlColumns(execstate);
+
+		if ( filter && execstate->spatial_fldnum >= 0 )
+		{
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+			OGR_L_SetSpatialFilterEx(execstate->sql_lyr, execstate->spatial_fldnum, filter);
+#else
+			OGR_L_SetSpatialFilter(execstate->sql_lyr, filter);
+#endif
+		}
+	}
+}
+
+/*
+ * Bounding box of a geometry value, false for an empty one.
+ */
+static bool
+ogrGeometryEnvelope(Datum value, Oid type, OGREnvelope *env)
+{
+	Oid sendfunction;
+	bool typeIsVarlena;
+	bytea *wkb_bytea;
+	unsigned char *wkb;
+	size_t wkbsize;
+	OGRGeometryH geom = NULL;
+	bool found = false;
+
+	getTypeBinaryOutputInfo(type, &sendfunction, &typeIsVarlena);
+	wkb_bytea = DatumGetByteaP(OidFunctionCall1(sendfunction, value));
+	wkb = (unsigned char *) VARDATA(wkb_bytea);
+	wkbsize = ogrEwkbStripSrid(wkb, VARSIZE(wkb_bytea) - VARHDRSZ);
+
+	if ( OGR_G_CreateFromWkb(wkb, NULL, &geom, wkbsize) != OGRERR_NONE )
+		ogrEreportError("unable to read outer geometry for OGR spatial filter");
+
+	if ( ! OGR_G_IsEmpty(geom) )
+	{
+		OGR_G_GetEnvelope(geom, env);
+		found = true;
+	}
+
+	OGR_G_DestroyGeometry(geom);
+	pfree(wkb_bytea);
+	return found;
+}
+
+/*
+ * Set the spatial filter to the box of the outer geometry, grown
+ * by the distance of the join clause, within the scan's own
+ * filter box. False if no feature can match.
+ */
+static bool
+ogrBindSpatialFilter(GisFdwExecState *execstate, Datum value, bool isnull, Oid type)
+{
+	OGREnvelope env;
+	double expand = execstate->spatial_param_expand;
+
+	if ( isnull || ! ogrGeometryEnvelope(value, type, &env) )
+		return false;
+
+	env.MinX -= expand;
+	env.MinY -= expand;
+	env.MaxX += expand;
+	env.MaxY += expand;
+
+	if ( execstate->has_base_env )
+	{
+		env.MinX = Max(env.MinX, execstate->base_env.MinX);
+		env.MinY = Max(env.MinY, execstate->base_env.MinY);
+		env.MaxX = Min(env.MaxX, execstate->base_env.MaxX);
+		env.MaxY = Min(env.MaxY, execstate->base_env.MaxY);
+		if ( env.MinX > env.MaxX || env.MinY > env.MaxY )
+			return false;
+	}
+
+	elog(DEBUG2, "OGR spatial filter from outer geometry: %g %g, %g %g",
+	     env.MinX, env.MinY, env.MaxX, env.MaxY);
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+	OGR_L_SetSpatialFilterRectEx(execstate->ogr.lyr, execstate->spatial_param_fldnum,
+	                             env.MinX, env.MinY, env.MaxX, env.MaxY);
+#else
+	OGR_L_SetSpatialFilterRect(execstate->ogr.lyr, env.MinX, env.MinY, env.MaxX, env.MaxY);
+#endif
+	return true;
+}
+
+/*
+ * Evaluate the params of the OGR SQL for the current outer row
+ * (or query parameters), and set the filters with their values.
+ */
+static void
+ogrBindAttributeFilter(ForeignScanState *node, GisFdwExecState *execstate)
+{
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	int nparams = list_length(execstate->param_exprs);
+	MemoryContext oldcontext;
+	Datum *values;
+	bool *nulls;
+	Oid *types;
+	ListCell *lc;
+	char *sql;
+	int i = 0;
+
+	/* Values and the SQL only need to last until the filter is set */
+	oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+
+	values = palloc(sizeof(Datum) * nparams);
+	nulls = palloc(sizeof(bool) * nparams);
+	types = palloc(sizeof(Oid) * nparams);
+
+	foreach(lc, execstate->param_exprs)
+	{
+		ExprState *expr_state = (ExprState *) lfirst(lc);
+
+#if PG_VERSION_NUM >= 100000
+		values[i] = ExecEvalExpr(expr_state, econtext, &(nulls[i]));
+#else
+		values[i] = ExecEvalExpr(expr_state, econtext, &(nulls[i]), NULL);
+#endif
+		types[i] = exprType((Node *) expr_state->expr);
+		i++;
+	}
+
+	sql = execstate->sql ?
+	      ogrDeparseBindParams(execstate->sql, values, nulls, types, nparams,
+	                           ogrSqlDialect(&(execstate->ogr))) : NULL;
+	elog(DEBUG2, "OGR SQL with params: %s", sql ? sql : "(none)");
+	if ( execstate->select )
+		ogrExecuteSelect(execstate, sql);
+	else
+		ogrSetAttributeFilter(execstate, sql);
+
+	if ( execstate->spatial_param > 0 )
+	{
+		i = execstate->spatial_param - 1;
+		execstate->params_empty = ! ogrBindSpatialFilter(execstate, values[i], nulls[i], types[i]);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Read the FID restrictions serialized by ogrGetForeignPlan.
+ */
+static void
+ogrReadFidFilter(GisFdwExecState *execstate, List *fdw_private)
+{
+	OgrFdwFidFilter *fid = &(execstate->fid);
+	Value *min_fid = (Value *) list_nth(fdw_private, OgrFdwScanPrivateFidMin);
+	Value *max_fid = (Value *) list_nth(fdw_private, OgrFdwScanPrivateFidMax);
+	List *fids = (List *) list_nth(fdw_private, OgrFdwScanPrivateFids);
+	ListCell *lc;
+
+	memset(fid, 0, sizeof(OgrFdwFidFilter));
+	fid->lookup = intVal(list_nth(fdw_private, OgrFdwScanPrivateFidLookup));
+	if ( fid->lookup )
+	{
+		fid->fids = palloc(sizeof(GIntBig) * Max(list_length(fids), 1));
+		foreach(lc, fids)
+			fid->fids[fid->nfids++] = CPLAtoGIntBig(strVal(lfirst(lc)));
+	}
+
+	fid->has_min = (min_fid != NULL);
+	if ( fid->has_min )
+		fid->min_fid = CPLAtoGIntBig(strVal(min_fid));
+	fid->has_max = (max_fid != NULL);
+	if ( fid->has_max )
+		fid->max_fid = CPLAtoGIntBig(strVal(max_fid));
+	execstate->fid_seek = fid->has_min || fid->has_max;
+}
+
+/*
+ * Position the layer at the start of the FID range. FIDs are
+ * the feature index here, and OGR fails to seek past the last
+ * feature, which leaves nothing to read.
+ */
+static void
+ogrFidStartRead(GisFdwExecState *execstate)
+{
+	OgrFdwFidFilter *fid = &(execstate->fid);
+	OGRErr err;
+
+	execstate->next_fid = 0;
+	execstate->fid_done = false;
+
+	if ( ! execstate->fid_seek )
+		return;
+
+	if ( fid->has_min && fid->has_max && fid->min_fid > fid->max_fid )
+	{
+		execstate->fid_done = true;
+		return;
+	}
+
+	if ( ! fid->has_min || fid->min_fid <= 0 )
+		return;
+
+	CPLPushErrorHandler(CPLQuietErrorHandler);
+	err = OGR_L_SetNextByIndex(execstate->ogr.lyr, fid->min_fid);
+	CPLPopErrorHandler();
+
+	if ( err != OGRERR_NONE )
+		execstate->fid_done = true;
+}
+
+/*
+ * Next feature of the scan: the next FID found among those to
+ * look up, or the next one read from the layer, up to the end
+ * of the FID range.
+ */
+static OGRFeatureH
+ogrNextFeature(GisFdwExecState *execstate)
+{
+	OgrFdwFidFilter *fid = &(execstate->fid);
+	OGRFeatureH feat = NULL;
+
+	if ( fid->lookup )
+	{
+		/* Drivers complain about FIDs they don't have, skip those */
+		CPLPushErrorHandler(CPLQuietErrorHandler);
+		while ( ! feat && execstate->next_fid < fid->nfids )
+			feat = OGR_L_GetFeature(execstate->ogr.lyr, fid->fids[execstate->next_fid++]);
+		CPLPopErrorHandler();
+		return feat;
+	}
+
+	if ( execstate->fid_done )
+		return NULL;
+
+	/* A scan running a SELECT reads its result */
+	feat = OGR_L_GetNextFeature(execstate->sql_lyr ? execstate->sql_lyr : execstate->ogr.lyr);
+
+	/* Features come in FID order, so the range ends at the first past it */
+	if ( feat && execstate->fid_seek && fid->has_max && OGR_F_GetFID(feat) > fid->max_fid )
+	{
+		OGR_F_Destroy(feat);
+		execstate->fid_done = true;
+		return NULL;
+	}
+
+	return feat;
+}
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * Set up the scan of the aggregates of a table, which has only
+ * the OGR SQL of the table's restrictions to apply. A grouped
+ * scan applies it in the WHERE of its SELECT instead.
+ */
+static void
+ogrBeginAggScan(ForeignScanState *node, ForeignScan *fsplan)
+{
+	Oid foreigntableid = (Oid) intVal(list_nth(fsplan->fdw_private, OgrFdwAggPrivateTable));
+	Value *sqlval = (Value *) list_nth(fsplan->fdw_private, OgrFdwAggPrivateSql);
+	Value *selval;
+	GisFdwExecState *execstate = (GisFdwExecState *) getGisFdwState(foreigntableid, GIS_EXEC_STATE);
+
+	execstate->sql = sqlval ? strVal(sqlval) : NULL;
+	execstate->agg_kinds = (List *) list_nth(fsplan->fdw_private, OgrFdwAggPrivateKinds);
+	execstate->agg_fields = (List *) list_nth(fsplan->fdw_private, OgrFdwAggPrivateFields);
+	selval = (Value *) list_nth(fsplan->fdw_private, OgrFdwAggPrivateSelect);
+	execstate->select = selval ? strVal(selval) : NULL;
+	selval = (Value *) list_nth(fsplan->fdw_private, OgrFdwAggPrivateSelectTail);
+	execstate->select_tail = selval ? strVal(selval) : NULL;
+
+	if ( ! execstate->select )
+		ogrSetAttributeFilter(execstate, execstate->sql);
+	execstate->filter_bound = true;
+
+	node->fdw_state = (void *) execstate;
+}
+#endif
+
+#if PG_VERSION_NUM >= 90600
+/*
+ * Set up the scan of a join the database runs, through the
+ * connection of the outer table. The inner one is in the same
+ * datasource.
+ */
+static void
+ogrBeginJoinScan(ForeignScanState *node, ForeignScan *fsplan)
+{
+	Oid foreigntableid = (Oid) intVal(list_nth(fsplan->fdw_private, OgrFdwJoinPrivateTable));
+	GisFdwExecState *execstate = (GisFdwExecState *) getGisFdwState(foreigntableid, GIS_EXEC_STATE);
+
+	execstate->select = strVal(list_nth(fsplan->fdw_private, OgrFdwJoinPrivateSql));
+	execstate->join_scan = true;
+	execstate->filter_bound = true;
+	execstate->spatial_fldnum = -1;
+	execstate->geombuf = makeStringInfo();
+
+	node->fdw_state = (void *) execstate;
+}
+#endif
+
+/*
+ * gisBeginForeignScan
+ */
+static void
+gisBeginForeignScan(ForeignScanState *node, int eflags)
+{
+	Oid foreigntableid;
+	ForeignScan *fsplan = (ForeignScan *)node->ss.ps.plan;
+	Value *sqlval;
+	GisFdwState *state;
+	GisFdwExecState *execstate;
+
+#if PG_VERSION_NUM >= 90600
+	/* Joins and aggregates run elsewhere scan no relation of their own */
+	if ( fsplan->scan.scanrelid == 0 )
+	{
+#if PG_VERSION_NUM >= 100000
+		if ( bms_membership(fsplan->fs_relids) != BMS_MULTIPLE )
+			ogrBeginAggScan(node, fsplan);
+		else
+#endif
+			ogrBeginJoinScan(node, fsplan);
+		return;
+	}
+#endif
+
+	/* Initialize OGR connection */
+	foreigntableid = RelationGetRelid(node->ss.ss_currentRelation);
+	state = getGisFdwState(foreigntableid, GIS_EXEC_STATE);
+	execstate = (GisFdwExecState *)state;
+
+	if (state->isRaster) {
+	    rasterBeginForeignScan(node, eflags, execstate);
+	} else {
+	    /* Read the OGR layer definition and PgSQL foreign table definitions */
+	    ogrReadColumnData(state);
+
+	    /* Geometries are exported into one buffer for the whole scan */
+	    execstate->geombuf = makeStringInfo();
+
+	    /* FID restrictions are read directly, feature by feature */
+	    ogrReadFidFilter(execstate, fsplan->fdw_private);
+
+	    /* Sorted scans read the result of a SELECT */
+	    sqlval = (Value *) list_nth(fsplan->fdw_private, OgrFdwScanPrivateSelect);
+	    execstate->select = sqlval ? strVal(sqlval) : NULL;
+	    sqlval = (Value *) list_nth(fsplan->fdw_private, OgrFdwScanPrivateSelectTail);
+	    execstate->select_tail = sqlval ? strVal(sqlval) : NULL;
+
+	    if ( execstate->ogr.lyr_arrow && ! execstate->select &&
+	         ! execstate->fid.lookup && ! execstate->fid_seek )
+	    {
+#ifdef OGR_FDW_ARROW
+		ogrArrowBeginScan(execstate);
+#else
+		elog(DEBUG1, "reading OGR layer \"%s\" by feature, Arrow batch reads need GDAL 3.6", execstate->ogr.lyr_str);
+#endif
+	    }
+
+	    /* Get private info created by planner functions. */
+	    sqlval = (Value *) list_nth(fsplan->fdw_private, OgrFdwScanPrivateSql);
+	    execstate->sql = sqlval ? strVal(sqlval) : NULL;
+
+	    /* Only read and convert the columns the query uses */
+	    ogrSetRetrievedAttrs(execstate, (List *) list_nth(fsplan->fdw_private, OgrFdwScanPrivateRetrievedAttrs));
+
+	    /* Let drivers with spatial indexes skip what's outside the query area */
+	    ogrSetSpatialFilter(execstate->ogr.lyr,
+	        list_nth(fsplan->fdw_private, OgrFdwScanPrivateSpatialWkb),
+	        intVal(list_nth(fsplan->fdw_private, OgrFdwScanPrivateSpatialField)),
+	        intVal(list_nth(fsplan->fdw_private, OgrFdwScanPrivateSpatialIsRect)));
+	    execstate->spatial_fldnum = intVal(list_nth(fsplan->fdw_private, OgrFdwScanPrivateSpatialField));
+
+	    /*
+	     * A spatial join sets the filter from each outer geometry,
+	     * within the box of the scan's own filter on the same field.
 	     */
-	    if ( sql_generated )
-		fdw_private = list_make2(makeString(sql.data), params_list);
-	    else
-		fdw_private = list_make2(NULL, params_list);
+	    execstate->spatial_param = intVal(list_nth(fsplan->fdw_private, OgrFdwScanPrivateSpatialParam));
+	    execstate->spatial_param_fldnum = intVal(list_nth(fsplan->fdw_private, OgrFdwScanPrivateSpatialParamField));
+	    execstate->spatial_param_expand = floatVal(list_nth(fsplan->fdw_private, OgrFdwScanPrivateSpatialParamExpand));
+	    execstate->has_base_env = false;
+	    execstate->params_empty = false;
+	    if ( execstate->spatial_param > 0 &&
+	         list_nth(fsplan->fdw_private, OgrFdwScanPrivateSpatialWkb) &&
+	         intVal(list_nth(fsplan->fdw_private, OgrFdwScanPrivateSpatialField)) == execstate->spatial_param_fldnum &&
+	         OGR_L_GetSpatialFilter(execstate->ogr.lyr) )
+	    {
+		OGR_G_GetEnvelope(OGR_L_GetSpatialFilter(execstate->ogr.lyr), &(execstate->base_env));
+		execstate->has_base_env = true;
+	    }
 
 	    /*
-	     * Clean up our connection
+	     * A filter on values from the outer side of a join, or on
+	     * query parameters, can only be set once those are known,
+	     * at the start of each (re)scan. Others can be set now,
+	     * except for a SELECT, which runs at the start of the scan.
 	     */
-	    ogrFinishConnection(&(planstate->ogr));
+	    if ( fsplan->fdw_exprs )
+	    {
+#if PG_VERSION_NUM >= 100000
+		execstate->param_exprs = ExecInitExprList(fsplan->fdw_exprs, (PlanState *) node);
+#else
+		execstate->param_exprs = (List *) ExecInitExpr((Expr *) fsplan->fdw_exprs, (PlanState *) node);
+#endif
+	    }
+	    else if ( ! execstate->select )
+	    {
+		ogrSetAttributeFilter(execstate, execstate->sql);
+		execstate->filter_bound = true;
+	    }
 	}
 
-	/* Create the ForeignScan node */
-	return make_foreignscan(tlist,
-							scan_clauses,
-							scan_relid,
-							NIL,	/* no expressions to evaluate */
-							fdw_private
-#if PG_VERSION_NUM >= 90500
-							,NIL  /* no scan_tlist */
-							,NIL   /* no remote quals */
-							,outer_plan
+	/* Save the state for the next call */
+	node->fdw_state = (void *) execstate;
+
+	return;
+}
+
+/*
+ * Apply a numeric typmod (precision and scale) to a numeric value,
+ * as numeric_in would have done.
+ */
+static Datum
+ogrNumericTypmod(Datum num, int typmod)
+{
+	if ( typmod < 0 )
+		return num;
+	return DirectFunctionCall2(numeric, num, Int32GetDatum(typmod));
+}
+
+static void
+ogrRangeError(const char *typname)
+{
+	ereport(ERROR,
+		(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+		 errmsg("OGR value is out of range for type %s", typname)));
+}
+
+/*
+ * Column converters
+ *
+ * Every column a scan returns gets one of these, picked once in
+ * ogrReadColumnConverters to suit its OGR and PgSQL types, so the
+ * per-feature work is just a walk over the table's converter list.
+ * Field converters are only called on fields that are set and
+ * not null. Where a value can be built from its binary form it
+ * is, otherwise it goes through text and the type input function.
+ */
+
+static void
+ogrConvertFid(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	GIntBig fid = OGR_F_GetFID(feat);
+
+	if ( fid == OGRNullFID )
+	{
+		*isnull = true;
+	}
+	else if ( col->pgtype == INT4OID )
+	{
+		if ( fid < INT_MIN || fid > INT_MAX )
+			ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("value \"" OGR_FDW_FRMT_INT64 "\" is out of range for type integer", OGR_FDW_CAST_INT64(fid))));
+		*value = Int32GetDatum((int32)fid);
+	}
+	else
+	{
+		*value = Int64GetDatum((int64)fid);
+	}
+}
+
+#ifdef OGR_FDW_HEXWKB
+static uint32
+ogrWkbUInt32(const unsigned char *p, bool xdr)
+{
+	if ( xdr )
+		return ((uint32)p[0] << 24) | ((uint32)p[1] << 16) | ((uint32)p[2] << 8) | p[3];
+	return ((uint32)p[3] << 24) | ((uint32)p[2] << 16) | ((uint32)p[1] << 8) | p[0];
+}
+
+/*
+ * Walk a (E)WKB geometry checking for the structural defects (too
+ * few points, unclosed rings) that the PostGIS "recv" function refuses
+ * and the hexwkb "input" function lets through. Returns a pointer
+ * just past the geometry, or NULL if it is defective, truncated, or
+ * a curve or anything else unusual, which take the lax route.
+ */
+static const unsigned char *
+ogrWkbWellFormed(const unsigned char *wkb, const unsigned char *end)
+{
+	uint32 type, n, i;
+	bool xdr, hasz;
+	size_t ndims = 2, ptsize;
+
+	if ( end - wkb < 5 )
+		return NULL;
+
+	xdr = (wkb[0] == 0);
+	type = ogrWkbUInt32(wkb + 1, xdr);
+	wkb += 5;
+
+	/* Old style Z/M flags, the EWKB SRID flag, and ISO type numbers */
+	hasz = (type & 0x80000000) != 0;
+	if ( type & 0x80000000 ) ndims++;
+	if ( type & 0x40000000 ) ndims++;
+	if ( type & 0x20000000 ) wkb += 4;
+	type &= 0x0FFFFFFF;
+	if ( type / 1000 == 1 || type / 1000 == 3 ) hasz = true;
+	if ( type / 1000 == 3 ) ndims += 2;
+	else if ( type / 1000 > 0 ) ndims++;
+	type %= 1000;
+	ptsize = ndims * sizeof(double);
+
+	if ( type == wkbPoint )
+		return ( (size_t)(end - wkb) < ptsize ) ? NULL : wkb + ptsize;
+
+	if ( end - wkb < 4 )
+		return NULL;
+	n = ogrWkbUInt32(wkb, xdr);
+	wkb += 4;
+
+	switch ( type )
+	{
+		case wkbLineString:
+			if ( n == 1 || (size_t)(end - wkb) < n * ptsize )
+				return NULL;
+			return wkb + n * ptsize;
+		case wkbPolygon:
+			for ( i = 0; i < n; i++ )
+			{
+				uint32 npts;
+				if ( end - wkb < 4 )
+					return NULL;
+				npts = ogrWkbUInt32(wkb, xdr);
+				wkb += 4;
+				if ( npts < 4 || (size_t)(end - wkb) < npts * ptsize )
+					return NULL;
+				/* Closed in X, Y and, when there is one, Z */
+				if ( memcmp(wkb, wkb + (npts - 1) * ptsize, (hasz ? 3 : 2) * sizeof(double)) != 0 )
+					return NULL;
+				wkb += npts * ptsize;
+			}
+			return wkb;
+		case wkbMultiPoint:
+		case wkbMultiLineString:
+		case wkbMultiPolygon:
+		case wkbGeometryCollection:
+			for ( i = 0; i < n && wkb; i++ )
+				wkb = ogrWkbWellFormed(wkb, end);
+			return wkb;
+		default:
+			return NULL;
+	}
+}
 #endif
-);
 
+/*
+ * Turn the WKB sitting four bytes into the scan's geometry buffer
+ * into a geometry Datum. If the column typmod has an SRID, the endian
+ * and type bytes are shifted forward and the SRID stamped into the
+ * gap, making the buffer EWKB, so PostGIS assigns the SRID while it
+ * reads the geometry instead of in a later ST_SetSRID() call.
+ */
+static Datum
+ogrGeometryFromBuffer(const OgrFdwColumn *col, const GisFdwExecState *execstate, size_t wkbsize)
+{
+	unsigned char *wkb = (unsigned char *)execstate->geombuf->data;
+	StringInfoData strinfo;
+
+	if ( col->pgtypmodsrid > 0 && wkbsize >= 5 )
+	{
+		uint32 srid = (uint32)col->pgtypmodsrid;
+		bool xdr = (wkb[4] == 0);
+
+		memmove(wkb, wkb + 4, 5);
+		/* SRID flag, in the high byte of the type */
+		wkb[xdr ? 1 : 4] |= 0x20;
+		wkb[xdr ? 8 : 5] = srid & 0xFF;
+		wkb[xdr ? 7 : 6] = (srid >> 8) & 0xFF;
+		wkb[xdr ? 6 : 7] = (srid >> 16) & 0xFF;
+		wkb[xdr ? 5 : 8] = (srid >> 24) & 0xFF;
+		wkbsize += 4;
+	}
+	else
+	{
+		wkb += 4;
+	}
+
+	/*
+	 * For geometry we need to convert the WKB into a serialized
+	 * geometry (aka "gserialized"). For that, we can use the type's "recv" function
+	 * which takes in WKB and spits out serialized form, or the "input" function
+	 * that takes in HEXWKB. The "input" function is more lax about geometry
+	 * structure errors (unclosed polys, etc), but costs a hex encode
+	 * and decode of every geometry, so it is only used for geometries
+	 * the "recv" function would reject.
+	 */
+#ifdef OGR_FDW_HEXWKB
+	if ( ! ogrWkbWellFormed(wkb, wkb + wkbsize) )
+	{
+		char *hexwkb = ogrBytesToHex(wkb, wkbsize);
+		Datum geom = FunctionCall1((FmgrInfo *)&(col->pginputflinfo), PointerGetDatum(hexwkb));
+		pfree(hexwkb);
+		return geom;
+	}
+#endif
 
+	/*
+	 * The "recv" function expects to receive a StringInfo pointer
+	 * on the first argument, so we form one of those ourselves by
+	 * hand, pointing at the data in the geometry buffer.
+	 *
+	 * The "recv" function tests for basic geometry validity,
+	 * things like polygon closure, etc. So don't feed it junk.
+	 */
+	strinfo.data = (char *)wkb;
+	strinfo.len = wkbsize;
+	strinfo.maxlen = strinfo.len;
+	strinfo.cursor = 0;
+	return FunctionCall1((FmgrInfo *)&(col->pgrecvflinfo), PointerGetDatum(&strinfo));
 }
 
 static void
-pgCanConvertToOgr(Oid pg_type, OGRFieldType ogr_type, const char *colname, const char *tblname)
+ogrConvertGeometry(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
 {
-	if ( pg_type == BOOLOID && ogr_type == OFTInteger )
-		return;
-	else if ( pg_type == INT2OID && ogr_type == OFTInteger )
-		return;
-	else if ( pg_type == INT4OID && ogr_type == OFTInteger )
+	int wkbsize;
+	int varsize;
+	bytea *varlena;
+
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+	OGRGeometryH geom = OGR_F_GetGeomFieldRef(feat, col->ogrfldnum);
+#else
+	OGRGeometryH geom = OGR_F_GetGeometryRef(feat);
+#endif
+
+	/* No geometry ? NULL */
+	if ( ! geom )
+	{
+		*isnull = true;
 		return;
-	else if ( pg_type == INT8OID )
+	}
+
+	wkbsize = OGR_G_WkbSize(geom);
+
+	/*
+	 * Nothing special to do for bytea, just send the varlena data through!
+	 */
+	if ( col->pgtype == BYTEAOID )
 	{
+		varsize = wkbsize + VARHDRSZ;
+		varlena = palloc(varsize);
+		if ( OGR_G_ExportToWkb(geom, wkbNDR, (unsigned char *)VARDATA(varlena)) != OGRERR_NONE )
+			ogrEreportError("failure reading OGR data source");
+		SET_VARSIZE(varlena, varsize);
+		*value = PointerGetDatum(varlena);
+		return;
+	}
+
+	/* Export into the scan's buffer, leaving room for an SRID */
+	enlargeStringInfo(execstate->geombuf, wkbsize + 4);
+	if ( OGR_G_ExportToWkb(geom, wkbNDR, (unsigned char *)execstate->geombuf->data + 4) != OGRERR_NONE )
+		ogrEreportError("failure reading OGR data source");
+
+	*value = ogrGeometryFromBuffer(col, execstate, wkbsize);
+}
+
+static void
+ogrConvertBinary(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	int bufsize;
+	GByte *buf = OGR_F_GetFieldAsBinary(feat, col->ogrfldnum, &bufsize);
+	int varsize = bufsize + VARHDRSZ;
+	bytea *varlena = palloc(varsize);
+
+	memcpy(VARDATA(varlena), buf, bufsize);
+	SET_VARSIZE(varlena, varsize);
+	*value = PointerGetDatum(varlena);
+}
+
+static inline int64
+ogrGetFieldAsInt64(const OGRFeatureH feat, int ogrfldnum)
+{
 #if GDAL_VERSION_MAJOR >= 2
-		if ( ogr_type == OFTInteger64 )
-			return;
+	return OGR_F_GetFieldAsInteger64(feat, ogrfldnum);
 #else
-		if ( ogr_type == OFTInteger )
-			return;
+	return OGR_F_GetFieldAsInteger(feat, ogrfldnum);
 #endif
-	}
-	else if ( pg_type == NUMERICOID && ogr_type == OFTReal )
-		return;
-	else if ( pg_type == FLOAT4OID && ogr_type == OFTReal )
-		return;
-	else if ( pg_type == FLOAT8OID && ogr_type == OFTReal )
-		return;
-	else if ( pg_type == TEXTOID && ogr_type == OFTString )
-		return;
-	else if ( pg_type == VARCHAROID && ogr_type == OFTString )
-		return;
-	else if ( pg_type == CHAROID && ogr_type == OFTString )
-		return;
-	else if ( pg_type == BPCHAROID && ogr_type == OFTString )
-		return;
-	else if ( pg_type == NAMEOID && ogr_type == OFTString )
-		return;
-	else if ( pg_type == BYTEAOID && ogr_type == OFTBinary )
-		return;
-	else if ( pg_type == DATEOID && ogr_type == OFTDate )
-		return;
-	else if ( pg_type == TIMEOID && ogr_type == OFTTime )
-		return;
-	else if ( pg_type == TIMESTAMPOID && ogr_type == OFTDateTime )
-		return;
+}
 
-	ereport(ERROR, (
-			errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-			errmsg("column \"%s\" of foreign table \"%s\" converts \"%s\" to OGR \"%s\"",
-				colname, tblname,
-				format_type_be(pg_type), OGR_GetFieldTypeName(ogr_type))
-			));
+static void
+ogrConvertIntToBool(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	*value = BoolGetDatum(ogrGetFieldAsInt64(feat, col->ogrfldnum) != 0);
+}
+
+static void
+ogrConvertIntToInt2(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	int64 val = ogrGetFieldAsInt64(feat, col->ogrfldnum);
+	if ( val < SHRT_MIN || val > SHRT_MAX )
+		ogrRangeError("smallint");
+	*value = Int16GetDatum((int16)val);
 }
 
 static void
-ogrCanConvertToPg(OGRFieldType ogr_type, Oid pg_type, const char *colname, const char *tblname)
+ogrConvertIntToInt4(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
 {
-	switch (ogr_type)
-	{
-		case OFTInteger:
-			if ( pg_type == BOOLOID ||  pg_type == INT4OID || pg_type == INT8OID || pg_type == NUMERICOID || pg_type == FLOAT4OID || pg_type == FLOAT8OID || pg_type == TEXTOID || pg_type == VARCHAROID )
-				return;
-			break;
-
-		case OFTReal:
-			if ( pg_type == NUMERICOID || pg_type == FLOAT4OID || pg_type == FLOAT8OID || pg_type == TEXTOID || pg_type == VARCHAROID )
-				return;
-			break;
-
-		case OFTBinary:
-			if ( pg_type == BYTEAOID )
-				return;
-			break;
+	int64 val = ogrGetFieldAsInt64(feat, col->ogrfldnum);
+	if ( val < INT_MIN || val > INT_MAX )
+		ogrRangeError("integer");
+	*value = Int32GetDatum((int32)val);
+}
 
-		case OFTString:
-			if ( pg_type == TEXTOID || pg_type == VARCHAROID || pg_type == CHAROID || pg_type == BPCHAROID )
-				return;
-			break;
+static void
+ogrConvertIntToInt8(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	*value = Int64GetDatum(ogrGetFieldAsInt64(feat, col->ogrfldnum));
+}
 
-		case OFTDate:
-			if ( pg_type == DATEOID || pg_type == TIMESTAMPOID || pg_type == TEXTOID || pg_type == VARCHAROID )
-				return;
-			break;
+static void
+ogrConvertIntToFloat4(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	*value = Float4GetDatum((float4)ogrGetFieldAsInt64(feat, col->ogrfldnum));
+}
 
-		case OFTTime:
-			if ( pg_type == TIMEOID || pg_type == TEXTOID || pg_type == VARCHAROID )
-				return;
-			break;
+static void
+ogrConvertIntToFloat8(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	*value = Float8GetDatum((float8)ogrGetFieldAsInt64(feat, col->ogrfldnum));
+}
 
-		case OFTDateTime:
-			if ( pg_type == TIMESTAMPOID || pg_type == TEXTOID || pg_type == VARCHAROID )
-				return;
-			break;
+static void
+ogrConvertIntToNumeric(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	Datum num = DirectFunctionCall1(int8_numeric, Int64GetDatum(ogrGetFieldAsInt64(feat, col->ogrfldnum)));
+	*value = ogrNumericTypmod(num, col->pgtypmod);
+}
 
-#if GDAL_VERSION_MAJOR >= 2
-		case OFTInteger64:
-			if ( pg_type == INT8OID || pg_type == NUMERICOID || pg_type == FLOAT8OID || pg_type == TEXTOID || pg_type == VARCHAROID )
-				return;
-			break;
-#endif
+static void
+ogrConvertRealToFloat4(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	double val = OGR_F_GetFieldAsDouble(feat, col->ogrfldnum);
+	float4 fval = (float4)val;
+	if ( isinf(fval) && ! isinf(val) )
+		ogrRangeError("real");
+	*value = Float4GetDatum(fval);
+}
 
-		case OFTWideString:
-		case OFTIntegerList:
-#if GDAL_VERSION_MAJOR >= 2
-		case OFTInteger64List:
-#endif
-		case OFTRealList:
-		case OFTStringList:
-		case OFTWideStringList:
-		{
-			ereport(ERROR, (
-					errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-					errmsg("column \"%s\" of foreign table \"%s\" uses an OGR array, currently unsupported", colname, tblname)
-					));
-			break;
-		}
-	}
-	ereport(ERROR, (
-			errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-			errmsg("column \"%s\" of foreign table \"%s\" converts OGR \"%s\" to \"%s\"",
-				colname, tblname,
-				OGR_GetFieldTypeName(ogr_type), format_type_be(pg_type))
-			));
+static void
+ogrConvertRealToFloat8(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	*value = Float8GetDatum(OGR_F_GetFieldAsDouble(feat, col->ogrfldnum));
 }
 
-#ifdef OGR_FDW_HEXWKB
+static void
+ogrConvertRealToNumeric(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	Datum num = DirectFunctionCall1(float8_numeric, Float8GetDatum(OGR_F_GetFieldAsDouble(feat, col->ogrfldnum)));
 
-static char *hexchr = "0123456789ABCDEF";
+	/*
+	 * OGR formats reals from fixed width sources with the
+	 * declared number of decimals, keep that display scale
+	 * like the text conversion did.
+	 */
+	if ( col->ogrfldscale >= 0 )
+		num = ogrNumericTypmod(num, ((NUMERIC_MAX_PRECISION << 16) | col->ogrfldscale) + VARHDRSZ);
+	*value = ogrNumericTypmod(num, col->pgtypmod);
+}
 
-static char *
-ogrBytesToHex(unsigned char *bytes, size_t size)
+static void
+ogrConvertStringToText(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
 {
-	char *hex;
-	int i;
-	if ( ! bytes || ! size )
+	const char *cstr = OGR_F_GetFieldAsString(feat, col->ogrfldnum);
+	size_t cstr_len = cstr ? strlen(cstr) : 0;
+
+	if ( cstr_len == 0 )
 	{
-		elog(ERROR, "hexbytes_from_bytes: invalid input");
-		return NULL;
+		*isnull = true;
+		return;
 	}
-	hex = palloc(size * 2 + 1);
-	hex[2*size] = '\0';
-	for( i = 0; i < size; i++ )
+
+	/* Validate OGR's UTF8, or convert it */
+	if ( execstate->ogr.lyr_utf8 )
 	{
-		/* Top four bits to 0-F */
-		hex[2*i] = hexchr[bytes[i] >> 4];
-		/* Bottom four bits to 0-F */
-		hex[2*i+1] = hexchr[bytes[i] & 0x0F];
+		cstr = pg_any_to_server(cstr, cstr_len, PG_UTF8);
+		cstr_len = strlen(cstr);
 	}
-	return hex;
+	*value = PointerGetDatum(cstring_to_text_with_len(cstr, cstr_len));
 }
 
-#endif
-
+/*
+ * Convert numbers and strings via a string representation,
+ * using the type input function of the column.
+ */
 static void
-freeOgrFdwTable(OgrFdwTable *table)
+ogrConvertViaText(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
 {
-	if ( table )
+	const char *cstr = OGR_F_GetFieldAsString(feat, col->ogrfldnum);
+	size_t cstr_len = cstr ? strlen(cstr) : 0;
+
+	if ( cstr_len == 0 )
 	{
-		if ( table->tblname ) pfree(table->tblname);
-		if ( table->cols ) pfree(table->cols);
-		pfree(table);
+		*isnull = true;
+		return;
 	}
-}
-
-typedef struct
-{
-	char *fldname;
-	int fldnum;
-} OgrFieldEntry;
 
-static int ogrFieldEntryCmpFunc(const void * a, const void * b)
-{
-	const char *a_name = ((OgrFieldEntry*)a)->fldname;
-	const char *b_name = ((OgrFieldEntry*)b)->fldname;
+	if ( execstate->ogr.lyr_utf8 )
+		cstr = pg_any_to_server(cstr, cstr_len, PG_UTF8);
 
-	return strcasecmp(a_name, b_name);
+	*value = InputFunctionCall((FmgrInfo *)&(col->pginputflinfo), (char *)cstr,
+	                           col->pginputioparam, col->pgtypmod);
 }
 
-
 /*
- * The execstate holds a foreign table relation id and an OGR connection,
- * this function finds all the OGR fields that match up to columns in the
- * foreign table definition, using columns name match and data type consistency
- * as the criteria for making a match.
- * The results of the matching are stored in the execstate before the function
- * returns.
+ * OGR date/times have a weird access method, so we use that to pull
+ * out the raw data and turn it into a string for PgSQL's (very
+ * sophisticated) date/time parsing routines to handle.
  */
 static void
-ogrReadColumnData(GisFdwState *state)
+ogrConvertDateTimeViaText(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
 {
-	Relation rel;
-	TupleDesc tupdesc;
-	int i;
-	OgrFdwTable *tbl;
-	OGRFeatureDefnH dfn;
-	int ogr_ncols;
-	int fid_count = 0;
-	int geom_count = 0;
-	int ogr_geom_count = 0;
-	int field_count = 0;
-	OgrFieldEntry *ogr_fields;
-	int ogr_fields_count = 0;
-	char *tblname = get_rel_name(state->foreigntableid);
+	int year, month, day, hour, minute, second, tz;
+	char cstr[256];
 
-	/* Blow away any existing table in the state */
-	if ( state->table )
+	OGR_F_GetFieldAsDateTime(feat, col->ogrfldnum,
+	                         &year, &month, &day,
+	                         &hour, &minute, &second, &tz);
+
+	if ( col->ogrfldtype == OFTDate )
 	{
-		freeOgrFdwTable(state->table);
-		state->table = NULL;
+		snprintf(cstr, 256, "%d-%02d-%02d", year, month, day);
+	}
+	else if ( col->ogrfldtype == OFTTime )
+	{
+		snprintf(cstr, 256, "%02d:%02d:%02d", hour, minute, second);
+	}
+	else
+	{
+		snprintf(cstr, 256, "%d-%02d-%02d %02d:%02d:%02d", year, month, day, hour, minute, second);
 	}
 
-	/* Fresh table */
-	tbl = palloc0(sizeof(OgrFdwTable));
+	*value = InputFunctionCall((FmgrInfo *)&(col->pginputflinfo), cstr,
+	                           col->pginputioparam, col->pgtypmod);
+}
 
-	/* One column for each PgSQL foreign table column */
-	rel = heap_open(state->foreigntableid, NoLock);
-	tupdesc = rel->rd_att;
-	state->tupdesc = tupdesc;
-	tbl->ncols = tupdesc->natts;
-	tbl->cols = palloc0(tbl->ncols * sizeof(OgrFdwColumn));
-	tbl->tblname = pstrdup(tblname);
+/*
+ * Build DATE, TIME and TIMESTAMP values straight from the OGR
+ * date/time parts.
+ */
+static void
+ogrConvertDateTime(const OGRFeatureH feat, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	struct pg_tm tm;
+	fsec_t fsec;
+	int tz;
+	Timestamp ts;
+#if GDAL_VERSION_MAJOR >= 2
+	float fsecond;
+#endif
 
-	/* Get OGR metadata ready */
-	dfn = OGR_L_GetLayerDefn(state->ogr.lyr);
-	ogr_ncols = OGR_FD_GetFieldCount(dfn);
-#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
-	ogr_geom_count = OGR_FD_GetGeomFieldCount(dfn);
+	memset(&tm, 0, sizeof(struct pg_tm));
+#if GDAL_VERSION_MAJOR >= 2
+	OGR_F_GetFieldAsDateTimeEx(feat, col->ogrfldnum,
+	                           &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+	                           &tm.tm_hour, &tm.tm_min, &fsecond, &tz);
+	tm.tm_sec = (int)fsecond;
+#if PG_VERSION_NUM >= 100000 || defined(HAVE_INT64_TIMESTAMP)
+	fsec = (fsec_t) rint((fsecond - tm.tm_sec) * USECS_PER_SEC);
 #else
-	ogr_geom_count = ( OGR_FD_GetGeomType(dfn) != wkbNone ) ? 1 : 0;
+	fsec = fsecond - tm.tm_sec;
+#endif
+#else
+	OGR_F_GetFieldAsDateTime(feat, col->ogrfldnum,
+	                         &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+	                         &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &tz);
+	fsec = 0;
 #endif
 
+	/* Times carry no date, pin them to the PgSQL epoch */
+	if ( col->ogrfldtype == OFTTime )
+	{
+		tm.tm_year = 2000;
+		tm.tm_mon = 1;
+		tm.tm_mday = 1;
+	}
 
-	/* Prepare sorted list of OGR column names */
-	/* TODO: change this to a hash table, to avoid repeated strcmp */
-	/* We will search both the original and laundered OGR field names for matches */
-	ogr_fields_count = 2 * ogr_ncols;
-	ogr_fields = palloc0(ogr_fields_count * sizeof(OgrFieldEntry));
-	for ( i = 0; i < ogr_ncols; i++ )
+	/* Leave anything odd for the input function to complain about */
+	if ( tm.tm_mon < 1 || tm.tm_mon > MONTHS_PER_YEAR ||
+	     tm.tm_mday < 1 || tm.tm_mday > 31 ||
+	     ! IS_VALID_JULIAN(tm.tm_year, tm.tm_mon, tm.tm_mday) ||
+	     (col->pgtype == DATEOID && col->ogrfldtype == OFTTime) )
 	{
-		char *fldname = pstrdup(OGR_Fld_GetNameRef(OGR_FD_GetFieldDefn(dfn, i)));
-		char *fldname_laundered = palloc(STR_MAX_LEN);
-		strncpy(fldname_laundered, fldname, STR_MAX_LEN);
-		ogrStringLaunder(fldname_laundered);
-		ogr_fields[2*i].fldname = fldname;
-		ogr_fields[2*i].fldnum = i;
-		ogr_fields[2*i+1].fldname = fldname_laundered;
-		ogr_fields[2*i+1].fldnum = i;
+		ogrConvertDateTimeViaText(feat, col, execstate, value, isnull);
+		return;
+	}
+
+	if ( col->pgtype == DATEOID )
+	{
+		*value = DateADTGetDatum(date2j(tm.tm_year, tm.tm_mon, tm.tm_mday) - POSTGRES_EPOCH_JDATE);
+		return;
 	}
-	qsort(ogr_fields, ogr_fields_count, sizeof(OgrFieldEntry), ogrFieldEntryCmpFunc);
 
+	if ( tm2timestamp(&tm, fsec, NULL, &ts) != 0 )
+		ogrRangeError("timestamp");
 
-	/* loop through foreign table columns */
-	for ( i = 0; i < tbl->ncols; i++ )
+	if ( col->pgtype == TIMEOID )
+		*value = DirectFunctionCall1(timestamp_time, TimestampGetDatum(ts));
+	else
+		*value = TimestampGetDatum(ts);
+}
+
+/*
+ * Pick the converter for a column. The OGR and PgSQL type
+ * pair has already been vetted by ogrCanConvertToPg.
+ */
+static OgrFdwConvertFunc
+ogrChooseConverter(const OgrFdwColumn *col)
+{
+	switch ( col->ogrvariant )
 	{
-		List *options;
-		ListCell *lc;
-		OgrFieldEntry *found_entry;
-		OgrFieldEntry entry;
+		case OGR_FID:
+			return ogrConvertFid;
+		case OGR_GEOMETRY:
+			return ogrConvertGeometry;
+		case OGR_FIELD:
+			break;
+		default:
+			return NULL;
+	}
 
-#if PG_VERSION_NUM >= 110000
-		Form_pg_attribute att_tuple = &tupdesc->attrs[i];
-#else
-		Form_pg_attribute att_tuple = tupdesc->attrs[i];
+	switch ( col->ogrfldtype )
+	{
+		case OFTBinary:
+			return ogrConvertBinary;
+		case OFTInteger:
+#if GDAL_VERSION_MAJOR >= 2
+		case OFTInteger64:
 #endif
-		OgrFdwColumn col = tbl->cols[i];
-		col.pgattnum = att_tuple->attnum;
-		col.pgtype = att_tuple->atttypid;
-		col.pgtypmod = att_tuple->atttypmod;
-		col.pgattisdropped = att_tuple->attisdropped;
+			switch ( col->pgtype )
+			{
+				case BOOLOID:    return ogrConvertIntToBool;
+				case INT2OID:    return ogrConvertIntToInt2;
+				case INT4OID:    return ogrConvertIntToInt4;
+				case INT8OID:    return ogrConvertIntToInt8;
+				case FLOAT4OID:  return ogrConvertIntToFloat4;
+				case FLOAT8OID:  return ogrConvertIntToFloat8;
+				case NUMERICOID: return ogrConvertIntToNumeric;
+				default:         return ogrConvertViaText;
+			}
+		case OFTReal:
+			switch ( col->pgtype )
+			{
+				case FLOAT4OID:  return ogrConvertRealToFloat4;
+				case FLOAT8OID:  return ogrConvertRealToFloat8;
+				case NUMERICOID: return ogrConvertRealToNumeric;
+				default:         return ogrConvertViaText;
+			}
+		case OFTString:
+			/* Length limited types still need their input function */
+			if ( col->pgtype == TEXTOID || (col->pgtype == VARCHAROID && col->pgtypmod < 0) )
+				return ogrConvertStringToText;
+			return ogrConvertViaText;
+		case OFTDate:
+		case OFTTime:
+		case OFTDateTime:
+			if ( col->pgtype == DATEOID || col->pgtype == TIMEOID || col->pgtype == TIMESTAMPOID )
+				return ogrConvertDateTime;
+			return ogrConvertDateTimeViaText;
+		default:
+			return NULL;
+	}
+}
+
+/*
+ * Collect the converters of the columns the scan has to fill,
+ * leaving out dropped, unmatched and unused ones, which stay NULL.
+ */
+static void
+ogrBuildConverterList(OgrFdwTable *tbl)
+{
+	int i;
+
+	if ( ! tbl->converters )
+		tbl->converters = palloc(sizeof(OgrFdwConverter) * (tbl->ncols + 1));
+
+	tbl->nconverters = 0;
+	for ( i = 0; i < tbl->ncols; i++ )
+	{
+		OgrFdwColumn *col = &(tbl->cols[i]);
 
-		/* Skip filling in any further metadata about dropped columns */
-		if ( col.pgattisdropped )
+		if ( col->pgattisdropped || col->pgattskip || ! col->convert )
 			continue;
 
-		/* Find the appropriate conversion functions */
-		getTypeInputInfo(col.pgtype, &col.pginputfunc, &col.pginputioparam);
-		getTypeBinaryInputInfo(col.pgtype, &col.pgrecvfunc, &col.pgrecvioparam);
-		getTypeOutputInfo(col.pgtype, &col.pgoutputfunc, &col.pgoutputvarlena);
-		getTypeBinaryOutputInfo(col.pgtype, &col.pgsendfunc, &col.pgsendvarlena);
+		tbl->converters[tbl->nconverters].func = col->convert;
+		tbl->converters[tbl->nconverters].attidx = i;
+		tbl->nconverters++;
+	}
+}
 
-		/* Get the PgSQL column name */
-		col.pgname = get_relid_attribute_name(rel->rd_id, att_tuple->attnum);
+/*
+ * Work out, once per scan, how each column gets converted:
+ * choose its converter, cache its input functions, and read
+ * the SRID out of any geometry typmod.
+ */
+static void
+ogrReadColumnConverters(OgrFdwTable *tbl)
+{
+	Oid typmodsridfunc = InvalidOid;
+	bool looked_up = false;
+	int i;
 
-		/* Handle FID first */
-		if ( strcaseeq(col.pgname, "fid") && (col.pgtype == INT4OID || col.pgtype == INT8OID) )
-		{
-			if ( fid_count >= 1 )
-				elog(ERROR, "FDW table '%s' includes more than one FID column", tblname);
+	for ( i = 0; i < tbl->ncols; i++ )
+	{
+		OgrFdwColumn *col = &(tbl->cols[i]);
 
-			col.ogrvariant = OGR_FID;
-			col.ogrfldnum = fid_count++;
-			tbl->cols[i] = col;
+		col->convert = NULL;
+		col->pgtypmodsrid = -1;
+
+		if ( col->pgattisdropped || col->ogrvariant == OGR_UNMATCHED )
 			continue;
-		}
 
-		/* If the OGR source has geometries, can we match them to Pg columns? */
-		/* We'll match to the first ones we find, irrespective of name */
-		if ( geom_count < ogr_geom_count && col.pgtype == GEOMETRYOID )
+		col->convert = ogrChooseConverter(col);
+		if ( ! col->convert )
 		{
-			col.ogrvariant = OGR_GEOMETRY;
-			col.ogrfldtype = OFTBinary;
-			col.ogrfldnum = geom_count++;
-			tbl->cols[i] = col;
-			continue;
+			if ( col->ogrvariant == OGR_FIELD )
+				elog(ERROR, "unsupported OGR type \"%s\"", OGR_GetFieldTypeName(col->ogrfldtype));
+			else
+				elog(ERROR, "OGR FDW unsupported column variant in \"%s\", %d", col->pgname, col->ogrvariant);
 		}
 
-		/* Now we search for matches in the OGR fields */
+		fmgr_info(col->pginputfunc, &(col->pginputflinfo));
 
-		/* By default, search for the PgSQL column name */
-		entry.fldname = col.pgname;
-		entry.fldnum = 0;
+		if ( col->ogrvariant != OGR_GEOMETRY || col->pgtype != GEOMETRYOID )
+			continue;
 
-		/*
-		 * But, if there is a 'column_name' option for this column, we
-		 * want to search for *that* in the OGR layer.
-		 */
-		options = GetForeignColumnOptions(state->foreigntableid, i + 1);
-		foreach(lc, options)
-		{
-			DefElem    *def = (DefElem *) lfirst(lc);
+		fmgr_info(col->pgrecvfunc, &(col->pgrecvflinfo));
 
-			if ( streq(def->defname, OPT_COLUMN) )
+		if ( col->pgtypmod >= 0 )
+		{
+			/* Collect the procedure Oid of the PostGIS function we need */
+			if ( ! looked_up )
 			{
-				entry.fldname = defGetString(def);
-				break;
+				typmodsridfunc = ogrLookupGeometryFunctionOid("postgis_typmod_srid");
+				looked_up = true;
 			}
+			if ( OidIsValid(typmodsridfunc) )
+				col->pgtypmodsrid = DatumGetInt32(OidFunctionCall1(typmodsridfunc, Int32GetDatum(col->pgtypmod)));
 		}
+	}
 
-		/* Search PgSQL column name in the OGR column name list */
-		found_entry = bsearch(&entry, ogr_fields, ogr_fields_count, sizeof(OgrFieldEntry), ogrFieldEntryCmpFunc);
+	ogrBuildConverterList(tbl);
+}
 
-		/* Column name matched, so save this entry, if the types are consistent */
-		if ( found_entry )
-		{
-			OGRFieldDefnH fld = OGR_FD_GetFieldDefn(dfn, found_entry->fldnum);
-			OGRFieldType fldtype = OGR_Fld_GetType(fld);
+/*
+* The gisIterateForeignScan is getting a new TupleTableSlot to handle
+* for each iteration. Each slot contains an entry for every column in
+* in the foreign table, that has to be filled out, either with a value
+* or a NULL for columns that either have been deleted or were not requested
+* in the query.
+*
+* The conversion plan was worked out when the scan began, so all
+* that's left here is to run the converter of each column the
+* query needs; everything else is left NULL.
+*/
+static OGRErr
+ogrFeatureToSlot(const OGRFeatureH feat, TupleTableSlot *slot, const GisFdwExecState *execstate)
+{
+	const OgrFdwTable *tbl = execstate->table;
+	const OgrFdwConverter *conv = tbl->converters;
+	const OgrFdwConverter *conv_end = conv + tbl->nconverters;
+	Datum *values = slot->tts_values;
+	bool *nulls = slot->tts_isnull;
 
-			/* Error if types mismatched when column names match */
-			ogrCanConvertToPg(fldtype, col.pgtype, col.pgname, tblname);
+	/* Check our assumption that slot and setup data match */
+	if ( tbl->ncols != slot->tts_tupleDescriptor->natts )
+	{
+		elog(ERROR, "FDW metadata table and exec table have mismatching number of columns");
+		return OGRERR_FAILURE;
+	}
 
-			col.ogrvariant = OGR_FIELD;
-			col.ogrfldnum = found_entry->fldnum;
-			col.ogrfldtype = fldtype;
-			field_count++;
-		}
-		else
+	memset(nulls, true, sizeof(bool) * tbl->ncols);
+
+	for ( ; conv < conv_end; conv++ )
+	{
+		const OgrFdwColumn *col = &(tbl->cols[conv->attidx]);
+
+		/* Only convert non-null fields */
+		if ( col->ogrvariant == OGR_FIELD )
 		{
-			col.ogrvariant = OGR_UNMATCHED;
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2,2,0)
+			if ( ! OGR_F_IsFieldSet(feat, col->ogrfldnum) || OGR_F_IsFieldNull(feat, col->ogrfldnum) )
+#else
+			if ( ! OGR_F_IsFieldSet(feat, col->ogrfldnum) )
+#endif
+				continue;
 		}
-		tbl->cols[i] = col;
+
+		nulls[conv->attidx] = false;
+		conv->func(feat, col, execstate, &(values[conv->attidx]), &(nulls[conv->attidx]));
 	}
 
-	elog(DEBUG2, "ogrReadColumnData matched %d FID, %d GEOM, %d FIELDS out of %d PGSQL COLUMNS", fid_count, geom_count, field_count, tbl->ncols);
+	/* done! */
+	return OGRERR_NONE;
+}
 
-	/* Clean up */
+#ifdef OGR_FDW_ARROW
 
-	state->table = tbl;
-	for( i = 0; i < 2*ogr_ncols; i++ )
-		if ( ogr_fields[i].fldname ) pfree(ogr_fields[i].fldname);
-	pfree(ogr_fields);
-	heap_close(rel, NoLock);
+/*
+ * Arrow batch reads
+ *
+ * With the batch_read 'arrow' table option, scans pull record
+ * batches through OGR_L_GetArrowStream, which honours the ignored
+ * fields and the filters set on the layer, and fill slots straight
+ * from the column buffers instead of going feature by feature.
+ */
 
-	return;
+#define OGR_FDW_ARROW_BATCH_SIZE "MAX_FEATURES_IN_BATCH=8192"
+#define OGR_FDW_ARROW_FID_NAME "OGC_FID"
+#define OGR_FDW_ARROW_GEOMETRY_NAME "wkb_geometry"
+
+typedef enum
+{
+	OGR_ARROW_UNSUPPORTED,
+	OGR_ARROW_BOOL,
+	OGR_ARROW_INT8,
+	OGR_ARROW_UINT8,
+	OGR_ARROW_INT16,
+	OGR_ARROW_UINT16,
+	OGR_ARROW_INT32,
+	OGR_ARROW_UINT32,
+	OGR_ARROW_INT64,
+	OGR_ARROW_FLOAT32,
+	OGR_ARROW_FLOAT64,
+	OGR_ARROW_STRING,
+	OGR_ARROW_LARGE_STRING,
+	OGR_ARROW_BINARY,
+	OGR_ARROW_LARGE_BINARY,
+	OGR_ARROW_DATE32,
+	OGR_ARROW_TIME32,
+	OGR_ARROW_TIMESTAMP
+} OgrArrowKind;
+
+typedef struct OgrFdwArrowColumn
+{
+	int attidx;            /* Table column (and slot) index */
+	int child;             /* Child array of the batch holding the column */
+	OgrArrowKind kind;     /* Storage of the child array */
+	int64 usecs;           /* Times: microseconds per stored unit */
+	int64 tzoffset;        /* Timestamps: microseconds from UTC to wall time */
+} OgrFdwArrowColumn;
+
+typedef struct OgrFdwArrowScan
+{
+	bool open;                     /* Stream and schema are live */
+	struct ArrowArrayStream stream;
+	struct ArrowSchema schema;
+	struct ArrowArray batch;       /* Current batch, live while batch.release is set */
+	int64 row;                     /* Next row of the current batch */
+	int ncols;
+	OgrFdwArrowColumn *cols;
+	MemoryContextCallback callback;
+} OgrFdwArrowScan;
+
+static void
+ogrArrowRelease(OgrFdwArrowScan *arrow)
+{
+	if ( ! arrow->open )
+		return;
+
+	if ( arrow->batch.release )
+		arrow->batch.release(&(arrow->batch));
+	if ( arrow->schema.release )
+		arrow->schema.release(&(arrow->schema));
+	if ( arrow->stream.release )
+		arrow->stream.release(&(arrow->stream));
+
+	memset(&(arrow->batch), 0, sizeof(struct ArrowArray));
+	memset(&(arrow->schema), 0, sizeof(struct ArrowSchema));
+	memset(&(arrow->stream), 0, sizeof(struct ArrowArrayStream));
+	arrow->open = false;
 }
 
 /*
- * ogrLookupGeometryFunctionOid
- *
- * Find the procedure Oids of useful functions so we can call
- * them later.
+ * GDAL owns the stream memory, so hand it back if the scan is
+ * torn down by an error rather than by ogrEndForeignScan.
  */
-static Oid
-ogrLookupGeometryFunctionOid(const char *proname)
+static void
+ogrArrowReleaseCallback(void *arg)
 {
-	List *names;
-	FuncCandidateList clist;
+	ogrArrowRelease((OgrFdwArrowScan *) arg);
+}
 
-	/* This only works if PostGIS is installed */
-	if ( GEOMETRYOID == InvalidOid || GEOMETRYOID == BYTEAOID )
-		return InvalidOid;
+static void
+ogrArrowError(OgrFdwArrowScan *arrow, const char *errstr)
+{
+	const char *arrowerr = arrow->stream.get_last_error ? arrow->stream.get_last_error(&(arrow->stream)) : NULL;
+	if ( arrowerr && ! streq(arrowerr, "") )
+	{
+		ereport(ERROR,
+			(errcode(ERRCODE_FDW_ERROR),
+			 errmsg("%s", errstr),
+			 errhint("%s", arrowerr)));
+	}
+	ogrEreportError(errstr);
+}
 
-	names = stringToQualifiedNameList(proname);
-#if PG_VERSION_NUM < 90400
-	clist = FuncnameGetCandidates(names, -1, NIL, false, false);
-#else
-	clist = FuncnameGetCandidates(names, -1, NIL, false, false, false);
-#endif
-	if ( streq(proname, "st_setsrid") )
+/*
+ * Timezone of an Arrow timestamp, as microseconds to add to the
+ * stored UTC value to get the wall time OGR would have reported.
+ */
+static int64
+ogrArrowTzOffset(const char *tz)
+{
+	char sign;
+	int hours, minutes;
+
+	if ( tz && sscanf(tz, "%c%d:%d", &sign, &hours, &minutes) == 3 && (sign == '+' || sign == '-') )
+		return (sign == '-' ? -1 : 1) * ((int64)hours * SECS_PER_HOUR + minutes * SECS_PER_MINUTE) * USECS_PER_SEC;
+
+	/* No timezone, UTC or a named zone, leave the values as they are */
+	return 0;
+}
+
+static OgrArrowKind
+ogrArrowKind(const char *format, OgrFdwArrowColumn *acol)
+{
+	acol->usecs = 1;
+	acol->tzoffset = 0;
+
+	if ( streq(format, "b") ) return OGR_ARROW_BOOL;
+	if ( streq(format, "c") ) return OGR_ARROW_INT8;
+	if ( streq(format, "C") ) return OGR_ARROW_UINT8;
+	if ( streq(format, "s") ) return OGR_ARROW_INT16;
+	if ( streq(format, "S") ) return OGR_ARROW_UINT16;
+	if ( streq(format, "i") ) return OGR_ARROW_INT32;
+	if ( streq(format, "I") ) return OGR_ARROW_UINT32;
+	if ( streq(format, "l") ) return OGR_ARROW_INT64;
+	if ( streq(format, "f") ) return OGR_ARROW_FLOAT32;
+	if ( streq(format, "g") ) return OGR_ARROW_FLOAT64;
+	if ( streq(format, "u") ) return OGR_ARROW_STRING;
+	if ( streq(format, "U") ) return OGR_ARROW_LARGE_STRING;
+	if ( streq(format, "z") ) return OGR_ARROW_BINARY;
+	if ( streq(format, "Z") ) return OGR_ARROW_LARGE_BINARY;
+	if ( streq(format, "tdD") ) return OGR_ARROW_DATE32;
+	if ( streq(format, "tts") || streq(format, "ttm") )
 	{
-		do
+		acol->usecs = ( format[2] == 's' ) ? USECS_PER_SEC : 1000;
+		return OGR_ARROW_TIME32;
+	}
+	if ( strncmp(format, "ts", 2) == 0 && format[2] && format[3] == ':' )
+	{
+		switch ( format[2] )
 		{
-			int i;
-			for ( i = 0; i < clist->nargs; i++ )
-			{
-				if ( clist->args[i] == GEOMETRYOID )
-					return clist->oid;
-			}
+			case 's': acol->usecs = USECS_PER_SEC; break;
+			case 'm': acol->usecs = 1000; break;
+			case 'u': acol->usecs = 1; break;
+			default: return OGR_ARROW_UNSUPPORTED;
 		}
-		while( (clist = clist->next) );
+		acol->tzoffset = ogrArrowTzOffset(format + 4);
+		return OGR_ARROW_TIMESTAMP;
 	}
-	else if ( streq(proname, "postgis_typmod_srid") )
+	return OGR_ARROW_UNSUPPORTED;
+}
+
+/*
+ * Name GDAL gives a column in the Arrow schema.
+ */
+static const char *
+ogrArrowColumnName(OGRLayerH lyr, const OgrFdwColumn *col)
+{
+	OGRFeatureDefnH dfn = OGR_L_GetLayerDefn(lyr);
+	const char *name;
+
+	switch ( col->ogrvariant )
 	{
-		return clist->oid;
+		case OGR_FID:
+			name = OGR_L_GetFIDColumn(lyr);
+			return ( name && *name ) ? name : OGR_FDW_ARROW_FID_NAME;
+		case OGR_GEOMETRY:
+			name = OGR_GFld_GetNameRef(OGR_FD_GetGeomFieldDefn(dfn, col->ogrfldnum));
+			return ( name && *name ) ? name : OGR_FDW_ARROW_GEOMETRY_NAME;
+		default:
+			return OGR_Fld_GetNameRef(OGR_FD_GetFieldDefn(dfn, col->ogrfldnum));
 	}
-
-	return InvalidOid;
 }
 
-
 /*
- * gisBeginForeignScan
+ * Open the Arrow stream on the layer and find the child array of
+ * every column the scan fills. Returns false, with the stream
+ * released, when the stream doesn't carry the columns in a form
+ * we read, in which case the scan goes feature by feature.
  */
-static void
-gisBeginForeignScan(ForeignScanState *node, int eflags)
+static bool
+ogrArrowOpen(GisFdwExecState *execstate)
 {
-	Oid foreigntableid = RelationGetRelid(node->ss.ss_currentRelation);
-	ForeignScan *fsplan = (ForeignScan *)node->ss.ps.plan;
-
-	/* Initialize OGR connection */
-	GisFdwState *state = getGisFdwState(foreigntableid, GIS_EXEC_STATE);
-	GisFdwExecState *execstate = (GisFdwExecState *)state;
+	OgrFdwArrowScan *arrow = execstate->arrow;
+	const OgrFdwTable *tbl = execstate->table;
+	OGRLayerH lyr = execstate->ogr.lyr;
+	char **options = NULL;
+	bool include_fid = false;
+	int i, j;
 
-	if (state->isRaster) {
-	    rasterBeginForeignScan(node, eflags, execstate);
-	} else {
-	    /* Read the OGR layer definition and PgSQL foreign table definitions */
-	    ogrReadColumnData(state);
+	for ( i = 0; i < tbl->nconverters; i++ )
+	{
+		if ( tbl->cols[tbl->converters[i].attidx].ogrvariant == OGR_FID )
+			include_fid = true;
+	}
+	options = CSLAddString(options, include_fid ? "INCLUDE_FID=YES" : "INCLUDE_FID=NO");
+	options = CSLAddString(options, OGR_FDW_ARROW_BATCH_SIZE);
 
-	    /* Collect the procedure Oids for PostGIS functions we might need */
-	    execstate->setsridfunc = ogrLookupGeometryFunctionOid("st_setsrid");
-	    execstate->typmodsridfunc = ogrLookupGeometryFunctionOid("postgis_typmod_srid");
+	memset(&(arrow->stream), 0, sizeof(struct ArrowArrayStream));
+	if ( ! OGR_L_GetArrowStream(lyr, &(arrow->stream), options) )
+	{
+		CSLDestroy(options);
+		ogrEreportError("unable to read OGR layer as an Arrow stream");
+	}
+	CSLDestroy(options);
+	arrow->open = true;
 
-	    /* Get private info created by planner functions. */
-	    execstate->sql = strVal(list_nth(fsplan->fdw_private, 0));
-	    // execstate->retrieved_attrs = (List *) list_nth(fsplan->fdw_private, 1);
+	if ( arrow->stream.get_schema(&(arrow->stream), &(arrow->schema)) != 0 )
+		ogrArrowError(arrow, "unable to read Arrow schema of OGR layer");
 
-	    if ( execstate->sql && strlen(execstate->sql) > 0 )
-	    {
-		OGRErr err = OGR_L_SetAttributeFilter(execstate->ogr.lyr, execstate->sql);
-		if ( err != OGRERR_NONE )
+	arrow->ncols = 0;
+	for ( i = 0; i < tbl->nconverters; i++ )
+	{
+		const OgrFdwColumn *col = &(tbl->cols[tbl->converters[i].attidx]);
+		OgrFdwArrowColumn *acol = &(arrow->cols[arrow->ncols]);
+		const char *name = ogrArrowColumnName(lyr, col);
+
+		acol->attidx = tbl->converters[i].attidx;
+		acol->child = -1;
+		acol->kind = OGR_ARROW_UNSUPPORTED;
+		for ( j = 0; j < arrow->schema.n_children; j++ )
 		{
-		    const char *ogrerr = CPLGetLastErrorMsg();
+			if ( streq(arrow->schema.children[j]->name, name) )
+			{
+				acol->child = j;
+				acol->kind = ogrArrowKind(arrow->schema.children[j]->format, acol);
+				break;
+			}
+		}
 
-		    if ( ogrerr && ! streq(ogrerr,"") )
-		    {
-			ereport(NOTICE,
-				(errcode(ERRCODE_FDW_ERROR),
-				 errmsg("unable to set OGR SQL '%s' on layer", execstate->sql),
-				 errhint("%s", ogrerr)));
-		    }
-		    else
-		    {
-			ereport(NOTICE,
-				(errcode(ERRCODE_FDW_ERROR),
-				 errmsg("unable to set OGR SQL '%s' on layer", execstate->sql)));
-		    }
+		if ( acol->kind == OGR_ARROW_UNSUPPORTED ||
+		     (col->ogrvariant == OGR_GEOMETRY && acol->kind != OGR_ARROW_BINARY && acol->kind != OGR_ARROW_LARGE_BINARY) )
+		{
+			elog(DEBUG1, "OGR Arrow stream has no readable column \"%s\" for \"%s\"", name, col->pgname);
+			ogrArrowRelease(arrow);
+			return false;
 		}
-	    }
-	    else
-	    {
-		OGR_L_SetAttributeFilter(execstate->ogr.lyr, NULL);
-	    }
+		arrow->ncols++;
 	}
 
-	/* Save the state for the next call */
-	node->fdw_state = (void *) execstate;
-
-	return;
+	elog(DEBUG1, "reading OGR layer \"%s\" as an Arrow stream", execstate->ogr.lyr_str);
+	arrow->row = 0;
+	return true;
 }
 
-/*
- * Rather than explicitly try and form PgSQL datums, use the type
- * input functions, that accept cstring representations, and convert
- * to the input format. We have to lookup the right input function for
- * each column in the foreign table.
- */
 static Datum
-pgDatumFromCString(const char *cstr, Oid pgtype, int pgtypmod, Oid pginputfunc)
+ogrInt64ToDatum(int64 val, const OgrFdwColumn *col)
 {
-	Datum value;
-	Datum cdata = CStringGetDatum(cstr);
+	char cstr[32];
 
-	value = OidFunctionCall3(pginputfunc, cdata,
-		ObjectIdGetDatum(InvalidOid),
-		Int32GetDatum(pgtypmod));
-
-	return value;
+	switch ( col->pgtype )
+	{
+		case BOOLOID:
+			return BoolGetDatum(val != 0);
+		case INT2OID:
+			if ( val < SHRT_MIN || val > SHRT_MAX )
+				ogrRangeError("smallint");
+			return Int16GetDatum((int16)val);
+		case INT4OID:
+			if ( val < INT_MIN || val > INT_MAX )
+				ogrRangeError("integer");
+			return Int32GetDatum((int32)val);
+		case INT8OID:
+			return Int64GetDatum(val);
+		case FLOAT4OID:
+			return Float4GetDatum((float4)val);
+		case FLOAT8OID:
+			return Float8GetDatum((float8)val);
+		case NUMERICOID:
+			return ogrNumericTypmod(DirectFunctionCall1(int8_numeric, Int64GetDatum(val)), col->pgtypmod);
+		default:
+			snprintf(cstr, sizeof(cstr), OGR_FDW_FRMT_INT64, OGR_FDW_CAST_INT64(val));
+			return InputFunctionCall((FmgrInfo *)&(col->pginputflinfo), cstr, col->pginputioparam, col->pgtypmod);
+	}
 }
 
-static inline void
-ogrNullSlot(Datum *values, bool *nulls, int i)
+static Datum
+ogrDoubleToDatum(double val, const OgrFdwColumn *col)
 {
-	values[i] = PointerGetDatum(NULL);
-	nulls[i] = true;
+	char cstr[512];
+	Datum num;
+
+	switch ( col->pgtype )
+	{
+		case FLOAT4OID:
+			if ( isinf((float4)val) && ! isinf(val) )
+				ogrRangeError("real");
+			return Float4GetDatum((float4)val);
+		case FLOAT8OID:
+			return Float8GetDatum(val);
+		case NUMERICOID:
+			num = DirectFunctionCall1(float8_numeric, Float8GetDatum(val));
+			if ( col->ogrfldscale >= 0 )
+				num = ogrNumericTypmod(num, ((NUMERIC_MAX_PRECISION << 16) | col->ogrfldscale) + VARHDRSZ);
+			return ogrNumericTypmod(num, col->pgtypmod);
+		default:
+			/* Format like OGR_F_GetFieldAsString would */
+			if ( col->ogrfldscale >= 0 )
+				snprintf(cstr, sizeof(cstr), "%.*f", col->ogrfldscale, val);
+			else
+				snprintf(cstr, sizeof(cstr), "%.15g", val);
+			return InputFunctionCall((FmgrInfo *)&(col->pginputflinfo), cstr, col->pginputioparam, col->pgtypmod);
+	}
 }
 
-/*
-* The gisIterateForeignScan is getting a new TupleTableSlot to handle
-* for each iteration. Each slot contains an entry for every column in
-* in the foreign table, that has to be filled out, either with a value
-* or a NULL for columns that either have been deleted or were not requested
-* in the query.
-*
-* The tupledescriptor tells us about the types of each slot.
-* For now we assume our slot has exactly the same number of
-* records and equivalent types to our OGR layer, and that our
-* foreign table's first two columns are an integer primary key
-* using int8 as the type, and then a geometry using bytea as
-* the type, then everything else.
-*/
-static OGRErr
-ogrFeatureToSlot(const OGRFeatureH feat, TupleTableSlot *slot, const GisFdwExecState *execstate)
+static Datum
+ogrTimestampToDatum(Timestamp ts, const OgrFdwColumn *col)
 {
-	const OgrFdwTable *tbl = execstate->table;
-	int i;
-	Datum *values = slot->tts_values;
-	bool *nulls = slot->tts_isnull;
-	TupleDesc tupdesc = slot->tts_tupleDescriptor;
-	int have_typmod_funcs = (execstate->setsridfunc && execstate->typmodsridfunc);
+	char *cstr;
 
-	/* Check our assumption that slot and setup data match */
-	if ( tbl->ncols != tupdesc->natts )
+	switch ( col->pgtype )
 	{
-		elog(ERROR, "FDW metadata table and exec table have mismatching number of columns");
-		return OGRERR_FAILURE;
+		case TIMESTAMPOID:
+			return TimestampGetDatum(ts);
+		case DATEOID:
+			return DirectFunctionCall1(timestamp_date, TimestampGetDatum(ts));
+		case TIMEOID:
+			return DirectFunctionCall1(timestamp_time, TimestampGetDatum(ts));
+		default:
+			if ( col->ogrfldtype == OFTDate )
+				cstr = DatumGetCString(DirectFunctionCall1(date_out, DirectFunctionCall1(timestamp_date, TimestampGetDatum(ts))));
+			else if ( col->ogrfldtype == OFTTime )
+				cstr = DatumGetCString(DirectFunctionCall1(time_out, DirectFunctionCall1(timestamp_time, TimestampGetDatum(ts))));
+			else
+				cstr = DatumGetCString(DirectFunctionCall1(timestamp_out, TimestampGetDatum(ts)));
+			return InputFunctionCall((FmgrInfo *)&(col->pginputflinfo), cstr, col->pginputioparam, col->pgtypmod);
 	}
+}
 
-	/* For each pgtable column, get a value from OGR */
-	for ( i = 0; i < tbl->ncols; i++ )
+/*
+ * Strings, binary fields and WKB geometries.
+ */
+static void
+ogrArrowBytesToDatum(const char *data, size_t len, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	if ( col->ogrvariant == OGR_GEOMETRY && col->pgtype != BYTEAOID )
 	{
-		OgrFdwColumn col = tbl->cols[i];
-		const char *pgname = col.pgname;
-		Oid pgtype = col.pgtype;
-		int pgtypmod = col.pgtypmod;
-		Oid pginputfunc = col.pginputfunc;
-		int ogrfldnum = col.ogrfldnum;
-		OGRFieldType ogrfldtype = col.ogrfldtype;
-		OgrColumnVariant ogrvariant = col.ogrvariant;
+		enlargeStringInfo(execstate->geombuf, len + 4);
+		memcpy(execstate->geombuf->data + 4, data, len);
+		*value = ogrGeometryFromBuffer(col, execstate, len);
+	}
+	else if ( col->ogrvariant == OGR_GEOMETRY || col->ogrfldtype == OFTBinary )
+	{
+		bytea *varlena = palloc(len + VARHDRSZ);
+		memcpy(VARDATA(varlena), data, len);
+		SET_VARSIZE(varlena, len + VARHDRSZ);
+		*value = PointerGetDatum(varlena);
+	}
+	else
+	{
+		const char *cstr = data;
 
-		/*
-		 * Fill in dropped attributes with NULL
-		 */
-		if ( col.pgattisdropped )
+		if ( len == 0 )
 		{
-			ogrNullSlot(values, nulls, i);
-			continue;
+			*isnull = true;
+			return;
 		}
 
-		if ( ogrvariant == OGR_FID )
+		/* Validate OGR's UTF8, or convert it */
+		if ( execstate->ogr.lyr_utf8 )
 		{
-			GIntBig fid = OGR_F_GetFID(feat);
-
-			if ( fid == OGRNullFID )
-			{
-				ogrNullSlot(values, nulls, i);
-			}
-			else
-			{
-				char fidstr[256];
-				snprintf(fidstr, 256, OGR_FDW_FRMT_INT64, OGR_FDW_CAST_INT64(fid));
-
-				nulls[i] = false;
-				values[i] = pgDatumFromCString(fidstr, pgtype, pgtypmod, pginputfunc);
-			}
+			cstr = pg_any_to_server(data, len, PG_UTF8);
+			if ( cstr != data )
+				len = strlen(cstr);
 		}
-		else if ( ogrvariant == OGR_GEOMETRY )
-		{
-			int wkbsize;
-			int varsize;
-			bytea *varlena;
-			unsigned char *wkb;
-			OGRErr err;
 
-#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
-			OGRGeometryH geom = OGR_F_GetGeomFieldRef(feat, ogrfldnum);
-#else
-			OGRGeometryH geom = OGR_F_GetGeometryRef(feat);
-#endif
-
-			/* No geometry ? NULL */
-			if ( ! geom )
-			{
-				/* No geometry column, so make the output null */
-				ogrNullSlot(values, nulls, i);
-				continue;
-			}
-
-			/*
-			 * Start by generating standard PgSQL variable length byte
-			 * buffer, with WKB filled into the data area.
-			 */
-			wkbsize = OGR_G_WkbSize(geom);
-			varsize = wkbsize + VARHDRSZ;
-			varlena = palloc(varsize);
-			wkb = (unsigned char *)VARDATA(varlena);
-			err = OGR_G_ExportToWkb(geom, wkbNDR, wkb);
-			SET_VARSIZE(varlena, varsize);
-
-			/* Couldn't create WKB from OGR geometry? error */
-			if ( err != OGRERR_NONE )
-			{
-				return err;
-			}
+		if ( col->pgtype == TEXTOID || (col->pgtype == VARCHAROID && col->pgtypmod < 0) )
+			*value = PointerGetDatum(cstring_to_text_with_len(cstr, len));
+		else
+			*value = InputFunctionCall((FmgrInfo *)&(col->pginputflinfo), pnstrdup(cstr, len),
+			                           col->pginputioparam, col->pgtypmod);
+	}
+}
 
-			if ( pgtype == BYTEAOID )
-			{
-				/*
-				 * Nothing special to do for bytea, just send the varlena data through!
-				 */
-				nulls[i] = false;
-				values[i] = PointerGetDatum(varlena);
-			}
-			else if ( pgtype == GEOMETRYOID )
-			{
-				/*
-				 * For geometry we need to convert the varlena WKB data into a serialized
-				 * geometry (aka "gserialized"). For that, we can use the type's "recv" function
-				 * which takes in WKB and spits out serialized form, or the "input" function
-				 * that takes in HEXWKB. The "input" function is more lax about geometry
-				 * structure errors (unclosed polys, etc).
-				 */
-#ifdef OGR_FDW_HEXWKB
-				char *hexwkb = ogrBytesToHex(wkb, wkbsize);
-				/*
-				 * Use the input function to convert the WKB from OGR into
-				 * a PostGIS internal format.
-				 */
-				nulls[i] = false;
-				values[i] = OidFunctionCall1(col.pginputfunc, PointerGetDatum(hexwkb));
-				pfree(hexwkb);
-#else
-				/*
-				 * The "recv" function expects to receive a StringInfo pointer
-				 * on the first argument, so we form one of those ourselves by
-				 * hand. Rather than copy into a fresh buffer, we'll just use the
-				 * existing varlena buffer and point to the data area.
-				 *
-				 * The "recv" function tests for basic geometry validity,
-				 * things like polygon closure, etc. So don't feed it junk.
-				 */
-				StringInfoData strinfo;
-				strinfo.data = (char *)wkb;
-				strinfo.len = wkbsize;
-				strinfo.maxlen = strinfo.len;
-				strinfo.cursor = 0;
-
-				/*
-				 * Use the recv function to convert the WKB from OGR into
-				 * a PostGIS internal format.
-				 */
-				nulls[i] = false;
-				values[i] = OidFunctionCall1(col.pgrecvfunc, PointerGetDatum(&strinfo));
-#endif
-
-				/*
-				 * Apply the typmod restriction to the incoming geometry, so it's
-				 * not really a restriction anymore, it's more like a requirement.
-				 *
-				 * TODO: In the case where the OGR input actually *knows* what SRID
-				 * it is, we should actually apply *that* and let the restriction run
-				 * its usual course.
-				 */
-				if ( have_typmod_funcs && col.pgtypmod >= 0 )
-				{
-					Datum srid = OidFunctionCall1(execstate->typmodsridfunc, Int32GetDatum(col.pgtypmod));
-					values[i] = OidFunctionCall2(execstate->setsridfunc, values[i], srid);
-				}
-			}
-			else
-			{
-				elog(NOTICE, "conversion to geometry called with column type not equal to bytea or geometry");
-				ogrNullSlot(values, nulls, i);
-			}
+static void
+ogrArrowToDatum(const OgrFdwArrowColumn *acol, const struct ArrowArray *arr, int64 i, const OgrFdwColumn *col, const GisFdwExecState *execstate, Datum *value, bool *isnull)
+{
+	const void *buf = arr->buffers[1];
 
-		}
-		else if ( ogrvariant == OGR_FIELD )
+	switch ( acol->kind )
+	{
+		case OGR_ARROW_BOOL:
+			*value = ogrInt64ToDatum((((const uint8 *)buf)[i >> 3] >> (i & 7)) & 1, col);
+			break;
+		case OGR_ARROW_INT8:
+			*value = ogrInt64ToDatum(((const int8 *)buf)[i], col);
+			break;
+		case OGR_ARROW_UINT8:
+			*value = ogrInt64ToDatum(((const uint8 *)buf)[i], col);
+			break;
+		case OGR_ARROW_INT16:
+			*value = ogrInt64ToDatum(((const int16 *)buf)[i], col);
+			break;
+		case OGR_ARROW_UINT16:
+			*value = ogrInt64ToDatum(((const uint16 *)buf)[i], col);
+			break;
+		case OGR_ARROW_INT32:
+			*value = ogrInt64ToDatum(((const int32 *)buf)[i], col);
+			break;
+		case OGR_ARROW_UINT32:
+			*value = ogrInt64ToDatum(((const uint32 *)buf)[i], col);
+			break;
+		case OGR_ARROW_INT64:
 		{
-#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2,2,0)
-			int field_not_null = OGR_F_IsFieldSet(feat, ogrfldnum) && ! OGR_F_IsFieldNull(feat, ogrfldnum);
-#else
-			int field_not_null = OGR_F_IsFieldSet(feat, ogrfldnum);
-#endif
-
-			/* Ensure that the OGR data type fits the destination Pg column */
-			ogrCanConvertToPg(ogrfldtype, pgtype, pgname, tbl->tblname);
-
-			/* Only convert non-null fields */
-			if ( field_not_null )
-			{
-				switch(ogrfldtype)
-				{
-					case OFTBinary:
-					{
-						/*
-						 * Convert binary fields to bytea directly
-						 */
-						int bufsize;
-						GByte *buf = OGR_F_GetFieldAsBinary(feat, ogrfldnum, &bufsize);
-						int varsize = bufsize + VARHDRSZ;
-						bytea *varlena = palloc(varsize);
-						memcpy(VARDATA(varlena), buf, bufsize);
-						SET_VARSIZE(varlena, varsize);
-						nulls[i] = false;
-						values[i] = PointerGetDatum(varlena);
-						break;
-					}
-					case OFTInteger:
-					case OFTReal:
-					case OFTString:
-#if GDAL_VERSION_MAJOR >= 2
-					case OFTInteger64:
-#endif
-					{
-						/*
-						 * Convert numbers and strings via a string representation.
-						 * Handling numbers directly would be faster, but require a lot of extra code.
-						 * For now, we go via text.
-						 */
-						const char *cstr_in = OGR_F_GetFieldAsString(feat, ogrfldnum);
-						size_t cstr_len = cstr_in ? strlen(cstr_in) : 0;
-						if ( cstr_in && cstr_len > 0 )
-						{
-							char *cstr_decoded;
-							if(execstate->ogr.lyr_utf8)
-								cstr_decoded = pg_any_to_server(cstr_in, cstr_len, PG_UTF8);
-							else
-								cstr_decoded = pstrdup(cstr_in);
-							nulls[i] = false;
-							values[i] = pgDatumFromCString(cstr_decoded, pgtype, pgtypmod, pginputfunc);
-						}
-						else
-						{
-							ogrNullSlot(values, nulls, i);
-						}
-						break;
-					}
-					case OFTDate:
-					case OFTTime:
-					case OFTDateTime:
-					{
-						/*
-						 * OGR date/times have a weird access method, so we use that to pull
-						 * out the raw data and turn it into a string for PgSQL's (very
-						 * sophisticated) date/time parsing routines to handle.
-						 */
-						int year, month, day, hour, minute, second, tz;
-						char cstr[256];
-
-						OGR_F_GetFieldAsDateTime(feat, ogrfldnum,
-						                         &year, &month, &day,
-						                         &hour, &minute, &second, &tz);
-
-						if ( ogrfldtype == OFTDate )
-						{
-							snprintf(cstr, 256, "%d-%02d-%02d", year, month, day);
-						}
-						else if ( ogrfldtype == OFTTime )
-						{
-							snprintf(cstr, 256, "%02d:%02d:%02d", hour, minute, second);
-						}
-						else
-						{
-							snprintf(cstr, 256, "%d-%02d-%02d %02d:%02d:%02d", year, month, day, hour, minute, second);
-						}
-						nulls[i] = false;
-						values[i] = pgDatumFromCString(cstr, pgtype, pgtypmod, pginputfunc);
-						break;
-
-					}
-					case OFTIntegerList:
-					case OFTRealList:
-					case OFTStringList:
-					{
-						/* TODO, map these OGR array types into PgSQL arrays (fun!) */
-						elog(ERROR, "unsupported OGR array type \"%s\"", OGR_GetFieldTypeName(ogrfldtype));
-						break;
-					}
-					default:
-					{
-						elog(ERROR, "unsupported OGR type \"%s\"", OGR_GetFieldTypeName(ogrfldtype));
-						break;
-					}
-
-				}
-			}
+			int64 val = ((const int64 *)buf)[i];
+			if ( col->ogrvariant == OGR_FID && val == OGRNullFID )
+				*isnull = true;
 			else
-			{
-				ogrNullSlot(values, nulls, i);
-			}
+				*value = ogrInt64ToDatum(val, col);
+			break;
 		}
-		/* Fill in unmatched columns with NULL */
-		else if ( ogrvariant == OGR_UNMATCHED )
+		case OGR_ARROW_FLOAT32:
+			*value = ogrDoubleToDatum(((const float *)buf)[i], col);
+			break;
+		case OGR_ARROW_FLOAT64:
+			*value = ogrDoubleToDatum(((const double *)buf)[i], col);
+			break;
+		case OGR_ARROW_STRING:
+		case OGR_ARROW_BINARY:
 		{
-			ogrNullSlot(values, nulls, i);
+			const int32 *offsets = buf;
+			ogrArrowBytesToDatum((const char *)arr->buffers[2] + offsets[i],
+			                     offsets[i+1] - offsets[i], col, execstate, value, isnull);
+			break;
 		}
-		else
+		case OGR_ARROW_LARGE_STRING:
+		case OGR_ARROW_LARGE_BINARY:
 		{
-			elog(ERROR, "OGR FDW unsupported column variant in \"%s\", %d", pgname, ogrvariant);
-			return OGRERR_FAILURE;
+			const int64 *offsets = buf;
+			ogrArrowBytesToDatum((const char *)arr->buffers[2] + offsets[i],
+			                     offsets[i+1] - offsets[i], col, execstate, value, isnull);
+			break;
 		}
+		case OGR_ARROW_DATE32:
+			*value = ogrTimestampToDatum(((int64)((const int32 *)buf)[i] - (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE)) * USECS_PER_DAY, col);
+			break;
+		case OGR_ARROW_TIME32:
+			/* Times carry no date, pin them to the PgSQL epoch */
+			*value = ogrTimestampToDatum((int64)((const int32 *)buf)[i] * acol->usecs, col);
+			break;
+		case OGR_ARROW_TIMESTAMP:
+			*value = ogrTimestampToDatum(((const int64 *)buf)[i] * acol->usecs + acol->tzoffset -
+			                             (int64)(POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY, col);
+			break;
+		default:
+			elog(ERROR, "unsupported Arrow column for \"%s\"", col->pgname);
+	}
+}
+
+/*
+ * Fill the slot from the next row of the current batch, fetching
+ * a new batch when it runs out. Returns false at the end of the stream.
+ */
+static bool
+ogrArrowNextRow(GisFdwExecState *execstate, TupleTableSlot *slot)
+{
+	OgrFdwArrowScan *arrow = execstate->arrow;
+	const OgrFdwTable *tbl = execstate->table;
+	Datum *values = slot->tts_values;
+	bool *nulls = slot->tts_isnull;
+	int i;
+
+	while ( ! arrow->batch.release || arrow->row >= arrow->batch.length )
+	{
+		if ( arrow->batch.release )
+			arrow->batch.release(&(arrow->batch));
+		memset(&(arrow->batch), 0, sizeof(struct ArrowArray));
+		arrow->row = 0;
+
+		if ( arrow->stream.get_next(&(arrow->stream), &(arrow->batch)) != 0 )
+			ogrArrowError(arrow, "failure reading OGR data source");
 
+		/* No more batches */
+		if ( ! arrow->batch.release )
+			return false;
 	}
 
-	/* done! */
-	return OGRERR_NONE;
+	memset(nulls, true, sizeof(bool) * tbl->ncols);
+
+	for ( i = 0; i < arrow->ncols; i++ )
+	{
+		const OgrFdwArrowColumn *acol = &(arrow->cols[i]);
+		const struct ArrowArray *arr = arrow->batch.children[acol->child];
+		const uint8 *validity = arr->buffers[0];
+		int64 idx = arr->offset + arrow->batch.offset + arrow->row;
+
+		if ( arr->null_count != 0 && validity && ! (validity[idx >> 3] & (1 << (idx & 7))) )
+			continue;
+
+		nulls[acol->attidx] = false;
+		ogrArrowToDatum(acol, arr, idx, &(tbl->cols[acol->attidx]), execstate,
+		                &(values[acol->attidx]), &(nulls[acol->attidx]));
+	}
+
+	arrow->row++;
+	return true;
+}
+
+/*
+ * Set up Arrow reads for a scan. The stream itself is only opened
+ * on the first fetch, once the columns to read are known.
+ */
+static void
+ogrArrowBeginScan(GisFdwExecState *execstate)
+{
+	OgrFdwArrowScan *arrow = palloc0(sizeof(OgrFdwArrowScan));
+
+	arrow->cols = palloc(sizeof(OgrFdwArrowColumn) * (execstate->table->ncols + 1));
+	arrow->callback.func = ogrArrowReleaseCallback;
+	arrow->callback.arg = arrow;
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, &(arrow->callback));
+	execstate->arrow = arrow;
 }
 
+#endif /* OGR_FDW_ARROW */
+
 static void ogrStaticText(char *text, const char *str)
 {
 	size_t len = strlen(str);
@@ -1790,7 +5441,7 @@ static void ogrStaticText(char *text, const char *str)
  * there, we want to over-write it, and remove the SRID flag, to
  * generate more "standard" WKB for OGR to consume.
  */
-static size_t
+size_t
 ogrEwkbStripSrid(unsigned char *wkb, size_t wkbsize)
 {
 	unsigned int type = 0;
@@ -2066,30 +5717,316 @@ ogrSlotToFeature(const TupleTableSlot *slot, OGRFeatureH feat, const OgrFdwTable
 					break;
 				}
 
-				/* TODO: array types for string, integer, float */
-				default:
-				{
-					elog(ERROR, "OGR FDW unsupported PgSQL column type in \"%s\", %d", pgname, pgtype);
-					return OGRERR_FAILURE;
-				}
-			}
+				/* TODO: array types for string, integer, float */
+				default:
+				{
+					elog(ERROR, "OGR FDW unsupported PgSQL column type in \"%s\", %d", pgname, pgtype);
+					return OGRERR_FAILURE;
+				}
+			}
+		}
+		/* Fill in unmatched columns with NULL */
+		else if ( ogrvariant == OGR_UNMATCHED )
+		{
+			OGR_F_UnsetField (feat, ogrfldnum);
+		}
+		else
+		{
+			elog(ERROR, "OGR FDW unsupported column variant in \"%s\", %d", pgname, ogrvariant);
+			return OGRERR_FAILURE;
+		}
+
+	}
+
+	/* done! */
+	return OGRERR_NONE;
+}
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * An extent as a PostGIS box2d, through its input function.
+ */
+static Datum
+ogrExtentDatum(const OGREnvelope *env, Oid typid)
+{
+	Oid typinput, typioparam;
+	char *str = psprintf("BOX(%.17g %.17g,%.17g %.17g)",
+	                     env->MinX, env->MinY, env->MaxX, env->MaxY);
+
+	getTypeInputInfo(typid, &typinput, &typioparam);
+	return OidInputFunctionCall(typinput, str, typioparam, -1);
+}
+
+/*
+ * Fill the one row of an aggregate scan with what OGR
+ * works out for the filtered layer.
+ */
+static TupleTableSlot *
+ogrIterateAggScan(ForeignScanState *node, GisFdwExecState *execstate)
+{
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	TupleDesc tupdesc = slot->tts_tupleDescriptor;
+	ListCell *lc1, *lc2;
+	int i = 0;
+
+	ExecClearTuple(slot);
+	if ( execstate->rownum > 0 )
+		return slot;
+
+	forboth(lc1, execstate->agg_kinds, lc2, execstate->agg_fields)
+	{
+		OGREnvelope env;
+		OGRErr err;
+		GIntBig count;
+#if PG_VERSION_NUM >= 110000
+		Oid typid = tupdesc->attrs[i].atttypid;
+#else
+		Oid typid = tupdesc->attrs[i]->atttypid;
+#endif
+
+		slot->tts_isnull[i] = false;
+		switch ( intVal(lfirst(lc1)) )
+		{
+			case OGR_AGG_COUNT:
+				count = OGR_L_GetFeatureCount(execstate->ogr.lyr, TRUE);
+				if ( count < 0 )
+					ogrEreportError("unable to count OGR features");
+				slot->tts_values[i] = Int64GetDatum((int64) count);
+				break;
+			case OGR_AGG_EXTENT:
+				/* An empty layer has no extent, that's a NULL */
+				CPLPushErrorHandler(CPLQuietErrorHandler);
+				err = OGR_L_GetExtentEx(execstate->ogr.lyr, intVal(lfirst(lc2)), &env, TRUE);
+				CPLPopErrorHandler();
+				if ( err == OGRERR_NONE )
+					slot->tts_values[i] = ogrExtentDatum(&env, typid);
+				else
+					slot->tts_isnull[i] = true;
+				break;
+			default:
+				elog(ERROR, "unknown OGR aggregate %d", intVal(lfirst(lc1)));
+		}
+		i++;
+	}
+
+	ExecStoreVirtualTuple(slot);
+	execstate->rownum++;
+	return slot;
+}
+
+/*
+ * Read the next group of a grouped scan from the result of its
+ * SELECT, which names the outputs "a1", "a2", ... in the order of
+ * the scan tuple. Values go through their input functions, apart
+ * from float8 ones, which OGR would round on the way to text.
+ */
+static TupleTableSlot *
+ogrIterateGroupScan(ForeignScanState *node, GisFdwExecState *execstate)
+{
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	TupleDesc tupdesc = slot->tts_tupleDescriptor;
+	OGRFeatureH feat;
+	int i;
+
+	ExecClearTuple(slot);
+
+	/* Run the query and find the outputs in its result, once */
+	if ( ! execstate->sql_lyr )
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(node->ss.ps.state->es_query_cxt);
+		OGRFeatureDefnH dfn;
+		const char *fidcol;
+
+		ogrExecuteSelect(execstate, execstate->sql);
+		dfn = OGR_L_GetLayerDefn(execstate->sql_lyr);
+		fidcol = OGR_L_GetFIDColumn(execstate->sql_lyr);
+
+		execstate->sql_fldnums = palloc(sizeof(int) * tupdesc->natts);
+		execstate->sql_inputs = palloc(sizeof(FmgrInfo) * tupdesc->natts);
+		execstate->sql_ioparams = palloc(sizeof(Oid) * tupdesc->natts);
+		for ( i = 0; i < tupdesc->natts; i++ )
+		{
+			char name[16];
+			Oid typinput;
+#if PG_VERSION_NUM >= 110000
+			Oid typid = tupdesc->attrs[i].atttypid;
+#else
+			Oid typid = tupdesc->attrs[i]->atttypid;
+#endif
+
+			snprintf(name, sizeof(name), "a%d", i + 1);
+			execstate->sql_fldnums[i] = OGR_FD_GetFieldIndex(dfn, name);
+
+			/* An integer output can be taken for the FID */
+			if ( execstate->sql_fldnums[i] < 0 && ! (fidcol && strcasecmp(fidcol, name) == 0) )
+				elog(ERROR, "OGR query result has no field \"%s\"", name);
+
+			getTypeInputInfo(typid, &typinput, &(execstate->sql_ioparams[i]));
+			fmgr_info(typinput, &(execstate->sql_inputs[i]));
+		}
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	feat = OGR_L_GetNextFeature(execstate->sql_lyr);
+	if ( ! feat )
+		return slot;
+
+	for ( i = 0; i < tupdesc->natts; i++ )
+	{
+		int fldnum = execstate->sql_fldnums[i];
+#if PG_VERSION_NUM >= 110000
+		Form_pg_attribute att = &(tupdesc->attrs[i]);
+#else
+		Form_pg_attribute att = tupdesc->attrs[i];
+#endif
+		char *str;
+
+		slot->tts_isnull[i] = false;
+		if ( fldnum < 0 )
+		{
+			str = psprintf(OGR_FDW_FRMT_INT64, OGR_FDW_CAST_INT64(OGR_F_GetFID(feat)));
+		}
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2,2,0)
+		else if ( ! OGR_F_IsFieldSet(feat, fldnum) || OGR_F_IsFieldNull(feat, fldnum) )
+#else
+		else if ( ! OGR_F_IsFieldSet(feat, fldnum) )
+#endif
+		{
+			slot->tts_isnull[i] = true;
+			continue;
+		}
+		else if ( att->atttypid == FLOAT8OID )
+		{
+			slot->tts_values[i] = Float8GetDatum(OGR_F_GetFieldAsDouble(feat, fldnum));
+			continue;
+		}
+		else
+		{
+			str = (char *) OGR_F_GetFieldAsString(feat, fldnum);
+			if ( execstate->ogr.lyr_utf8 )
+				str = pg_any_to_server(str, strlen(str), PG_UTF8);
+		}
+
+		slot->tts_values[i] = InputFunctionCall(&(execstate->sql_inputs[i]), str,
+		                                        execstate->sql_ioparams[i], att->atttypmod);
+	}
+
+	OGR_F_Destroy(feat);
+	ExecStoreVirtualTuple(slot);
+	execstate->rownum++;
+	return slot;
+}
+#endif
+
+#if PG_VERSION_NUM >= 90600
+/*
+ * Make up the table of a join scan from its scan tuple, each
+ * column read from the field, geometry or FID of the result
+ * named after its place in the tuple, "a1", "a2", ..., so its
+ * rows convert just like features of a table.
+ */
+static void
+ogrMapJoinColumns(GisFdwExecState *execstate, TupleDesc tupdesc)
+{
+	OGRFeatureDefnH dfn = OGR_L_GetLayerDefn(execstate->sql_lyr);
+	const char *fidcol = OGR_L_GetFIDColumn(execstate->sql_lyr);
+	OgrFdwTable *tbl = palloc0(sizeof(OgrFdwTable));
+	int i;
+
+	tbl->tblname = pstrdup("join");
+	tbl->ncols = tupdesc->natts;
+	tbl->cols = palloc0(sizeof(OgrFdwColumn) * tbl->ncols);
+
+	for ( i = 0; i < tbl->ncols; i++ )
+	{
+#if PG_VERSION_NUM >= 110000
+		Form_pg_attribute att = &(tupdesc->attrs[i]);
+#else
+		Form_pg_attribute att = tupdesc->attrs[i];
+#endif
+		OgrFdwColumn *col = &(tbl->cols[i]);
+		char name[16];
+		int fldnum;
+
+		snprintf(name, sizeof(name), "a%d", i + 1);
+		col->pgattnum = att->attnum;
+		col->pgname = pstrdup(NameStr(att->attname));
+		col->pgtype = att->atttypid;
+		col->pgtypmod = att->atttypmod;
+		col->ogrfldscale = -1;
+		getTypeInputInfo(col->pgtype, &(col->pginputfunc), &(col->pginputioparam));
+
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+		if ( (fldnum = OGR_FD_GetGeomFieldIndex(dfn, name)) >= 0 )
+		{
+			col->ogrvariant = OGR_GEOMETRY;
+			col->ogrfldnum = fldnum;
+			col->ogrfldtype = OFTBinary;
+			if ( col->pgtype == GEOMETRYOID )
+				getTypeBinaryInputInfo(col->pgtype, &(col->pgrecvfunc), &(col->pgrecvioparam));
+			continue;
+		}
+#endif
+
+		if ( (fldnum = OGR_FD_GetFieldIndex(dfn, name)) >= 0 )
+		{
+			OGRFieldDefnH fld = OGR_FD_GetFieldDefn(dfn, fldnum);
+
+			col->ogrvariant = OGR_FIELD;
+			col->ogrfldnum = fldnum;
+			col->ogrfldtype = OGR_Fld_GetType(fld);
+			col->ogrfldscale = OGR_Fld_GetWidth(fld) ? OGR_Fld_GetPrecision(fld) : -1;
 		}
-		/* Fill in unmatched columns with NULL */
-		else if ( ogrvariant == OGR_UNMATCHED )
+		else if ( fidcol && strcasecmp(fidcol, name) == 0 )
 		{
-			OGR_F_UnsetField (feat, ogrfldnum);
+			/* The driver took an integer output for the FID */
+			col->ogrvariant = OGR_FID;
 		}
 		else
 		{
-			elog(ERROR, "OGR FDW unsupported column variant in \"%s\", %d", pgname, ogrvariant);
-			return OGRERR_FAILURE;
+			elog(ERROR, "OGR query result has no field \"%s\"", name);
 		}
+	}
+
+	execstate->table = tbl;
+	ogrReadColumnConverters(tbl);
+}
+
+/*
+ * Read the next row of a join the database runs, running its
+ * SELECT the first time through.
+ */
+static TupleTableSlot *
+ogrIterateJoinScan(ForeignScanState *node, GisFdwExecState *execstate)
+{
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	OGRFeatureH feat;
+
+	ExecClearTuple(slot);
+
+	if ( ! execstate->sql_lyr )
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(node->ss.ps.state->es_query_cxt);
 
+		ogrExecuteSelect(execstate, NULL);
+		if ( ! execstate->table )
+			ogrMapJoinColumns(execstate, slot->tts_tupleDescriptor);
+		MemoryContextSwitchTo(oldcontext);
 	}
 
-	/* done! */
-	return OGRERR_NONE;
+	feat = OGR_L_GetNextFeature(execstate->sql_lyr);
+	if ( ! feat )
+		return slot;
+
+	if ( OGRERR_NONE != ogrFeatureToSlot(feat, slot, execstate) )
+		ogrEreportError("failure reading OGR data source");
+
+	ExecStoreVirtualTuple(slot);
+	execstate->rownum++;
+	OGR_F_Destroy(feat);
+	return slot;
 }
+#endif
 
 /*
  * gisIterateForeignScan
@@ -2103,45 +6040,50 @@ gisIterateForeignScan(ForeignScanState *node)
 	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
 	OGRFeatureH feat;
 
+#if PG_VERSION_NUM >= 90600
+	if ( ((ForeignScan *) node->ss.ps.plan)->scan.scanrelid == 0 )
+	{
+		if ( execstate->join_scan )
+			return ogrIterateJoinScan(node, execstate);
+#if PG_VERSION_NUM >= 100000
+		if ( execstate->select )
+			return ogrIterateGroupScan(node, execstate);
+		return ogrIterateAggScan(node, execstate);
+#endif
+	}
+#endif
+
 	if (execstate->isRaster) {
 	    if(execstate->raster.rt_file_count == 0)
 		return ExecClearTuple(slot);
 
 	    /*
-	     * S1: Read tuple from buffer(execstate->raster.tuples),
-	     *      if Current state->tuples buffer is consumed. Then goto S2
+	     * S1: Read tile from buffer(execstate->tiles),
+	     *      if Current state->tiles buffer is consumed. Then goto S2
 	     * S2: Get more data from current file
-	     *      if Get Some ,then read from current state->tuples
+	     *      if Get Some ,then read from current state->tiles
 	     *      else: goto S3
 	     * S3: Get data from next file
-	     *      if Get some, then read from state->tuples
-	     *      else(all files data is alrady iterated): goto S4
-	     * S4: return null
+	     *      if Get some, then read from state->tiles
+	     *      else: goto S2, files outside the box give no tiles
+	     * S4: return null once all the files are read
 	     */
-	    if (execstate->next_tuple >= execstate->num_tuples)
+	    while (execstate->next_tuple >= execstate->num_tuples)
 	    {
-		execstate->num_tuples = 0;
-		// Read current file
-		if (!execstate->eof_curfile_reached && execstate->raster.rt_file_count) {
-		    //elog(INFO, "read current file %s", state->rt_files[state->cur_fileno]);
+		if (!execstate->eof_curfile_reached)
 		    fetch_more_data(node, false);
-		}
-
-		// If current file is already eof, then Read next file
-		if (execstate->num_tuples == 0 && execstate->eof_curfile_reached) {
-		    if (execstate->cur_fileno < execstate->raster.rt_file_count - 1) {
-			//elog(INFO, "current file eof, read another %s", state->rt_files[state->cur_fileno + 1]);
-			fetch_more_data(node, true);
-		    } else {
-			return ExecClearTuple(slot);
-		    }
-		}
+		else if (execstate->cur_fileno < execstate->raster.rt_file_count - 1)
+		    fetch_more_data(node, true);
+		else
+		    return ExecClearTuple(slot);
 	    }
 
-	    ExecStoreTuple(execstate->tuples[execstate->next_tuple++],
-		    slot,
-		    InvalidBuffer,
-		    false);
+	    /* The tile goes in the raster column, anything else is null */
+	    ExecClearTuple(slot);
+	    memset(slot->tts_isnull, true, sizeof(bool) * slot->tts_tupleDescriptor->natts);
+	    slot->tts_values[0] = execstate->tiles[execstate->next_tuple++];
+	    slot->tts_isnull[0] = false;
+	    ExecStoreVirtualTuple(slot);
 	} else {
 	    /*
 	     * Clear the slot. If it gets through w/o being filled up, that means
@@ -2156,11 +6098,41 @@ gisIterateForeignScan(ForeignScanState *node)
 	     */
 	    if ( execstate->rownum == 0 )
 	    {
-		OGR_L_ResetReading(execstate->ogr.lyr);
+		if ( ! execstate->filter_bound )
+		{
+		    ogrBindAttributeFilter(node, execstate);
+		    execstate->filter_bound = true;
+		}
+		/* No feature is within reach of this outer row */
+		if ( execstate->params_empty )
+		    return slot;
+		OGR_L_ResetReading(execstate->sql_lyr ? execstate->sql_lyr : execstate->ogr.lyr);
+		ogrFidStartRead(execstate);
+#ifdef OGR_FDW_ARROW
+		if ( execstate->arrow && ! execstate->arrow->open && ! ogrArrowOpen(execstate) )
+		{
+		    /* Fall back to reading features */
+		    execstate->arrow = NULL;
+		    OGR_L_ResetReading(execstate->ogr.lyr);
+		}
+#endif
+	    }
+
+#ifdef OGR_FDW_ARROW
+	    /* Fill the slot from the current Arrow batch */
+	    if ( execstate->arrow )
+	    {
+		if ( ogrArrowNextRow(execstate, slot) )
+		{
+		    ExecStoreVirtualTuple(slot);
+		    execstate->rownum++;
+		}
+		return slot;
 	    }
+#endif
 
 	    /* If we rectreive a feature from OGR, copy it over into the slot */
-	    feat = OGR_L_GetNextFeature(execstate->ogr.lyr);
+	    feat = ogrNextFeature(execstate);
 	    if ( feat )
 	    {
 		/* convert result to arrays of values and null indicators */
@@ -2190,12 +6162,59 @@ ogrReScanForeignScan(ForeignScanState *node)
 {
 	GisFdwExecState *execstate = (GisFdwExecState *) node->fdw_state;
 
-	OGR_L_ResetReading(execstate->ogr.lyr);
+#ifdef OGR_FDW_ARROW
+	if ( execstate->arrow )
+		ogrArrowRelease(execstate->arrow);
+#endif
+	OGR_L_ResetReading(execstate->sql_lyr ? execstate->sql_lyr : execstate->ogr.lyr);
 	execstate->rownum = 0;
 
+	/* Params may have new values, set the filter again */
+	if ( execstate->param_exprs )
+		execstate->filter_bound = false;
+
 	return;
 }
 
+/*
+ * ogrExplainForeignScan
+ *		Show the filtering OGR does for us in EXPLAIN VERBOSE
+ */
+static void
+ogrExplainForeignScan(ForeignScanState *node, ExplainState *es)
+{
+	GisFdwExecState *execstate = (GisFdwExecState *) node->fdw_state;
+#if PG_VERSION_NUM >= 90500
+	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+#endif
+
+	if ( ! es->verbose || execstate->isRaster )
+		return;
+
+	if ( execstate->select )
+		ExplainPropertyText("OGR Query", ogrSelectStatement(execstate, execstate->sql), es);
+	else if ( execstate->sql && strlen(execstate->sql) > 0 )
+		ExplainPropertyText("OGR SQL", execstate->sql, es);
+
+#if PG_VERSION_NUM >= 90500
+	/* The clauses OGR applies exactly, that aren't checked again */
+	if ( fsplan->fdw_recheck_quals )
+	{
+		List *context;
+		char *exprstr;
+
+#if PG_VERSION_NUM >= 130000
+		context = set_deparse_context_plan(es->deparse_cxt, (Plan *) fsplan, NIL);
+#else
+		context = set_deparse_context_planstate(es->deparse_cxt, (Node *) node, NIL);
+#endif
+		exprstr = deparse_expression((Node *) make_ands_explicit(fsplan->fdw_recheck_quals),
+		                             context, true, false);
+		ExplainPropertyText("Remote Filter", exprstr, es);
+	}
+#endif
+}
+
 /*
  * ogrEndForeignScan
  *		Finish scanning foreign table and dispose objects used for this scan
@@ -2207,11 +6226,250 @@ ogrEndForeignScan(ForeignScanState *node)
 
 	elog(DEBUG2, "processed %d rows from OGR", execstate->rownum);
 
+#ifdef OGR_FDW_ARROW
+	if ( execstate->arrow )
+		ogrArrowRelease(execstate->arrow);
+#endif
+	if ( execstate->sql_lyr )
+	{
+		GDALDatasetReleaseResultSet(execstate->ogr.ds, execstate->sql_lyr);
+		ogrPoolResultSet(&(execstate->ogr), NULL);
+	}
+	execstate->sql_lyr = NULL;
 	ogrFinishConnection( &(execstate->ogr) );
+	if ( execstate->rt_reader )
+		raster_reader_close(execstate->rt_reader);
 
 	return;
 }
 
+/*
+ * Convert a feature into a sample row for ANALYZE. The
+ * conversion garbage goes in tmpcontext, the row itself in
+ * the caller's context.
+ */
+static HeapTuple
+ogrSampleRow(const OGRFeatureH feat, TupleTableSlot *slot, const GisFdwExecState *execstate, MemoryContext tmpcontext)
+{
+	MemoryContext oldcontext = MemoryContextSwitchTo(tmpcontext);
+	HeapTuple tuple;
+
+	if ( OGRERR_NONE != ogrFeatureToSlot(feat, slot, execstate) )
+		ogrEreportError("failure reading OGR data source");
+
+	MemoryContextSwitchTo(oldcontext);
+	tuple = heap_form_tuple(slot->tts_tupleDescriptor, slot->tts_values, slot->tts_isnull);
+	MemoryContextReset(tmpcontext);
+
+	return tuple;
+}
+
+#if PG_VERSION_NUM >= 90500
+/*
+ * Drivers that number features 0 to n-1 and can fetch them by
+ * FID, so ANALYZE can pick its sample without reading the rest.
+ */
+static bool
+ogrCanSampleByFid(const OgrConnection *ogr)
+{
+	const char *dr_str = GDALGetDriverShortName(GDALGetDatasetDriver(ogr->ds));
+
+	return (streq(dr_str, "ESRI Shapefile") || streq(dr_str, "FlatGeobuf")) &&
+	       OGR_L_TestCapability(ogr->lyr, OLCRandomRead) == TRUE &&
+	       OGR_L_TestCapability(ogr->lyr, OLCFastFeatureCount) == TRUE;
+}
+
+/*
+ * Sample the layer by FID, drawing the FIDs the same way ANALYZE
+ * draws heap blocks. Deleted features leave holes in the FID
+ * sequence, which just come back as nothing.
+ */
+static int
+ogrSampleRowsByFid(GisFdwExecState *execstate, TupleTableSlot *slot, MemoryContext tmpcontext,
+                   HeapTuple *rows, int targrows, GIntBig nfeatures)
+{
+	BlockSamplerData bs;
+	int numrows = 0;
+
+	BlockSampler_Init(&bs, (BlockNumber) nfeatures, targrows, random());
+	while ( BlockSampler_HasMore(&bs) )
+	{
+		BlockNumber fid = BlockSampler_Next(&bs);
+		OGRFeatureH feat;
+
+		vacuum_delay_point();
+
+		feat = OGR_L_GetFeature(execstate->ogr.lyr, fid);
+		if ( ! feat )
+			continue;
+
+		rows[numrows++] = ogrSampleRow(feat, slot, execstate, tmpcontext);
+		OGR_F_Destroy(feat);
+	}
+
+	return numrows;
+}
+#endif
+
+/*
+ * Sample the layer with a full read, keeping a reservoir of
+ * targrows rows. Features that don't make it into the reservoir
+ * are skipped without being converted.
+ */
+static int
+ogrSampleRowsByScan(GisFdwExecState *execstate, TupleTableSlot *slot, MemoryContext tmpcontext,
+                    HeapTuple *rows, int targrows, double *totalrows)
+{
+#if PG_VERSION_NUM >= 90500
+	ReservoirStateData rstate;
+#else
+	double rstate;
+#endif
+	double rowstoskip = -1;
+	double samplerows = 0;
+	int numrows = 0;
+	OGRFeatureH feat;
+
+#if PG_VERSION_NUM >= 90500
+	reservoir_init_selection_state(&rstate, targrows);
+#else
+	rstate = anl_init_selection_state(targrows);
+#endif
+
+	OGR_L_ResetReading(execstate->ogr.lyr);
+	while ( (feat = OGR_L_GetNextFeature(execstate->ogr.lyr)) )
+	{
+		vacuum_delay_point();
+
+		if ( numrows < targrows )
+		{
+			rows[numrows++] = ogrSampleRow(feat, slot, execstate, tmpcontext);
+		}
+		else
+		{
+			/*
+			 * Once the reservoir is full, work out how many features
+			 * to pass over before the next one replaces a random
+			 * member of the reservoir.
+			 */
+			if ( rowstoskip < 0 )
+#if PG_VERSION_NUM >= 90500
+				rowstoskip = reservoir_get_next_S(&rstate, samplerows, targrows);
+#else
+				rowstoskip = anl_get_next_S(samplerows, targrows, &rstate);
+#endif
+
+			if ( rowstoskip <= 0 )
+			{
+#if PG_VERSION_NUM >= 90500
+				int k = (int) (targrows * sampler_random_fract(rstate.randstate));
+#else
+				int k = (int) (targrows * anl_random_fract());
+#endif
+				Assert(k >= 0 && k < targrows);
+				heap_freetuple(rows[k]);
+				rows[k] = ogrSampleRow(feat, slot, execstate, tmpcontext);
+			}
+
+			rowstoskip -= 1;
+		}
+
+		samplerows += 1;
+		OGR_F_Destroy(feat);
+	}
+
+	*totalrows = samplerows;
+	return numrows;
+}
+
+/*
+ * ogrAcquireSampleRows
+ *		Collect a random sample of the layer's features for ANALYZE,
+ *		converted just the way a scan would convert them.
+ */
+static int
+ogrAcquireSampleRows(Relation relation, int elevel,
+                     HeapTuple *rows, int targrows,
+                     double *totalrows,
+                     double *totaldeadrows)
+{
+	Oid foreigntableid = RelationGetRelid(relation);
+	GisFdwState *state = getGisFdwState(foreigntableid, GIS_EXEC_STATE);
+	GisFdwExecState *execstate = (GisFdwExecState *) state;
+	OGRLayerH lyr = execstate->ogr.lyr;
+	TupleTableSlot *slot;
+	MemoryContext tmpcontext;
+	int numrows = -1;
+
+	/* Read the OGR layer definition and PgSQL foreign table definitions */
+	ogrReadColumnData(state);
+	execstate->geombuf = makeStringInfo();
+
+	if ( execstate->ogr.analyze_sample_size > 0 )
+		targrows = Min(targrows, execstate->ogr.analyze_sample_size);
+
+	/* A pooled layer may still carry the filters of an earlier scan */
+	OGR_L_SetAttributeFilter(lyr, NULL);
+	OGR_L_SetSpatialFilter(lyr, NULL);
+	OGR_L_SetIgnoredFields(lyr, NULL);
+
+	slot = MakeSingleTupleTableSlot(RelationGetDescr(relation));
+	tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+	                                   "ogr_fdw analyze",
+	                                   ALLOCSET_SMALL_MINSIZE,
+	                                   ALLOCSET_SMALL_INITSIZE,
+	                                   ALLOCSET_SMALL_MAXSIZE);
+
+#if PG_VERSION_NUM >= 90500
+	if ( ogrCanSampleByFid(&(execstate->ogr)) )
+	{
+		GIntBig nfeatures = OGR_L_GetFeatureCount(lyr, false);
+
+		if ( nfeatures >= 0 && nfeatures <= MaxBlockNumber )
+		{
+			numrows = ogrSampleRowsByFid(execstate, slot, tmpcontext, rows, targrows, nfeatures);
+			*totalrows = nfeatures;
+		}
+	}
+#endif
+	if ( numrows < 0 )
+		numrows = ogrSampleRowsByScan(execstate, slot, tmpcontext, rows, targrows, totalrows);
+
+	*totaldeadrows = 0;
+
+	ereport(elevel,
+		(errmsg("\"%s\": OGR layer \"%s\" contains %.0f features; %d rows in sample",
+		        RelationGetRelationName(relation), execstate->ogr.lyr_str,
+		        *totalrows, numrows)));
+
+	MemoryContextDelete(tmpcontext);
+	ExecDropSingleTupleTableSlot(slot);
+	ogrFinishConnection(&(execstate->ogr));
+
+	return numrows;
+}
+
+/*
+ * ogrAnalyzeForeignTable
+ *		Tell ANALYZE how to sample an OGR layer
+ */
+static bool
+ogrAnalyzeForeignTable(Relation relation,
+                       AcquireSampleRowsFunc *func,
+                       BlockNumber *totalpages)
+{
+	/* Raster tables have no features to sample */
+	if ( isRaster(RelationGetRelid(relation)) )
+		return false;
+
+	*func = ogrAcquireSampleRows;
+
+	/* OGR layers have no pages, and nothing plans with them */
+	*totalpages = 1;
+
+	return true;
+}
+
 /* ======================================================== */
 /* WRITE SUPPORT */
 /* ======================================================== */
@@ -2338,6 +6596,10 @@ static void ogrBeginForeignModify (ModifyTableState *mtstate,
 	/* Read the OGR layer definition and PgSQL foreign table definitions */
 	ogrReadColumnData(state);
 
+	/* Group the writes into data source transactions */
+	if ( ! (eflags & EXEC_FLAG_EXPLAIN_ONLY) )
+		ogrWriteXactBegin((GisFdwModifyState *)state);
+
 	/* Save OGR connection, etc, for later */
 	rinfo->ri_FdwState = state;
 	return;
@@ -2400,6 +6662,7 @@ static TupleTableSlot *ogrExecForeignUpdate (EState *estate,
 		ogrEreportError("failure writing back OGR feature");
 
 	OGR_F_Destroy(feat);
+	ogrWriteXactRow(modstate);
 
 	/* TODO: slot handling? what happens with RETURNING clauses? */
 
@@ -2507,35 +6770,40 @@ static TupleTableSlot *ogrExecForeignUpdate (EState *estate,
 //     int         location;       /* token location, or -1 if unknown */
 // } Var;
 
-static TupleTableSlot *ogrExecForeignInsert (EState *estate,
-					ResultRelInfo *rinfo,
-					TupleTableSlot *slot,
-					TupleTableSlot *planSlot)
+/*
+ * Write a row as a new feature, and put the FID OGR assigned to
+ * it into the slot. The feature object is created once and reused
+ * for every row: ogrSlotToFeature sets or clears every field and
+ * geometry on it, but only touches the FID when the table has a
+ * fid column, so the FID OGR gave the last row is cleared here.
+ */
+static void
+ogrInsertSlot(GisFdwModifyState *modstate, TupleTableSlot *slot)
 {
-	GisFdwModifyState *modstate = rinfo->ri_FdwState;
-	OGRFeatureDefnH ogr_fd = OGR_L_GetLayerDefn(modstate->ogr.lyr);
-	OGRFeatureH feat = OGR_F_Create(ogr_fd);
 	TupleDesc td = slot->tts_tupleDescriptor;
 	int fid_column;
 	OGRErr err;
 	GIntBig fid;
 
-	elog(DEBUG2, "ogrExecForeignInsert");
+	if ( ! modstate->feat )
+	{
+		modstate->feat = OGR_F_Create(OGR_L_GetLayerDefn(modstate->ogr.lyr));
+		if ( ! modstate->feat )
+			ogrEreportError("failure creating OGR feature");
+	}
 
 	/* Copy the data from the slot onto the feature */
-	if ( ! feat )
-		ogrEreportError("failure creating OGR feature");
-
-	err = ogrSlotToFeature(slot, feat, modstate->table);
+	OGR_F_SetFID(modstate->feat, OGRNullFID);
+	err = ogrSlotToFeature(slot, modstate->feat, modstate->table);
 	if ( err != OGRERR_NONE )
 		ogrEreportError("failure populating OGR feature");
 
-	err = OGR_L_CreateFeature(modstate->ogr.lyr, feat);
+	err = OGR_L_CreateFeature(modstate->ogr.lyr, modstate->feat);
 	if ( err != OGRERR_NONE )
 		ogrEreportError("failure writing OGR feature");
 
-	fid = OGR_F_GetFID(feat);
-	OGR_F_Destroy(feat);
+	fid = OGR_F_GetFID(modstate->feat);
+	ogrWriteXactRow(modstate);
 
 	/* Update the FID for RETURNING slot */
 	fid_column = ogrGetFidColumn(td);
@@ -2545,11 +6813,21 @@ static TupleTableSlot *ogrExecForeignInsert (EState *estate,
 		slot->tts_isnull[fid_column] = false;
 		slot->tts_nvalid++;
 	}
-
-	return slot;
 }
 
+static TupleTableSlot *ogrExecForeignInsert (EState *estate,
+					ResultRelInfo *rinfo,
+					TupleTableSlot *slot,
+					TupleTableSlot *planSlot)
+{
+	GisFdwModifyState *modstate = rinfo->ri_FdwState;
+
+	elog(DEBUG2, "ogrExecForeignInsert");
+
+	ogrInsertSlot(modstate, slot);
 
+	return slot;
+}
 
 static TupleTableSlot *ogrExecForeignDelete (EState *estate,
 					ResultRelInfo *rinfo,
@@ -2591,8 +6869,9 @@ static TupleTableSlot *ogrExecForeignDelete (EState *estate,
 
 	if ( err != OGRERR_NONE )
 		return NULL;
-	else
-		return slot;
+
+	ogrWriteXactRow(modstate);
+	return slot;
 }
 
 static void ogrEndForeignModify (EState *estate, ResultRelInfo *rinfo)
@@ -2601,11 +6880,38 @@ static void ogrEndForeignModify (EState *estate, ResultRelInfo *rinfo)
 
 	elog(DEBUG2, "ogrEndForeignModify");
 
+	if ( modstate->feat )
+		OGR_F_Destroy(modstate->feat);
+	modstate->feat = NULL;
+
+	ogrWriteXactCommit(modstate);
 	ogrFinishConnection( &(modstate->ogr) );
 
+	/* Counts of the layer, and of any other on the same source, are stale now */
+	ogrCountCacheForget(InvalidOid);
+
 	return;
 }
 
+#if PG_VERSION_NUM >= 110000
+/*
+ * ogrBeginForeignInsert / ogrEndForeignInsert
+ * COPY into, and tuple routing to, a foreign table set up and
+ * finish writing just like an INSERT.
+ */
+static void ogrBeginForeignInsert (ModifyTableState *mtstate,
+					ResultRelInfo *rinfo)
+{
+	ogrBeginForeignModify(mtstate, rinfo, NIL, 0, 0);
+}
+
+static void ogrEndForeignInsert (EState *estate,
+					ResultRelInfo *rinfo)
+{
+	ogrEndForeignModify(estate, rinfo);
+}
+#endif
+
 static int ogrIsForeignRelUpdatable (Relation rel)
 {
 	static int readonly = 0;
@@ -2784,27 +7090,39 @@ rasterBeginForeignScan(ForeignScanState *node, int eflags, GisFdwExecState *exec
     char *location;
     EState *estate = node->ss.ps.state;
     RasterConnection *conn = &(execstate->raster);
+    TupleDesc tupdesc = RelationGetDescr(node->ss.ss_currentRelation);
+    ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
 
     if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
         return;
     /*
      * Set variables for conn
      */
-    execstate->attinmeta = TupleDescGetAttInMetadata(RelationGetDescr(node->ss.ss_currentRelation));
+#if PG_VERSION_NUM >= 110000
+    rasterSetColumnType(execstate, tupdesc->attrs[0].atttypid, tupdesc->attrs[0].atttypmod);
+#else
+    rasterSetColumnType(execstate, tupdesc->attrs[0]->atttypid, tupdesc->attrs[0]->atttypmod);
+#endif
     conn->batch_context = AllocSetContextCreate(estate->es_query_cxt,
             "rasterdb_fdw temporary data",
             ALLOCSET_DEFAULT_MINSIZE,
             ALLOCSET_DEFAULT_INITSIZE,
             ALLOCSET_DEFAULT_MAXSIZE);
-    conn->temp_context = AllocSetContextCreate(estate->es_query_cxt,
-            "rasterdb_fdw temporary data",
-            ALLOCSET_SMALL_MINSIZE,
-            ALLOCSET_SMALL_INITSIZE,
-            ALLOCSET_SMALL_MAXSIZE);
+    execstate->rt_reader = raster_reader_create(estate->es_query_cxt);
+    // box of the spatial restrictions, from ogrGetForeignPlan
+    if (list_length(fsplan->fdw_private) == 4)
+        raster_reader_set_filter(execstate->rt_reader,
+                floatVal(list_nth(fsplan->fdw_private, 0)),
+                floatVal(list_nth(fsplan->fdw_private, 1)),
+                floatVal(list_nth(fsplan->fdw_private, 2)),
+                floatVal(list_nth(fsplan->fdw_private, 3)));
 
     //Set raster files
     set_raster_config(&(conn->config), conn->conf_file);
     config = conn->config;
+    // the table's bands win over the conf file's
+    if (conn->bands)
+        set_raster_bands(config, conn->bands);
     location = conn->location;
     stat(location, &s_buf);
 
@@ -2829,10 +7147,9 @@ rasterBeginForeignScan(ForeignScanState *node, int eflags, GisFdwExecState *exec
 	conn->rt_file_count++;
     } else if (S_ISDIR(s_buf.st_mode)) {
 	int tmp_length= 0;
-	char filename[FILENAME_MAXSIZE];
+	char filename[MAXPGPATH];
 	DIR *dir;
 	struct dirent *entry;
-	memset(filename, 0, 50);
 	if ((dir = opendir(location)) != NULL) {
 	    // print all the files and directories within directory
 	    while ((entry = readdir(dir)) != NULL) {
@@ -2840,12 +7157,15 @@ rasterBeginForeignScan(ForeignScanState *node, int eflags, GisFdwExecState *exec
 		    elog(DEBUG1, "Do not support %s type %d", entry->d_name, entry->d_type);
 		    continue;
 		}
-		tmp_length = strlen(location) + strlen(entry->d_name) + 2;
-		snprintf(filename,
-			tmp_length,
+		tmp_length = snprintf(filename,
+			sizeof(filename),
 			"%s/%s",
 			location,
 			entry->d_name);
+		if ((size_t) tmp_length >= sizeof(filename)) {
+		    elog(INFO, "raster file name too long:%s/%s", location, entry->d_name);
+		    continue;
+		}
 		if (GDALIdentifyDriver(filename, NULL) == NULL) {
 		    elog(INFO, "GDAL identify raster failed:%s", filename);
 		    continue;
@@ -2885,20 +7205,19 @@ rasterBeginForeignScan(ForeignScanState *node, int eflags, GisFdwExecState *exec
 static void
 fetch_more_data(ForeignScanState *node, bool nextfile) {
     GisFdwExecState *state = (GisFdwExecState*) node->fdw_state;
-    AttInMetadata *attinmeta = state->attinmeta;
     int batchsize = state->raster.config->batchsize;
     int numrows = 0; // fetched rasterdb rows
     int i = 0;
-    char **buf = NULL;
+    rt_raster *rasts = NULL;
     MemoryContext oldcontext;
     char *filename;
 
-    state->tuples = NULL;
+    state->tiles = NULL;
 
     MemoryContextReset(state->raster.batch_context);
     oldcontext = MemoryContextSwitchTo(state->raster.batch_context);
 
-    buf = palloc0(sizeof(char *) * batchsize);
+    rasts = palloc0(sizeof(rt_raster) * batchsize);
     if(nextfile) {
         state->cur_lineno = 0;
         state->cur_fileno++;
@@ -2906,17 +7225,15 @@ fetch_more_data(ForeignScanState *node, bool nextfile) {
     filename = state->raster.rt_files[state->cur_fileno];
     elog(DEBUG1, "Processing file:%s", filename);
 
-    numrows = analysis_raster(filename, state->raster.config, state->cur_lineno, buf);
+    numrows = analysis_raster(state->rt_reader, filename, state->raster.config, state->cur_lineno, rasts);
 
-    state->tuples = (HeapTuple *)palloc0(numrows * sizeof(HeapTuple));
+    state->tiles = (Datum *)palloc0(numrows * sizeof(Datum));
     for (i = 0; i < numrows; i++) {
-        state->tuples[i] =
-            make_tuple_from_string(buf[i], node->ss.ss_currentRelation,
-                    attinmeta,
-                    state->raster.temp_context);
+        state->tiles[i] = rasterTileDatum(state, rasts[i]);
+        raster_destroy(rasts[i]);
     }
 
-    pfree(buf);
+    pfree(rasts);
 
     state->cur_lineno += numrows;
     state->next_tuple = 0;
@@ -2926,34 +7243,95 @@ fetch_more_data(ForeignScanState *node, bool nextfile) {
     MemoryContextSwitchTo(oldcontext);
 }
 
-static HeapTuple
-make_tuple_from_string(char *str, Relation rel, AttInMetadata *attinmeta,
-        MemoryContext temp_context) {
+/*
+ * Work out how tiles go into the raster column. The PostGIS raster
+ * type is recognized by its name and input function here rather
+ * than by an oid looked up when the library loads, which depends
+ * on the search_path and on PostGIS being installed by then. Other
+ * types take the WKB through their binary input, or as hex through
+ * their text input when they are strings (whose binary input would
+ * take the WKB as characters) or have no binary one.
+ */
+static void
+rasterSetColumnType(GisFdwExecState *execstate, Oid typid, int32 typmod) {
     HeapTuple tuple;
-    TupleDesc tupledesc = RelationGetDescr(rel);
-    Datum *values;
-    bool *nulls;
-    MemoryContext oldcontext;
+    Form_pg_type typform;
+    Oid func;
+    char *input;
+
+    tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
+    if (!HeapTupleIsValid(tuple))
+        elog(ERROR, "cache lookup failed for type %u", typid);
+    typform = (Form_pg_type) GETSTRUCT(tuple);
+
+    input = get_func_name(typform->typinput);
+    if (strcmp(NameStr(typform->typname), "raster") == 0 &&
+            input && strcmp(input, "raster_in") == 0) {
+        execstate->rt_format = RASTER_TILE_SERIALIZED;
+        func = InvalidOid;
+    } else if (typform->typcategory != TYPCATEGORY_STRING &&
+            OidIsValid(typform->typreceive)) {
+        execstate->rt_format = RASTER_TILE_WKB;
+        func = typform->typreceive;
+    } else {
+        execstate->rt_format = RASTER_TILE_HEXWKB;
+        func = typform->typinput;
+    }
+    execstate->rt_ioparam = getTypeIOParam(tuple);
+    execstate->rt_typmod = typmod;
+    ReleaseSysCache(tuple);
 
-    Assert(tupledesc->nattrs = 1);
+    if (OidIsValid(func))
+        fmgr_info(func, &(execstate->rt_inflinfo));
+}
 
-    oldcontext = MemoryContextSwitchTo(temp_context);
+/*
+ * Datum of a tile for the raster column: the tile serialized in
+ * the raster type's own on-disk format, or for any other column
+ * type its WKB read through the type's input (bytea_recv for a
+ * bytea column).
+ */
+static Datum
+rasterTileDatum(GisFdwExecState *state, rt_raster rast) {
+    StringInfoData strinfo;
+    uint8_t *wkb;
+    uint32_t wkbsize = 0;
+    Datum d;
+
+    if (state->rt_format == RASTER_TILE_SERIALIZED) {
+        /* serialized raster starts with its size, where the varlena header goes */
+        struct rt_raster_t *ser = rt_raster_serialize(rast);
+        void *pgrast;
+
+        if (ser == NULL)
+            elog(ERROR, "rt_raster_serialize return NULL.");
+        pgrast = palloc(ser->size);
+        memcpy(pgrast, ser, ser->size);
+        SET_VARSIZE(pgrast, ser->size);
+        rtdealloc(ser);
+        return PointerGetDatum(pgrast);
+    }
 
-    values = (Datum *) palloc0(tupledesc->natts * sizeof(Datum));
-    nulls = (bool *) palloc0(tupledesc->natts * sizeof(bool));
-    memset(nulls, true, tupledesc->natts * sizeof(bool));
-    nulls[0] = (str == NULL);
-    values[0] = InputFunctionCall(&attinmeta->attinfuncs[0],
-            str,
-            attinmeta->attioparams[0],
-            attinmeta->atttypmods[0]
-            );
+    if (state->rt_format == RASTER_TILE_HEXWKB) {
+        char *hex = rt_raster_to_hexwkb(rast, FALSE, &wkbsize);
 
-    MemoryContextSwitchTo(oldcontext);
-    tuple = heap_form_tuple(tupledesc, values, nulls);
-    MemoryContextReset(temp_context);
+        if (hex == NULL)
+            elog(ERROR, "rt_raster_to_hexwkb return NULL.");
+        d = InputFunctionCall(&(state->rt_inflinfo), hex, state->rt_ioparam, state->rt_typmod);
+        rtdealloc(hex);
+        return d;
+    }
 
-    return tuple;
+    wkb = rt_raster_to_wkb(rast, FALSE, &wkbsize);
+    if (wkb == NULL)
+        elog(ERROR, "rt_raster_to_wkb return NULL.");
+    strinfo.data = (char *)wkb;
+    strinfo.len = wkbsize;
+    strinfo.maxlen = strinfo.len;
+    strinfo.cursor = 0;
+    d = ReceiveFunctionCall(&(state->rt_inflinfo), &strinfo, state->rt_ioparam, state->rt_typmod);
+    rtdealloc(wkb);
+    return d;
 }
 
 #endif /* PostgreSQL 9.5+ */
@@ -19,7 +19,9 @@
 #include "access/reloptions.h"
 #include "access/sysattr.h"
 #include "access/transam.h"
+#include "access/xact.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_am.h"
 #include "catalog/pg_collation.h"
 #include "catalog/pg_foreign_table.h"
 #include "catalog/pg_foreign_server.h"
@@ -41,32 +43,51 @@
 #include "optimizer/clauses.h"
 #include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
 #include "optimizer/planmain.h"
 #include "optimizer/restrictinfo.h"
+#include "optimizer/tlist.h"
 #include "optimizer/var.h"
 #include "parser/parsetree.h"
 #include "storage/ipc.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/date.h"
+#include "utils/datetime.h"
+#include "utils/guc.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/numeric.h"
 #include "utils/rel.h"
+#if PG_VERSION_NUM >= 100000
+#include "utils/ruleutils.h"
+#endif
+#include "utils/selfuncs.h"
 #include "utils/syscache.h"
 #include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 90500
+#include "utils/sampling.h"
+#endif
 #include "funcapi.h"
 
 /* GDAL/OGR includes and compat */
 #include "ogr_fdw_gdal.h"
+
+/* Columnar reads through the GDAL Arrow stream interface */
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(3,6,0) && PG_VERSION_NUM >= 90500 && \
+    (PG_VERSION_NUM >= 100000 || defined(HAVE_INT64_TIMESTAMP))
+#define OGR_FDW_ARROW 1
+#endif
 #include "ogr_fdw_common.h"
 #include "rt_fdw_common.h"
 
 /* Local configuration defines */
 
-/* Use hexwkb input by default, but have option to use */
-/* the binary recv input instead. Binary input is strict */
-/* on geometry structure (no unclosed polys, etc) and */
-/* hexwkb is not. */
+/* Geometries go through the binary recv input, which is */
+/* strict on geometry structure (no unclosed polys, etc). */
+/* With this defined, the ones it would reject fall back */
+/* to the lax hexwkb input instead of raising errors. */
 #define OGR_FDW_HEXWKB TRUE
 
 typedef enum
@@ -83,11 +104,25 @@ typedef enum {
 	OGR_UPDATEABLE_UNSET
 } OgrUpdateable;
 
+struct OgrFdwColumn;
+struct GisFdwExecState;
+
+/*
+ * Converts the value of one column from an OGR feature into
+ * a PgSQL Datum. Chosen once per scan, to suit the OGR and
+ * PgSQL type pair of the column.
+ */
+typedef void (*OgrFdwConvertFunc)(const OGRFeatureH feat,
+                                  const struct OgrFdwColumn *col,
+                                  const struct GisFdwExecState *execstate,
+                                  Datum *value, bool *isnull);
+
 typedef struct OgrFdwColumn
 {
 	/* PgSQL metadata */
 	int pgattnum;            /* PostgreSQL attribute number */
 	int pgattisdropped;      /* PostgreSQL attribute dropped? */
+	bool pgattskip;          /* Not used by the query, leave it NULL */
 	char *pgname;            /* PostgreSQL column name */
 	Oid pgtype;              /* PostgreSQL data type */
 	int pgtypmod;            /* PostgreSQL type modifier */
@@ -108,15 +143,33 @@ typedef struct OgrFdwColumn
 	OgrColumnVariant ogrvariant;
 	int ogrfldnum;
 	OGRFieldType ogrfldtype;
+	int ogrfldscale;         /* Decimals OGR formats a real with, -1 if free */
+
+	/* Conversion plan, for scans */
+	OgrFdwConvertFunc convert;   /* OGR value to Datum converter */
+	FmgrInfo pginputflinfo;      /* Cached input function, for conversions via text */
+	FmgrInfo pgrecvflinfo;       /* Cached recv function, for geometries */
+	int pgtypmodsrid;            /* SRID of the geometry typmod, -1 if none */
 } OgrFdwColumn;
 
+typedef struct OgrFdwConverter
+{
+	OgrFdwConvertFunc func;
+	int attidx;                  /* Column (and slot) index to fill */
+} OgrFdwConverter;
+
 typedef struct OgrFdwTable
 {
 	int ncols;
 	char *tblname;
 	OgrFdwColumn *cols;
+	int nconverters;             /* Columns the scan has to fill */
+	OgrFdwConverter *converters;
 } OgrFdwTable;
 
+/* Pooled datasource handle, see the connection pool in ogr_fdw.c */
+struct OgrConnPoolEntry;
+
 typedef struct OgrConnection
 {
 	char *ds_str;         /* datasource connection string */
@@ -127,8 +180,11 @@ typedef struct OgrConnection
 	bool ds_updateable;
 	bool lyr_updateable;
 	bool lyr_utf8;        /* OGR layer will return UTF8 strings */
+	bool lyr_arrow;       /* Read the layer in Arrow batches */
+	int analyze_sample_size; /* Most rows ANALYZE samples, 0 for no limit */
 	GDALDatasetH ds;      /* GDAL datasource handle */
 	OGRLayerH lyr;        /* OGR layer handle */
+	struct OgrConnPoolEntry *pool; /* pool entry ds was borrowed from */
 } OgrConnection;
 
 typedef struct RasterConnection
@@ -137,11 +193,45 @@ typedef struct RasterConnection
 	char *location;
 	int rt_file_count; /*total files# */
 	char **rt_files; /*filenames[], size==rt_file_count*/
+	char *bands; /* bands table option, or NULL */
 	RasterConfig *config;
 	MemoryContext batch_context;
-	MemoryContext temp_context;
 } RasterConnection;
 
+/* How raster tiles become the Datum of the raster column */
+typedef enum
+{
+	RASTER_TILE_SERIALIZED, /* the PostGIS raster type's own format */
+	RASTER_TILE_WKB,        /* WKB, through the column type's binary input */
+	RASTER_TILE_HEXWKB      /* hex WKB, through its text input */
+} RasterTileFormat;
+
+/* SQL dialect a driver takes attribute filters in */
+typedef enum
+{
+	OGR_DIALECT_OGRSQL,    /* OGR SQL, evaluated by OGR */
+	OGR_DIALECT_SQLITE,    /* handed on to SQLite, by the GPKG and SQLite drivers */
+	OGR_DIALECT_POSTGRESQL /* handed on to the server, by the PostgreSQL driver */
+} OgrSqlDialect;
+
+/*
+ * Restrictions on the FID column, which drivers can serve by
+ * random access (equality and IN lists) or by starting the read
+ * at a feature index (ranges) instead of checking every feature.
+ */
+typedef struct OgrFdwFidFilter
+{
+	bool lookup;           /* an equality or IN list was found */
+	GIntBig *fids;         /* FIDs passing all of them, sorted and unique */
+	int nfids;
+	bool has_min;          /* inclusive bounds of the FID range */
+	bool has_max;
+	GIntBig min_fid;
+	GIntBig max_fid;
+	int nclauses;          /* number of restrictions collected */
+	List *clauses;         /* restrictions they came from */
+} OgrFdwFidFilter;
+
 typedef enum
 {
 	GIS_PLAN_STATE,
@@ -170,9 +260,22 @@ typedef struct GisFdwPlanState
 	bool isRaster;
 	RasterConnection raster;
 	int nrows;           /* estimate of number of rows in file */
+	double fetched_rows; /* estimate of features OGR hands back after its filters */
+	Cost feature_cost;   /* cost of converting one feature into a tuple */
 	Cost startup_cost;
 	Cost total_cost;
 	bool *pushdown_clauses;
+	/* OGR filters, worked out once for the estimates and the plan */
+	char *sql;             /* OGR SQL for the attribute filter */
+	List *params_list;
+	List *pushed_clauses;  /* restrictions OGR applies for us */
+	List *exact_clauses;   /* of those, the ones it applies exactly as PgSQL would */
+	QualCost local_qual_cost; /* cost of checking the rest locally */
+	char *spatial_hex;     /* hex WKB of the spatial filter, or NULL */
+	int spatial_fldnum;    /* OGR geometry field it applies to */
+	bool spatial_rect;     /* the filter is just a box */
+	OgrFdwFidFilter fid;   /* FID restrictions */
+	bool fid_seek;         /* the FID range is read by feature index */
 } GisFdwPlanState;
 
 typedef struct GisFdwExecState
@@ -187,8 +290,31 @@ typedef struct GisFdwExecState
 	/*4 items for org*/
 	char *sql;             /* OGR SQL for attribute filter */
 	int rownum;            /* how many rows have we read thus far? */
-	Oid setsridfunc;       /* ST_SetSRID() */
-	Oid typmodsridfunc;    /* postgis_typmod_srid() */
+	StringInfo geombuf;    /* WKB export buffer, reused for every geometry */
+	struct OgrFdwArrowScan *arrow; /* Arrow batch reader, or NULL for feature reads */
+	List *param_exprs;     /* ExprStates giving the values of the $n in sql */
+	bool filter_bound;     /* sql is set on the layer with the current values */
+	int spatial_param;     /* 1-based param holding an outer geometry to filter on, or 0 */
+	int spatial_param_fldnum; /* OGR geometry field of that filter */
+	double spatial_param_expand; /* distance to grow the outer box by */
+	bool has_base_env;     /* base_env holds the scan's own spatial filter box */
+	OGREnvelope base_env;
+	bool params_empty;     /* current params can't match any feature */
+	OgrFdwFidFilter fid;   /* FIDs to look up, when fid.lookup */
+	bool fid_seek;         /* read the FID range by feature index */
+	int next_fid;          /* next of fid.fids to look up */
+	bool fid_done;         /* no more features in the FID range */
+	List *agg_kinds;       /* aggregates OGR works out, for a scan with no relation */
+	List *agg_fields;      /* and the OGR geometry fields of their extents */
+	int spatial_fldnum;    /* OGR geometry field of the scan's spatial filter */
+	char *select;          /* SELECT run by the driver in place of reading the layer, or NULL */
+	char *select_tail;     /* its GROUP BY or ORDER BY, after the WHERE of sql */
+	OGRLayerH sql_lyr;     /* result layer of the SELECT */
+	bool sql_mapped;       /* columns point at the fields of the result layer */
+	int *sql_fldnums;      /* result field of each grouped output, -1 for the FID */
+	FmgrInfo *sql_inputs;  /* and the input functions to read them with */
+	Oid *sql_ioparams;
+	bool join_scan;        /* reads a join the database runs, table is made up from the scan tuple */
 
 	/*Below items for raster*/
 	int cur_fileno; /*Current Processing file# */
@@ -196,8 +322,12 @@ typedef struct GisFdwExecState
 	int next_tuple; /*index of next one tuple to return*/
 	int num_tuples; /* # of tuples in array*/
 	bool eof_curfile_reached; /* true if last raw fetched in current file*/
-	HeapTuple *tuples; /*array of currently-retrieved tuples*/
-	AttInMetadata *attinmeta;
+	RasterReader *rt_reader; /* file being read, open across batches */
+	Datum *tiles; /*array of currently-retrieved tile rasters*/
+	RasterTileFormat rt_format; /* how tiles go into the raster column */
+	FmgrInfo rt_inflinfo; /* input of the column type, for a type other than raster */
+	Oid rt_ioparam;
+	int32 rt_typmod;
 } GisFdwExecState;
 
 typedef struct GisFdwModifyState
@@ -208,10 +338,42 @@ typedef struct GisFdwModifyState
 	OgrFdwTable *table;
 	TupleDesc tupdesc;
 	bool isRaster;
+	struct OgrWriteXact *xact; /* open data source transaction, or NULL */
+	int xact_rows;         /* rows written in it so far */
+	OGRFeatureH feat;      /* feature reused for every insert */
 } GisFdwModifyState;
 
+/*
+ * Spatial restrictions found while deparsing, to be handed to
+ * OGR_L_SetSpatialFilter. Several restrictions are combined by
+ * intersecting their bounds, a single intersects restriction keeps
+ * its exact geometry.
+ */
+typedef struct OgrFdwSpatialFilter
+{
+	int nfilters;          /* number of restrictions collected */
+	int ogrfldnum;         /* OGR geometry field they apply to */
+	OGREnvelope env;       /* intersection of all their bounds */
+	OGRGeometryH geom;     /* exact geometry, only when nfilters == 1 */
+	List *clauses;         /* restrictions the filters came from */
+} OgrFdwSpatialFilter;
+
 /* Shared function signatures */
-bool ogrDeparse(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel, List *exprs, GisFdwState *state, List **param);
+bool ogrDeparse(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel, List *exprs, GisFdwState *state, List **param, OgrFdwSpatialFilter *spatial, OgrFdwFidFilter *fid, List **pushed, List **exact);
+Expr *ogrSpatialJoinClause(PlannerInfo *root, RelOptInfo *foreignrel, Expr *clause, GisFdwState *state, int *ogrfldnum, double *expand);
+bool ogrRasterSpatialFilter(RelOptInfo *baserel, List *clauses, OGREnvelope *env);
+char *ogrDeparseBindParams(const char *sql, const Datum *values, const bool *nulls, const Oid *types, int nparams, OgrSqlDialect dialect);
+OgrSqlDialect ogrSqlDialect(const OgrConnection *con);
+char *ogrDeparseSelect(GisFdwState *state, List *retrieved_attrs);
+bool ogrDeparseOrderBy(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel, List *pathkeys, GisFdwState *state);
+#if PG_VERSION_NUM >= 100000
+bool ogrDeparseGroupedSelect(StringInfo select, StringInfo tail, PlannerInfo *root, RelOptInfo *foreignrel, PathTarget *target, GisFdwState *state);
+#endif
+#if PG_VERSION_NUM >= 90600
+void ogrDeparseJoinClauses(StringInfo buf, PlannerInfo *root, RelOptInfo *outerrel, GisFdwState *outer, RelOptInfo *innerrel, GisFdwState *inner, List *clauses, List **pushed, List **exact);
+char *ogrDeparseJoinSelect(RelOptInfo *outerrel, GisFdwState *outer, RelOptInfo *innerrel, GisFdwState *inner, List *tlist, const char *where);
+#endif
+size_t ogrEwkbStripSrid(unsigned char *wkb, size_t wkbsize);
 
 
 /* Shared global value of the Geometry OId */
@@ -25,12 +25,25 @@ typedef struct OgrDeparseCtx
 	RelOptInfo *foreignrel;   /* the foreign relation we are planning for */
 	StringInfo buf;           /* output buffer to append to */
 	List **params_list;       /* exprs that will become remote Params */
-	OGRGeometryH geom;        /* if filter contains a geometry constant, it resides here */
+	OgrFdwSpatialFilter *spatial; /* spatial restrictions for OGR_L_SetSpatialFilter */
+	OgrFdwFidFilter *fid;     /* FID restrictions for direct reads */
+	int or_depth;             /* > 0 while inside an OR or NOT, where filters can't apply */
+	bool exact;               /* OGR gives the same answer as PgSQL for the clause so far */
+	bool incomplete;          /* terms of an AND were left out of the clause so far */
+	bool equality;            /* the clause so far only tests plain operands with =, <> and IN */
+	OgrSqlDialect dialect;    /* SQL the driver takes attribute filters in */
 	GisFdwState *state;       /* to convert local column names to OGR names */
+	RelOptInfo *innerrel;     /* inner table of a join the database runs, or NULL */
+	GisFdwState *inner_state; /* and its columns */
 } OgrDeparseCtx;
 
 /* Local function signatures */
 static bool ogrDeparseExpr(Expr *node, OgrDeparseCtx *context);
+static bool ogrDeparseCast(Expr *arg, Oid type, OgrDeparseCtx *context);
+static void ogrAppendQuotedName(StringInfo buf, const char *name);
+static bool ogrIsPostgreSQL(const OgrConnection *con);
+static const char *ogrColumnSourceName(const OgrFdwColumn *col, OGRLayerH lyr);
+static bool ogrDeparseSpatialJoin(List *args, bool intersects, OgrDeparseCtx *context);
 // static void ogrDeparseOpExpr(OpExpr* node, OgrDeparseCtx *context);
 
 static void setStringInfoLength(StringInfo str, int len)
@@ -39,8 +52,63 @@ static void setStringInfoLength(StringInfo str, int len)
 	str->data[len] = '\0';
 }
 
+/*
+ * Dates and timestamps are written in the form the dialect
+ * compares them in, whatever the DateStyle: OGR SQL parses
+ * 'YYYY/MM/DD HH:MM:SS', SQLite compares the ISO strings GeoPackage
+ * stores, and PostgreSQL servers take ISO too. Timestamps don't go
+ * to SQLite, since GeoPackage stores them with a 'T' and time zone,
+ * and only to the millisecond OGR keeps. Time zones aren't carried
+ * over, so timestamptz stays local.
+ */
+static char *
+ogrDateTimeString(Datum datum, Oid type, OgrSqlDialect dialect)
+{
+	char sep = (dialect == OGR_DIALECT_OGRSQL) ? '/' : '-';
+
+	if ( type == DATEOID )
+	{
+		DateADT date = DatumGetDateADT(datum);
+		int year, mon, mday;
+
+		if ( DATE_NOT_FINITE(date) )
+			return NULL;
+
+		j2date(date + POSTGRES_EPOCH_JDATE, &year, &mon, &mday);
+		if ( year <= 0 )
+			return NULL;
+
+		return psprintf("'%04d%c%02d%c%02d'", year, sep, mon, sep, mday);
+	}
+
+#if PG_VERSION_NUM >= 100000 || defined(HAVE_INT64_TIMESTAMP)
+	if ( type == TIMESTAMPOID && dialect != OGR_DIALECT_SQLITE )
+	{
+		Timestamp ts = DatumGetTimestamp(datum);
+		struct pg_tm tm;
+		fsec_t fsec;
+
+		if ( TIMESTAMP_NOT_FINITE(ts) ||
+		     timestamp2tm(ts, NULL, &tm, &fsec, NULL, NULL) != 0 ||
+		     tm.tm_year <= 0 || fsec % 1000 != 0 )
+			return NULL;
+
+		if ( fsec )
+			return psprintf("'%04d%c%02d%c%02d %02d:%02d:%02d.%03d'",
+			                tm.tm_year, sep, tm.tm_mon, sep, tm.tm_mday,
+			                tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(fsec / 1000));
+		else
+			return psprintf("'%04d%c%02d%c%02d %02d:%02d:%02d'",
+			                tm.tm_year, sep, tm.tm_mon, sep, tm.tm_mday,
+			                tm.tm_hour, tm.tm_min, tm.tm_sec);
+	}
+#endif
+
+	return NULL;
+}
+
 static char *
-ogrStringFromDatum(Datum datum, Oid type)
+ogrStringFromDatum(Datum datum, Oid type, OgrSqlDialect dialect)
 {
 	StringInfoData result;
 	regproc typoutput;
@@ -77,10 +145,10 @@ ogrStringFromDatum(Datum datum, Oid type)
 	/* render the constant in OGR SQL */
 	switch (type)
 	{
-		case TEXTOID:
 		case DATEOID:
 		case TIMESTAMPOID:
-		case TIMESTAMPTZOID:
+			return ogrDateTimeString(datum, type, dialect);
+		case TEXTOID:
 		case CHAROID:
 		case BPCHAROID:
 		case VARCHAROID:
@@ -127,59 +195,18 @@ ogrDeparseConst(Const* constant, OgrDeparseCtx *context)
 	{
 		appendStringInfoString(context->buf, "NULL");
 	}
-	/* Use geometry as a spatial filter? */
+	/*
+	 * Geometry doesn't play a role in the deparsed SQL, geometry
+	 * constants are picked up as spatial filters by ogrSpatialFilterAdd
+	 */
 	else if ( constant->consttype == GEOMETRYOID )
 	{
-		/*
-		 * For geometry we need to convert the gserialized constant into 
-		 * an OGRGeometry for the OGR spatial filter.
-		 * For that, we can use the type's "send" function
-		 * which takes in gserialized and spits out EWKB.
-		 */
-		Oid sendfunction;
-		bool typeIsVarlena;
-		Datum wkbdatum;
-		char *gser;
-		char *wkb;
-		int wkb_size;
-		OGRGeometryH ogrgeom;
-		OGRErr err;
-
-		/*
-		 * Given a type oid (geometry in this case),
-		 * look up the "send" function that takes in
-		 * serialized input and outputs the binary (WKB) form.
-		 */
-		getTypeBinaryOutputInfo(constant->consttype, &sendfunction, &typeIsVarlena);
-		wkbdatum = OidFunctionCall1(sendfunction, constant->constvalue);
-		
-		/* 
-		 * Convert the WKB into an OGR geometry 
-		 */
-		gser = DatumGetPointer(wkbdatum);
-		wkb = VARDATA(gser);
-		wkb_size = VARSIZE(gser) - VARHDRSZ;
-		err = OGR_G_CreateFromWkb((unsigned char *)wkb, NULL, &ogrgeom, wkb_size);
-		
-		/* 
-		 * Save the result
-		 */
-		if ( err != OGRERR_NONE )
-		{
-			if ( ! context->geom )
-				context->geom = ogrgeom;
-			else
-				elog(WARNING, "got two geometries in OGR FDW query, only using the first");
-		}
-		/* 
-		 * geometry doesn't play a role in the deparsed SQL 
-		 */
 		return false;
 	}
 	else
 	{
 		/* get a string representation of the value */
-		char *c = ogrStringFromDatum(constant->constvalue, constant->consttype);
+		char *c = ogrStringFromDatum(constant->constvalue, constant->consttype, context->dialect);
 		if ( c == NULL )
 		{
 			return false;
@@ -193,11 +220,69 @@ ogrDeparseConst(Const* constant, OgrDeparseCtx *context)
 }
 
 
+/*
+ * Types whose values ogrStringFromDatum can write into OGR SQL
+ * once they are known.
+ */
+static bool
+ogrTypeIsBindable(Oid type, OgrSqlDialect dialect)
+{
+	switch (type)
+	{
+		case TIMESTAMPOID:
+			return dialect != OGR_DIALECT_SQLITE;
+		case TEXTOID:
+		case DATEOID:
+		case CHAROID:
+		case BPCHAROID:
+		case VARCHAROID:
+		case NAMEOID:
+		case INT8OID:
+		case INT2OID:
+		case INT4OID:
+		case OIDOID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case NUMERICOID:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Values only known at execution time, query parameters and
+ * columns from the outer side of a join, go into the OGR SQL as
+ * $n placeholders, numbered by their place in the params list.
+ * The scan fills in the values before it sets the filter.
+ */
+static bool
+ogrDeparseExecValue(Expr *node, Oid type, OgrDeparseCtx *context)
+{
+	List **params = context->params_list;
+	ListCell *lc;
+	int idx = 1;
+
+	if ( ! params || ! ogrTypeIsBindable(type, context->dialect) )
+		return false;
+
+	foreach(lc, *params)
+	{
+		if ( equal(node, lfirst(lc)) )
+			break;
+		idx++;
+	}
+	if ( ! lc )
+		*params = lappend(*params, node);
+
+	appendStringInfo(context->buf, "$%d", idx);
+	return true;
+}
+
 static bool
 ogrDeparseParam(Param *node, OgrDeparseCtx *context)
 {
-	elog(DEBUG3, "got into ogrDeparseParam code");
-	return false;
+	return ogrDeparseExecValue((Expr *) node, node->paramtype, context);
 }
 
 static bool
@@ -222,10 +307,69 @@ ogrIsLegalVarName(const char *varname)
 	return true;
 }
 
+/*
+ * Find the column a Var reads in the tables of a join the
+ * database runs, with the table it belongs to and the alias
+ * the SQL gives that table.
+ */
+static OgrFdwColumn *
+ogrVarColumn(Var *var, OgrDeparseCtx *context, GisFdwState **state, const char **alias)
+{
+	GisFdwState *st;
+	int i;
+
+	if ( var->varlevelsup != 0 )
+		return NULL;
+
+	if ( var->varno == context->foreignrel->relid )
+	{
+		st = context->state;
+		*alias = "r1";
+	}
+	else if ( context->innerrel && var->varno == context->innerrel->relid )
+	{
+		st = context->inner_state;
+		*alias = "r2";
+	}
+	else
+	{
+		return NULL;
+	}
+
+	for ( i = 0; i < st->table->ncols; i++ )
+	{
+		OgrFdwColumn *col = &(st->table->cols[i]);
+
+		if ( col->pgattnum == var->varattno && ! col->pgattisdropped )
+		{
+			*state = st;
+			return col;
+		}
+	}
+	return NULL;
+}
+
 static bool
 ogrDeparseVar(Var *node, OgrDeparseCtx *context)
 {
 	StringInfoData *buf = context->buf;
+
+	/* Columns of a join go by their table's alias, geometries only into spatial tests */
+	if ( context->innerrel )
+	{
+		GisFdwState *state;
+		const char *alias;
+		const char *name;
+		OgrFdwColumn *col = ogrVarColumn(node, context, &state, &alias);
+
+		if ( ! col || col->ogrvariant == OGR_GEOMETRY ||
+		     ! (name = ogrColumnSourceName(col, state->ogr.lyr)) )
+			return false;
+
+		appendStringInfo(buf, "%s.", alias);
+		ogrAppendQuotedName(buf, name);
+		return true;
+	}
 	
 	if (node->varno == context->foreignrel->relid && node->varlevelsup == 0)
 	{
@@ -276,11 +420,9 @@ ogrDeparseVar(Var *node, OgrDeparseCtx *context)
 	}
 	else
 	{
-		elog(ERROR, "got to param handling section of ogrDeparseVar");
-		return false;
+		/* Column of the outer side of a join */
+		return ogrDeparseExecValue((Expr *) node, node->vartype, context);
 	}
-	
-	return true;
 }
 
 static int ogrOperatorCmpFunc(const void * a, const void * b)
@@ -304,295 +446,1943 @@ ogrOperatorIsSupported(const char *opname)
 }
 
 
-static bool
-ogrDeparseOpExpr(OpExpr* node, OgrDeparseCtx *context)
+/*
+ * Return the foreign table column for a node, if it is a geometry
+ * column of the foreign table that maps to an OGR geometry field.
+ */
+static OgrFdwColumn *
+ogrSpatialColumn(Expr *node, OgrDeparseCtx *context)
 {
-	StringInfo buf = context->buf;
-	HeapTuple tuple;
-	Form_pg_operator form;
-	char oprkind;
-	char *opname;
-	ListCell *arg;
-	bool result = true;
+	OgrFdwTable *table = context->state->table;
+	Var *var;
+	int i;
 
-	/* Retrieve information about the operator from system catalog. */
-	tuple = SearchSysCache1(OPEROID, ObjectIdGetDatum(node->opno));
-	if (!HeapTupleIsValid(tuple))
-		elog(ERROR, "cache lookup failed for operator %u", node->opno);
-	form = (Form_pg_operator) GETSTRUCT(tuple);
-	oprkind = form->oprkind;
-	opname = NameStr(form->oprname);
+	while ( node && IsA(node, RelabelType) )
+		node = ((RelabelType *) node)->arg;
 
-	/* Don't deparse expressions we cannot support */
-	if ( ! ogrOperatorIsSupported(opname) )
-	{
-		ReleaseSysCache(tuple);
-		return false;
-	}
+	if ( ! node || ! IsA(node, Var) )
+		return NULL;
 
-	/* TODO: When a && operator is found, we need to do special */
-	/*       handling to send the box back up to OGR for SetSpatialFilter */
+	var = (Var *) node;
+	if ( var->varno != context->foreignrel->relid || var->varlevelsup != 0 )
+		return NULL;
 
-	/* Overlaps operator is special case: if one side is a constant, */
-	/* then we can pass it as a spatial filter to OGR */
-	if ( strcmp("&&", opname) == 0 )
+	for ( i = 0; i < table->ncols; i++ )
 	{
-		// Expr *r_arg = lfirst(list_head(node->args));
-		// Expr *l_arg = lfirst(list_tail(node->args));
-		// Const *constant;
+		if ( table->cols[i].pgattnum == var->varattno &&
+		     table->cols[i].ogrvariant == OGR_GEOMETRY &&
+		     table->cols[i].pgtype == GEOMETRYOID )
+		{
+			return &(table->cols[i]);
+		}
+	}
+	return NULL;
+}
 
-		elog(DEBUG1, "whoa, dude, found a && operator");
+/*
+ * Convert a geometry constant into an OGR geometry. For that,
+ * we can use the type's "send" function which takes in
+ * gserialized and spits out EWKB.
+ */
+static OGRGeometryH
+ogrSpatialConst(Expr *node)
+{
+	Const *constant;
+	Oid sendfunction;
+	bool typeIsVarlena;
+	bytea *wkb_bytea;
+	unsigned char *wkb;
+	size_t wkbsize;
+	OGRGeometryH geom = NULL;
+
+	while ( node && IsA(node, RelabelType) )
+		node = ((RelabelType *) node)->arg;
+
+	if ( ! node || ! IsA(node, Const) )
+		return NULL;
 
-		/* Specifically, we need a Geometry Const on one side and a Var */
-		/* column on the other side that is from the FDW relation */
-		/* Both of those implies and OGR spatial filter can be reasonably */
-		/* set. */
+	constant = (Const *) node;
+	if ( constant->constisnull || constant->consttype != GEOMETRYOID )
+		return NULL;
 
-		// if ( nodeTag(r_arg) == T_Const )
-		// 	constant = (Const*)r_arg;
-		// else if ( nodeTag(l_arg) == T_Const)
-		// 	constant = (Const*)l_arg;
-		// else
-		// 	return false;
-		
-		// if ( constant->consttype != GEOMETRYOID )
+	getTypeBinaryOutputInfo(constant->consttype, &sendfunction, &typeIsVarlena);
+	wkb_bytea = DatumGetByteaP(OidFunctionCall1(sendfunction, constant->constvalue));
+	wkb = (unsigned char *) VARDATA(wkb_bytea);
+	wkbsize = ogrEwkbStripSrid(wkb, VARSIZE(wkb_bytea) - VARHDRSZ);
 
-		ReleaseSysCache(tuple);
+	if ( OGR_G_CreateFromWkb(wkb, NULL, &geom, wkbsize) != OGRERR_NONE )
+		geom = NULL;
 
-		return false;
-	}
+	pfree(wkb_bytea);
+	return geom;
+}
 
-	/* Sanity check. */
-	Assert((oprkind == 'r' && list_length(node->args) == 1) ||
-	       (oprkind == 'l' && list_length(node->args) == 1) ||
-	       (oprkind == 'b' && list_length(node->args) == 2));
+/*
+ * Record a restriction between a geometry column and a geometry
+ * constant as a spatial filter. The bounds of the constant, grown
+ * by "expand", narrow the filter envelope. Only restrictions that
+ * hold for the whole query (not under an OR) can become filters.
+ * The filter is only a pre-filter, PgSQL still applies the
+ * restriction itself.
+ */
+static void
+ogrSpatialFilterAdd(List *args, double expand, bool exact, OgrDeparseCtx *context)
+{
+	OgrFdwSpatialFilter *spatial = context->spatial;
+	OgrFdwColumn *col;
+	OGRGeometryH geom = NULL;
+	OGREnvelope env;
+
+	if ( ! spatial || context->or_depth > 0 || list_length(args) < 2 )
+		return;
+
+	/* Specifically, we need a geometry column on one side */
+	/* and a geometry constant on the other */
+	if ( (col = ogrSpatialColumn(linitial(args), context)) )
+		geom = ogrSpatialConst(lsecond(args));
+	else if ( (col = ogrSpatialColumn(lsecond(args), context)) )
+		geom = ogrSpatialConst(linitial(args));
+
+	if ( ! geom )
+		return;
+
+	/* OGR filters one geometry field at a time, stick with the first */
+	if ( spatial->nfilters > 0 && spatial->ogrfldnum != col->ogrfldnum )
+	{
+		OGR_G_DestroyGeometry(geom);
+		return;
+	}
 
-	/* Always parenthesize the operator expression. */
-	appendStringInfoChar(buf, '(');
+	OGR_G_GetEnvelope(geom, &env);
+	env.MinX -= expand;
+	env.MinY -= expand;
+	env.MaxX += expand;
+	env.MaxY += expand;
 
-	/* Deparse left operand. */
-	if ( oprkind == 'r' || oprkind == 'b' )
+	if ( spatial->nfilters == 0 )
 	{
-		arg = list_head(node->args);
-		/* recurse for nested operations */
-		result &= ogrDeparseExpr(lfirst(arg), context);
-		appendStringInfoChar(buf, ' ');
+		spatial->ogrfldnum = col->ogrfldnum;
+		spatial->env = env;
 	}
-
-	/* Special case, the 'LIKE' operator is converted to ~~ */
-	/* by PgSQL, so we have to convert it back here */
-	/* All OGR string comparisons are case insensitive, so we just */
-	/* use 'ILIKE' all the time. */
-	if ( streq(opname, "~~") || streq(opname, "~~*") )
-		opname = "ILIKE";
-	
-	/* Operator symbol */
-	appendStringInfoString(buf, opname);
-	
-	/* Deparse right operand. */
-	if (oprkind == 'l' || oprkind == 'b')
+	else
 	{
-		arg = list_tail(node->args);
-		appendStringInfoChar(buf, ' ');
-		/* recurse for nested operations */
-		result &= ogrDeparseExpr(lfirst(arg), context);
+		spatial->env.MinX = Max(spatial->env.MinX, env.MinX);
+		spatial->env.MinY = Max(spatial->env.MinY, env.MinY);
+		spatial->env.MaxX = Min(spatial->env.MaxX, env.MaxX);
+		spatial->env.MaxY = Min(spatial->env.MaxY, env.MaxY);
 	}
 
-	appendStringInfoChar(buf, ')');
+	/* An exact geometry is only useful as the sole restriction */
+	if ( spatial->geom )
+	{
+		OGR_G_DestroyGeometry(spatial->geom);
+		spatial->geom = NULL;
+	}
+	if ( exact && spatial->nfilters == 0 )
+		spatial->geom = geom;
+	else
+		OGR_G_DestroyGeometry(geom);
 
-	ReleaseSysCache(tuple);
-	return result;
-	
+	spatial->nfilters++;
+	elog(DEBUG2, "OGR spatial filter %d on field %d", spatial->nfilters, spatial->ogrfldnum);
 }
 
+/*
+ * Spatial functions never appear in the OGR SQL, but
+ * ST_Intersects() and ST_DWithin() against constants can
+ * become spatial filters. (PostGIS 2 inlines these into a
+ * && and an underscore function, so look for those too.)
+ * ST_Intersects() between the tables of a join goes into
+ * the SQL of the database running it.
+ */
 static bool
-ogrDeparseBoolExpr(BoolExpr *node, OgrDeparseCtx *context)
+ogrDeparseFuncExpr(FuncExpr *node, OgrDeparseCtx *context)
 {
-	const char *op = NULL;		/* keep compiler quiet */
-	ListCell *lc;
-	bool first = true;
-	bool result = true;
-	int len_save_all, len_save_part;
-	int boolop = node->boolop;
-	int result_total = 0;
-	StringInfo buf = context->buf;
+	char *funcname;
+	int nargs = list_length(node->args);
+	bool result = false;
 
-	switch (boolop)
+	/* Type conversions, apart from length coercions which take more args */
+	if ( node->funcformat == COERCE_EXPLICIT_CAST || node->funcformat == COERCE_IMPLICIT_CAST )
 	{
-		case AND_EXPR:
-			op = "AND";
-			break;
-		case OR_EXPR:
-			op = "OR";
-			break;
-
-		/* OGR SQL cannot handle "NOT" */
-		case NOT_EXPR:
-			return false;
+		if ( nargs == 1 )
+			return ogrDeparseCast(linitial(node->args), node->funcresulttype, context);
+		return false;
 	}
 
-	len_save_all = buf->len;
+	funcname = get_func_name(node->funcid);
+	if ( ! funcname )
+		return false;
 
-	appendStringInfoChar(buf, '(');
-	foreach(lc, node->args)
+	if ( (streq(funcname, "st_intersects") || streq(funcname, "_st_intersects")) && nargs == 2 )
 	{
-		
-		len_save_part = buf->len;
-		
-		/* Connect expressions and parenthesize each condition */
-		if ( ! first )
-			appendStringInfo(buf, " %s ", op);
-
-		/* Unparse the expression, if possible */
-		result = ogrDeparseExpr((Expr *) lfirst(lc), context);
-		result_total += result;
-		
-		/* We can backtrack just this term for AND expressions */
-		if ( boolop == AND_EXPR && ! result )
-			setStringInfoLength(buf, len_save_part);
-
-		/* We have to drop the whole thing if we can't get every part of an OR expression */
-		if ( boolop == OR_EXPR && ! result )
-			break;
-		
-		/* Don't flip the "first" bit until we get a good expression */
-		if ( first && result )
-			first = false;
+		if ( context->innerrel )
+			result = ogrDeparseSpatialJoin(node->args, true, context);
+		else
+			ogrSpatialFilterAdd(node->args, 0.0, true, context);
+	}
+	else if ( (streq(funcname, "st_dwithin") || streq(funcname, "_st_dwithin")) && nargs == 3 )
+	{
+		Const *dist = (Const *) lthird(node->args);
+		if ( IsA(dist, Const) && ! dist->constisnull && dist->consttype == FLOAT8OID )
+			ogrSpatialFilterAdd(node->args, DatumGetFloat8(dist->constvalue), false, context);
+	}
+	else
+	{
+		elog(NOTICE, "unsupported OGR FDW expression type, T_FuncExpr");
 	}
-	appendStringInfoChar(buf, ')');
-	
-	/* We have to drop the whole thing if we can't get every part of an OR expression */
-	if ( boolop == OR_EXPR && ! result )
-		setStringInfoLength(buf, len_save_all);
-	
-	return result_total > 0;
-}
 
+	pfree(funcname);
+	return result;
+}
 
+/*
+ * Whether a node is the FID column of the foreign table.
+ */
 static bool
-ogrDeparseRelabelType(RelabelType *node, OgrDeparseCtx *context)
+ogrIsFidColumn(Expr *node, OgrDeparseCtx *context)
 {
-	if (node->relabelformat != COERCE_IMPLICIT_CAST)
-		elog(WARNING, "Received a non-implicit relabel expression but did not handle it");
+	OgrFdwTable *table = context->state->table;
+	Var *var;
+	int i;
+
+	while ( node && IsA(node, RelabelType) )
+		node = ((RelabelType *) node)->arg;
+
+	if ( ! node || ! IsA(node, Var) )
+		return false;
+
+	var = (Var *) node;
+	if ( var->varno != context->foreignrel->relid || var->varlevelsup != 0 )
+		return false;
+
+	for ( i = 0; i < table->ncols; i++ )
+	{
+		if ( table->cols[i].pgattnum == var->varattno )
+			return table->cols[i].ogrvariant == OGR_FID;
+	}
+	return false;
+}
+
+/*
+ * Read an integer value of a given type.
+ */
+static bool
+ogrFidFromDatum(Datum value, Oid type, GIntBig *fid)
+{
+	switch ( type )
+	{
+		case INT2OID:
+			*fid = DatumGetInt16(value);
+			return true;
+		case INT4OID:
+			*fid = DatumGetInt32(value);
+			return true;
+		case INT8OID:
+			*fid = DatumGetInt64(value);
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool
+ogrFidConst(Expr *node, GIntBig *fid)
+{
+	Const *constant;
+
+	while ( node && IsA(node, RelabelType) )
+		node = ((RelabelType *) node)->arg;
+
+	if ( ! node || ! IsA(node, Const) )
+		return false;
+
+	constant = (Const *) node;
+	if ( constant->constisnull )
+		return false;
+
+	return ogrFidFromDatum(constant->constvalue, constant->consttype, fid);
+}
+
+/*
+ * Narrow the FIDs to look up to those also in a new list.
+ */
+static void
+ogrFidFilterLookup(OgrFdwFidFilter *fid, const GIntBig *fids, int nfids)
+{
+	int i, j, n = 0;
+
+	if ( ! fid->lookup )
+	{
+		fid->fids = palloc(sizeof(GIntBig) * Max(nfids, 1));
+		memcpy(fid->fids, fids, sizeof(GIntBig) * nfids);
+		fid->nfids = nfids;
+		fid->lookup = true;
+		return;
+	}
+
+	for ( i = 0; i < fid->nfids; i++ )
+	{
+		for ( j = 0; j < nfids; j++ )
+		{
+			if ( fid->fids[i] == fids[j] )
+			{
+				fid->fids[n++] = fid->fids[i];
+				break;
+			}
+		}
+	}
+	fid->nfids = n;
+}
+
+/*
+ * Record a comparison between the FID column and an integer
+ * constant. Like spatial filters, only restrictions that hold
+ * for the whole query can be used. They stay in the OGR SQL too,
+ * and PgSQL still applies them itself.
+ */
+static void
+ogrFidFilterAdd(List *args, const char *opname, OgrDeparseCtx *context)
+{
+	OgrFdwFidFilter *fid = context->fid;
+	GIntBig val;
+	bool commuted = false;
+
+	if ( ! fid || context->or_depth > 0 || list_length(args) != 2 )
+		return;
+
+	if ( ogrIsFidColumn(lsecond(args), context) && ogrFidConst(linitial(args), &val) )
+		commuted = true;
+	else if ( ! (ogrIsFidColumn(linitial(args), context) && ogrFidConst(lsecond(args), &val)) )
+		return;
+
+	/* Read "const op fid" as "fid op' const" */
+	if ( commuted )
+	{
+		if ( streq(opname, "<") ) opname = ">";
+		else if ( streq(opname, "<=") ) opname = ">=";
+		else if ( streq(opname, ">") ) opname = "<";
+		else if ( streq(opname, ">=") ) opname = "<=";
+	}
+
+	if ( streq(opname, "=") )
+	{
+		ogrFidFilterLookup(fid, &val, 1);
+	}
+	else if ( streq(opname, ">") || streq(opname, ">=") )
+	{
+		if ( streq(opname, ">") )
+		{
+			if ( val == GINTBIG_MAX )
+				return;
+			val++;
+		}
+		if ( ! fid->has_min || val > fid->min_fid )
+			fid->min_fid = val;
+		fid->has_min = true;
+	}
+	else if ( streq(opname, "<") || streq(opname, "<=") )
+	{
+		if ( streq(opname, "<") )
+		{
+			if ( val == GINTBIG_MIN )
+				return;
+			val--;
+		}
+		if ( ! fid->has_max || val < fid->max_fid )
+			fid->max_fid = val;
+		fid->has_max = true;
+	}
+	else
+	{
+		return;
+	}
+
+	fid->nclauses++;
+}
+
+static int
+ogrFidCmpFunc(const void *a, const void *b)
+{
+	GIntBig fa = *(const GIntBig *) a;
+	GIntBig fb = *(const GIntBig *) b;
+
+	return fa < fb ? -1 : (fa > fb ? 1 : 0);
+}
+
+/*
+ * Drop the FIDs to look up that are outside the FID range, and
+ * sort them so features are read in order, once.
+ */
+static void
+ogrFidFilterFinish(OgrFdwFidFilter *fid)
+{
+	int i, n = 0;
+
+	if ( ! fid->lookup )
+		return;
+
+	qsort(fid->fids, fid->nfids, sizeof(GIntBig), ogrFidCmpFunc);
+	for ( i = 0; i < fid->nfids; i++ )
+	{
+		if ( fid->has_min && fid->fids[i] < fid->min_fid )
+			continue;
+		if ( fid->has_max && fid->fids[i] > fid->max_fid )
+			continue;
+		if ( n > 0 && fid->fids[n-1] == fid->fids[i] )
+			continue;
+		fid->fids[n++] = fid->fids[i];
+	}
+	fid->nfids = n;
+}
+
+/*
+ * Whether OGR compares an operand exactly like PgSQL does: integer
+ * columns backed by integer OGR fields (or the FID), and integer
+ * constants. OGR compares strings case-insensitively, reals may
+ * have been rounded on the way into PgSQL, and so on.
+ */
+static bool
+ogrIsExactOperand(Expr *node, OgrDeparseCtx *context)
+{
+	while ( node && IsA(node, RelabelType) )
+		node = ((RelabelType *) node)->arg;
+
+	if ( ! node )
+		return false;
+
+	if ( IsA(node, Const) )
+	{
+		Const *constant = (Const *) node;
+		return ! constant->constisnull &&
+		       (constant->consttype == INT2OID ||
+		        constant->consttype == INT4OID ||
+		        constant->consttype == INT8OID);
+	}
+
+	if ( IsA(node, Var) )
+	{
+		GisFdwState *state;
+		const char *alias;
+		OgrFdwColumn *col = ogrVarColumn((Var *) node, context, &state, &alias);
+
+		if ( ! col )
+			return false;
+
+		if ( col->pgtype != INT2OID && col->pgtype != INT4OID && col->pgtype != INT8OID )
+			return false;
+		if ( col->ogrvariant == OGR_FID )
+			return true;
+		return col->ogrvariant == OGR_FIELD &&
+		       (col->ogrfldtype == OFTInteger
+#if GDAL_VERSION_MAJOR >= 2
+		        || col->ogrfldtype == OFTInteger64
+#endif
+		       );
+	}
+
+	return false;
+}
+
+static bool
+ogrArgsAreExact(List *args, OgrDeparseCtx *context)
+{
+	ListCell *lc;
+
+	foreach(lc, args)
+	{
+		if ( ! ogrIsExactOperand(lfirst(lc), context) )
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Whether the operands are columns, constants and values bound in
+ * at execution as they are, without a cast.
+ */
+static bool
+ogrArgsArePlain(List *args)
+{
+	ListCell *lc;
+
+	foreach(lc, args)
+	{
+		Expr *node = (Expr *) lfirst(lc);
+
+		while ( node && IsA(node, RelabelType) )
+			node = ((RelabelType *) node)->arg;
+
+		if ( ! node || ! (IsA(node, Var) || IsA(node, Const) || IsA(node, Param)) )
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Whether OGR applies an operator clause exactly as PgSQL would.
+ * Inequality is left out, since OGR's handling of NULL fields in
+ * it has varied between versions.
+ */
+static bool
+ogrOpExprIsExact(const char *opname, List *args, OgrDeparseCtx *context)
+{
+	if ( ! (streq(opname, "=") || streq(opname, "<") || streq(opname, "<=") ||
+	        streq(opname, ">") || streq(opname, ">=")) )
+		return false;
+
+	return ogrArgsAreExact(args, context);
+}
+
+/*
+ * Whether a negated clause keeps every feature PgSQL keeps. OGR SQL
+ * compares strings without case, so "name <> 'PAUL'" would leave
+ * out 'Paul'. Negations are only handed on when all their operands
+ * are exact, or in SQLite when the clause only tests plain operands
+ * with =, <> and IN: its BINARY collation, LIKE and casts can order
+ * and match values unlike PgSQL does.
+ */
+static bool
+ogrCanNegate(bool exact, bool equality, OgrDeparseCtx *context)
+{
+	if ( exact )
+		return true;
+	return context->dialect == OGR_DIALECT_SQLITE && equality;
+}
+
+static bool
+ogrDeparseOpExpr(OpExpr* node, OgrDeparseCtx *context)
+{
+	StringInfo buf = context->buf;
+	HeapTuple tuple;
+	Form_pg_operator form;
+	char oprkind;
+	char *opname;
+	ListCell *arg;
+	bool result = true;
+
+	/* Retrieve information about the operator from system catalog. */
+	tuple = SearchSysCache1(OPEROID, ObjectIdGetDatum(node->opno));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for operator %u", node->opno);
+	form = (Form_pg_operator) GETSTRUCT(tuple);
+	oprkind = form->oprkind;
+	opname = NameStr(form->oprname);
+
+	/* Don't deparse expressions we cannot support */
+	if ( ! ogrOperatorIsSupported(opname) )
+	{
+		ReleaseSysCache(tuple);
+		return false;
+	}
+
+	/* Overlaps operator is special case: if one side is a constant, */
+	/* then we can pass its box as a spatial filter to OGR, but it */
+	/* never goes into the OGR SQL. Between the tables of a join */
+	/* run by PostGIS, it goes into its SQL as is. */
+	if ( strcmp("&&", opname) == 0 )
+	{
+		ReleaseSysCache(tuple);
+		if ( context->innerrel )
+			return ogrDeparseSpatialJoin(node->args, false, context);
+		ogrSpatialFilterAdd(node->args, 0.0, false, context);
+		return false;
+	}
+
+	/* Inequality is a negation, and OGR may match fewer features on it */
+	if ( oprkind == 'b' && (streq(opname, "<>") || streq(opname, "!=")) &&
+	     ! ogrCanNegate(ogrArgsAreExact(node->args, context), ogrArgsArePlain(node->args), context) )
+	{
+		ReleaseSysCache(tuple);
+		return false;
+	}
+
+	/* Comparisons on the FID can be served by direct reads */
+	if ( oprkind == 'b' )
+		ogrFidFilterAdd(node->args, opname, context);
+
+	if ( oprkind != 'b' || ! ogrOpExprIsExact(opname, node->args, context) )
+	{
+		context->exact = false;
+		if ( ! (streq(opname, "=") || streq(opname, "<>") || streq(opname, "!=")) ||
+		     ! ogrArgsArePlain(node->args) )
+			context->equality = false;
+	}
+
+	/* Sanity check. */
+	Assert((oprkind == 'r' && list_length(node->args) == 1) ||
+	       (oprkind == 'l' && list_length(node->args) == 1) ||
+	       (oprkind == 'b' && list_length(node->args) == 2));
+
+	/* Always parenthesize the operator expression. */
+	appendStringInfoChar(buf, '(');
+
+	/* Deparse left operand. */
+	if ( oprkind == 'r' || oprkind == 'b' )
+	{
+		arg = list_head(node->args);
+		/* recurse for nested operations */
+		result &= ogrDeparseExpr(lfirst(arg), context);
+		appendStringInfoChar(buf, ' ');
+	}
+
+	/* Special case, the 'LIKE' operator is converted to ~~ */
+	/* by PgSQL, so we have to convert it back here */
+	/* All OGR string comparisons are case insensitive, so we just */
+	/* use 'ILIKE' all the time. SQLite has no ILIKE, but its LIKE */
+	/* is case insensitive. */
+	if ( streq(opname, "~~") || streq(opname, "~~*") )
+		opname = (context->dialect == OGR_DIALECT_SQLITE) ? "LIKE" : "ILIKE";
+	
+	/* Operator symbol */
+	appendStringInfoString(buf, opname);
+	
+	/* Deparse right operand. */
+	if (oprkind == 'l' || oprkind == 'b')
+	{
+		arg = list_tail(node->args);
+		appendStringInfoChar(buf, ' ');
+		/* recurse for nested operations */
+		result &= ogrDeparseExpr(lfirst(arg), context);
+	}
+
+	appendStringInfoChar(buf, ')');
+
+	ReleaseSysCache(tuple);
+	return result;
+	
+}
+
+/*
+ * Only a clause deparsed in full can be negated: leaving a term
+ * of an AND out anywhere inside would make the negation leave out
+ * features PgSQL keeps. So would a clause OGR matches on more
+ * features than PgSQL, see ogrCanNegate().
+ */
+static bool
+ogrDeparseNotExpr(BoolExpr *node, OgrDeparseCtx *context)
+{
+	StringInfo buf = context->buf;
+	int len_save = buf->len;
+	bool incomplete_save = context->incomplete;
+	bool equality_save = context->equality;
+	Expr *arg = (Expr *) linitial(node->args);
+	bool result;
+
+	/* Filters found inside don't hold for the query */
+	context->or_depth++;
+	context->incomplete = false;
+	context->equality = true;
+
+	/* Only operators and their combinations can be exact */
+	context->exact = IsA(arg, OpExpr) || IsA(arg, BoolExpr) || IsA(arg, ScalarArrayOpExpr);
+
+	appendStringInfoString(buf, "(NOT ");
+	result = ogrDeparseExpr(arg, context);
+	appendStringInfoChar(buf, ')');
+
+	if ( ! result || context->incomplete ||
+	     ! ogrCanNegate(context->exact, context->equality, context) )
+	{
+		setStringInfoLength(buf, len_save);
+		result = false;
+	}
+
+	context->or_depth--;
+	context->exact = false;
+	context->incomplete = incomplete_save;
+	context->equality = context->equality && equality_save;
+	return result;
+}
+
+static bool
+ogrDeparseBoolExpr(BoolExpr *node, OgrDeparseCtx *context)
+{
+	const char *op = NULL;		/* keep compiler quiet */
+	ListCell *lc;
+	bool first = true;
+	bool result = true;
+	int len_save_all, len_save_part;
+	int boolop = node->boolop;
+	int result_total = 0;
+	StringInfo buf = context->buf;
+
+	switch (boolop)
+	{
+		case AND_EXPR:
+			op = "AND";
+			break;
+		case OR_EXPR:
+			op = "OR";
+			break;
+
+		case NOT_EXPR:
+			return ogrDeparseNotExpr(node, context);
+	}
+
+	len_save_all = buf->len;
+
+	/* Spatial filters only apply when every OR branch has them */
+	if ( boolop == OR_EXPR )
+		context->or_depth++;
+
+	appendStringInfoChar(buf, '(');
+	foreach(lc, node->args)
+	{
+		
+		len_save_part = buf->len;
+		
+		/* Connect expressions and parenthesize each condition */
+		if ( ! first )
+			appendStringInfo(buf, " %s ", op);
+
+		/* Only operators and their combinations can be exact */
+		if ( ! IsA(lfirst(lc), OpExpr) && ! IsA(lfirst(lc), BoolExpr) )
+			context->exact = false;
+
+		/* Unparse the expression, if possible */
+		result = ogrDeparseExpr((Expr *) lfirst(lc), context);
+		result_total += result;
+		
+		/* We can backtrack just this term for AND expressions */
+		/* (and OGR then only applies part of the clause) */
+		if ( boolop == AND_EXPR && ! result )
+		{
+			setStringInfoLength(buf, len_save_part);
+			context->exact = false;
+			context->incomplete = true;
+		}
+
+		/* We have to drop the whole thing if we can't get every part of an OR expression */
+		if ( boolop == OR_EXPR && ! result )
+			break;
+		
+		/* Don't flip the "first" bit until we get a good expression */
+		if ( first && result )
+			first = false;
+	}
+	appendStringInfoChar(buf, ')');
+
+	if ( boolop == OR_EXPR )
+		context->or_depth--;
+
+	/* We have to drop the whole thing if we can't get every part of an OR expression */
+	if ( boolop == OR_EXPR && ! result )
+	{
+		setStringInfoLength(buf, len_save_all);
+		return false;
+	}
+	
+	return result_total > 0;
+}
+
+
+static bool
+ogrDeparseRelabelType(RelabelType *node, OgrDeparseCtx *context)
+{
+	if (node->relabelformat != COERCE_IMPLICIT_CAST)
+		elog(WARNING, "Received a non-implicit relabel expression but did not handle it");
 
 	return ogrDeparseExpr(node->arg, context);
 }
 
 static bool
-ogrDeparseNullTest(NullTest *node, OgrDeparseCtx *context)
+ogrDeparseNullTest(NullTest *node, OgrDeparseCtx *context)
+{
+	StringInfo buf = context->buf;
+	int len_save = buf->len;
+
+    appendStringInfoChar(buf, '(');
+    if ( ! ogrDeparseExpr(node->arg, context) )
+    {
+        setStringInfoLength(buf, len_save);
+        return false;
+    }
+    if (node->nulltesttype == IS_NULL)
+        appendStringInfoString(buf, " IS NULL)");
+    else
+        appendStringInfoString(buf, " IS NOT NULL)");
+
+	return true;
+}
+
+/*
+ * IN and NOT IN lists, which PgSQL turns into "col = ANY(ARRAY)"
+ * and "col <> ALL(ARRAY)", go into the OGR SQL as lists when the
+ * array is a constant. NULLs in an IN list can't match and are
+ * left out. A NOT IN list with NULLs matches nothing in PgSQL,
+ * that's left to PgSQL. IN lists on the FID can also be read by
+ * FID.
+ */
+static bool
+ogrDeparseScalarArrayOpExpr(ScalarArrayOpExpr *node, OgrDeparseCtx *context)
+{
+	StringInfo buf = context->buf;
+	int len_save = buf->len;
+	OgrFdwFidFilter *fid = context->fid;
+	Expr *arg;
+	Const *constant;
+	char *opname;
+	ArrayType *arr;
+	Oid elemtype;
+	int16 elmlen;
+	bool elmbyval;
+	char elmalign;
+	Datum *elems;
+	bool *nulls;
+	int nelems, i, n = 0;
+	bool first = true;
+	bool intlist, exact;
+
+	if ( list_length(node->args) != 2 )
+		return false;
+
+	opname = get_opname(node->opno);
+	arg = lsecond(node->args);
+	if ( ! opname ||
+	     ! (node->useOr ? streq(opname, "=") : (streq(opname, "<>") || streq(opname, "!="))) ||
+	     ! IsA(arg, Const) || ((Const *) arg)->constisnull )
+	{
+		elog(NOTICE, "unsupported OGR FDW expression type, T_ScalarArrayOpExpr");
+		return false;
+	}
+
+	constant = (Const *) arg;
+	arr = DatumGetArrayTypeP(constant->constvalue);
+	elemtype = ARR_ELEMTYPE(arr);
+	if ( elemtype == BOOLOID )
+		return false;
+
+	get_typlenbyvalalign(elemtype, &elmlen, &elmbyval, &elmalign);
+	deconstruct_array(arr, elemtype, elmlen, elmbyval, elmalign, &elems, &nulls, &nelems);
+
+	intlist = (elemtype == INT2OID || elemtype == INT4OID || elemtype == INT8OID);
+	exact = intlist && ogrIsExactOperand(linitial(node->args), context);
+	if ( ! node->useOr || ! exact )
+		context->exact = false;
+
+	/* NOT IN is a negation, see ogrCanNegate() */
+	if ( ! node->useOr && ! ogrCanNegate(exact, ogrArgsArePlain(node->args), context) )
+		return false;
+
+	appendStringInfoChar(buf, '(');
+	if ( ! ogrDeparseExpr(linitial(node->args), context) )
+	{
+		setStringInfoLength(buf, len_save);
+		return false;
+	}
+	appendStringInfoString(buf, node->useOr ? " IN (" : " NOT IN (");
+	for ( i = 0; i < nelems; i++ )
+	{
+		char *str;
+
+		if ( nulls[i] )
+		{
+			if ( node->useOr )
+				continue;
+			setStringInfoLength(buf, len_save);
+			return false;
+		}
+
+		str = ogrStringFromDatum(elems[i], elemtype, context->dialect);
+		if ( ! str )
+		{
+			setStringInfoLength(buf, len_save);
+			return false;
+		}
+		if ( ! first )
+			appendStringInfoString(buf, ", ");
+		appendStringInfoString(buf, str);
+		first = false;
+	}
+	appendStringInfoString(buf, "))");
+
+	/* Nothing to list, "IN ()" isn't valid */
+	if ( first )
+	{
+		setStringInfoLength(buf, len_save);
+		return false;
+	}
+
+	/* FID lists can be read directly, like equalities */
+	if ( fid && context->or_depth == 0 && node->useOr && intlist &&
+	     ogrIsFidColumn(linitial(node->args), context) )
+	{
+		GIntBig *fids = palloc(sizeof(GIntBig) * nelems);
+
+		for ( i = 0; i < nelems; i++ )
+		{
+			if ( ! nulls[i] )
+				ogrFidFromDatum(elems[i], elemtype, &(fids[n++]));
+		}
+		ogrFidFilterLookup(fid, fids, n);
+		fid->nclauses++;
+		pfree(fids);
+	}
+
+	return true;
+}
+
+/*
+ * Name of a type in the CAST of the dialect. OGR SQL's character
+ * is a string of any length, in PostgreSQL it's char(1).
+ */
+static const char *
+ogrCastTypeName(Oid type, OgrSqlDialect dialect)
+{
+	bool sqlite = (dialect == OGR_DIALECT_SQLITE);
+	bool pgsql = (dialect == OGR_DIALECT_POSTGRESQL);
+
+	switch ( type )
+	{
+		case INT2OID:
+		case INT4OID:
+			return sqlite ? "INTEGER" : "integer";
+		case INT8OID:
+#if GDAL_VERSION_MAJOR >= 2
+			return sqlite ? "INTEGER" : "bigint";
+#else
+			return sqlite ? "INTEGER" : (pgsql ? "bigint" : NULL);
+#endif
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case NUMERICOID:
+			return sqlite ? "REAL" : (pgsql ? "float8" : "float");
+		case TEXTOID:
+		case VARCHAROID:
+		case BPCHAROID:
+			return sqlite ? "TEXT" : (pgsql ? "text" : "character");
+		case DATEOID:
+			return sqlite ? NULL : "date";
+		case TIMESTAMPOID:
+			return sqlite ? NULL : "timestamp";
+		default:
+			return NULL;
+	}
+}
+
+/*
+ * Casts, whether written or added by PgSQL to match up types, go
+ * into the OGR SQL as CAST() to the nearest type of the dialect.
+ * The conversions don't quite match PgSQL's, so the result is
+ * never exact.
+ */
+static bool
+ogrDeparseCast(Expr *arg, Oid type, OgrDeparseCtx *context)
+{
+	StringInfo buf = context->buf;
+	int len_save = buf->len;
+	const char *typname = ogrCastTypeName(type, context->dialect);
+
+	if ( ! typname )
+		return false;
+
+	context->exact = false;
+	context->equality = false;
+	appendStringInfoString(buf, "CAST(");
+	if ( ! ogrDeparseExpr(arg, context) )
+	{
+		setStringInfoLength(buf, len_save);
+		return false;
+	}
+	appendStringInfo(buf, " AS %s)", typname);
+	return true;
+}
+
+static bool
+ogrDeparseExpr(Expr *node, OgrDeparseCtx *context)
+{
+	if ( node == NULL )
+		return false;
+
+	switch ( nodeTag(node) )
+	{
+		case T_OpExpr:
+			return ogrDeparseOpExpr((OpExpr *) node, context);
+		case T_Const:
+			return ogrDeparseConst((Const *) node, context);
+		case T_Var:
+			return ogrDeparseVar((Var *) node, context);
+		case T_Param:
+			return ogrDeparseParam((Param *) node, context);
+		case T_BoolExpr:
+			/* Handle "OR" and "NOT" queries */
+			return ogrDeparseBoolExpr((BoolExpr *) node, context);
+		case T_NullTest:
+			/* Handle "IS NULL" queries */
+			return ogrDeparseNullTest((NullTest *) node, context);
+		case T_RelabelType:
+			return ogrDeparseRelabelType((RelabelType *) node, context);
+		case T_ScalarArrayOpExpr:
+			/* Handle "IN" and "NOT IN" lists */
+			return ogrDeparseScalarArrayOpExpr((ScalarArrayOpExpr *) node, context);
+		case T_CoerceViaIO:
+			return ogrDeparseCast(((CoerceViaIO *) node)->arg, ((CoerceViaIO *) node)->resulttype, context);
+		case T_ArrayRef:
+			elog(NOTICE, "unsupported OGR FDW expression type, T_ArrayRef");
+			return false;
+		case T_ArrayExpr:
+			elog(NOTICE, "unsupported OGR FDW expression type, T_ArrayExpr");
+			return false;
+		case T_FuncExpr:
+			return ogrDeparseFuncExpr((FuncExpr *) node, context);
+		case T_DistinctExpr:
+			elog(NOTICE, "unsupported OGR FDW expression type, T_DistinctExpr");
+			return false;
+		default:
+			elog(NOTICE, "unsupported OGR FDW expression type for deparse: %d", (int) nodeTag(node));
+			return false;
+	}
+	
+}
+
+
+bool
+ogrDeparse(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel, List *exprs, GisFdwState *state, List **params, OgrFdwSpatialFilter *spatial, OgrFdwFidFilter *fid, List **pushed, List **exact)
+{
+	OgrDeparseCtx context;
+	ListCell *lc;
+	bool first = true;
+
+	/* params are added to, so deparses can share placeholders */
+	if (pushed)
+		*pushed = NIL;
+	if (exact)
+		*exact = NIL;
+
+	/* Set up context struct for recursion */
+	context.buf = buf;
+	context.root = root;
+	context.foreignrel = foreignrel;
+	context.params_list = params;
+	context.spatial = spatial;
+	context.fid = fid;
+	context.or_depth = 0;
+	context.incomplete = false;
+	context.equality = true;
+	context.dialect = ogrSqlDialect(&(state->ogr));
+	context.state = state;
+
+	if ( spatial )
+		memset(spatial, 0, sizeof(OgrFdwSpatialFilter));
+	if ( fid )
+		memset(fid, 0, sizeof(OgrFdwFidFilter));
+
+	foreach(lc, exprs)
+	{
+		RestrictInfo *ri = (RestrictInfo *) lfirst(lc);
+		int len_save = buf->len;
+		int nfilters_save = spatial ? spatial->nfilters : 0;
+		int nfid_save = fid ? fid->nclauses : 0;
+		bool result;
+
+		/* Connect expressions with "AND" and parenthesize each condition */
+		if ( ! first )
+		{
+			appendStringInfoString(buf, " AND ");
+		}
+
+		/* Unparse the expression, if possible */
+		context.exact = IsA(ri->clause, OpExpr) || IsA(ri->clause, BoolExpr);
+		// appendStringInfoChar(buf, '(');
+		result = ogrDeparseExpr(ri->clause, &context);
+		// appendStringInfoChar(buf, ')');
+
+		if ( ! result )
+		{
+			/* Couldn't unparse some portion of the expression, so rewind the stringinfo */
+			setStringInfoLength(buf, len_save);
+		}
+
+		/* Note the restrictions OGR will filter on, for the estimates */
+		if ( spatial && spatial->nfilters > nfilters_save )
+			spatial->clauses = lappend(spatial->clauses, ri);
+		if ( fid && fid->nclauses > nfid_save )
+			fid->clauses = lappend(fid->clauses, ri);
+		if ( pushed && (result || (spatial && spatial->nfilters > nfilters_save)) )
+			*pushed = lappend(*pushed, ri);
+		if ( exact && result && context.exact )
+			*exact = lappend(*exact, ri);
+		
+		/* Don't flip the "first" bit until we get a good expression */
+		if ( first && result )
+			first = false;
+	}	
+
+	if ( fid )
+		ogrFidFilterFinish(fid);
+	
+	return true;	
+}
+
+/*
+ * Recognize a join clause OGR can apply as a spatial filter once
+ * the geometry from the outer side is known: && or ST_Intersects()
+ * between one of our geometry columns and an outer geometry, or
+ * ST_DWithin() with a constant distance. Returns the outer geometry
+ * expression and sets the OGR geometry field and the distance to
+ * grow the outer geometry's box by, or returns NULL.
+ */
+Expr *
+ogrSpatialJoinClause(PlannerInfo *root, RelOptInfo *foreignrel, Expr *clause, GisFdwState *state, int *ogrfldnum, double *expand)
+{
+	OgrDeparseCtx context;
+	OgrFdwColumn *col;
+	List *args;
+	Expr *outer;
+	Relids outer_relids;
+	double dist = 0.0;
+
+	memset(&context, 0, sizeof(OgrDeparseCtx));
+	context.root = root;
+	context.foreignrel = foreignrel;
+	context.state = state;
+
+	if ( IsA(clause, OpExpr) )
+	{
+		char *opname = get_opname(((OpExpr *) clause)->opno);
+
+		if ( ! opname || ! streq(opname, "&&") )
+			return NULL;
+		args = ((OpExpr *) clause)->args;
+	}
+	else if ( IsA(clause, FuncExpr) )
+	{
+		FuncExpr *func = (FuncExpr *) clause;
+		char *funcname = get_func_name(func->funcid);
+		int nargs = list_length(func->args);
+
+		if ( ! funcname )
+			return NULL;
+
+		if ( (streq(funcname, "st_intersects") || streq(funcname, "_st_intersects")) && nargs == 2 )
+		{
+			/* Nothing to grow the box by */
+		}
+		else if ( (streq(funcname, "st_dwithin") || streq(funcname, "_st_dwithin")) && nargs == 3 )
+		{
+			Const *d = (Const *) lthird(func->args);
+			if ( ! IsA(d, Const) || d->constisnull || d->consttype != FLOAT8OID )
+				return NULL;
+			dist = DatumGetFloat8(d->constvalue);
+		}
+		else
+		{
+			return NULL;
+		}
+		args = func->args;
+	}
+	else
+	{
+		return NULL;
+	}
+
+	if ( (col = ogrSpatialColumn(linitial(args), &context)) )
+		outer = lsecond(args);
+	else if ( (col = ogrSpatialColumn(lsecond(args), &context)) )
+		outer = linitial(args);
+	else
+		return NULL;
+
+	/* The other side has to be a geometry from the other relations */
+#if PG_VERSION_NUM >= 140000
+	outer_relids = pull_varnos(root, (Node *) outer);
+#else
+	outer_relids = pull_varnos((Node *) outer);
+#endif
+	if ( exprType((Node *) outer) != GEOMETRYOID ||
+	     bms_is_empty(outer_relids) ||
+	     bms_is_member(foreignrel->relid, outer_relids) ||
+	     contain_volatile_functions((Node *) outer) )
+		return NULL;
+
+	*ogrfldnum = col->ogrfldnum;
+	*expand = dist;
+	return outer;
+}
+
+/*
+ * Is node the tile column of a raster table, or its footprint
+ * (the raster to geometry cast is ST_ConvexHull)?
+ */
+static bool
+ogrRasterColumn(Expr *node, RelOptInfo *baserel)
+{
+	Var *var;
+
+	while ( node && IsA(node, RelabelType) )
+		node = ((RelabelType *) node)->arg;
+
+	if ( node && IsA(node, FuncExpr) )
+	{
+		FuncExpr *func = (FuncExpr *) node;
+		char *funcname = get_func_name(func->funcid);
+
+		if ( ! funcname || list_length(func->args) != 1 || func->funcresulttype != GEOMETRYOID ||
+		     ! (streq(funcname, "st_convexhull") || streq(funcname, "st_envelope")) )
+			return false;
+		node = linitial(func->args);
+		while ( node && IsA(node, RelabelType) )
+			node = ((RelabelType *) node)->arg;
+	}
+
+	if ( ! node || ! IsA(node, Var) )
+		return false;
+
+	/* Tiles are read into the first column */
+	var = (Var *) node;
+	return var->varno == baserel->relid && var->varlevelsup == 0 && var->varattno == 1;
+}
+
+/*
+ * Work out the box a raster table scan can keep to: the bounds of
+ * the geometry constants the tiles are compared to with &&,
+ * ST_Intersects() or ST_DWithin() in the scan's restrictions
+ * (the top level ones, not those under an OR), intersected.
+ * Returns false if there are none. The restrictions are still
+ * checked by PgSQL.
+ */
+bool
+ogrRasterSpatialFilter(RelOptInfo *baserel, List *clauses, OGREnvelope *env)
+{
+	ListCell *lc;
+	int nfilters = 0;
+
+	foreach(lc, clauses)
+	{
+		Expr *clause = (Expr *) lfirst(lc);
+		List *args;
+		OGRGeometryH geom = NULL;
+		OGREnvelope genv;
+		double dist = 0.0;
+
+		if ( IsA(clause, RestrictInfo) )
+			clause = ((RestrictInfo *) clause)->clause;
+
+		if ( IsA(clause, OpExpr) )
+		{
+			char *opname = get_opname(((OpExpr *) clause)->opno);
+
+			if ( ! opname || ! streq(opname, "&&") )
+				continue;
+			args = ((OpExpr *) clause)->args;
+		}
+		else if ( IsA(clause, FuncExpr) )
+		{
+			FuncExpr *func = (FuncExpr *) clause;
+			char *funcname = get_func_name(func->funcid);
+
+			if ( ! funcname || list_length(func->args) < 2 )
+				continue;
+
+			/* The raster ST_Intersects() takes an optional band number after the geometry */
+			if ( streq(funcname, "st_intersects") || streq(funcname, "_st_intersects") )
+			{
+				/* Nothing to grow the box by */
+			}
+			else if ( (streq(funcname, "st_dwithin") || streq(funcname, "_st_dwithin")) && list_length(func->args) == 3 )
+			{
+				Const *d = (Const *) lthird(func->args);
+				if ( ! IsA(d, Const) || d->constisnull || d->consttype != FLOAT8OID )
+					continue;
+				dist = DatumGetFloat8(d->constvalue);
+			}
+			else
+			{
+				continue;
+			}
+			args = func->args;
+		}
+		else
+		{
+			continue;
+		}
+
+		if ( ogrRasterColumn(linitial(args), baserel) )
+			geom = ogrSpatialConst(lsecond(args));
+		else if ( ogrRasterColumn(lsecond(args), baserel) )
+			geom = ogrSpatialConst(linitial(args));
+		if ( ! geom )
+			continue;
+
+		OGR_G_GetEnvelope(geom, &genv);
+		OGR_G_DestroyGeometry(geom);
+		genv.MinX -= dist;
+		genv.MinY -= dist;
+		genv.MaxX += dist;
+		genv.MaxY += dist;
+
+		if ( nfilters++ == 0 )
+		{
+			*env = genv;
+		}
+		else
+		{
+			env->MinX = Max(env->MinX, genv.MinX);
+			env->MinY = Max(env->MinY, genv.MinY);
+			env->MaxX = Min(env->MaxX, genv.MaxX);
+			env->MaxY = Min(env->MaxY, genv.MaxY);
+		}
+	}
+
+	return nfilters > 0;
+}
+
+/*
+ * Fill in the $n placeholders of a deparsed OGR SQL filter with
+ * the values of the params, leaving quoted strings and names alone.
+ * Returns NULL if a value can't be written in the dialect.
+ */
+char *
+ogrDeparseBindParams(const char *sql, const Datum *values, const bool *nulls, const Oid *types, int nparams, OgrSqlDialect dialect)
+{
+	StringInfoData buf;
+	const char *p = sql;
+	char quote = '\0';
+
+	initStringInfo(&buf);
+	while ( *p )
+	{
+		if ( quote )
+		{
+			/* Doubled quotes just close and reopen */
+			if ( *p == quote )
+				quote = '\0';
+			appendStringInfoChar(&buf, *p++);
+		}
+		else if ( *p == '\'' || *p == '"' )
+		{
+			quote = *p;
+			appendStringInfoChar(&buf, *p++);
+		}
+		else if ( *p == '$' && isdigit((unsigned char) p[1]) )
+		{
+			char *end;
+			char *str;
+			long n = strtol(p + 1, &end, 10);
+
+			if ( n < 1 || n > nparams )
+				elog(ERROR, "OGR SQL parameter $%ld out of range", n);
+
+			if ( nulls[n-1] )
+			{
+				appendStringInfoString(&buf, "NULL");
+			}
+			else
+			{
+				/* A value the dialect can't take leaves no filter at all */
+				str = ogrStringFromDatum(values[n-1], types[n-1], dialect);
+				if ( ! str )
+				{
+					pfree(buf.data);
+					return NULL;
+				}
+				appendStringInfoString(&buf, str);
+			}
+			p = end;
+		}
+		else
+		{
+			appendStringInfoChar(&buf, *p++);
+		}
+	}
+
+	return buf.data;
+}
+
+/*
+ * Statements the driver runs itself double-quote every name, so
+ * names of any case or characters come through.
+ */
+static void
+ogrAppendQuotedName(StringInfo buf, const char *name)
+{
+	const char *p;
+
+	appendStringInfoChar(buf, '"');
+	for ( p = name; *p; p++ )
+	{
+		if ( *p == '"' )
+			appendStringInfoChar(buf, '"');
+		appendStringInfoChar(buf, *p);
+	}
+	appendStringInfoChar(buf, '"');
+}
+
+static bool
+ogrIsPostgreSQL(const OgrConnection *con)
+{
+	GDALDriverH dr = GDALGetDatasetDriver(con->ds);
+	return streq(GDALGetDriverShortName(dr), "PostgreSQL");
+}
+
+/*
+ * Return the foreign table column for a node, if it is a plain
+ * column of the foreign table.
+ */
+static OgrFdwColumn *
+ogrTableColumn(Expr *node, OgrDeparseCtx *context)
+{
+	OgrFdwTable *table = context->state->table;
+	Var *var;
+	int i;
+
+	while ( node && IsA(node, RelabelType) )
+		node = ((RelabelType *) node)->arg;
+
+	if ( ! node || ! IsA(node, Var) )
+		return NULL;
+
+	var = (Var *) node;
+	if ( var->varno != context->foreignrel->relid || var->varlevelsup != 0 )
+		return NULL;
+
+	for ( i = 0; i < table->ncols; i++ )
+	{
+		if ( table->cols[i].pgattnum == var->varattno && ! table->cols[i].pgattisdropped )
+			return &(table->cols[i]);
+	}
+	return NULL;
+}
+
+/*
+ * Name of the FID, field or geometry field a column reads, in
+ * the layer's own table, or NULL if it has no usable name.
+ */
+static const char *
+ogrColumnSourceName(const OgrFdwColumn *col, OGRLayerH lyr)
+{
+	OGRFeatureDefnH dfn = OGR_L_GetLayerDefn(lyr);
+	const char *name = NULL;
+
+	switch ( col->ogrvariant )
+	{
+		case OGR_FID:
+			name = OGR_L_GetFIDColumn(lyr);
+			break;
+		case OGR_FIELD:
+			name = OGR_Fld_GetNameRef(OGR_FD_GetFieldDefn(dfn, col->ogrfldnum));
+			break;
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(1,11,0)
+		case OGR_GEOMETRY:
+			name = OGR_GFld_GetNameRef(OGR_FD_GetGeomFieldDefn(dfn, col->ogrfldnum));
+			break;
+#endif
+		default:
+			break;
+	}
+
+	if ( ! name || name[0] == '\0' )
+		return NULL;
+	return name;
+}
+
+/*
+ * Whether the database compares the values of a column as PgSQL
+ * does, so it can sort and group them for us: integers and the
+ * FID, reals read as float8, and dates. Strings are left out, as
+ * their order is down to collations and OGR reads empty ones as
+ * NULL.
+ */
+static bool
+ogrColumnComparesExactly(const OgrFdwColumn *col)
 {
-	StringInfo buf = context->buf;
+	bool integer = col->ogrvariant == OGR_FIELD &&
+	               (col->ogrfldtype == OFTInteger
+#if GDAL_VERSION_MAJOR >= 2
+	                || col->ogrfldtype == OFTInteger64
+#endif
+	               );
+
+	switch ( col->pgtype )
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+			return col->ogrvariant == OGR_FID || integer;
+		case FLOAT8OID:
+			return integer || (col->ogrvariant == OGR_FIELD && col->ogrfldtype == OFTReal);
+		case DATEOID:
+			return col->ogrvariant == OGR_FIELD && col->ogrfldtype == OFTDate;
+		default:
+			return false;
+	}
+}
 
-    appendStringInfoChar(buf, '(');
-    ogrDeparseExpr(node->arg, context);
-    if (node->nulltesttype == IS_NULL)
-        appendStringInfoString(buf, " IS NULL)");
-    else
-        appendStringInfoString(buf, " IS NOT NULL)");
+/*
+ * The table of a layer, in the database. PostgreSQL layers
+ * outside the search path are "schema.table".
+ */
+static void
+ogrAppendTableName(StringInfo buf, GisFdwState *state)
+{
+	const char *lyrname = OGR_L_GetName(state->ogr.lyr);
+	const char *dot;
 
-	return true;
+	if ( ogrIsPostgreSQL(&(state->ogr)) && (dot = strchr(lyrname, '.')) )
+	{
+		char *schema = pnstrdup(lyrname, dot - lyrname);
+		ogrAppendQuotedName(buf, schema);
+		appendStringInfoChar(buf, '.');
+		ogrAppendQuotedName(buf, dot + 1);
+	}
+	else
+	{
+		ogrAppendQuotedName(buf, lyrname);
+	}
 }
 
-static bool
-ogrDeparseExpr(Expr *node, OgrDeparseCtx *context)
+/*
+ * Start of the SELECT the driver runs in place of reading the
+ * layer, up to the WHERE: the retrieved columns, by the names
+ * they have in the database, and the table. Returns NULL if a
+ * column has no name to select it by.
+ */
+char *
+ogrDeparseSelect(GisFdwState *state, List *retrieved_attrs)
 {
-	if ( node == NULL )
-		return false;
+	OgrFdwTable *table = state->table;
+	OGRLayerH lyr = state->ogr.lyr;
+	StringInfoData buf;
+	bool first = true;
+	int i;
 
-	switch ( nodeTag(node) )
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, "SELECT ");
+
+	for ( i = 0; i < table->ncols; i++ )
 	{
-		case T_OpExpr:
-			return ogrDeparseOpExpr((OpExpr *) node, context);
-		case T_Const:
-			return ogrDeparseConst((Const *) node, context);
-		case T_Var:
-			return ogrDeparseVar((Var *) node, context);
-		case T_Param:
-			return ogrDeparseParam((Param *) node, context);
-		case T_BoolExpr:
-			/* Handle "OR" and "NOT" queries */
-			return ogrDeparseBoolExpr((BoolExpr *) node, context);
-		case T_NullTest:
-			/* Handle "IS NULL" queries */
-			return ogrDeparseNullTest((NullTest *) node, context);
-		case T_RelabelType:
-			return ogrDeparseRelabelType((RelabelType *) node, context);
-		case T_ScalarArrayOpExpr:
-			/* TODO: Handle this to support the "IN" operator */
-			elog(NOTICE, "unsupported OGR FDW expression type, T_ScalarArrayOpExpr");
-			return false;
-		case T_ArrayRef:
-			elog(NOTICE, "unsupported OGR FDW expression type, T_ArrayRef");
-			return false;
-		case T_ArrayExpr:
-			elog(NOTICE, "unsupported OGR FDW expression type, T_ArrayExpr");
+		OgrFdwColumn *col = &(table->cols[i]);
+		const char *name;
+		ListCell *lc;
+
+		if ( col->pgattisdropped || col->ogrvariant == OGR_UNMATCHED )
+			continue;
+
+		foreach(lc, retrieved_attrs)
+		{
+			if ( intVal(lfirst(lc)) == col->pgattnum )
+				break;
+		}
+		if ( ! lc )
+			continue;
+
+		if ( ! (name = ogrColumnSourceName(col, lyr)) )
+			return NULL;
+
+		if ( ! first )
+			appendStringInfoString(&buf, ", ");
+		ogrAppendQuotedName(&buf, name);
+		first = false;
+	}
+
+	/* Nothing to read, just the rows */
+	if ( first )
+		appendStringInfoChar(&buf, '1');
+
+	appendStringInfoString(&buf, " FROM ");
+	ogrAppendTableName(&buf, state);
+
+	return buf.data;
+}
+
+/*
+ * Write the sort keys of an ORDER BY for the pathkeys, if the
+ * database sorts the same way PgSQL would: each key one of our
+ * columns the database compares exactly, in its default btree
+ * order. SQLite has no NULLS FIRST/LAST before 3.30, so it sorts
+ * on the NULL test first.
+ */
+bool
+ogrDeparseOrderBy(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel, List *pathkeys, GisFdwState *state)
+{
+	OgrDeparseCtx context;
+	bool postgres = ogrIsPostgreSQL(&(state->ogr));
+	bool first = true;
+	ListCell *lc;
+
+	memset(&context, 0, sizeof(OgrDeparseCtx));
+	context.root = root;
+	context.foreignrel = foreignrel;
+	context.state = state;
+
+	foreach(lc, pathkeys)
+	{
+		PathKey *pathkey = (PathKey *) lfirst(lc);
+		EquivalenceClass *ec = pathkey->pk_eclass;
+		OgrFdwColumn *col = NULL;
+		const char *name;
+		const char *dir;
+		ListCell *lm;
+
+		if ( ec->ec_has_volatile )
 			return false;
-		case T_FuncExpr:
-			elog(NOTICE, "unsupported OGR FDW expression type, T_FuncExpr");
+
+		foreach(lm, ec->ec_members)
+		{
+			EquivalenceMember *em = (EquivalenceMember *) lfirst(lm);
+			if ( (col = ogrTableColumn(em->em_expr, &context)) )
+				break;
+		}
+
+		if ( ! col || ! ogrColumnComparesExactly(col) ||
+		     ! (name = ogrColumnSourceName(col, state->ogr.lyr)) )
 			return false;
-		case T_DistinctExpr:
-			elog(NOTICE, "unsupported OGR FDW expression type, T_DistinctExpr");
+
+		if ( pathkey->pk_opfamily != get_opclass_family(GetDefaultOpClass(col->pgtype, BTREE_AM_OID)) )
 			return false;
-		default:
-			elog(NOTICE, "unsupported OGR FDW expression type for deparse: %d", (int) nodeTag(node));
+
+		if ( pathkey->pk_strategy == BTLessStrategyNumber )
+			dir = "ASC";
+		else if ( pathkey->pk_strategy == BTGreaterStrategyNumber )
+			dir = "DESC";
+		else
 			return false;
+
+		if ( ! first )
+			appendStringInfoString(buf, ", ");
+		first = false;
+
+		if ( postgres )
+		{
+			ogrAppendQuotedName(buf, name);
+			appendStringInfo(buf, " %s NULLS %s", dir, pathkey->pk_nulls_first ? "FIRST" : "LAST");
+		}
+		else
+		{
+			ogrAppendQuotedName(buf, name);
+			appendStringInfo(buf, " IS NULL %s, ", pathkey->pk_nulls_first ? "DESC" : "ASC");
+			ogrAppendQuotedName(buf, name);
+			appendStringInfo(buf, " %s", dir);
+		}
 	}
-	
+
+	return ! first;
 }
 
+#if PG_VERSION_NUM >= 100000
+/*
+ * Write an aggregate the database works out just as PgSQL does:
+ * count(*), and count(), min() and max() of columns it compares
+ * exactly. sum() only of int2 and int4 columns, whose PgSQL sums
+ * are int8 and can't overflow where the database's would.
+ */
+static bool
+ogrDeparseGroupedAgg(Aggref *agg, OgrDeparseCtx *context)
+{
+	StringInfo buf = context->buf;
+	OgrFdwColumn *col;
+	const char *name;
+	char *aggname;
+
+	if ( agg->aggfilter || agg->aggorder || agg->aggdistinct ||
+	     agg->aggdirectargs || agg->aggvariadic ||
+	     agg->aggsplit != AGGSPLIT_SIMPLE ||
+	     get_func_namespace(agg->aggfnoid) != PG_CATALOG_NAMESPACE )
+		return false;
+
+	aggname = get_func_name(agg->aggfnoid);
+	if ( ! aggname )
+		return false;
+
+	if ( agg->aggstar )
+	{
+		if ( ! streq(aggname, "count") )
+			return false;
+		appendStringInfoString(buf, "count(*)");
+		return true;
+	}
+
+	if ( list_length(agg->args) != 1 )
+		return false;
+
+	col = ogrTableColumn(((TargetEntry *) linitial(agg->args))->expr, context);
+	if ( ! col || ! ogrColumnComparesExactly(col) ||
+	     ! (name = ogrColumnSourceName(col, context->state->ogr.lyr)) )
+		return false;
+
+	if ( streq(aggname, "sum") && col->pgtype != INT2OID && col->pgtype != INT4OID )
+		return false;
+	if ( ! (streq(aggname, "count") || streq(aggname, "min") ||
+	        streq(aggname, "max") || streq(aggname, "sum")) )
+		return false;
+
+	appendStringInfo(buf, "%s(", aggname);
+	ogrAppendQuotedName(buf, name);
+	appendStringInfoChar(buf, ')');
+	return true;
+}
 
+/*
+ * Write the select list of a grouped query, with each output
+ * named "a1", "a2", ..., and the GROUP BY to follow its WHERE.
+ * Grouping keys have to be columns the database compares exactly,
+ * and outputs grouping keys or aggregates of ogrDeparseGroupedAgg.
+ */
 bool
-ogrDeparse(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel, List *exprs, GisFdwState *state, List **params)
+ogrDeparseGroupedSelect(StringInfo select, StringInfo tail, PlannerInfo *root, RelOptInfo *foreignrel, PathTarget *target, GisFdwState *state)
 {
+	Query *query = root->parse;
 	OgrDeparseCtx context;
+	List *group_exprs = NIL;
 	ListCell *lc;
-	bool first = true;
-
-	/* initialize result list to empty */
-	if (params)
-		*params = NIL;
+	int i = 0;
 
-	/* Set up context struct for recursion */
-	context.buf = buf;
+	memset(&context, 0, sizeof(OgrDeparseCtx));
 	context.root = root;
 	context.foreignrel = foreignrel;
-	context.params_list = params;
-	context.geom = NULL;
 	context.state = state;
-	// context.geom_op = NULL;
-	// context.geom_func = NULL;
+	context.buf = select;
 
-	foreach(lc, exprs)
+	appendStringInfoString(tail, " GROUP BY ");
+	foreach(lc, query->groupClause)
 	{
-		RestrictInfo *ri = (RestrictInfo *) lfirst(lc);
-		int len_save = buf->len;
-		bool result;
+		SortGroupClause *sgc = (SortGroupClause *) lfirst(lc);
+		Expr *expr = (Expr *) get_sortgroupclause_expr(sgc, query->targetList);
+		OgrFdwColumn *col = ogrTableColumn(expr, &context);
+		const char *name;
 
-		/* Connect expressions with "AND" and parenthesize each condition */
-		if ( ! first )
+		if ( ! col || ! ogrColumnComparesExactly(col) ||
+		     ! (name = ogrColumnSourceName(col, state->ogr.lyr)) )
+			return false;
+
+		if ( group_exprs )
+			appendStringInfoString(tail, ", ");
+		ogrAppendQuotedName(tail, name);
+		group_exprs = lappend(group_exprs, expr);
+	}
+
+	appendStringInfoString(select, "SELECT ");
+	foreach(lc, target->exprs)
+	{
+		Expr *expr = (Expr *) lfirst(lc);
+
+		if ( i > 0 )
+			appendStringInfoString(select, ", ");
+
+		if ( IsA(expr, Aggref) )
 		{
-			appendStringInfoString(buf, " AND ");
+			if ( ! ogrDeparseGroupedAgg((Aggref *) expr, &context) )
+				return false;
+		}
+		else if ( list_member(group_exprs, expr) )
+		{
+			ogrAppendQuotedName(select, ogrColumnSourceName(ogrTableColumn(expr, &context), state->ogr.lyr));
+		}
+		else
+		{
+			return false;
 		}
+		appendStringInfo(select, " AS a%d", ++i);
+	}
 
-		/* Unparse the expression, if possible */
-		// appendStringInfoChar(buf, '(');
-		result = ogrDeparseExpr(ri->clause, &context);
-		// appendStringInfoChar(buf, ')');
+	appendStringInfoString(select, " FROM ");
+	ogrAppendTableName(select, state);
+	return true;
+}
+#endif
 
-		if ( ! result )
+/*
+ * A spatial test between the geometries of the two tables of a
+ * join the database runs. PostGIS runs && and ST_Intersects() as
+ * they are. A GeoPackage only has the bounding boxes to compare,
+ * which narrows ST_Intersects() down, through the R-tree of the
+ * inner table when it has one (&& compares the single precision
+ * boxes of PostGIS, which that can't match). PgSQL checks the
+ * test again either way.
+ */
+static bool
+ogrDeparseSpatialJoin(List *args, bool intersects, OgrDeparseCtx *context)
+{
+	StringInfo buf = context->buf;
+	GisFdwState *state[2];
+	const char *alias[2];
+	OgrFdwColumn *col[2];
+	StringInfoData geom[2];
+	const char *fid;
+	OGRLayerH lyr;
+	int i, inner;
+
+	if ( list_length(args) != 2 )
+		return false;
+
+	for ( i = 0; i < 2; i++ )
+	{
+		Expr *node = (Expr *) list_nth(args, i);
+		const char *name;
+
+		while ( node && IsA(node, RelabelType) )
+			node = ((RelabelType *) node)->arg;
+
+		if ( ! node || ! IsA(node, Var) ||
+		     ! (col[i] = ogrVarColumn((Var *) node, context, &(state[i]), &(alias[i]))) ||
+		     col[i]->ogrvariant != OGR_GEOMETRY ||
+		     ! (name = ogrColumnSourceName(col[i], state[i]->ogr.lyr)) )
+			return false;
+
+		initStringInfo(&(geom[i]));
+		appendStringInfo(&(geom[i]), "%s.", alias[i]);
+		ogrAppendQuotedName(&(geom[i]), name);
+	}
+
+	/* Geometries of one table are no join */
+	if ( state[0] == state[1] )
+		return false;
+
+	context->exact = false;
+
+	if ( ogrIsPostgreSQL(&(context->state->ogr)) )
+	{
+		if ( intersects )
+			appendStringInfo(buf, "ST_Intersects(%s, %s)", geom[0].data, geom[1].data);
+		else
+			appendStringInfo(buf, "(%s && %s)", geom[0].data, geom[1].data);
+		return true;
+	}
+
+	/* A box test only narrows the join down, it can't be negated */
+	if ( ! intersects || context->or_depth > 0 ||
+	     ! streq(GDALGetDriverShortName(GDALGetDatasetDriver(context->state->ogr.ds)), "GPKG") )
+		return false;
+
+	inner = (state[1] == context->inner_state) ? 1 : 0;
+	lyr = state[inner]->ogr.lyr;
+	fid = OGR_L_GetFIDColumn(lyr);
+
+	/* The R-tree indexes the layer's (first) geometry by FID */
+	if ( col[inner]->ogrfldnum == 0 && fid && fid[0] &&
+	     OGR_L_TestCapability(lyr, OLCFastSpatialFilter) == TRUE )
+	{
+		const char *g = geom[1 - inner].data;
+
+		appendStringInfo(buf, "%s.", alias[inner]);
+		ogrAppendQuotedName(buf, fid);
+		appendStringInfoString(buf, " IN (SELECT id FROM ");
+		ogrAppendQuotedName(buf, psprintf("rtree_%s_%s", OGR_L_GetName(lyr),
+		                                  ogrColumnSourceName(col[inner], lyr)));
+		appendStringInfo(buf, " WHERE minx <= ST_MaxX(%s) AND maxx >= ST_MinX(%s)"
+		                      " AND miny <= ST_MaxY(%s) AND maxy >= ST_MinY(%s))",
+		                 g, g, g, g);
+	}
+	else
+	{
+		const char *a = geom[0].data;
+		const char *b = geom[1].data;
+
+		appendStringInfo(buf, "(ST_MinX(%s) <= ST_MaxX(%s) AND ST_MaxX(%s) >= ST_MinX(%s)"
+		                      " AND ST_MinY(%s) <= ST_MaxY(%s) AND ST_MaxY(%s) >= ST_MinY(%s))",
+		                 a, b, a, b, a, b, a, b);
+	}
+	return true;
+}
+
+#if PG_VERSION_NUM >= 90600
+/*
+ * Write the WHERE of a join the database runs: the join clauses
+ * and the restrictions on both tables, with the columns of the
+ * outer table as "r1" and the inner one as "r2". Clauses that
+ * can't be written are left out, the pushed and exact lists are
+ * as ogrDeparse makes them.
+ */
+void
+ogrDeparseJoinClauses(StringInfo buf, PlannerInfo *root,
+                      RelOptInfo *outerrel, GisFdwState *outer,
+                      RelOptInfo *innerrel, GisFdwState *inner,
+                      List *clauses, List **pushed, List **exact)
+{
+	OgrDeparseCtx context;
+	ListCell *lc;
+
+	memset(&context, 0, sizeof(OgrDeparseCtx));
+	context.buf = buf;
+	context.root = root;
+	context.foreignrel = outerrel;
+	context.state = outer;
+	context.innerrel = innerrel;
+	context.inner_state = inner;
+	context.dialect = ogrSqlDialect(&(outer->ogr));
+
+	*pushed = NIL;
+	*exact = NIL;
+
+	foreach(lc, clauses)
+	{
+		RestrictInfo *ri = (RestrictInfo *) lfirst(lc);
+		int len_save = buf->len;
+
+		if ( buf->len > 0 )
+			appendStringInfoString(buf, " AND ");
+
+		context.exact = IsA(ri->clause, OpExpr) || IsA(ri->clause, BoolExpr);
+		context.incomplete = false;
+		if ( ! ogrDeparseExpr(ri->clause, &context) )
 		{
-			/* Couldn't unparse some portion of the expression, so rewind the stringinfo */
 			setStringInfoLength(buf, len_save);
+			continue;
 		}
-		
-		/* Don't flip the "first" bit until we get a good expression */
-		if ( first && result )
-			first = false;
-	}	
-	
-	return true;	
+
+		*pushed = lappend(*pushed, ri);
+		if ( context.exact )
+			*exact = lappend(*exact, ri);
+	}
 }
 
+/*
+ * The SELECT of a join the database runs, returning the columns
+ * of the scan tuple (a target list of Vars) as "a1", "a2", ...
+ * Returns NULL if a column has no name to select it by.
+ */
+char *
+ogrDeparseJoinSelect(RelOptInfo *outerrel, GisFdwState *outer,
+                     RelOptInfo *innerrel, GisFdwState *inner,
+                     List *tlist, const char *where)
+{
+	OgrDeparseCtx context;
+	StringInfoData buf;
+	ListCell *lc;
+	int i = 0;
+
+	memset(&context, 0, sizeof(OgrDeparseCtx));
+	context.foreignrel = outerrel;
+	context.state = outer;
+	context.innerrel = innerrel;
+	context.inner_state = inner;
+
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, "SELECT ");
+
+	foreach(lc, tlist)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+		GisFdwState *state;
+		const char *alias;
+		const char *name;
+		OgrFdwColumn *col;
+
+		if ( ! IsA(tle->expr, Var) ||
+		     ! (col = ogrVarColumn((Var *) tle->expr, &context, &state, &alias)) ||
+		     ! (name = ogrColumnSourceName(col, state->ogr.lyr)) )
+			return NULL;
+
+		if ( i > 0 )
+			appendStringInfoString(&buf, ", ");
+		appendStringInfo(&buf, "%s.", alias);
+		ogrAppendQuotedName(&buf, name);
+		appendStringInfo(&buf, " AS a%d", ++i);
+	}
 
+	/* Nothing to read, just the rows */
+	if ( i == 0 )
+		appendStringInfoChar(&buf, '1');
 
+	appendStringInfoString(&buf, " FROM ");
+	ogrAppendTableName(&buf, outer);
+	appendStringInfoString(&buf, " r1, ");
+	ogrAppendTableName(&buf, inner);
+	appendStringInfoString(&buf, " r2");
+	if ( where && strlen(where) > 0 )
+		appendStringInfo(&buf, " WHERE %s", where);
 
+	return buf.data;
+}
+#endif
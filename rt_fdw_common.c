@@ -2,10 +2,12 @@
 // Created by 何文婷 on 18/3/22.
 //
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
 #include "rt_fdw_common.h"
 #include "stdint.h"
 #include "ogr_srs_api.h"
-#include "gdal_vrt.h"
 
 rt_pixtype
 rt_util_gdal_datatype_to_pixtype(GDALDataType gdt) {
@@ -31,217 +33,21 @@ rt_util_gdal_datatype_to_pixtype(GDALDataType gdt) {
     return PT_END;
 }
 
+/*
+ * Destroy a tile. The pixels of all its bands are one block owned
+ * by the first band, the others point into it.
+ */
 void raster_destroy(rt_raster raster) {
     uint16_t i;
     uint16_t nbands = rt_raster_get_num_bands(raster);
     for (i = 0; i < nbands; i++) {
         rt_band band = rt_raster_get_band(raster, i);
         if (band == NULL) continue;
-
-        if (!rt_band_is_offline(band) && !rt_band_get_ownsdata_flag(band)) {
-            void* mem = rt_band_get_data(band);
-            if (mem) rtdealloc(mem);
-        }
         rt_band_destroy(band);
     }
     rt_raster_destroy(raster);
 }
 
-rt_raster
-rt_raster_from_gdal_dataset(GDALDatasetH ds) {
-    rt_raster rast = NULL;
-    double gt[6] = {0};
-    CPLErr cplerr;
-    uint32_t width = 0;
-    uint32_t height = 0;
-    uint32_t numBands = 0;
-    int i = 0;
-    char *authname = NULL;
-    char *authcode = NULL;
-
-    GDALRasterBandH gdband = NULL;
-    GDALDataType gdpixtype = GDT_Unknown;
-    rt_band band;
-    int32_t idx;
-    rt_pixtype pt = PT_END;
-    uint32_t ptlen = 0;
-    int hasnodata = 0;
-    double nodataval;
-
-    int x;
-    int y;
-
-    int nXBlocks, nYBlocks;
-    int nXBlockSize, nYBlockSize;
-    int iXBlock, iYBlock;
-    int nXValid, nYValid;
-    int iY;
-
-    uint8_t *values = NULL;
-    uint32_t valueslen = 0;
-    uint8_t *ptr = NULL;
-
-
-    /* raster size */
-    width = GDALGetRasterXSize(ds);
-    height = GDALGetRasterYSize(ds);
-
-    /* create new raster */
-    rast = rt_raster_new(width, height);
-    if (NULL == rast) {
-        rterror("rt_raster_from_gdal_dataset: Out of memory allocating new raster");
-        return NULL;
-    }
-
-    /* get raster attributes */
-    cplerr = GDALGetGeoTransform(ds, gt);
-    if (cplerr != CE_None) {
-//        RASTER_DEBUG(4, "Using default geotransform matrix (0, 1, 0, 0, 0, -1)");
-        gt[0] = 0;
-        gt[1] = 1;
-        gt[2] = 0;
-        gt[3] = 0;
-        gt[4] = 0;
-        gt[5] = -1;
-    }
-
-    /* apply raster attributes */
-    rast->ipX = gt[0];
-    rast->scaleX = gt[1];
-    rast->skewX = gt[2];
-    rast->ipY = gt[3];
-    rast->skewY = gt[4];
-    rast->scaleY = gt[5];
-
-    /* srid */
-    if (rt_util_gdal_sr_auth_info(ds, &authname, &authcode) == ES_NONE) {
-        if (
-                authname != NULL &&
-                strcmp(authname, "EPSG") == 0 &&
-                authcode != NULL
-                ) {
-            rt_raster_set_srid(rast, atoi(authcode));
-        }
-
-        if (authname != NULL)
-            rtdealloc(authname);
-        if (authcode != NULL)
-            rtdealloc(authcode);
-    }
-
-    numBands = GDALGetRasterCount(ds);
-
-
-    /* copy bands */
-    for (i = 1; i <= numBands; i++) {
-        gdband = NULL;
-        gdband = GDALGetRasterBand(ds, i);
-
-        /* pixtype */
-        gdpixtype = GDALGetRasterDataType(gdband);
-        pt = rt_util_gdal_datatype_to_pixtype(gdpixtype);
-        if (pt == PT_END) {
-            rterror("rt_raster_from_gdal_dataset: Unknown pixel type for GDAL band");
-            rt_raster_destroy(rast);
-            return NULL;
-        }
-        ptlen = rt_pixtype_size(pt);
-
-        /* size: width and height */
-        width = GDALGetRasterBandXSize(gdband);
-        height = GDALGetRasterBandYSize(gdband);
-
-        /* nodata */
-        nodataval = GDALGetRasterNoDataValue(gdband, &hasnodata);
-
-        /* create band object */
-        idx = rt_raster_generate_new_band(
-                rast, pt,
-                (hasnodata ? nodataval : 0),
-                hasnodata, nodataval, rt_raster_get_num_bands(rast)
-        );
-        if (idx < 0) {
-            rterror("rt_raster_from_gdal_dataset: Could not allocate memory for raster band");
-            rt_raster_destroy(rast);
-            return NULL;
-        }
-        band = rt_raster_get_band(rast, idx);
-
-        /* this makes use of GDAL's "natural" blocks */
-        GDALGetBlockSize(gdband, &nXBlockSize, &nYBlockSize);
-        nXBlocks = (width + nXBlockSize - 1) / nXBlockSize;
-        nYBlocks = (height + nYBlockSize - 1) / nYBlockSize;
-
-        /* allocate memory for values */
-        valueslen = ptlen * nXBlockSize * nYBlockSize;
-        values = rtalloc(valueslen);
-        if (values == NULL) {
-            rterror("rt_raster_from_gdal_dataset: Could not allocate memory for GDAL band pixel values");
-            rt_raster_destroy(rast);
-            return NULL;
-        }
-
-        for (iYBlock = 0; iYBlock < nYBlocks; iYBlock++) {
-            for (iXBlock = 0; iXBlock < nXBlocks; iXBlock++) {
-                x = iXBlock * nXBlockSize;
-                y = iYBlock * nYBlockSize;
-
-                memset(values, 0, valueslen);
-
-                /* valid block width */
-                if ((iXBlock + 1) * nXBlockSize > width)
-                    nXValid = width - (iXBlock * nXBlockSize);
-                else
-                    nXValid = nXBlockSize;
-
-                /* valid block height */
-                if ((iYBlock + 1) * nYBlockSize > height)
-                    nYValid = height - (iYBlock * nYBlockSize);
-                else
-                    nYValid = nYBlockSize;
-
-                cplerr = GDALRasterIO(
-                        gdband, GF_Read,
-                        x, y,
-                        nXValid, nYValid,
-                        values, nXValid, nYValid,
-                        gdpixtype,
-                        0, 0
-                );
-                if (cplerr != CE_None) {
-                    rterror("rt_raster_from_gdal_dataset: Could not get data from GDAL raster");
-                    rtdealloc(values);
-                    rt_raster_destroy(rast);
-                    return NULL;
-                }
-
-                /* if block width is same as raster width, shortcut */
-                if (nXBlocks == 1 && nYBlockSize > 1 && nXValid == width) {
-                    x = 0;
-                    y = nYBlockSize * iYBlock;
-
-                    rt_band_set_pixel_line(band, x, y, values, nXValid * nYValid);
-                }
-                else {
-                    ptr = values;
-                    x = nXBlockSize * iXBlock;
-                    for (iY = 0; iY < nYValid; iY++) {
-                        y = iY + (nYBlockSize * iYBlock);
-
-                        rt_band_set_pixel_line(band, x, y, ptr, nXValid);
-                        ptr += (nXValid * ptlen);
-                    }
-                }
-            }
-        }
-
-        /* free memory */
-        rtdealloc(values);
-    }
-
-    return rast;
-}
-
 void init_config(RasterConfig *config) {
     config->srid = config->out_srid = 0;
     config->batchsize = DEFAULT_BATCHSIZE;
@@ -288,59 +94,192 @@ void set_raster_config(RasterConfig **config, char *conf_file) {
         } else if(strncmp(buf, "batchsize", strlen("batchsize")) == 0) {
             (*config)->batchsize = atoi(p + 1);
             elog(DEBUG1, "config->batchsize= %d", (*config)->batchsize);
+        } else if(strncmp(buf, "bands", strlen("bands")) == 0) {
+            set_raster_bands(*config, p + 1);
+        } else if(strncmp(buf, "pad_tile", strlen("pad_tile")) == 0) {
+            (*config)->pad_tile = atoi(p + 1);
+            elog(DEBUG1, "config->pad_tile= %d", (*config)->pad_tile);
         }
     }
     fclose(f);
 }
 
+/*
+ * Parse a comma separated list of 1-based band numbers, like
+ * "1,2,3", into a new array in *nband (when nband is not NULL).
+ * Returns the number of bands, or -1 for a bad list.
+ */
+int parse_raster_bands(const char *str, int **nband) {
+    const char *p = str;
+    char *end;
+    int count = 0;
+    long val;
+
+    if (nband != NULL)
+        *nband = NULL;
+    while (1) {
+        val = strtol(p, &end, 10);
+        if (end == p || val <= 0 || val > INT_MAX)
+            break;
+        if (nband != NULL) {
+            *nband = rtrealloc(*nband, sizeof(int) * (count + 1));
+            if (*nband == NULL)
+                elog(ERROR, "Could not allocate memory for storing band numbers");
+            (*nband)[count] = (int) val;
+        }
+        count++;
+        while (isspace((unsigned char) *end))
+            end++;
+        if (*end == '\0')
+            return count;
+        if (*end != ',')
+            break;
+        p = end + 1;
+    }
+
+    if (nband != NULL && *nband != NULL) {
+        rtdealloc(*nband);
+        *nband = NULL;
+    }
+    return -1;
+}
+
+/* Set the bands a scan reads, replacing any set before */
+void set_raster_bands(RasterConfig *config, const char *bands) {
+    int *nband = NULL;
+    int count = parse_raster_bands(bands, &nband);
+
+    if (count < 0) {
+        elog(ERROR, "invalid bands setting \"%s\", use a comma separated list of band numbers", bands);
+    }
+    if (config->nband != NULL)
+        rtdealloc(config->nband);
+    config->nband = nband;
+    config->nband_count = count;
+    elog(DEBUG1, "config->nband_count= %d", count);
+}
+
 void rtdealloc_config(RasterConfig *config) {
     if (config->nband_count > 0 && config->nband != NULL)
         rtdealloc(config->nband);
     rtdealloc(config);
 }
 
-int analysis_raster(char *filename, RasterConfig *config, int cur_lineno, char **buf) {
-    int rows = 0;
-    RASTERINFO *rasterinfo;
+static void raster_reader_callback(void *arg) {
+    raster_reader_close((RasterReader *) arg);
+}
 
-    elog(DEBUG1, "----->analysis_raster(%s:%d)", filename, cur_lineno);
-    rasterinfo = rtalloc(sizeof(RASTERINFO));
-    if(rasterinfo == NULL) {
-        elog(ERROR, "rtalloc for RASTERINFO failed");
-    }
-    memset(rasterinfo, 0, sizeof(RASTERINFO));
+/*
+ * Make a reader in mcxt. Whatever file it has open is closed
+ * when mcxt goes away, so an error mid-scan doesn't leak it.
+ */
+RasterReader *raster_reader_create(MemoryContext mcxt) {
+    RasterReader *reader;
+    MemoryContextCallback *cb;
+
+    reader = MemoryContextAllocZero(mcxt, sizeof(RasterReader));
+    cb = MemoryContextAlloc(mcxt, sizeof(MemoryContextCallback));
+    cb->func = raster_reader_callback;
+    cb->arg = reader;
+    MemoryContextRegisterResetCallback(mcxt, cb);
+    return reader;
+}
 
-    /* convert raster to tiles and explained in hexString*/
-    rows = convert_raster(filename, config, rasterinfo, cur_lineno, buf);
+void raster_reader_close(RasterReader *reader) {
+    RASTERINFO *info = &(reader->info);
+
+    if (reader->hds != NULL)
+        GDALClose(reader->hds);
+    if (info->srs != NULL)
+        rtdealloc(info->srs);
+    if (info->nband != NULL)
+        rtdealloc(info->nband);
+    if (info->gdalbandtype != NULL)
+        rtdealloc(info->gdalbandtype);
+    if (info->bandtype != NULL)
+        rtdealloc(info->bandtype);
+    if (info->hasnodata != NULL)
+        rtdealloc(info->hasnodata);
+    if (info->nodataval != NULL)
+        rtdealloc(info->nodataval);
+    if (reader->bands != NULL)
+        rtdealloc(reader->bands);
+
+    memset(info, 0, sizeof(RASTERINFO));
+    reader->hds = NULL;
+    reader->bands = NULL;
+    reader->iotype = GDT_Unknown;
+    reader->filename = NULL;
+    reader->ntiles[0] = reader->ntiles[1] = 0;
+    reader->tile_lo[0] = reader->tile_lo[1] = 0;
+    reader->tile_count[0] = reader->tile_count[1] = 0;
+}
 
-    elog(DEBUG1, "<-----analysis_raster");
-    return rows;
+/* Only read the tiles of each file that touch this box */
+void raster_reader_set_filter(RasterReader *reader, double minx, double miny, double maxx, double maxy) {
+    reader->has_filter = 1;
+    reader->filter[0] = minx;
+    reader->filter[1] = miny;
+    reader->filter[2] = maxx;
+    reader->filter[3] = maxy;
 }
 
-int convert_raster(char *filename, RasterConfig *config, RASTERINFO *info, int cur_lineno, char **buf) {
-    int ntiles[2] = {1, 1};
-    int tileno = 0;
-    int processdno = 0;
-    int _tile_size[2] = {0};
-    int i = 0, xtile = 0, ytile = 0;
-    int nbands = 0;
-    int batchsize = config->batchsize;
-    uint32_t hexlen = 0;
-    double gt[6] = {0.};
-    char *hex = NULL;
+/*
+ * Work out the range of tiles of the open file that touch the
+ * filter box, on one axis: the box spans world coordinates lo..hi,
+ * which map to pixels with gt[off] + p * gt[off + scale]. Tiles
+ * that only touch the box on an edge are kept, PgSQL rechecks.
+ */
+static void tile_range(RasterReader *reader, RasterConfig *config, int axis, double lo, double hi) {
+    RASTERINFO *info = &(reader->info);
+    double origin = info->gt[axis == 0 ? 0 : 3];
+    double scale = info->gt[axis == 0 ? 1 : 5];
+    int tile_size = info->tile_size[axis];
+    int ntiles = reader->ntiles[axis];
+    // extent of the tiles in pixels, the last one is cut short unless padded
+    double extent = config->pad_tile ? (double) ntiles * tile_size : info->dim[axis];
+    double p1 = (lo - origin) / scale;
+    double p2 = (hi - origin) / scale;
+    double pmin = Min(p1, p2) - 1e-6;
+    double pmax = Max(p1, p2) + 1e-6;
+    int first, last;
+
+    if (lo > hi || pmax < 0 || pmin > extent) {
+        reader->tile_lo[axis] = 0;
+        reader->tile_count[axis] = 0;
+        return;
+    }
+    first = Max((int) ceil(Max(pmin, 0) / tile_size) - 1, 0);
+    last = Min((int) floor(Min(pmax, extent) / tile_size), ntiles - 1);
+    reader->tile_lo[axis] = first;
+    reader->tile_count[axis] = Max(last - first + 1, 0);
+}
+
+/*
+ * Open filename into reader and fill its RASTERINFO, unless it
+ * is already the open file. Any other file is closed first.
+ */
+void raster_reader_open(RasterReader *reader, const char *filename, RasterConfig *config) {
+    RASTERINFO *info = &(reader->info);
     const char *proDefString = NULL;
-    GDALDatasetH hds;
-    VRTDatasetH tds;
-    VRTSourcedRasterBandH tband;
-    rt_raster rast = NULL;
+    int i = 0;
+    int nbands = 0;
 
-    elog(DEBUG1, "----->convert_raster");
-    hds = GDALOpen(filename, GA_ReadOnly);
+    if (reader->filename != NULL && strcmp(reader->filename, filename) == 0)
+        return;
+    raster_reader_close(reader);
+
+    elog(DEBUG1, "----->raster_reader_open(%s)", filename);
+    reader->hds = GDALOpen(filename, GA_ReadOnly);
+    if (reader->hds == NULL) {
+        elog(ERROR, "raster_reader_open: could not open raster file %s", filename);
+    }
+    reader->filename = filename;
 
     //S1: get tilesize
     // dimensions of raster
-    info->dim[0] = GDALGetRasterXSize(hds);
-    info->dim[1] = GDALGetRasterYSize(hds);
+    info->dim[0] = GDALGetRasterXSize(reader->hds);
+    info->dim[1] = GDALGetRasterYSize(reader->hds);
 
     /* tile split:
      * if no tile size set, then reuse orignal raster dimensions
@@ -351,23 +290,16 @@ int convert_raster(char *filename, RasterConfig *config, RASTERINFO *info, int c
     info->tile_size[0] = (config->tile_size[0] ? config->tile_size[0] : info->dim[0]);
     info->tile_size[1] = (config->tile_size[1] ? config->tile_size[1] : info->dim[1]);
     // number of tiles on width and height
-    if (config->tile_size[0] != info->dim[0])
-        ntiles[0] = (info->dim[0] + info->tile_size[0] - 1)/(info->tile_size[0]);
-    if (config->tile_size[1] != info->dim[1])
-        ntiles[1] = (info->dim[1] + info->tile_size[1] - 1)/(info->tile_size[1]);
-
-    tileno = ntiles[0] * ntiles[1];
-    if(tileno < cur_lineno)
-        return 0;
+    reader->ntiles[0] = (info->dim[0] + info->tile_size[0] - 1)/(info->tile_size[0]);
+    reader->ntiles[1] = (info->dim[1] + info->tile_size[1] - 1)/(info->tile_size[1]);
 
     //S2: get srs and srid
-    proDefString =  GDALGetProjectionRef(hds);
+    proDefString =  GDALGetProjectionRef(reader->hds);
     if (proDefString != NULL && proDefString[0] != '\0') {
         OGRSpatialReferenceH hSRS = OSRNewSpatialReference(NULL);
         //Set info->srs
-        info->srs = rtalloc(sizeof(char *) * (strlen(proDefString) + 1));
+        info->srs = rtalloc(strlen(proDefString) + 1);
         if (info->srs == NULL) {
-            GDALClose(hds);
             elog(ERROR, "rtalloc for info->srs failed.");
         }
         strcpy(info->srs, proDefString);
@@ -385,8 +317,8 @@ int convert_raster(char *filename, RasterConfig *config, RASTERINFO *info, int c
         OSRDestroySpatialReference(hSRS);
     }
 
-    //S2 Set info record geotransform metrix
-    if(GDALGetGeoTransform(hds, info->gt) != CE_None) {
+    //S3 Set info record geotransform metrix
+    if(GDALGetGeoTransform(reader->hds, info->gt) != CE_None) {
         elog(DEBUG2, "Using default geotransform matrix (0, 1, 0, 0, 0, -1) for raster: %s", filename);
         info->gt[0] = 0;
         info->gt[1] = 1;
@@ -395,55 +327,76 @@ int convert_raster(char *filename, RasterConfig *config, RASTERINFO *info, int c
         info->gt[4] = 0;
         info->gt[5] = -1;
     }
-    memcpy(gt, info->gt, sizeof(double) * 6);
 
     /*
-     * TODO
-     * Processing multiple bands
+     * Tiles in the filter box. A skewed raster, or one without a
+     * usable geotransform, is read whole.
      */
-    nbands = GDALGetRasterCount(hds);
-    Assert(nbands == 1);
-    info->nband_count = nbands;
+    reader->tile_lo[0] = reader->tile_lo[1] = 0;
+    reader->tile_count[0] = reader->ntiles[0];
+    reader->tile_count[1] = reader->ntiles[1];
+    if (reader->has_filter && info->gt[2] == 0 && info->gt[4] == 0 &&
+            info->gt[1] != 0 && info->gt[5] != 0) {
+        tile_range(reader, config, 0, reader->filter[0], reader->filter[2]);
+        tile_range(reader, config, 1, reader->filter[1], reader->filter[3]);
+        elog(DEBUG1, "%s: tiles %d+%d x %d+%d of %dx%d in filter box", filename,
+                reader->tile_lo[0], reader->tile_count[0],
+                reader->tile_lo[1], reader->tile_count[1],
+                reader->ntiles[0], reader->ntiles[1]);
+    }
+
+    /* the configured bands, or all of them */
+    nbands = GDALGetRasterCount(reader->hds);
+    info->nband_count = (config->nband_count > 0 ? config->nband_count : nbands);
+    if (info->nband_count == 0) {
+        elog(ERROR, "raster_reader_open: %s has no bands", filename);
+    }
     info->nband = rtalloc(info->nband_count * sizeof(int));
     if (info->nband == NULL) {
-        GDALClose(hds);
         elog(ERROR, "rtalloc info->nband failed");
     }
-    for (i = 0; i < info->nband_count; i++)
-        info->nband[i] = i + 1;
+    for (i = 0; i < info->nband_count; i++) {
+        info->nband[i] = (config->nband_count > 0 ? config->nband[i] : i + 1);
+        if (info->nband[i] > nbands) {
+            elog(ERROR, "raster_reader_open: band %d asked for, %s has %d bands", info->nband[i], filename, nbands);
+        }
+    }
 
     /* initialize parameters dependent on nband */
-	info->gdalbandtype = rtalloc(sizeof(GDALDataType) * info->nband_count);
-	if (info->gdalbandtype == NULL) {
-		GDALClose(hds);
-		elog(ERROR, "convert_raster: Could not allocate memory for storing GDAL data type");
-	}
-	info->bandtype = rtalloc(sizeof(rt_pixtype) * info->nband_count);
-	if (info->bandtype == NULL) {
-		GDALClose(hds);
-		elog(ERROR, "convert_raster: Could not allocate memory for storing pixel type");
-	}
+    reader->bands = rtalloc(sizeof(GDALRasterBandH) * info->nband_count);
+    if (reader->bands == NULL) {
+        elog(ERROR, "raster_reader_open: Could not allocate memory for storing band handles");
+    }
+    info->gdalbandtype = rtalloc(sizeof(GDALDataType) * info->nband_count);
+    if (info->gdalbandtype == NULL) {
+        elog(ERROR, "raster_reader_open: Could not allocate memory for storing GDAL data type");
+    }
+    info->bandtype = rtalloc(sizeof(rt_pixtype) * info->nband_count);
+    if (info->bandtype == NULL) {
+        elog(ERROR, "raster_reader_open: Could not allocate memory for storing pixel type");
+    }
     info->hasnodata = rtalloc(sizeof(int) * info->nband_count);
     if (info->hasnodata == NULL) {
-	    GDALClose(hds);
-	    elog(ERROR, "convert_raster: Could not allocate memory for storing hasnodata flag");
+        elog(ERROR, "raster_reader_open: Could not allocate memory for storing hasnodata flag");
     }
     info->nodataval = rtalloc(sizeof(double) * info->nband_count);
     if (info->nodataval == NULL) {
-	    GDALClose(hds);
-	    elog(ERROR, "convert_raster: Could not allocate memory for storing nodata value");
+        elog(ERROR, "raster_reader_open: Could not allocate memory for storing nodata value");
     }
 
-    memset(info->gdalbandtype, GDT_Unknown, sizeof(GDALDataType) * info->nband_count);
-	memset(info->bandtype, PT_END, sizeof(rt_pixtype) * info->nband_count);
-    memset(info->hasnodata, 0, sizeof(int) * info->nband_count);
-    memset(info->nodataval, 0, sizeof(double) * info->nband_count);
-
     /* Process each band data type*/
     for (i = 0; i < info->nband_count; i++) {
-        GDALRasterBandH rbh = GDALGetRasterBand(hds, info->nband[i]);
+        GDALRasterBandH rbh = GDALGetRasterBand(reader->hds, info->nband[i]);
+        reader->bands[i] = rbh;
         info->gdalbandtype[i] = GDALGetRasterDataType(rbh);
         info->bandtype[i] = rt_util_gdal_datatype_to_pixtype(info->gdalbandtype[i]);
+        if (info->bandtype[i] == PT_END) {
+            elog(ERROR, "raster_reader_open: Unknown pixel type for GDAL band %d of %s", info->nband[i], filename);
+        }
+        if (i == 0)
+            reader->iotype = info->gdalbandtype[i];
+        else if (reader->iotype != info->gdalbandtype[i])
+            reader->iotype = GDT_Unknown;
 
         /* hasnodata and nodataval*/
         info->nodataval[i] = GDALGetRasterNoDataValue(rbh, &(info->hasnodata[i]));
@@ -456,83 +409,141 @@ int convert_raster(char *filename, RasterConfig *config, RASTERINFO *info, int c
             }
         }
     }
+    elog(DEBUG1, "<-----raster_reader_open");
+}
 
-    elog(DEBUG1, "INFO Process each tile %d",__LINE__);
-    /* Process each tile */
-    for (xtile = cur_lineno / ntiles[1];  xtile < ntiles[0] && processdno < batchsize; xtile++) {
-        // x coordinate edge
-        if (!config->pad_tile && xtile == ntiles[0] - 1)
-            _tile_size[0] = info->dim[0] - xtile * info->tile_size[0];
-        else
-            _tile_size[0] = info->tile_size[0];
-
-        if(xtile == cur_lineno / ntiles[1])
-            ytile = cur_lineno % ntiles[0];
-        else
-            ytile = 0;
-
-        for (; ytile < ntiles[1]; ytile++) {
-            // y coordinate edge
-            if (!config->pad_tile && ytile == ntiles[1] - 1)
-                _tile_size[1] = info->dim[1] - ytile * info->tile_size[1];
-            else
-                _tile_size[1] = info->tile_size[1];
-
-            //Create tile
-            tds = VRTCreate(_tile_size[0], _tile_size[1]);
-            GDALSetProjection(tds, info->srs);
-
-            //TODO: DO not understand why
-            GDALApplyGeoTransform(info->gt, xtile * info->tile_size[0], ytile * info->tile_size[1], &(gt[0]),&(gt[3]));
-            GDALSetGeoTransform(tds, gt);
-
-            //Add band data sources
-            elog(DEBUG1, "xtile=%d,ytile=%d,info->tile_size=%dx%d,_tile_size=%dx%d",xtile,ytile,info->tile_size[0],
-			info->tile_size[1],_tile_size[0],_tile_size[1]);
-            for (i = 0; i < info->nband_count; i++) {
-                GDALAddBand(tds, info->gdalbandtype[i], NULL);
-                tband = (VRTSourcedRasterBandH)GDALGetRasterBand(tds, i + 1);
-                if (info->hasnodata[i])
-                    GDALSetRasterNoDataValue(tband, info->nodataval[i]);
-                VRTAddSimpleSource(tband, GDALGetRasterBand(hds, info->nband[i]),
-                                   xtile * info->tile_size[0],ytile * info->tile_size[1],
-                                   _tile_size[0],_tile_size[1],
-                                   0,0,
-                                   _tile_size[0],_tile_size[1],
-                                    "near", VRT_NODATA_UNSET);
+int analysis_raster(RasterReader *reader, const char *filename, RasterConfig *config, int cur_lineno, rt_raster *rasts) {
+    int rows = 0;
 
-            }
+    elog(DEBUG1, "----->analysis_raster(%s:%d)", filename, cur_lineno);
+    raster_reader_open(reader, filename, config);
 
-            VRTFlushCache(tds);
+    /* convert raster to tiles */
+    rows = convert_raster(reader, config, cur_lineno, rasts);
 
-            /* Convert VRT to raster to hexwkb
-             */
-            rast = rt_raster_from_gdal_dataset(tds);
-            if (rast == NULL) {
-                elog(ERROR, "rt_raster_from_gdal_dataset failed.");
-                rterror("error");
-                GDALClose(hds);
-                return 0;
-            }
+    elog(DEBUG1, "<-----analysis_raster");
+    return rows;
+}
 
-            rt_raster_set_srid(rast, info->srid);
+/*
+ * Read tile (xtile, ytile) of the open file. The pixels of all
+ * the bands go in one block, band after band, and when the bands
+ * share a pixel type are read with a single GDALDatasetRasterIO
+ * straight into it. The part of a padded edge tile past the
+ * raster is nodata (or 0).
+ */
+static rt_raster read_tile(RasterReader *reader, RasterConfig *config, int xtile, int ytile) {
+    RASTERINFO *info = &(reader->info);
+    int xoff = xtile * info->tile_size[0];
+    int yoff = ytile * info->tile_size[1];
+    // valid pixels of the window, less than the tile on the right and bottom edges
+    int nx = Min(info->tile_size[0], (int) info->dim[0] - xoff);
+    int ny = Min(info->tile_size[1], (int) info->dim[1] - yoff);
+    int width = config->pad_tile ? info->tile_size[0] : nx;
+    int height = config->pad_tile ? info->tile_size[1] : ny;
+    size_t npixels = (size_t) width * height;
+    size_t blocksize = 0;
+    size_t offset = 0;
+    int i = 0;
+    int pixsize = 0;
+    uint8_t *block;
+    rt_raster rast;
+    CPLErr err = CE_None;
 
-            hex = rt_raster_to_hexwkb(rast, FALSE, &hexlen);
-            raster_destroy(rast);
+    elog(DEBUG1, "xtile=%d,ytile=%d,info->tile_size=%dx%d,_tile_size=%dx%d",xtile,ytile,info->tile_size[0],
+        info->tile_size[1],width,height);
 
-            if (hex == NULL) {
-                GDALClose(hds);
-                elog(ERROR, "rt_raster_to_hexwk return NULL.");
-            }
-            GDALClose(tds);
+    for (i = 0; i < info->nband_count; i++)
+        blocksize += rt_pixtype_size(info->bandtype[i]) * npixels;
+    block = rtalloc(blocksize);
+    if (block == NULL) {
+        elog(ERROR, "read_tile: Could not allocate memory for band pixel values");
+    }
 
-            buf[processdno++] = hex;
-            if(processdno == batchsize)
-                break;
+    /* fill the padding, a zero source stride repeats the one value */
+    if (nx < width || ny < height) {
+        for (i = 0, offset = 0; i < info->nband_count; i++) {
+            pixsize = rt_pixtype_size(info->bandtype[i]);
+            GDALCopyWords(&(info->nodataval[i]), GDT_Float64, 0,
+                    block + offset, info->gdalbandtype[i], pixsize, npixels);
+            offset += pixsize * npixels;
         }
-    }// finish process all the tiles
+    }
+
+    if (reader->iotype != GDT_Unknown) {
+        pixsize = rt_pixtype_size(info->bandtype[0]);
+        err = GDALDatasetRasterIO(reader->hds, GF_Read,
+                xoff, yoff, nx, ny,
+                block, nx, ny, reader->iotype,
+                info->nband_count, info->nband,
+                pixsize, pixsize * width, pixsize * npixels);
+    } else {
+        /* bands of different types, one read each */
+        for (i = 0, offset = 0; i < info->nband_count && err == CE_None; i++) {
+            pixsize = rt_pixtype_size(info->bandtype[i]);
+            err = GDALRasterIO(reader->bands[i], GF_Read,
+                    xoff, yoff, nx, ny,
+                    block + offset, nx, ny, info->gdalbandtype[i],
+                    pixsize, pixsize * width);
+            offset += pixsize * npixels;
+        }
+    }
+    if (err != CE_None) {
+        rtdealloc(block);
+        elog(ERROR, "read_tile: Could not get data from GDAL raster");
+    }
+
+    rast = rt_raster_new(width, height);
+    if (rast == NULL) {
+        rtdealloc(block);
+        elog(ERROR, "read_tile: Out of memory allocating new raster");
+    }
+
+    /* georeference of the tile's upper-left corner */
+    GDALApplyGeoTransform(info->gt, xoff, yoff, &(rast->ipX), &(rast->ipY));
+    rast->scaleX = info->gt[1];
+    rast->skewX = info->gt[2];
+    rast->skewY = info->gt[4];
+    rast->scaleY = info->gt[5];
+    rt_raster_set_srid(rast, info->srid);
+
+    for (i = 0, offset = 0; i < info->nband_count; i++) {
+        rt_band band = rt_band_new_inline(width, height, info->bandtype[i],
+                info->hasnodata[i], info->nodataval[i], block + offset);
+        if (band == NULL || rt_raster_add_band(rast, band, i) < 0) {
+            if (band != NULL)
+                rt_band_destroy(band);
+            raster_destroy(rast);
+            if (i == 0)
+                rtdealloc(block);
+            elog(ERROR, "read_tile: Could not add band to raster");
+        }
+        /* the first band owns the block */
+        if (i == 0)
+            rt_band_set_ownsdata_flag(band, 1);
+        offset += rt_pixtype_size(info->bandtype[i]) * npixels;
+    }
+    return rast;
+}
+
+/*
+ * Cut up to config->batchsize tiles of the open file, from tile
+ * cur_lineno on, into rasts; the caller destroys them. The tiles
+ * in the filter box (all of them without one) are numbered column
+ * by column: tile n is xtile tile_lo[0] + n / tile_count[1], ytile
+ * tile_lo[1] + n % tile_count[1].
+ */
+int convert_raster(RasterReader *reader, RasterConfig *config, int cur_lineno, rt_raster *rasts) {
+    int *lo = reader->tile_lo;
+    int *count = reader->tile_count;
+    int processdno = 0;
+    int tileno = 0;
+
+    elog(DEBUG1, "----->convert_raster");
+    /* Process each tile */
+    for (tileno = cur_lineno; tileno < count[0] * count[1] && processdno < config->batchsize; tileno++)
+        rasts[processdno++] = read_tile(reader, config, lo[0] + tileno / count[1], lo[1] + tileno % count[1]);
 
-    GDALClose(hds);
     elog(DEBUG1, "<----->convert_raster");
     return processdno;
 }
@@ -17,14 +17,12 @@
 #include "utils/builtins.h"
 #include "utils/elog.h"
 #include "ogr_srs_api.h"
-#include "gdal_vrt.h"
 
 #define FLT_NEQ(x, y) (fabs(x - y) > FLT_EPSILON)
 #define FLT_EQ(x, y) (!FLT_NEQ(x, y))
 #define LOCATION_MAXSIZE 512
 // Each time fetch how many lines from raster file
 #define DEFAULT_BATCHSIZE 100
-#define FILENAME_MAXSIZE 50
 
 /* Pixel types */
 typedef enum {
@@ -131,6 +129,27 @@ typedef struct rasterinfo_t {
     int tile_size[2];
 } RASTERINFO;
 
+/*
+ * A scan's open raster file. It stays open, with its RASTERINFO
+ * and band handles, across batches (so GDAL's block cache stays
+ * warm) and is only closed when the scan moves to the next file.
+ */
+typedef struct RasterReader {
+    const char *filename; /* file open, NULL for none */
+    GDALDatasetH hds;
+    GDALRasterBandH *bands; /* handles of info.nband[] */
+    GDALDataType iotype; /* pixel type of all the bands, GDT_Unknown if they differ */
+    RASTERINFO info;
+    /* number of tiles on width and height */
+    int ntiles[2];
+    /* box the scan keeps to (minx, miny, maxx, maxy), if has_filter */
+    int has_filter;
+    double filter[4];
+    /* first tile and number of tiles on width and height in the box */
+    int tile_lo[2];
+    int tile_count[2];
+} RasterReader;
+
 
 extern void rterror(const char *fmt, ...);
 extern void rtinfo(const char *fmt, ...);
@@ -146,6 +165,7 @@ extern rt_band rt_raster_get_band(rt_raster raster, int n);
 extern int rt_band_is_offline(rt_band band);
 extern void rt_band_destroy(rt_band band);
 extern char *rt_raster_to_hexwkb(rt_raster raster, int outasin, uint32_t *hexwkbsize);
+extern void *rt_raster_serialize(rt_raster raster);
 extern uint8_t *rt_raster_to_wkb(rt_raster raster, int outasin, uint32_t *wkbsize);
 extern uint8_t isMachineLittleEndian(void);
 extern uint16_t rt_raster_get_width(rt_raster raster);
@@ -188,12 +208,18 @@ extern int rt_band_get_ownsdata_flag(rt_band band);
 
 rt_pixtype rt_util_gdal_datatype_to_pixtype(GDALDataType gdt);
 void raster_destroy(rt_raster raster);
-rt_raster rt_raster_from_gdal_dataset(GDALDatasetH ds);
 
 void rtdealloc_config(RasterConfig *config);
 void init_config(RasterConfig *config);
 void set_raster_config(RasterConfig **config, char *conf_file);
+int parse_raster_bands(const char *str, int **nband);
+void set_raster_bands(RasterConfig *config, const char *bands);
+
+RasterReader *raster_reader_create(MemoryContext mcxt);
+void raster_reader_open(RasterReader *reader, const char *filename, RasterConfig *config);
+void raster_reader_close(RasterReader *reader);
+void raster_reader_set_filter(RasterReader *reader, double minx, double miny, double maxx, double maxy);
 
-int analysis_raster(char *filename, RasterConfig *config, int cur_lineno, char **buf);
-int convert_raster(char *filename, RasterConfig *config, RASTERINFO *info, int cur_lineno, char **buf);
+int analysis_raster(RasterReader *reader, const char *filename, RasterConfig *config, int cur_lineno, rt_raster *rasts);
+int convert_raster(RasterReader *reader, RasterConfig *config, int cur_lineno, rt_raster *rasts);
 #endif //RASTERDB_LIBRTCORE_H